@@ -0,0 +1,158 @@
+#!/bin/sh
+#
+# Compare elfkillah against the section stripping tools found on this
+# box (strip, strip --strip-section-headers, objcopy, sstrip) on the
+# same generated corpus. For every tool it reports throughput over the
+# input bytes, the peak RSS of a single invocation and the total size
+# of the outputs. Tools which are not installed are skipped.
+#
+# usage: bench/compare.sh [files-per-size] [workdir]
+#
+
+set -e
+
+FILES=${1:-20}
+WORK=${2:-$(mktemp -d /tmp/elfkillah-bench.XXXXXX)}
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+CC=${CC:-cc}
+JOBS=$(nproc 2>/dev/null || echo 1)
+
+mkdir -p "$WORK/corpus" "$WORK/out"
+
+# Build elfkillah and a tiny runner that reports wall time and peak RSS
+$CC -O2 -pthread -o "$WORK/elfkillah" "$SRC/elfkillah.c" -lz -llzma
+cat > "$WORK/runstat.c" <<'RUNSTAT'
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+int
+main(int argc, char *argv[])
+{
+	struct timespec t0, t1;
+	struct rusage ru;
+	int status;
+	pid_t pid;
+
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	pid = fork();
+	if(pid == 0){
+		execvp(argv[1],argv + 1);
+		_exit(127);
+	}
+	if(pid == -1 || wait4(pid,&status,0,&ru) == -1)
+		return 1;
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+
+	printf("%lld %ld\n",(t1.tv_sec - t0.tv_sec) * 1000000000LL
+		+ (t1.tv_nsec - t0.tv_nsec),ru.ru_maxrss);
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+RUNSTAT
+$CC -O2 -o "$WORK/runstat" "$WORK/runstat.c"
+
+# Generate binaries of growing size, all carrying debug sections
+for funcs in 10 200 2000; do
+	i=0
+	while [ $i -lt $FILES ]; do
+		f="$WORK/corpus/f$funcs-$i"
+		if [ ! -f "$f" ]; then
+			{
+				j=0
+				while [ $j -lt $funcs ]; do
+					echo "int fn$j(int x) { return x * $j + $i; }"
+					j=$((j + 1))
+				done
+				echo "int main(void) { return fn0($i) != $i; }"
+			} > "$f.c"
+			$CC -g -O0 -o "$f" "$f.c"
+			rm -f "$f.c"
+		fi
+		i=$((i + 1))
+	done
+done
+
+INBYTES=$(cat "$WORK"/corpus/* | wc -c)
+NFILES=$(ls "$WORK/corpus" | wc -l)
+
+# run <name> <command...>, where {} in the command is replaced by the
+# input file and {o} by the output file, once per corpus file
+run()
+{
+	name=$1
+	shift
+	rm -f "$WORK"/out/*
+	total=0
+	rss=0
+	for f in "$WORK"/corpus/*; do
+		o="$WORK/out/$(basename "$f")"
+		args=""
+		for a in "$@"; do
+			case $a in
+			{}) a=$f ;;
+			{o}) a=$o ;;
+			esac
+			args="$args $a"
+		done
+		res=$("$WORK/runstat" $args) || { echo "$name: failed on $f" >&2; return; }
+		total=$((total + ${res% *}))
+		[ ${res#* } -gt $rss ] && rss=${res#* }
+	done
+	report "$name" $total $rss
+}
+
+report()
+{
+	outbytes=$(cat "$WORK"/out/* | wc -c)
+	awk -v n="$1" -v ns="$2" -v rss="$3" -v inb="$INBYTES" -v outb="$outbytes" -v files="$NFILES" \
+		'BEGIN { printf "%-32s %10.1f %10.1f %10d %12d\n", n, inb / (ns / 1e9) / 1048576, files / (ns / 1e9), rss, outb }'
+}
+
+have()
+{
+	command -v "$1" >/dev/null 2>&1
+}
+
+printf "%d files, %d bytes of input\n\n" "$NFILES" "$INBYTES"
+printf "%-32s %10s %10s %10s %12s\n" "tool" "MiB/s" "files/s" "rss(KiB)" "out(bytes)"
+
+run "elfkillah" "$WORK/elfkillah" {} {o}
+
+# One process for the whole corpus, as the batch mode is meant to be run
+set --
+for f in "$WORK"/corpus/*; do
+	set -- "$@" "$f" "$WORK/out/$(basename "$f")"
+done
+rm -f "$WORK"/out/*
+res=$("$WORK/runstat" "$WORK/elfkillah" -j "$JOBS" "$@")
+report "elfkillah -j $JOBS (batch)" ${res% *} ${res#* }
+
+if have strip; then
+	run "strip" strip -o {o} {}
+	one=$(ls "$WORK"/corpus/* | head -n 1)
+	if strip --strip-section-headers -o "$WORK/probe" "$one" 2>/dev/null; then
+		run "strip --strip-section-headers" strip --strip-section-headers -o {o} {}
+	fi
+	rm -f "$WORK/probe"
+fi
+
+if have objcopy; then
+	run "objcopy --strip-all" objcopy --strip-all {} {o}
+fi
+
+# sstrip works in place, so each run includes a copy of the input
+if have sstrip; then
+	cat > "$WORK/sstrip.sh" <<'SSTRIP'
+#!/bin/sh
+cp "$1" "$2" && sstrip "$2"
+SSTRIP
+	chmod +x "$WORK/sstrip.sh"
+	run "cp + sstrip" "$WORK/sstrip.sh" {} {o}
+fi
+
+echo
+echo "corpus and outputs left in $WORK"
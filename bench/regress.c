@@ -0,0 +1,540 @@
+/*
+  Copyright (C) 2014 Fabrizio Curcio aka spike
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Benchmark baselines and regression checks. "run" strips a corpus
+  with every engine setup a number of times, interleaved so drift hits
+  them alike, and saves files/s, p99 latency and peak RSS of every
+  repetition under a label, normally the commit. "compare" sets two
+  labels against each other per engine and metric: medians, 95%
+  confidence intervals of the means and a two-sided Mann-Whitney U
+  test; a change for the worse with p < 0.05 and beyond 2% is a
+  regression, and makes compare exit with status 1.
+
+    cc -O2 -o regress bench/regress.c -lm
+    ./regress run corpus/ $(git rev-parse --short HEAD) 10
+    ./regress compare <baseline> $(git rev-parse --short HEAD)
+
+  Results live in $ELFKILLAH_RESULTS, bench-results by default, one
+  tab separated file per label; elfkillah is $ELFKILLAH, ./elfkillah
+  by default. p99 comes from the per-file totals of --record.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define MAX_BATCH 8192
+#define MAX_REPS 64
+#define ALPHA 0.05
+#define MIN_CHANGE 0.02
+
+enum {
+	METRIC_FILES,
+	METRIC_P99,
+	METRIC_RSS,
+	METRIC_COUNT
+};
+
+typedef struct {
+	const char *name;
+	const char *jobs;
+	const char *copy_threads;
+	const char *flag;
+} Engine;
+
+/* Higher is better for files/s, lower for the others */
+static const char *metric_names[METRIC_COUNT] = {"files/s", "p99(us)", "rss(KiB)"};
+static const int metric_higher[METRIC_COUNT] = {1, 0, 0};
+
+static char nproc[24];
+
+static const Engine engines[] = {
+	{"write", "1", "1", NULL},
+	{"pwrite", "1", "4", NULL},
+	{"batch", nproc, "1", NULL},
+	{"isolate", nproc, "1", "--isolate"},
+};
+
+#define NENGINES (sizeof(engines) / sizeof(engines[0]))
+
+typedef struct {
+	double v[NENGINES][METRIC_COUNT][MAX_REPS];
+	int n[NENGINES][METRIC_COUNT];
+} Results;
+
+static void
+err_exit(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+dbl_cmp(const void *a, const void *b)
+{
+	double x, y;
+
+	x = *(const double *)a;
+	y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static const char *
+results_dir(void)
+{
+	return getenv("ELFKILLAH_RESULTS") != NULL ? getenv("ELFKILLAH_RESULTS") : "bench-results";
+}
+
+static char **
+list_corpus(const char *dir, size_t *n)
+{
+	DIR *d;
+	struct dirent *e;
+	char **files, path[PATH_MAX];
+	size_t cap;
+	struct stat st;
+
+	d = opendir(dir);
+	if(d == NULL)
+		err_exit("list_corpus() --> opendir()");
+
+	files = NULL;
+	cap = 0;
+	*n = 0;
+	while((e = readdir(d)) != NULL){
+		snprintf(path,sizeof(path),"%s/%s",dir,e->d_name);
+		if(stat(path,&st) == -1 || !S_ISREG(st.st_mode))
+			continue;
+		if(*n == cap){
+			cap = cap ? 2 * cap : 256;
+			files = (char **)realloc(files,cap * sizeof(char *));
+			if(files == NULL)
+				err_exit("list_corpus() --> realloc()");
+		}
+		files[*n] = strdup(path);
+		if(files[(*n)++] == NULL)
+			err_exit("list_corpus() --> strdup()");
+	}
+	closedir(d);
+
+	return files;
+}
+
+/* Append the per-file totals of a --record trace, in microseconds */
+static void
+read_trace(const char *path, double **lat, size_t *n, size_t *cap)
+{
+	FILE *f;
+	char line[512];
+	uint64_t v[11];
+
+	f = fopen(path,"r");
+	if(f == NULL)
+		err_exit("read_trace() --> fopen()");
+
+	while(fgets(line,sizeof(line),f) != NULL){
+		if(line[0] == '#' || sscanf(line,"%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64
+		   " %" SCNu64 " %" SCNu64 " %" SCNu64,&v[0],&v[1],&v[2],&v[3],&v[4],&v[5],&v[6]) != 7)
+			continue;
+		if(*n == *cap){
+			*cap = *cap ? 2 * *cap : 1024;
+			*lat = (double *)realloc(*lat,*cap * sizeof(double));
+			if(*lat == NULL)
+				err_exit("read_trace() --> realloc()");
+		}
+		(*lat)[(*n)++] = v[6] / 1e3;
+	}
+	fclose(f);
+}
+
+/* One pass of one engine over the corpus: files/s, p99 and peak RSS */
+static void
+run_engine(const Engine *e, char **files, size_t nfiles, const char *work, double *m)
+{
+	char **args, trace[PATH_MAX], *outs;
+	const char *bin;
+	double *lat;
+	size_t b, i, nargs, nlat, cap, len;
+	uint64_t ns, start;
+	struct rusage ru;
+	long rss;
+	int status;
+	pid_t pid;
+
+	bin = getenv("ELFKILLAH") != NULL ? getenv("ELFKILLAH") : "./elfkillah";
+	snprintf(trace,sizeof(trace),"%s/trace",work);
+	len = strlen(work) + sizeof("/out-00000000");
+
+	args = (char **)malloc((10 + 2 * MAX_BATCH) * sizeof(char *));
+	outs = (char *)malloc(MAX_BATCH * len);
+	if(args == NULL || outs == NULL)
+		err_exit("run_engine() --> malloc()");
+
+	lat = NULL;
+	nlat = cap = 0;
+	ns = 0;
+	rss = 0;
+	for(b=0; b<nfiles; b += MAX_BATCH){
+		nargs = 0;
+		args[nargs++] = (char *)bin;
+		args[nargs++] = "-j";
+		args[nargs++] = (char *)e->jobs;
+		args[nargs++] = "-c";
+		args[nargs++] = (char *)e->copy_threads;
+		args[nargs++] = "--record";
+		args[nargs++] = trace;
+		if(e->flag != NULL)
+			args[nargs++] = (char *)e->flag;
+		for(i=b; i<nfiles && i < b + MAX_BATCH; i++){
+			args[nargs++] = files[i];
+			args[nargs] = outs + (i - b) * len;
+			snprintf(args[nargs++],len,"%s/out-%08zu",work,i - b);
+		}
+		args[nargs] = NULL;
+
+		start = now_ns();
+		pid = fork();
+		if(pid == -1)
+			err_exit("run_engine() --> fork()");
+		if(pid == 0){
+			execv(bin,args);
+			_exit(127);
+		}
+		if(wait4(pid,&status,0,&ru) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+			fprintf(stderr,"regress: %s failed for engine %s\n",bin,e->name);
+			exit(EXIT_FAILURE);
+		}
+		ns += now_ns() - start;
+		if(ru.ru_maxrss > rss)
+			rss = ru.ru_maxrss;
+
+		read_trace(trace,&lat,&nlat,&cap);
+	}
+
+	qsort(lat,nlat,sizeof(double),dbl_cmp);
+	m[METRIC_FILES] = nfiles / (ns / 1e9);
+	m[METRIC_P99] = nlat > 0 ? lat[(nlat * 99) / 100 < nlat ? (nlat * 99) / 100 : nlat - 1] : 0;
+	m[METRIC_RSS] = rss;
+
+	free(lat);
+	free(outs);
+	free(args);
+}
+
+static int
+cmd_run(const char *corpus, const char *label, int reps)
+{
+	char **files, work[64], path[PATH_MAX];
+	double m[METRIC_COUNT];
+	size_t nfiles, e;
+	FILE *f;
+	int r, k;
+
+	files = list_corpus(corpus,&nfiles);
+	if(nfiles == 0){
+		fprintf(stderr,"regress: no files in %s\n",corpus);
+		return EXIT_FAILURE;
+	}
+
+	snprintf(work,sizeof(work),"/tmp/elfkillah-regress.XXXXXX");
+	if(mkdtemp(work) == NULL)
+		err_exit("cmd_run() --> mkdtemp()");
+
+	mkdir(results_dir(),0755);
+	snprintf(path,sizeof(path),"%s/%s.tsv",results_dir(),label);
+	f = fopen(path,"w");
+	if(f == NULL)
+		err_exit("cmd_run() --> fopen()");
+	fprintf(f,"# label %s, corpus %s, %zu files, %d repetitions\n",label,corpus,nfiles,reps);
+	fprintf(f,"# engine\tmetric\tvalue\n");
+
+	/* A warm-up pass per engine for the page cache, not recorded */
+	for(e=0; e<NENGINES; e++)
+		run_engine(&engines[e],files,nfiles,work,m);
+
+	for(r=0; r<reps; r++){
+		for(e=0; e<NENGINES; e++){
+			run_engine(&engines[e],files,nfiles,work,m);
+			for(k=0; k<METRIC_COUNT; k++)
+				fprintf(f,"%s\t%s\t%.3f\n",engines[e].name,metric_names[k],m[k]);
+		}
+		fprintf(stderr,"regress: repetition %d of %d done\n",r + 1,reps);
+	}
+
+	fclose(f);
+	printf("saved %s\n",path);
+
+	for(e=0; e<nfiles && e<MAX_BATCH; e++){
+		snprintf(path,sizeof(path),"%s/out-%08zu",work,e);
+		unlink(path);
+	}
+	snprintf(path,sizeof(path),"%s/trace",work);
+	unlink(path);
+	rmdir(work);
+
+	return EXIT_SUCCESS;
+}
+
+static void
+load_results(const char *label, Results *res)
+{
+	FILE *f;
+	char path[PATH_MAX], line[256], engine[64], metric[64];
+	double v;
+	size_t e;
+	int k;
+
+	memset(res,0,sizeof(*res));
+	snprintf(path,sizeof(path),"%s/%s.tsv",results_dir(),label);
+	f = fopen(path,"r");
+	if(f == NULL)
+		err_exit(path);
+
+	while(fgets(line,sizeof(line),f) != NULL){
+		if(line[0] == '#' || sscanf(line,"%63[^\t]\t%63[^\t]\t%lf",engine,metric,&v) != 3)
+			continue;
+		for(e=0; e<NENGINES && strcmp(engines[e].name,engine) != 0; e++)
+			;
+		for(k=0; k<METRIC_COUNT && strcmp(metric_names[k],metric) != 0; k++)
+			;
+		if(e == NENGINES || k == METRIC_COUNT || res->n[e][k] == MAX_REPS)
+			continue;
+		res->v[e][k][res->n[e][k]++] = v;
+	}
+	fclose(f);
+}
+
+static double
+median(const double *v, int n)
+{
+	double s[MAX_REPS];
+
+	memcpy(s,v,n * sizeof(double));
+	qsort(s,n,sizeof(double),dbl_cmp);
+	return n % 2 ? s[n / 2] : (s[n / 2 - 1] + s[n / 2]) / 2;
+}
+
+/* Half width of the 95% confidence interval of the mean, Student's t */
+static double
+ci95(const double *v, int n, double *mean)
+{
+	static const double t[] = {
+		0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+		2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093,
+		2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045,
+		2.042
+	};
+	double sum, var;
+	int i;
+
+	for(sum=0, i=0; i<n; i++)
+		sum += v[i];
+	*mean = sum / n;
+	if(n < 2)
+		return 0;
+
+	for(var=0, i=0; i<n; i++)
+		var += (v[i] - *mean) * (v[i] - *mean);
+	var /= n - 1;
+
+	return (n - 1 < 31 ? t[n - 1] : 1.96) * sqrt(var / n);
+}
+
+/*
+  Two-sided Mann-Whitney U test. Exact distribution of U when there
+  are no ties and both samples are small, the normal approximation
+  with tie and continuity correction otherwise.
+*/
+static double
+mann_whitney(const double *a, int na, const double *b, int nb)
+{
+	double all[2 * MAX_REPS], rank[2 * MAX_REPS], ra, u, mu, sigma, ties, z, t;
+	double *f, *g, total, lo, hi;
+	int from[2 * MAX_REPS], i, j, k, n, umax, ui;
+
+	n = na + nb;
+	for(i=0; i<na; i++){
+		all[i] = a[i];
+		from[i] = 0;
+	}
+	for(i=0; i<nb; i++){
+		all[na + i] = b[i];
+		from[na + i] = 1;
+	}
+
+	/* Sort both together, carrying the origin */
+	for(i=1; i<n; i++)
+		for(j=i; j > 0 && all[j - 1] > all[j]; j--){
+			t = all[j];
+			all[j] = all[j - 1];
+			all[j - 1] = t;
+			k = from[j];
+			from[j] = from[j - 1];
+			from[j - 1] = k;
+		}
+
+	ties = 0;
+	for(i=0; i<n; i=j){
+		for(j=i; j<n && all[j] == all[i]; j++)
+			;
+		for(k=i; k<j; k++)
+			rank[k] = (i + j + 1) / 2.0;
+		ties += (double)(j - i) * (j - i) * (j - i) - (j - i);
+	}
+
+	for(ra=0, i=0; i<n; i++)
+		if(from[i] == 0)
+			ra += rank[i];
+	u = ra - na * (na + 1) / 2.0;
+
+	if(ties == 0 && na <= 30 && nb <= 30){
+		/* f[u] counts the orderings of na and nb items giving U = u */
+		umax = na * nb;
+		f = (double *)calloc((umax + 1) * (nb + 1),sizeof(double));
+		g = (double *)calloc((umax + 1) * (nb + 1),sizeof(double));
+		if(f == NULL || g == NULL)
+			err_exit("mann_whitney() --> calloc()");
+		for(j=0; j<=nb; j++)
+			f[j * (umax + 1)] = 1;
+		for(i=1; i<=na; i++){
+			memset(g,0,(umax + 1) * (nb + 1) * sizeof(double));
+			for(j=0; j<=nb; j++)
+				for(k=0; k<=i * j; k++){
+					g[j * (umax + 1) + k] = (k >= j ? f[j * (umax + 1) + k - j] : 0)
+						+ (j > 0 ? g[(j - 1) * (umax + 1) + k] : 0);
+				}
+			memcpy(f,g,(umax + 1) * (nb + 1) * sizeof(double));
+		}
+
+		ui = (int)u;
+		for(total=0, lo=0, hi=0, k=0; k<=umax; k++){
+			total += f[nb * (umax + 1) + k];
+			if(k <= ui)
+				lo += f[nb * (umax + 1) + k];
+			if(k >= ui)
+				hi += f[nb * (umax + 1) + k];
+		}
+		free(f);
+		free(g);
+
+		t = 2 * (lo < hi ? lo : hi) / total;
+		return t > 1 ? 1 : t;
+	}
+
+	mu = na * nb / 2.0;
+	sigma = sqrt(na * nb / 12.0 * ((n + 1) - ties / ((double)n * (n - 1))));
+	if(sigma == 0)
+		return 1;
+	z = (fabs(u - mu) - 0.5) / sigma;
+	if(z < 0)
+		z = 0;
+
+	return erfc(z / sqrt(2));
+}
+
+static int
+cmd_compare(const char *base_label, const char *new_label)
+{
+	static Results base, cur;
+	double mb, mn, cb, cn, mean_b, mean_n, change, p;
+	const char *verdict;
+	size_t e;
+	int k, regressions, worse;
+
+	load_results(base_label,&base);
+	load_results(new_label,&cur);
+
+	printf("%-8s %-9s %12s %12s %20s %20s %8s %8s  %s\n","engine","metric",
+		base_label,new_label,"base mean+-95%","new mean+-95%","change","p","");
+
+	regressions = 0;
+	for(e=0; e<NENGINES; e++)
+		for(k=0; k<METRIC_COUNT; k++){
+			if(base.n[e][k] == 0 || cur.n[e][k] == 0)
+				continue;
+
+			mb = median(base.v[e][k],base.n[e][k]);
+			mn = median(cur.v[e][k],cur.n[e][k]);
+			cb = ci95(base.v[e][k],base.n[e][k],&mean_b);
+			cn = ci95(cur.v[e][k],cur.n[e][k],&mean_n);
+			change = mb != 0 ? (mn - mb) / mb : 0;
+			p = mann_whitney(base.v[e][k],base.n[e][k],cur.v[e][k],cur.n[e][k]);
+
+			worse = metric_higher[k] ? change < -MIN_CHANGE : change > MIN_CHANGE;
+			if(p < ALPHA && worse){
+				verdict = "REGRESSION";
+				regressions++;
+			}else if(p < ALPHA && fabs(change) > MIN_CHANGE)
+				verdict = "improved";
+			else
+				verdict = "";
+
+			printf("%-8s %-9s %12.1f %12.1f %11.1f+-%-7.1f %11.1f+-%-7.1f %+7.1f%% %8.4f  %s\n",
+				engines[e].name,metric_names[k],mb,mn,mean_b,cb,mean_n,cn,
+				100 * change,p,verdict);
+		}
+
+	if(regressions > 0)
+		printf("\n%d significant regression%s\n",regressions,regressions > 1 ? "s" : "");
+
+	return regressions > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int
+main(int argc, char *argv[])
+{
+	long n;
+	int reps;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	snprintf(nproc,sizeof(nproc),"%ld",n > 0 ? n : 1);
+
+	if(argc >= 4 && strcmp(argv[1],"run") == 0){
+		reps = argc > 4 ? atoi(argv[4]) : 10;
+		if(reps < 1 || reps > MAX_REPS)
+			reps = 10;
+		return cmd_run(argv[2],argv[3],reps);
+	}
+	if(argc == 4 && strcmp(argv[1],"compare") == 0)
+		return cmd_compare(argv[2],argv[3]);
+
+	fprintf(stderr,"usage: %s run <corpus-dir> <label> [repetitions]\n",argv[0]);
+	fprintf(stderr,"       %s compare <baseline-label> <label>\n",argv[0]);
+	return 2;
+}
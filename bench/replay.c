@@ -0,0 +1,360 @@
+/*
+  Copyright (C) 2014 Fabrizio Curcio aka spike
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Replay a trace written by elfkillah --record: synthesize a corpus of
+  ELF files with the recorded sizes and layouts, each file's section
+  header table and string table where the original had them, then run
+  elfkillah over it with whatever options are given, so production
+  shaped workloads can be measured anywhere.
+
+    cc -O2 -o replay bench/replay.c
+    ELFKILLAH=./elfkillah ./replay trace workdir -j 8 -s
+
+  The corpus is kept in workdir/corpus and only files of the wrong size
+  are made again. elfkillah runs over batches of REPLAY_BATCH files, so
+  its -s and --record output is per batch on large traces.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define REPLAY_BATCH 8192
+#define FILL_SIZE (1 << 20)
+#define STAGES 5
+
+typedef struct {
+	uint64_t size;
+	uint64_t shoff;
+	int type;
+	uint64_t strtbloff;
+	uint64_t strtblsize;
+	uint64_t truncated;
+	uint64_t lat[STAGES];
+} Record;
+
+static const char *stage_names[STAGES] = {
+	"total", "open/map", "write", "patch", "unmap"
+};
+
+static void
+err_exit(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static Record *
+load_trace(const char *path, size_t *n)
+{
+	FILE *f;
+	Record *recs, r;
+	size_t cap;
+	char line[512];
+
+	f = fopen(path,"r");
+	if(f == NULL)
+		err_exit("load_trace() --> fopen()");
+
+	recs = NULL;
+	cap = 0;
+	*n = 0;
+	while(fgets(line,sizeof(line),f) != NULL){
+		if(line[0] == '#')
+			continue;
+		if(sscanf(line,"%" SCNu64 " %" SCNu64 " %d %" SCNu64 " %" SCNu64 " %" SCNu64
+			  " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64,
+			  &r.size,&r.shoff,&r.type,&r.strtbloff,&r.strtblsize,&r.truncated,
+			  &r.lat[0],&r.lat[1],&r.lat[2],&r.lat[3],&r.lat[4]) != 11)
+			continue;
+		if(r.shoff < 2 || r.shoff >= r.size || (r.type != 32 && r.type != 64))
+			continue;
+		if(*n == cap){
+			cap = cap ? 2 * cap : 1024;
+			recs = (Record *)realloc(recs,cap * sizeof(Record));
+			if(recs == NULL)
+				err_exit("load_trace() --> realloc()");
+		}
+		recs[(*n)++] = r;
+	}
+	fclose(f);
+
+	return recs;
+}
+
+static int
+pwrite_all(int fd, const void *buf, size_t len, off_t off)
+{
+	const char *p;
+	ssize_t written;
+
+	for(p=(const char *)buf; len > 0; p += written, off += written, len -= written){
+		written = pwrite(fd,p,len,off);
+		if(written == -1 && errno == EINTR)
+			written = 0;
+		else if(written <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+  A file with the recorded layout: a header pointing at a section
+  header table at e_shoff, whose entry 1 is the string table at the
+  recorded place. Everything else is noise, which is all elfkillah
+  ever copies.
+*/
+static void
+synthesize(const char *path, const Record *r, const unsigned char *fill)
+{
+	Elf32_Ehdr e32;
+	Elf64_Ehdr e64;
+	Elf32_Shdr s32;
+	Elf64_Shdr s64;
+	uint64_t off, shnum, shentsize, len;
+	int fd;
+
+	fd = open(path,O_CREAT|O_WRONLY|O_TRUNC,S_IRWXU);
+	if(fd == -1)
+		err_exit("synthesize() --> open()");
+
+	for(off=0; off < r->size; off += len){
+		len = r->size - off < FILL_SIZE ? r->size - off : FILL_SIZE;
+		if(pwrite_all(fd,fill + (off / FILL_SIZE) % 7,len,off) == -1)
+			err_exit("synthesize() --> pwrite()");
+	}
+
+	shentsize = r->type == 64 ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr);
+	shnum = (r->size - r->shoff) / shentsize;
+	if(shnum > 0xff00)
+		shnum = 0xff00;
+
+	if(r->type == 64){
+		memset(&e64,0,sizeof(e64));
+		memset(&s64,0,sizeof(s64));
+		memcpy(e64.e_ident,ELFMAG,SELFMAG);
+		e64.e_ident[EI_CLASS] = ELFCLASS64;
+		e64.e_ident[EI_DATA] = ELFDATA2LSB;
+		e64.e_ident[EI_VERSION] = EV_CURRENT;
+		e64.e_type = ET_DYN;
+		e64.e_version = EV_CURRENT;
+		e64.e_ehsize = sizeof(e64);
+		e64.e_shoff = r->shoff;
+		e64.e_shentsize = shentsize;
+		e64.e_shnum = shnum;
+		e64.e_shstrndx = shnum > 1 ? 1 : SHN_UNDEF;
+		pwrite_all(fd,&e64,sizeof(e64),0);
+		pwrite_all(fd,&s64,sizeof(s64),r->shoff);
+		s64.sh_type = SHT_STRTAB;
+		s64.sh_offset = r->strtbloff;
+		s64.sh_size = r->strtblsize;
+		if(shnum > 1)
+			pwrite_all(fd,&s64,sizeof(s64),r->shoff + shentsize);
+	}else{
+		memset(&e32,0,sizeof(e32));
+		memset(&s32,0,sizeof(s32));
+		memcpy(e32.e_ident,ELFMAG,SELFMAG);
+		e32.e_ident[EI_CLASS] = ELFCLASS32;
+		e32.e_ident[EI_DATA] = ELFDATA2LSB;
+		e32.e_ident[EI_VERSION] = EV_CURRENT;
+		e32.e_type = ET_DYN;
+		e32.e_version = EV_CURRENT;
+		e32.e_ehsize = sizeof(e32);
+		e32.e_shoff = r->shoff;
+		e32.e_shentsize = shentsize;
+		e32.e_shnum = shnum;
+		e32.e_shstrndx = shnum > 1 ? 1 : SHN_UNDEF;
+		pwrite_all(fd,&e32,sizeof(e32),0);
+		pwrite_all(fd,&s32,sizeof(s32),r->shoff);
+		s32.sh_type = SHT_STRTAB;
+		s32.sh_offset = r->strtbloff;
+		s32.sh_size = r->strtblsize;
+		if(shnum > 1)
+			pwrite_all(fd,&s32,sizeof(s32),r->shoff + shentsize);
+	}
+
+	close(fd);
+}
+
+static int
+u64_cmp(const void *a, const void *b)
+{
+	uint64_t x, y;
+
+	x = *(const uint64_t *)a;
+	y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* What the trace saw, to set the replay against */
+static void
+print_recorded(const Record *recs, size_t n)
+{
+	uint64_t *v, bytes, sum;
+	size_t i;
+	int s;
+
+	v = (uint64_t *)malloc(n * sizeof(uint64_t));
+	if(v == NULL)
+		err_exit("print_recorded() --> malloc()");
+
+	for(bytes=0, i=0; i<n; i++)
+		bytes += recs[i].size;
+	printf("%zu files, %llu bytes recorded\n\n",n,(unsigned long long)bytes);
+	printf("%-10s %12s %12s %12s\n","recorded","mean(us)","p50(us)","p99(us)");
+
+	for(s=0; s<STAGES; s++){
+		for(sum=0, i=0; i<n; i++){
+			v[i] = recs[i].lat[s];
+			sum += v[i];
+		}
+		qsort(v,n,sizeof(uint64_t),u64_cmp);
+		printf("%-10s %12.1f %12.1f %12.1f\n",stage_names[s],sum / 1e3 / n,
+			v[n / 2] / 1e3,v[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1] / 1e3);
+	}
+	printf("\n");
+
+	free(v);
+}
+
+static uint64_t
+run_batch(char **argv)
+{
+	uint64_t start;
+	int status;
+	pid_t pid;
+
+	start = now_ns();
+	pid = fork();
+	if(pid == -1)
+		err_exit("run_batch() --> fork()");
+	if(pid == 0){
+		execv(argv[0],argv);
+		_exit(127);
+	}
+	if(waitpid(pid,&status,0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+		fprintf(stderr,"replay: %s failed\n",argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	return now_ns() - start;
+}
+
+int
+main(int argc, char *argv[])
+{
+	Record *recs;
+	unsigned char *fill;
+	char **args, *names;
+	const char *bin;
+	uint64_t ns, bytes, x;
+	size_t n, i, b, nargs, nopts, len;
+	struct stat st;
+	char dir[PATH_MAX], path[PATH_MAX];
+
+	if(argc < 3){
+		fprintf(stderr,"usage: %s <trace> <workdir> [elfkillah options]\n",argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	bin = getenv("ELFKILLAH") != NULL ? getenv("ELFKILLAH") : "./elfkillah";
+	recs = load_trace(argv[1],&n);
+	if(n == 0){
+		fprintf(stderr,"replay: no records in %s\n",argv[1]);
+		return EXIT_FAILURE;
+	}
+	print_recorded(recs,n);
+
+	snprintf(dir,sizeof(dir),"%s/corpus",argv[2]);
+	mkdir(argv[2],0755);
+	mkdir(dir,0755);
+	snprintf(dir,sizeof(dir),"%s/out",argv[2]);
+	mkdir(dir,0755);
+
+	fill = (unsigned char *)malloc(FILL_SIZE + 8);
+	if(fill == NULL)
+		err_exit("main() --> malloc()");
+	for(x=0x9e3779b97f4a7c15ULL, i=0; i<FILL_SIZE + 8; i++){
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		fill[i] = x;
+	}
+
+	for(bytes=0, i=0; i<n; i++){
+		snprintf(path,sizeof(path),"%s/corpus/%08zu",argv[2],i);
+		if(stat(path,&st) == -1 || (uint64_t)st.st_size != recs[i].size)
+			synthesize(path,&recs[i],fill);
+		bytes += recs[i].size;
+	}
+
+	/* elfkillah [options] <in> <out> ... in batches the argv limit allows */
+	nopts = argc - 3;
+	len = strlen(argv[2]) + sizeof("/corpus/00000000");
+	args = (char **)malloc((2 + nopts + 2 * REPLAY_BATCH) * sizeof(char *));
+	names = (char *)malloc(2 * REPLAY_BATCH * len);
+	if(args == NULL || names == NULL)
+		err_exit("main() --> malloc()");
+	args[0] = (char *)bin;
+	memcpy(args + 1,argv + 3,nopts * sizeof(char *));
+
+	fflush(stdout);
+	ns = 0;
+	for(b=0; b<n; b += REPLAY_BATCH){
+		nargs = 1 + nopts;
+		for(i=b; i<n && i < b + REPLAY_BATCH; i++){
+			args[nargs] = names + (nargs - 1 - nopts) * len;
+			snprintf(args[nargs++],len,"%s/corpus/%08zu",argv[2],i);
+			args[nargs] = names + (nargs - 1 - nopts) * len;
+			snprintf(args[nargs++],len,"%s/out/%08zu",argv[2],i);
+		}
+		args[nargs] = NULL;
+		ns += run_batch(args);
+	}
+
+	printf("replayed %zu files in %.3f s: %.1f files/s, %.1f MiB/s\n",n,ns / 1e9,
+		n / (ns / 1e9),bytes / (ns / 1e9) / 1048576);
+
+	free(names);
+	free(args);
+	free(fill);
+	free(recs);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,433 @@
+/*
+  Copyright (C) 2014 Fabrizio Curcio aka spike
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Directory walk scalability. "gen" builds a synthetic tree of the
+  given number of entries, directories fanned out and nested, files a
+  mix of small ELF and other files with hard links and symlinks among
+  them. "run" walks it with every combination of reader threads and
+  getdents64 buffer sizes, once taking every regular file and once
+  opening each to check its ELF magic, and reports entries/s. Nothing
+  is stripped, so this is the cost of finding the work alone.
+
+    cc -O2 -pthread -o walk bench/walk.c
+    ./walk gen /dev/shm/tree 1000000
+    ./walk run /dev/shm/tree 1,2,4,8 4096,32768,262144
+
+  Generate on tmpfs, or on a loop mounted filesystem to measure that
+  one; either way the second and later passes run from the dentry and
+  inode caches.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <elf.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define GEN_FANOUT 64
+#define GEN_FILES_PER_DIR 48
+#define MAX_CONFIGS 16
+
+typedef struct {
+	uint64_t ino;
+	int64_t off;
+	unsigned short reclen;
+	unsigned char type;
+	char name[];
+} Dirent64;
+
+typedef struct {
+	char **dirs;		/* directories left to read */
+	size_t ndirs;
+	size_t cap;
+	int busy;		/* readers inside a directory */
+	int done;
+	pthread_mutex_t lock;
+	pthread_cond_t more;
+	size_t bufsize;
+	int prefilter;
+} Walk;
+
+typedef struct {
+	Walk *walk;
+	pthread_t tid;
+	uint64_t entries;
+	uint64_t dirs;
+	uint64_t files;
+	uint64_t links;
+	uint64_t elf;
+} Reader;
+
+static void
+err_exit(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* A file of its own: one in four an ELF header, the rest text */
+static void
+gen_file(int dfd, const char *name, size_t n)
+{
+	Elf64_Ehdr hdr;
+	char text[64];
+	int fd, len;
+
+	fd = openat(dfd,name,O_WRONLY | O_CREAT | O_TRUNC,0755);
+	if(fd == -1)
+		err_exit("gen_file() --> openat()");
+
+	if(n % 4 == 0){
+		memset(&hdr,0,sizeof(hdr));
+		memcpy(hdr.e_ident,ELFMAG,SELFMAG);
+		hdr.e_ident[EI_CLASS] = ELFCLASS64;
+		hdr.e_ident[EI_DATA] = ELFDATA2LSB;
+		hdr.e_ident[EI_VERSION] = EV_CURRENT;
+		hdr.e_type = ET_DYN;
+		hdr.e_machine = EM_X86_64;
+		hdr.e_version = EV_CURRENT;
+		hdr.e_ehsize = sizeof(hdr);
+		if(write(fd,&hdr,sizeof(hdr)) != sizeof(hdr))
+			err_exit("gen_file() --> write()");
+	}else{
+		len = snprintf(text,sizeof(text),"entry %zu\n",n);
+		if(write(fd,text,len) != len)
+			err_exit("gen_file() --> write()");
+	}
+	close(fd);
+}
+
+/*
+  Fill dfd with files until the budget runs out, then fan out into
+  subdirectories sharing what is left: half of it to the first, which
+  makes a deep spine, the rest evenly. Every 16th entry is a hard link
+  to the previous file and every 32nd a symlink to it.
+*/
+static void
+gen_dir(int dfd, size_t *left, size_t *serial)
+{
+	char name[32], last[32];
+	size_t i, share;
+	int sub;
+
+	last[0] = '\0';
+	for(i=0; i<GEN_FILES_PER_DIR && *left > 0; i++, (*left)--, (*serial)++){
+		snprintf(name,sizeof(name),"f%zu",*serial);
+		if(last[0] != '\0' && *serial % 32 == 0){
+			if(symlinkat(last,dfd,name) == -1)
+				err_exit("gen_dir() --> symlinkat()");
+		}else if(last[0] != '\0' && *serial % 16 == 0){
+			if(linkat(dfd,last,dfd,name,0) == -1)
+				err_exit("gen_dir() --> linkat()");
+		}else{
+			gen_file(dfd,name,*serial);
+			memcpy(last,name,sizeof(name));
+		}
+	}
+
+	for(i=0; i<GEN_FANOUT && *left > 0; i++){
+		/* Directories count as entries too */
+		snprintf(name,sizeof(name),"d%zu",(*serial)++);
+		(*left)--;
+		if(mkdirat(dfd,name,0755) == -1)
+			err_exit("gen_dir() --> mkdirat()");
+		sub = openat(dfd,name,O_RDONLY | O_DIRECTORY);
+		if(sub == -1)
+			err_exit("gen_dir() --> openat()");
+
+		share = i == 0 ? *left / 2 : *left / (GEN_FANOUT - i);
+		*left -= share;
+		gen_dir(sub,&share,serial);
+		*left += share;
+		close(sub);
+	}
+}
+
+static int
+cmd_gen(const char *root, size_t entries)
+{
+	size_t serial;
+	uint64_t start;
+	int dfd;
+
+	if(mkdir(root,0755) == -1 && errno != EEXIST)
+		err_exit("cmd_gen() --> mkdir()");
+	dfd = open(root,O_RDONLY | O_DIRECTORY);
+	if(dfd == -1)
+		err_exit("cmd_gen() --> open()");
+
+	start = now_ns();
+	serial = 0;
+	gen_dir(dfd,&entries,&serial);
+	close(dfd);
+
+	printf("%zu entries in %.1fs\n",serial,(now_ns() - start) / 1e9);
+	return EXIT_SUCCESS;
+}
+
+static void
+walk_push(Walk *w, char *dir)
+{
+	pthread_mutex_lock(&w->lock);
+	if(w->ndirs == w->cap){
+		w->cap = w->cap ? 2 * w->cap : 1024;
+		w->dirs = (char **)realloc(w->dirs,w->cap * sizeof(char *));
+		if(w->dirs == NULL)
+			err_exit("walk_push() --> realloc()");
+	}
+	w->dirs[w->ndirs++] = dir;
+	pthread_cond_signal(&w->more);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Next directory, NULL once none is queued and no reader can add one */
+static char *
+walk_pop(Walk *w, int finished)
+{
+	char *dir;
+
+	pthread_mutex_lock(&w->lock);
+	w->busy -= finished;
+	while(w->ndirs == 0 && !w->done){
+		if(w->busy == 0){
+			w->done = 1;
+			pthread_cond_broadcast(&w->more);
+			break;
+		}
+		pthread_cond_wait(&w->more,&w->lock);
+	}
+	dir = NULL;
+	if(w->ndirs > 0){
+		dir = w->dirs[--w->ndirs];
+		w->busy++;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return dir;
+}
+
+static int
+has_magic(int dfd, const char *name)
+{
+	char magic[SELFMAG];
+	int fd, ok;
+
+	fd = openat(dfd,name,O_RDONLY | O_NOFOLLOW | O_NOCTTY);
+	if(fd == -1)
+		return 0;
+	ok = pread(fd,magic,SELFMAG,0) == SELFMAG && memcmp(magic,ELFMAG,SELFMAG) == 0;
+	close(fd);
+
+	return ok;
+}
+
+static void
+read_dir(Reader *r, char *path, char *buf)
+{
+	Dirent64 *d;
+	struct stat st;
+	unsigned char type;
+	char *sub;
+	size_t len;
+	long n, off;
+	int dfd;
+
+	dfd = open(path,O_RDONLY | O_DIRECTORY);
+	if(dfd == -1)
+		return;
+	len = strlen(path);
+
+	while((n = syscall(SYS_getdents64,dfd,buf,r->walk->bufsize)) > 0)
+		for(off=0; off<n; off += d->reclen){
+			d = (Dirent64 *)(buf + off);
+			if(d->name[0] == '.' && (d->name[1] == '\0' || (d->name[1] == '.' && d->name[2] == '\0')))
+				continue;
+			r->entries++;
+
+			type = d->type;
+			if(type == DT_UNKNOWN && fstatat(dfd,d->name,&st,AT_SYMLINK_NOFOLLOW) == 0)
+				type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+
+			if(type == DT_DIR){
+				sub = (char *)malloc(len + strlen(d->name) + 2);
+				if(sub == NULL)
+					err_exit("read_dir() --> malloc()");
+				sprintf(sub,"%s/%s",path,d->name);
+				r->dirs++;
+				walk_push(r->walk,sub);
+			}else if(type == DT_REG){
+				r->files++;
+				if(r->walk->prefilter && has_magic(dfd,d->name))
+					r->elf++;
+			}else
+				r->links++;
+		}
+	close(dfd);
+}
+
+static void *
+reader_thread(void *arg)
+{
+	Reader *r;
+	char *buf, *dir;
+	int finished;
+
+	r = (Reader *)arg;
+	buf = (char *)malloc(r->walk->bufsize);
+	if(buf == NULL)
+		err_exit("reader_thread() --> malloc()");
+
+	finished = 0;
+	while((dir = walk_pop(r->walk,finished)) != NULL){
+		read_dir(r,dir,buf);
+		free(dir);
+		finished = 1;
+	}
+	free(buf);
+
+	return NULL;
+}
+
+static void
+run_walk(const char *root, int threads, size_t bufsize, int prefilter, int report)
+{
+	Walk w;
+	Reader *readers, sum;
+	uint64_t start, ns;
+	char *dir;
+	int i;
+
+	memset(&w,0,sizeof(w));
+	pthread_mutex_init(&w.lock,NULL);
+	pthread_cond_init(&w.more,NULL);
+	w.bufsize = bufsize;
+	w.prefilter = prefilter;
+
+	dir = strdup(root);
+	if(dir == NULL)
+		err_exit("run_walk() --> strdup()");
+	walk_push(&w,dir);
+
+	readers = (Reader *)calloc(threads,sizeof(Reader));
+	if(readers == NULL)
+		err_exit("run_walk() --> calloc()");
+
+	start = now_ns();
+	for(i=0; i<threads; i++){
+		readers[i].walk = &w;
+		if(pthread_create(&readers[i].tid,NULL,reader_thread,&readers[i]) != 0)
+			err_exit("run_walk() --> pthread_create()");
+	}
+	memset(&sum,0,sizeof(sum));
+	for(i=0; i<threads; i++){
+		pthread_join(readers[i].tid,NULL);
+		sum.entries += readers[i].entries;
+		sum.dirs += readers[i].dirs;
+		sum.files += readers[i].files;
+		sum.links += readers[i].links;
+		sum.elf += readers[i].elf;
+	}
+	ns = now_ns() - start;
+
+	if(report)
+		printf("%7d %8zu %9s %12.0f %9.3f %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 "\n",
+			threads,bufsize,prefilter ? "magic" : "off",sum.entries / (ns / 1e9),ns / 1e9,
+			sum.dirs,sum.files,sum.links,sum.elf);
+
+	free(readers);
+	free(w.dirs);
+	pthread_cond_destroy(&w.more);
+	pthread_mutex_destroy(&w.lock);
+}
+
+static int
+parse_list(const char *arg, long *v)
+{
+	char *end;
+	int n;
+
+	for(n=0; n<MAX_CONFIGS && *arg != '\0'; n++){
+		v[n] = strtol(arg,&end,10);
+		if(end == arg || v[n] <= 0)
+			return 0;
+		arg = *end == ',' ? end + 1 : end;
+	}
+
+	return n;
+}
+
+static int
+cmd_run(const char *root, const char *thread_list, const char *buf_list)
+{
+	long threads[MAX_CONFIGS], bufs[MAX_CONFIGS];
+	int nt, nb, t, b, p;
+
+	nt = parse_list(thread_list,threads);
+	nb = parse_list(buf_list,bufs);
+	if(nt == 0 || nb == 0){
+		fprintf(stderr,"walk: bad thread or buffer list\n");
+		return 2;
+	}
+
+	/* One untimed pass to bring the tree into the caches */
+	run_walk(root,1,32768,0,0);
+	printf("%7s %8s %9s %12s %9s %9s %9s %9s %9s\n","threads","getdents","prefilter",
+		"entries/s","seconds","dirs","files","other","elf");
+
+	for(p=0; p<2; p++)
+		for(t=0; t<nt; t++)
+			for(b=0; b<nb; b++)
+				run_walk(root,threads[t],bufs[b] < 512 ? 512 : bufs[b],p,1);
+
+	return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char *argv[])
+{
+	if(argc == 4 && strcmp(argv[1],"gen") == 0)
+		return cmd_gen(argv[2],strtoul(argv[3],NULL,10));
+	if(argc >= 3 && strcmp(argv[1],"run") == 0)
+		return cmd_run(argv[2],argc > 3 ? argv[3] : "1,2,4,8",argc > 4 ? argv[4] : "4096,32768,262144");
+
+	fprintf(stderr,"usage: %s gen <root> <entries>\n",argv[0]);
+	fprintf(stderr,"       %s run <root> [threads,...] [getdents-bytes,...]\n",argv[0]);
+	return 2;
+}
@@ -0,0 +1,303 @@
+/*
+  Copyright (C) 2014 Fabrizio Curcio aka spike
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Read a bundle written by elfkillah --bundle: list it, extract its
+  outputs as files, or run one without extracting anything, from a
+  memfd. Every page and name is checked against the bundle before use,
+  so a damaged bundle fails instead of reading out of it.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "elfkillah.h"
+
+typedef struct {
+	const unsigned char *base;
+	const ElfkillahBundle *head;
+	const ElfkillahBundleEntry *entries;
+	const uint32_t *list;
+	uint64_t nlist;
+	const char *names;
+	uint64_t names_size;
+} Bundle;
+
+extern char **environ;
+
+static void
+err_exit(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static void
+usage(const char *pname)
+{
+	fprintf(stderr,"%s -l <bundle>\n",pname);
+	fprintf(stderr,"%s -x <bundle> [<dir>]\n",pname);
+	fprintf(stderr,"%s <bundle> <name> [<arg> ...]\n\n",pname);
+	fprintf(stderr,"  -l              list the outputs in <bundle>\n");
+	fprintf(stderr,"  -x              extract every output under <dir> (default .)\n");
+	fprintf(stderr,"  otherwise       run output <name> from memory with the args given\n");
+	exit(EXIT_FAILURE);
+}
+
+static void
+bad_bundle(const char *path)
+{
+	fprintf(stderr,"%s: not a bundle, or a damaged one\n",path);
+	exit(EXIT_FAILURE);
+}
+
+static int
+write_all(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t written;
+
+	while(len > 0){
+		written = write(fd,buf,len);
+		if(written == -1 && errno == EINTR)
+			continue;
+		if(written <= 0)
+			return -1;
+		buf += written;
+		len -= written;
+	}
+
+	return 0;
+}
+
+static void
+bundle_map(Bundle *b, const char *path)
+{
+	const ElfkillahBundle *h;
+	struct stat st;
+	uint64_t size;
+	int fd;
+
+	fd = open(path,O_RDONLY);
+	if(fd == -1)
+		err_exit(path);
+	if(fstat(fd,&st) == -1)
+		err_exit("fstat()");
+	if(st.st_size < ELFKILLAH_BUNDLE_PAGE)
+		bad_bundle(path);
+	size = st.st_size;
+
+	b->base = (const unsigned char *)mmap(NULL,size,PROT_READ,MAP_SHARED,fd,0);
+	if(b->base == MAP_FAILED)
+		err_exit("mmap()");
+	close(fd);
+
+	/* Sections in order, each inside the file */
+	h = (const ElfkillahBundle *)b->base;
+	if(h->magic != ELFKILLAH_BUNDLE_MAGIC || h->size != size || h->pages < 1
+	   || h->entries != h->pages * ELFKILLAH_BUNDLE_PAGE || h->entries > size
+	   || h->count > (size - h->entries) / sizeof(ElfkillahBundleEntry)
+	   || h->list != h->entries + h->count * sizeof(ElfkillahBundleEntry)
+	   || h->names < h->list || h->names > size || (h->names - h->list) % sizeof(uint32_t) != 0
+	   || (h->names < size && b->base[size - 1] != '\0'))
+		bad_bundle(path);
+
+	b->head = h;
+	b->entries = (const ElfkillahBundleEntry *)(b->base + h->entries);
+	b->list = (const uint32_t *)(b->base + h->list);
+	b->nlist = (h->names - h->list) / sizeof(uint32_t);
+	b->names = (const char *)b->base + h->names;
+	b->names_size = size - h->names;
+}
+
+/* The name of entry i, NULL when the entry does not fit the bundle */
+static const char *
+entry_check(const Bundle *b, uint32_t i)
+{
+	const ElfkillahBundleEntry *e;
+	uint64_t n, k;
+
+	e = &b->entries[i];
+	n = (e->size + ELFKILLAH_BUNDLE_PAGE - 1) / ELFKILLAH_BUNDLE_PAGE;
+	if(e->first > b->nlist || n > b->nlist - e->first || e->name >= b->names_size)
+		return NULL;
+	for(k=0; k<n; k++)
+		if(b->list[e->first + k] == 0 || b->list[e->first + k] >= b->head->pages)
+			return NULL;
+
+	return b->names + e->name;
+}
+
+static int
+entry_write(const Bundle *b, uint32_t i, int fd)
+{
+	const ElfkillahBundleEntry *e;
+	uint64_t off, len;
+	const uint32_t *page;
+
+	e = &b->entries[i];
+	page = &b->list[e->first];
+	for(off=0; off<e->size; off += len, page++){
+		len = e->size - off < ELFKILLAH_BUNDLE_PAGE ? e->size - off : ELFKILLAH_BUNDLE_PAGE;
+		if(write_all(fd,b->base + (uint64_t)*page * ELFKILLAH_BUNDLE_PAGE,len) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void
+list(const Bundle *b, const char *path)
+{
+	uint64_t refs;
+	uint32_t i;
+	const char *name;
+
+	refs = 0;
+	for(i=0; i<b->head->count; i++){
+		name = entry_check(b,i);
+		if(name == NULL)
+			bad_bundle(path);
+		printf("%06o %12llu  %s\n",b->entries[i].mode,(unsigned long long)b->entries[i].size,name);
+		refs += (b->entries[i].size + ELFKILLAH_BUNDLE_PAGE - 1) / ELFKILLAH_BUNDLE_PAGE;
+	}
+	printf("%u outputs, %llu pages, %llu stored\n",b->head->count,(unsigned long long)refs,
+		(unsigned long long)b->head->pages - 1);
+}
+
+/* Create the directories of name under dfd; refuses names which leave it */
+static int
+make_parents(int dfd, const char *name)
+{
+	char dir[PATH_MAX], *seg, *slash;
+
+	if(name[0] == '\0' || name[0] == '/' || snprintf(dir,sizeof(dir),"%s",name) >= (int)sizeof(dir))
+		return -1;
+	for(seg=dir; seg != NULL; seg = slash != NULL ? slash + 1 : NULL){
+		slash = strchr(seg,'/');
+		if(strncmp(seg,"..",2) == 0 && (seg[2] == '/' || seg[2] == '\0'))
+			return -1;
+	}
+
+	for(slash=strchr(dir,'/'); slash != NULL; slash=strchr(slash + 1,'/')){
+		*slash = '\0';
+		if(mkdirat(dfd,dir,0755) == -1 && errno != EEXIST)
+			return -1;
+		*slash = '/';
+	}
+
+	return 0;
+}
+
+static void
+extract(const Bundle *b, const char *path, const char *dir)
+{
+	const char *name;
+	uint32_t i;
+	int dfd, fd;
+
+	dfd = open(dir,O_RDONLY|O_DIRECTORY);
+	if(dfd == -1)
+		err_exit(dir);
+
+	for(i=0; i<b->head->count; i++){
+		name = entry_check(b,i);
+		if(name == NULL)
+			bad_bundle(path);
+		if(make_parents(dfd,name) == -1){
+			fprintf(stderr,"%s: cannot extract %s\n",path,name);
+			exit(EXIT_FAILURE);
+		}
+		fd = openat(dfd,name,O_CREAT|O_TRUNC|O_WRONLY|O_NOFOLLOW,0600);
+		if(fd == -1)
+			err_exit(name);
+		if(entry_write(b,i,fd) == -1 || fchmod(fd,b->entries[i].mode & 0777) == -1)
+			err_exit(name);
+		close(fd);
+	}
+	close(dfd);
+}
+
+/* Copy the output into a memfd and execute it, never touching a filesystem */
+static void
+run(const Bundle *b, const char *path, const char *name, char *argv[])
+{
+	const char *base;
+	uint32_t i;
+	int fd;
+
+	for(i=0; i<b->head->count; i++)
+		if(entry_check(b,i) != NULL && strcmp(entry_check(b,i),name) == 0)
+			break;
+	if(i == b->head->count){
+		fprintf(stderr,"%s: no %s in it\n",path,name);
+		exit(EXIT_FAILURE);
+	}
+
+	base = strrchr(name,'/') != NULL ? strrchr(name,'/') + 1 : name;
+	fd = memfd_create(base,MFD_CLOEXEC);
+	if(fd == -1)
+		err_exit("memfd_create()");
+	if(entry_write(b,i,fd) == -1)
+		err_exit("write()");
+
+	fexecve(fd,argv,environ);
+	err_exit(name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	Bundle b;
+	int c, mode;
+
+	mode = 0;
+	while((c = getopt(argc,argv,"+lxh")) != -1){
+		switch(c){
+		case 'l':
+		case 'x':
+			mode = c;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if(mode == 'l' && argc - optind == 1){
+		bundle_map(&b,argv[optind]);
+		list(&b,argv[optind]);
+	}else if(mode == 'x' && (argc - optind == 1 || argc - optind == 2)){
+		bundle_map(&b,argv[optind]);
+		extract(&b,argv[optind],argc - optind == 2 ? argv[optind + 1] : ".");
+	}else if(mode == 0 && argc - optind >= 2){
+		bundle_map(&b,argv[optind]);
+		run(&b,argv[optind],argv[optind + 1],argv + optind + 1);
+	}else
+		usage(argv[0]);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,379 @@
+/*
+  Copyright (C) 2014 Fabrizio Curcio aka spike
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  A tiny stand-in for the remote cache of elfkillah --remote. It keeps
+  /ac/<hex> and /cas/<hex> entries as files under a directory and
+  speaks just enough HTTP/1.1 for GET, HEAD and PUT on them, over
+  keep-alive connections which may pipeline requests. Entries are
+  neither verified nor ever evicted.
+
+    cc -O2 -pthread -o elfkillah-cas elfkillah-cas.c
+    ./elfkillah-cas -p 8080 /tmp/cas &
+    ./elfkillah --remote localhost:8080 in out
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#define CAS_BUF (64 << 10)
+#define CAS_MAX_LINE 1024
+
+typedef struct {
+	int fd;
+	size_t len;
+	size_t pos;
+	char buf[CAS_BUF];
+} Conn;
+
+static int store_dfd;
+static unsigned long tmp_serial;
+
+static void
+err_exit(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static void
+usage(const char *pname)
+{
+	fprintf(stderr,"%s [-a <addr>] [-p <port>] <dir>\n\n",pname);
+	fprintf(stderr,"  -a <addr>       listen on <addr> (default 127.0.0.1)\n");
+	fprintf(stderr,"  -p <port>       listen on <port> (default 8080)\n");
+	exit(EXIT_FAILURE);
+}
+
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t written;
+
+	while(len > 0){
+		written = write(fd,buf,len);
+		if(written == -1 && errno == EINTR)
+			continue;
+		if(written <= 0)
+			return -1;
+		buf += written;
+		len -= written;
+	}
+
+	return 0;
+}
+
+static int
+fill(Conn *c)
+{
+	ssize_t got;
+
+	do
+		got = read(c->fd,c->buf,sizeof(c->buf));
+	while(got == -1 && errno == EINTR);
+	if(got <= 0)
+		return -1;
+
+	c->len = got;
+	c->pos = 0;
+	return 0;
+}
+
+static int
+read_line(Conn *c, char *line, size_t max)
+{
+	size_t n;
+	char ch;
+
+	for(n=0; ; ){
+		if(c->pos == c->len && fill(c) == -1)
+			return -1;
+		ch = c->buf[c->pos++];
+		if(ch == '\n')
+			break;
+		if(n + 1 >= max)
+			return -1;
+		line[n++] = ch;
+	}
+	if(n > 0 && line[n - 1] == '\r')
+		n--;
+	line[n] = '\0';
+
+	return 0;
+}
+
+/* Move len bytes of body to fd, or drop them with fd -1 */
+static int
+read_body(Conn *c, size_t len, int fd)
+{
+	size_t n;
+
+	while(len > 0){
+		if(c->pos == c->len && fill(c) == -1)
+			return -1;
+		n = c->len - c->pos < len ? c->len - c->pos : len;
+		if(fd != -1 && write_all(fd,c->buf + c->pos,n) == -1)
+			return -1;
+		c->pos += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+reply(Conn *c, int status, const char *reason, size_t length)
+{
+	char hdr[128];
+	int len;
+
+	len = snprintf(hdr,sizeof(hdr),"HTTP/1.1 %d %s\r\nContent-Length: %zu\r\n\r\n",
+		status,reason,length);
+	return write_all(c->fd,hdr,len);
+}
+
+/* ac/<hex> or cas/<hex>, relative to the store; NULL for anything else */
+static const char *
+entry_path(const char *path, char *out, size_t max)
+{
+	const char *hex;
+	size_t n;
+
+	if(strncmp(path,"/ac/",4) == 0)
+		hex = path + 4;
+	else if(strncmp(path,"/cas/",5) == 0)
+		hex = path + 5;
+	else
+		return NULL;
+
+	n = strspn(hex,"0123456789abcdef");
+	if(n == 0 || n > 128 || hex[n] != '\0')
+		return NULL;
+
+	snprintf(out,max,"%s",path + 1);
+	return out;
+}
+
+static int
+serve_get(Conn *c, const char *name, int head)
+{
+	struct stat sb;
+	off_t off;
+	ssize_t sent;
+	int fd, ret;
+
+	fd = openat(store_dfd,name,O_RDONLY);
+	if(fd == -1 || fstat(fd,&sb) == -1){
+		if(fd != -1)
+			close(fd);
+		return reply(c,404,"Not Found",0);
+	}
+
+	ret = reply(c,200,"OK",sb.st_size);
+	for(off=0; ret == 0 && !head && off < sb.st_size; ){
+		sent = sendfile(c->fd,fd,&off,sb.st_size - off);
+		if(sent == -1 && errno == EINTR)
+			continue;
+		if(sent <= 0)
+			ret = -1;
+	}
+	close(fd);
+
+	return ret;
+}
+
+/* Written aside and renamed, so readers never see half an entry */
+static int
+serve_put(Conn *c, const char *name, size_t length)
+{
+	char tmp[64];
+	int fd, ok;
+
+	snprintf(tmp,sizeof(tmp),"tmp/%d.%lu",(int)getpid(),
+		__atomic_fetch_add(&tmp_serial,1,__ATOMIC_RELAXED));
+	fd = openat(store_dfd,tmp,O_CREAT|O_EXCL|O_WRONLY,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if(fd == -1){
+		if(read_body(c,length,-1) == -1)
+			return -1;
+		return reply(c,500,"Internal Server Error",0);
+	}
+
+	if(read_body(c,length,fd) == -1){
+		close(fd);
+		unlinkat(store_dfd,tmp,0);
+		return -1;
+	}
+	ok = close(fd) == 0 && renameat(store_dfd,tmp,store_dfd,name) == 0;
+	if(!ok){
+		unlinkat(store_dfd,tmp,0);
+		return reply(c,500,"Internal Server Error",0);
+	}
+
+	return reply(c,200,"OK",0);
+}
+
+static void *
+serve(void *arg)
+{
+	Conn *c;
+	char line[CAS_MAX_LINE], method[16], path[CAS_MAX_LINE], name[CAS_MAX_LINE];
+	size_t length;
+	int keep, chunked, ret;
+
+	c = (Conn *)arg;
+	for(keep=1; keep; ){
+		if(read_line(c,line,sizeof(line)) == -1)
+			break;
+		if(line[0] == '\0')
+			continue;
+		if(sscanf(line,"%15s %1023s HTTP/1.%*d",method,path) != 2)
+			break;
+
+		length = 0;
+		chunked = 0;
+		while((ret = read_line(c,line,sizeof(line))) == 0 && line[0] != '\0'){
+			if(strncasecmp(line,"Content-Length:",15) == 0)
+				length = strtoull(line + 15,NULL,10);
+			else if(strncasecmp(line,"Connection:",11) == 0 && strcasestr(line + 11,"close") != NULL)
+				keep = 0;
+			else if(strncasecmp(line,"Transfer-Encoding:",18) == 0)
+				chunked = 1;
+		}
+		if(ret == -1)
+			break;
+		if(chunked){
+			reply(c,501,"Not Implemented",0);
+			break;
+		}
+
+		if(entry_path(path,name,sizeof(name)) == NULL)
+			ret = read_body(c,length,-1) == -1 ? -1 : reply(c,404,"Not Found",0);
+		else if(strcmp(method,"GET") == 0 || strcmp(method,"HEAD") == 0)
+			ret = serve_get(c,name,method[0] == 'H');
+		else if(strcmp(method,"PUT") == 0)
+			ret = serve_put(c,name,length);
+		else
+			ret = read_body(c,length,-1) == -1 ? -1 : reply(c,405,"Method Not Allowed",0);
+
+		if(ret == -1)
+			break;
+	}
+
+	close(c->fd);
+	free(c);
+
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct addrinfo hints, *res;
+	pthread_attr_t attr;
+	pthread_t tid;
+	const char *addr, *port;
+	Conn *c;
+	int lfd, fd, one, opt;
+
+	addr = "127.0.0.1";
+	port = "8080";
+	while((opt = getopt(argc,argv,"a:p:h")) != -1){
+		switch(opt){
+		case 'a':
+			addr = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(argc - optind != 1)
+		usage(argv[0]);
+
+	if(mkdir(argv[optind],0755) == -1 && errno != EEXIST)
+		err_exit(argv[optind]);
+	store_dfd = open(argv[optind],O_RDONLY|O_DIRECTORY);
+	if(store_dfd == -1)
+		err_exit(argv[optind]);
+	if((mkdirat(store_dfd,"ac",0755) == -1 && errno != EEXIST)
+	   || (mkdirat(store_dfd,"cas",0755) == -1 && errno != EEXIST)
+	   || (mkdirat(store_dfd,"tmp",0755) == -1 && errno != EEXIST))
+		err_exit("mkdirat()");
+
+	memset(&hints,0,sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if(getaddrinfo(addr,port,&hints,&res) != 0){
+		fprintf(stderr,"%s: cannot resolve %s:%s\n",argv[0],addr,port);
+		return EXIT_FAILURE;
+	}
+
+	lfd = socket(res->ai_family,res->ai_socktype | SOCK_CLOEXEC,res->ai_protocol);
+	if(lfd == -1)
+		err_exit("socket()");
+	one = 1;
+	setsockopt(lfd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+	if(bind(lfd,res->ai_addr,res->ai_addrlen) == -1 || listen(lfd,128) == -1)
+		err_exit("bind()");
+	freeaddrinfo(res);
+
+	signal(SIGPIPE,SIG_IGN);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+
+	for(;;){
+		fd = accept4(lfd,NULL,NULL,SOCK_CLOEXEC);
+		if(fd == -1){
+			if(errno == EINTR || errno == ECONNABORTED || errno == EMFILE)
+				continue;
+			err_exit("accept4()");
+		}
+		setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+
+		c = (Conn *)malloc(sizeof(Conn));
+		if(c == NULL)
+			err_exit("malloc()");
+		c->fd = fd;
+		c->len = 0;
+		c->pos = 0;
+		if(pthread_create(&tid,&attr,serve,c) != 0){
+			close(fd);
+			free(c);
+		}
+	}
+}
@@ -0,0 +1,553 @@
+/*
+  Copyright (C) 2014 Fabrizio Curcio aka spike
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Serve the debug store of elfkillah --debug-store the way debuginfod
+  does: /buildid/<id>/debuginfo answers with the debuginfo file kept
+  for a build-id, /buildid/<id>/section/<name> with one section of it.
+  Both are sent straight from the pack with sendfile(). The index is
+  mapped and searched in its Eytzinger order, records still in the
+  journal are searched after it; a rebuilt index is picked up on the
+  next request.
+
+    cc -O2 -pthread -o elfkillah-debuginfod elfkillah-debuginfod.c
+    ./elfkillah-debuginfod /var/cache/elfkillah-debug &
+    DEBUGINFOD_URLS=http://127.0.0.1:8002 gdb ./stripped
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <elf.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "elfkillah.h"
+
+#define DEBUGINFOD_BUF (64 << 10)
+#define DEBUGINFOD_MAX_LINE 1024
+
+typedef struct {
+	int fd;
+	size_t len;
+	size_t pos;
+	char buf[DEBUGINFOD_BUF];
+} Conn;
+
+/* The mapped index and the inode it was mapped from */
+typedef struct {
+	const ElfkillahDebugIndex *hdr;
+	size_t size;
+	ino_t ino;
+	int refs;
+} Index;
+
+static int store_dfd;
+static int pack_fd;
+static Index *index_cur;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+err_exit(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static void
+usage(const char *pname)
+{
+	fprintf(stderr,"%s [-a <addr>] [-p <port>] <store>\n\n",pname);
+	fprintf(stderr,"  -a <addr>       listen on <addr> (default 127.0.0.1)\n");
+	fprintf(stderr,"  -p <port>       listen on <port> (default 8002)\n");
+	exit(EXIT_FAILURE);
+}
+
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t written;
+
+	while(len > 0){
+		written = write(fd,buf,len);
+		if(written == -1 && errno == EINTR)
+			continue;
+		if(written <= 0)
+			return -1;
+		buf += written;
+		len -= written;
+	}
+
+	return 0;
+}
+
+static int
+fill(Conn *c)
+{
+	ssize_t got;
+
+	do
+		got = read(c->fd,c->buf,sizeof(c->buf));
+	while(got == -1 && errno == EINTR);
+	if(got <= 0)
+		return -1;
+
+	c->len = got;
+	c->pos = 0;
+	return 0;
+}
+
+static int
+read_line(Conn *c, char *line, size_t max)
+{
+	size_t n;
+	char ch;
+
+	for(n=0; ; ){
+		if(c->pos == c->len && fill(c) == -1)
+			return -1;
+		ch = c->buf[c->pos++];
+		if(ch == '\n')
+			break;
+		if(n + 1 >= max)
+			return -1;
+		line[n++] = ch;
+	}
+	if(n > 0 && line[n - 1] == '\r')
+		n--;
+	line[n] = '\0';
+
+	return 0;
+}
+
+/* Move len bytes of body to fd, or drop them with fd -1 */
+static int
+read_body(Conn *c, size_t len, int fd)
+{
+	size_t n;
+
+	while(len > 0){
+		if(c->pos == c->len && fill(c) == -1)
+			return -1;
+		n = c->len - c->pos < len ? c->len - c->pos : len;
+		if(fd != -1 && write_all(fd,c->buf + c->pos,n) == -1)
+			return -1;
+		c->pos += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+reply(Conn *c, int status, const char *reason, size_t length)
+{
+	char hdr[256];
+	int len;
+
+	len = snprintf(hdr,sizeof(hdr),"HTTP/1.1 %d %s\r\nContent-Type: application/octet-stream\r\n"
+		"Content-Length: %zu\r\nX-Debuginfod-Size: %zu\r\n\r\n",status,reason,length,length);
+	return write_all(c->fd,hdr,len);
+}
+
+static int
+send_range(Conn *c, off_t off, size_t len, int head)
+{
+	off_t end;
+	ssize_t sent;
+
+	if(reply(c,200,"OK",len) == -1)
+		return -1;
+	for(end = off + len; !head && off < end; ){
+		sent = sendfile(c->fd,pack_fd,&off,end - off);
+		if(sent == -1 && errno == EINTR)
+			continue;
+		if(sent <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void
+index_put(Index *ix)
+{
+	pthread_mutex_lock(&index_lock);
+	if(--ix->refs == 0){
+		if(ix->hdr != NULL)
+			munmap((void *)ix->hdr,ix->size);
+		free(ix);
+	}
+	pthread_mutex_unlock(&index_lock);
+}
+
+/* The current index, mapped again when it has been rebuilt */
+static Index *
+index_get(void)
+{
+	Index *ix;
+	struct stat sb;
+	void *ptr;
+	int fd;
+
+	pthread_mutex_lock(&index_lock);
+	fd = openat(store_dfd,"index",O_RDONLY);
+	if(fd != -1 && fstat(fd,&sb) == 0 && (index_cur == NULL || sb.st_ino != index_cur->ino)
+	   && (size_t)sb.st_size >= sizeof(ElfkillahDebugIndex)){
+		ptr = mmap(NULL,sb.st_size,PROT_READ,MAP_SHARED,fd,0);
+		ix = (Index *)malloc(sizeof(Index));
+		if(ptr != MAP_FAILED && ix != NULL){
+			ix->hdr = (const ElfkillahDebugIndex *)ptr;
+			ix->size = sb.st_size;
+			ix->ino = sb.st_ino;
+			ix->refs = 1;
+			if(ix->hdr->magic != ELFKILLAH_DEBUG_MAGIC
+			   || (size_t)sb.st_size != sizeof(ElfkillahDebugIndex) + (size_t)ix->hdr->count * sizeof(ElfkillahDebugRecord)){
+				munmap(ptr,sb.st_size);
+				ix->hdr = NULL;
+			}
+			if(index_cur != NULL && --index_cur->refs == 0){
+				if(index_cur->hdr != NULL)
+					munmap((void *)index_cur->hdr,index_cur->size);
+				free(index_cur);
+			}
+			index_cur = ix;
+		}else if(ptr != MAP_FAILED)
+			munmap(ptr,sb.st_size);
+	}
+	if(fd != -1)
+		close(fd);
+
+	ix = index_cur;
+	if(ix != NULL)
+		ix->refs++;
+	pthread_mutex_unlock(&index_lock);
+
+	return ix;
+}
+
+static int
+record_cmp(const ElfkillahDebugRecord *r, const ElfkillahDebugRecord *key)
+{
+	int c;
+
+	c = memcmp(r->id,key->id,ELFKILLAH_BUILD_ID_MAX);
+	if(c == 0)
+		c = r->id_len < key->id_len ? -1 : r->id_len > key->id_len;
+	return c;
+}
+
+/*
+  Newest first: the journal from its end, then the index. Node k of the
+  Eytzinger layout sits at record k - 1; the descent ends below a leaf
+  and the trailing ones of k lead back to the last node not less than
+  the key.
+*/
+static int
+lookup(const ElfkillahDebugRecord *key, ElfkillahDebugRecord *found)
+{
+	const ElfkillahDebugRecord *tree;
+	ElfkillahDebugRecord *journal;
+	struct stat sb;
+	Index *ix;
+	size_t n, k;
+	int fd, ok;
+
+	ok = 0;
+	fd = openat(store_dfd,"journal",O_RDONLY);
+	if(fd != -1 && fstat(fd,&sb) == 0 && sb.st_size >= (off_t)sizeof(*journal)){
+		n = sb.st_size / sizeof(*journal);
+		journal = (ElfkillahDebugRecord *)malloc(n * sizeof(*journal));
+		if(journal != NULL && pread(fd,journal,n * sizeof(*journal),0) == (ssize_t)(n * sizeof(*journal)))
+			while(n > 0 && !ok)
+				if(record_cmp(&journal[--n],key) == 0){
+					*found = journal[n];
+					ok = 1;
+				}
+		free(journal);
+	}
+	if(fd != -1)
+		close(fd);
+	if(ok)
+		return 1;
+
+	ix = index_get();
+	if(ix == NULL)
+		return 0;
+	if(ix->hdr != NULL){
+		tree = (const ElfkillahDebugRecord *)(ix->hdr + 1);
+		n = ix->hdr->count;
+		for(k=1; k<=n; )
+			k = 2 * k + (record_cmp(&tree[k - 1],key) < 0);
+		k >>= __builtin_ffsll(~k);
+		if(k != 0 && record_cmp(&tree[k - 1],key) == 0){
+			*found = tree[k - 1];
+			ok = 1;
+		}
+	}
+	index_put(ix);
+
+	return ok;
+}
+
+/* Where a named section of a stored debuginfo file lies in the pack */
+static int
+find_section(const ElfkillahDebugRecord *rec, const char *name, off_t *off, size_t *len)
+{
+	unsigned char ehdr[sizeof(Elf64_Ehdr)], *shdrs;
+	char *names;
+	Elf64_Shdr s64, strtab;
+	Elf32_Shdr s32;
+	Elf64_Ehdr e64;
+	Elf32_Ehdr e32;
+	uint64_t shoff, shnum, shentsize, shstrndx, i;
+	int ok;
+
+	if(rec->size < sizeof(Elf32_Ehdr) || pread(pack_fd,ehdr,sizeof(ehdr),rec->offset) < (ssize_t)sizeof(Elf32_Ehdr))
+		return 0;
+	if(ehdr[EI_CLASS] == ELFCLASS32){
+		memcpy(&e32,ehdr,sizeof(e32));
+		shoff = e32.e_shoff;
+		shnum = e32.e_shnum;
+		shentsize = e32.e_shentsize;
+		shstrndx = e32.e_shstrndx;
+		if(shentsize < sizeof(Elf32_Shdr))
+			return 0;
+	}else{
+		memcpy(&e64,ehdr,sizeof(e64));
+		shoff = e64.e_shoff;
+		shnum = e64.e_shnum;
+		shentsize = e64.e_shentsize;
+		shstrndx = e64.e_shstrndx;
+		if(shentsize < sizeof(Elf64_Shdr))
+			return 0;
+	}
+	if(shnum == 0 || shstrndx >= shnum || shoff > rec->size || shnum * shentsize > rec->size - shoff)
+		return 0;
+
+	shdrs = (unsigned char *)malloc(shnum * shentsize);
+	if(shdrs == NULL || pread(pack_fd,shdrs,shnum * shentsize,rec->offset + shoff) != (ssize_t)(shnum * shentsize)){
+		free(shdrs);
+		return 0;
+	}
+
+	/* Widen every entry into s64 */
+	#define SHDR_AT(i) (ehdr[EI_CLASS] == ELFCLASS32 \
+		? (memcpy(&s32,shdrs + (i) * shentsize,sizeof(s32)), \
+		   s64.sh_name = s32.sh_name, s64.sh_type = s32.sh_type, \
+		   s64.sh_offset = s32.sh_offset, s64.sh_size = s32.sh_size, s64) \
+		: (memcpy(&s64,shdrs + (i) * shentsize,sizeof(s64)), s64))
+
+	ok = 0;
+	strtab = SHDR_AT(shstrndx);
+	names = NULL;
+	if(strtab.sh_type != SHT_NOBITS && strtab.sh_size > 0 && strtab.sh_offset <= rec->size
+	   && strtab.sh_size <= rec->size - strtab.sh_offset)
+		names = (char *)malloc(strtab.sh_size + 1);
+	if(names != NULL && pread(pack_fd,names,strtab.sh_size,rec->offset + strtab.sh_offset) == (ssize_t)strtab.sh_size){
+		names[strtab.sh_size] = '\0';
+		for(i=1; i<shnum && !ok; i++){
+			s64 = SHDR_AT(i);
+			if(s64.sh_name < strtab.sh_size && strcmp(names + s64.sh_name,name) == 0
+			   && s64.sh_type != SHT_NOBITS && s64.sh_offset <= rec->size
+			   && s64.sh_size <= rec->size - s64.sh_offset){
+				*off = rec->offset + s64.sh_offset;
+				*len = s64.sh_size;
+				ok = 1;
+			}
+		}
+	}
+	#undef SHDR_AT
+
+	free(names);
+	free(shdrs);
+
+	return ok;
+}
+
+/* /buildid/<hex>/debuginfo or /buildid/<hex>/section/<name> */
+static int
+serve_buildid(Conn *c, const char *path, int head)
+{
+	ElfkillahDebugRecord key, rec;
+	const char *hex, *rest;
+	size_t n, i, len;
+	off_t off;
+	int hi, lo;
+
+	hex = path + 9;
+	n = strspn(hex,"0123456789abcdefABCDEF");
+	rest = hex + n;
+	if(n == 0 || n % 2 != 0 || n / 2 > ELFKILLAH_BUILD_ID_MAX || *rest != '/')
+		return reply(c,404,"Not Found",0);
+
+	memset(&key,0,sizeof(key));
+	for(i=0; i<n / 2; i++){
+		hi = hex[2 * i] <= '9' ? hex[2 * i] - '0' : (hex[2 * i] | 0x20) - 'a' + 10;
+		lo = hex[2 * i + 1] <= '9' ? hex[2 * i + 1] - '0' : (hex[2 * i + 1] | 0x20) - 'a' + 10;
+		key.id[i] = hi << 4 | lo;
+	}
+	key.id_len = n / 2;
+
+	if(!lookup(&key,&rec))
+		return reply(c,404,"Not Found",0);
+
+	if(strcmp(rest,"/debuginfo") == 0)
+		return send_range(c,rec.offset,rec.size,head);
+	if(strncmp(rest,"/section/",9) == 0 && find_section(&rec,rest + 9,&off,&len))
+		return send_range(c,off,len,head);
+
+	return reply(c,404,"Not Found",0);
+}
+
+static void *
+serve(void *arg)
+{
+	Conn *c;
+	char line[DEBUGINFOD_MAX_LINE], method[16], path[DEBUGINFOD_MAX_LINE];
+	size_t length;
+	int keep, ret;
+
+	c = (Conn *)arg;
+	for(keep=1; keep; ){
+		if(read_line(c,line,sizeof(line)) == -1)
+			break;
+		if(line[0] == '\0')
+			continue;
+		if(sscanf(line,"%15s %1023s HTTP/1.%*d",method,path) != 2)
+			break;
+
+		length = 0;
+		while((ret = read_line(c,line,sizeof(line))) == 0 && line[0] != '\0'){
+			if(strncasecmp(line,"Content-Length:",15) == 0)
+				length = strtoull(line + 15,NULL,10);
+			else if(strncasecmp(line,"Connection:",11) == 0 && strcasestr(line + 11,"close") != NULL)
+				keep = 0;
+		}
+		if(ret == -1 || read_body(c,length,-1) == -1)
+			break;
+
+		if(strcmp(method,"GET") != 0 && strcmp(method,"HEAD") != 0)
+			ret = reply(c,405,"Method Not Allowed",0);
+		else if(strncmp(path,"/buildid/",9) == 0)
+			ret = serve_buildid(c,path,method[0] == 'H');
+		else
+			ret = reply(c,404,"Not Found",0);
+
+		if(ret == -1)
+			break;
+	}
+
+	close(c->fd);
+	free(c);
+
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct addrinfo hints, *res;
+	pthread_attr_t attr;
+	pthread_t tid;
+	const char *addr, *port;
+	Conn *c;
+	int lfd, fd, one, opt;
+
+	addr = "127.0.0.1";
+	port = "8002";
+	while((opt = getopt(argc,argv,"a:p:h")) != -1){
+		switch(opt){
+		case 'a':
+			addr = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(argc - optind != 1)
+		usage(argv[0]);
+
+	store_dfd = open(argv[optind],O_RDONLY|O_DIRECTORY);
+	if(store_dfd == -1)
+		err_exit(argv[optind]);
+	pack_fd = openat(store_dfd,"pack",O_RDONLY);
+	if(pack_fd == -1)
+		err_exit("pack");
+
+	memset(&hints,0,sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if(getaddrinfo(addr,port,&hints,&res) != 0){
+		fprintf(stderr,"%s: cannot resolve %s:%s\n",argv[0],addr,port);
+		return EXIT_FAILURE;
+	}
+
+	lfd = socket(res->ai_family,res->ai_socktype | SOCK_CLOEXEC,res->ai_protocol);
+	if(lfd == -1)
+		err_exit("socket()");
+	one = 1;
+	setsockopt(lfd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+	if(bind(lfd,res->ai_addr,res->ai_addrlen) == -1 || listen(lfd,128) == -1)
+		err_exit("bind()");
+	freeaddrinfo(res);
+
+	signal(SIGPIPE,SIG_IGN);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+
+	for(;;){
+		fd = accept4(lfd,NULL,NULL,SOCK_CLOEXEC);
+		if(fd == -1){
+			if(errno == EINTR || errno == ECONNABORTED || errno == EMFILE)
+				continue;
+			err_exit("accept4()");
+		}
+		setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+
+		c = (Conn *)malloc(sizeof(Conn));
+		if(c == NULL)
+			err_exit("malloc()");
+		c->fd = fd;
+		c->len = 0;
+		c->pos = 0;
+		if(pthread_create(&tid,&attr,serve,c) != 0){
+			close(fd);
+			free(c);
+		}
+	}
+}
@@ -0,0 +1,823 @@
+/*
+  Copyright (C) 2014 Fabrizio Curcio aka spike
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  A stand-in for the S3 compatible store behind elfkillah --s3. It
+  keeps objects as files under <dir>/<bucket>/<key> and knows plain
+  PUT, GET, HEAD and DELETE of objects and the multipart uploads:
+  POST ?uploads, PUT ?partNumber&uploadId, POST ?uploadId and DELETE
+  ?uploadId. Bodies sent with x-amz-checksum-sha256 are checked against
+  it. Requests are not authenticated, signed or not.
+
+    cc -O2 -pthread -o elfkillah-s3 elfkillah-s3.c
+    ./elfkillah-s3 -p 9000 /tmp/s3 &
+    ./elfkillah --s3 http://localhost:9000/bucket in key
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#define S3_BUF (64 << 10)
+#define S3_MAX_LINE 8192
+#define S3_MAX_PARTS 10000
+#define S3_MAX_UPLOAD_ID 512
+#define S3_UPLOAD_ID_BYTES 119		/* base64 of it ends in '=', as real ones may */
+
+typedef struct {
+	int fd;
+	size_t len;
+	size_t pos;
+	char buf[S3_BUF];
+} Conn;
+
+typedef struct {
+	uint32_t h[8];
+	uint64_t len;
+	unsigned char buf[64];
+} Sha256;
+
+/* What a request is about, taken apart */
+typedef struct {
+	char method[16];
+	char path[PATH_MAX];		/* bucket/key, decoded, no leading '/' */
+	char upload[S3_MAX_UPLOAD_ID * 3 + 1];	/* as a directory name */
+	long part;
+	int uploads;
+	size_t length;
+	char checksum[64];
+	int keep;
+} Request;
+
+static int store_dfd;
+static unsigned long serial;
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void
+err_exit(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static void
+usage(const char *pname)
+{
+	fprintf(stderr,"%s [-a <addr>] [-p <port>] <dir>\n\n",pname);
+	fprintf(stderr,"  -a <addr>       listen on <addr> (default 127.0.0.1)\n");
+	fprintf(stderr,"  -p <port>       listen on <port> (default 9000)\n");
+	exit(EXIT_FAILURE);
+}
+
+#define ROR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void
+sha256_block(uint32_t *h, const unsigned char *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+	int i;
+
+	for(i=0; i<16; i++)
+		w[i] = (uint32_t)p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+	for(; i<64; i++)
+		w[i] = w[i - 16] + (ROR(w[i - 15],7) ^ ROR(w[i - 15],18) ^ w[i - 15] >> 3)
+			+ w[i - 7] + (ROR(w[i - 2],17) ^ ROR(w[i - 2],19) ^ w[i - 2] >> 10);
+
+	a = h[0]; b = h[1]; c = h[2]; d = h[3];
+	e = h[4]; f = h[5]; g = h[6]; k = h[7];
+	for(i=0; i<64; i++){
+		t1 = k + (ROR(e,6) ^ ROR(e,11) ^ ROR(e,25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROR(a,2) ^ ROR(a,13) ^ ROR(a,22)) + ((a & b) ^ (a & c) ^ (b & c));
+		k = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void
+sha256_init(Sha256 *s)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(s->h,iv,sizeof(iv));
+	s->len = 0;
+}
+
+static void
+sha256_update(Sha256 *s, const void *data, size_t len)
+{
+	const unsigned char *p;
+	size_t used, n;
+
+	p = (const unsigned char *)data;
+	used = s->len % 64;
+	s->len += len;
+	while(len > 0){
+		n = 64 - used < len ? 64 - used : len;
+		memcpy(s->buf + used,p,n);
+		used += n;
+		p += n;
+		len -= n;
+		if(used == 64){
+			sha256_block(s->h,s->buf);
+			used = 0;
+		}
+	}
+}
+
+static void
+sha256_final(Sha256 *s, unsigned char *out)
+{
+	unsigned char pad[72];
+	uint64_t bits;
+	size_t n, i;
+
+	bits = s->len * 8;
+	n = 64 - (s->len + 8) % 64;
+	memset(pad,0,sizeof(pad));
+	pad[0] = 0x80;
+	for(i=0; i<8; i++)
+		pad[n + i] = bits >> (56 - 8 * i);
+	sha256_update(s,pad,n + 8);
+
+	for(i=0; i<8; i++){
+		out[4 * i] = s->h[i] >> 24;
+		out[4 * i + 1] = s->h[i] >> 16;
+		out[4 * i + 2] = s->h[i] >> 8;
+		out[4 * i + 3] = s->h[i];
+	}
+}
+
+static void
+base64(const unsigned char *src, size_t len, char *dst)
+{
+	static const char digits[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint32_t v;
+	size_t i;
+
+	for(i=0; i<len; i += 3){
+		v = src[i] << 16 | (i + 1 < len ? src[i + 1] << 8 : 0) | (i + 2 < len ? src[i + 2] : 0);
+		*dst++ = digits[v >> 18];
+		*dst++ = digits[(v >> 12) & 63];
+		*dst++ = i + 1 < len ? digits[(v >> 6) & 63] : '=';
+		*dst++ = i + 2 < len ? digits[v & 63] : '=';
+	}
+	*dst = '\0';
+}
+
+static void
+hex(const unsigned char *src, size_t len, char *dst)
+{
+	static const char digits[] = "0123456789abcdef";
+	size_t i;
+
+	for(i=0; i<len; i++){
+		dst[2 * i] = digits[src[i] >> 4];
+		dst[2 * i + 1] = digits[src[i] & 15];
+	}
+	dst[2 * len] = '\0';
+}
+
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t written;
+
+	while(len > 0){
+		written = write(fd,buf,len);
+		if(written == -1 && errno == EINTR)
+			continue;
+		if(written <= 0)
+			return -1;
+		buf += written;
+		len -= written;
+	}
+
+	return 0;
+}
+
+static int
+fill(Conn *c)
+{
+	ssize_t got;
+
+	do
+		got = read(c->fd,c->buf,sizeof(c->buf));
+	while(got == -1 && errno == EINTR);
+	if(got <= 0)
+		return -1;
+
+	c->len = got;
+	c->pos = 0;
+	return 0;
+}
+
+static int
+read_line(Conn *c, char *line, size_t max)
+{
+	size_t n;
+	char ch;
+
+	for(n=0; ; ){
+		if(c->pos == c->len && fill(c) == -1)
+			return -1;
+		ch = c->buf[c->pos++];
+		if(ch == '\n')
+			break;
+		if(n + 1 >= max)
+			return -1;
+		line[n++] = ch;
+	}
+	if(n > 0 && line[n - 1] == '\r')
+		n--;
+	line[n] = '\0';
+
+	return 0;
+}
+
+/* Move len bytes of body to fd, hashing them, or drop them with fd -1 */
+static int
+read_body(Conn *c, size_t len, int fd, Sha256 *sum)
+{
+	size_t n;
+
+	while(len > 0){
+		if(c->pos == c->len && fill(c) == -1)
+			return -1;
+		n = c->len - c->pos < len ? c->len - c->pos : len;
+		if(fd != -1 && write_all(fd,c->buf + c->pos,n) == -1)
+			return -1;
+		if(sum != NULL)
+			sha256_update(sum,c->buf + c->pos,n);
+		c->pos += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+reply(Conn *c, int status, const char *reason, const char *headers, const char *body)
+{
+	char hdr[1024];
+	size_t len;
+	int n;
+
+	len = body != NULL ? strlen(body) : 0;
+	n = snprintf(hdr,sizeof(hdr),"HTTP/1.1 %d %s\r\n%s%sContent-Length: %zu\r\n\r\n",status,reason,
+		headers != NULL ? headers : "",body != NULL ? "Content-Type: application/xml\r\n" : "",len);
+	if(write_all(c->fd,hdr,n) == -1)
+		return -1;
+	return len > 0 ? write_all(c->fd,body,len) : 0;
+}
+
+static int
+reply_error(Conn *c, int status, const char *reason, const char *code)
+{
+	char body[256];
+
+	snprintf(body,sizeof(body),"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<Error><Code>%s</Code><Message>%s</Message></Error>",code,reason);
+	return reply(c,status,reason,NULL,body);
+}
+
+static void
+unescape(char *s)
+{
+	char *src, *dst;
+	unsigned int v;
+
+	for(src=dst=s; *src != '\0'; src++){
+		if(*src == '%' && sscanf(src + 1,"%2x",&v) == 1 && v != 0){
+			*dst++ = v;
+			src += 2;
+		}else
+			*dst++ = *src;
+	}
+	*dst = '\0';
+}
+
+/* Decode %XX in place; NULL for anything which could leave the store */
+static char *
+decode(char *s)
+{
+	char *seg;
+
+	unescape(s);
+	for(seg=s; seg != NULL; seg = strchr(seg,'/') != NULL ? strchr(seg,'/') + 1 : NULL)
+		if(seg[0] == '\0' || (seg[0] == '.' && (seg[1] == '/' || seg[1] == '\0'
+		   || (seg[1] == '.' && (seg[2] == '/' || seg[2] == '\0')))))
+			return NULL;
+	return s;
+}
+
+/* mkdir -p for the directories of a path under the store */
+static int
+make_parents(const char *path)
+{
+	char dir[PATH_MAX], *slash;
+
+	snprintf(dir,sizeof(dir),"%s",path);
+	for(slash=strchr(dir,'/'); slash != NULL; slash=strchr(slash + 1,'/')){
+		*slash = '\0';
+		if(mkdirat(store_dfd,dir,0755) == -1 && errno != EEXIST)
+			return -1;
+		*slash = '/';
+	}
+	return 0;
+}
+
+/* Receive a body into a fresh file under tmp/, checked against its checksum */
+static int
+receive(Conn *c, const Request *r, char *tmp, size_t max, unsigned char *sum, int *bad)
+{
+	Sha256 s;
+	char b64[64];
+	int fd;
+
+	snprintf(tmp,max,"tmp/%d.%lu",(int)getpid(),__atomic_fetch_add(&serial,1,__ATOMIC_RELAXED));
+	fd = openat(store_dfd,tmp,O_CREAT|O_EXCL|O_WRONLY,0644);
+	sha256_init(&s);
+	if(read_body(c,r->length,fd,&s) == -1){
+		if(fd != -1){
+			close(fd);
+			unlinkat(store_dfd,tmp,0);
+		}
+		return -1;
+	}
+	sha256_final(&s,sum);
+	base64(sum,32,b64);
+
+	*bad = fd == -1 || close(fd) == -1 || (r->checksum[0] != '\0' && strcmp(r->checksum,b64) != 0);
+	if(*bad && fd != -1)
+		unlinkat(store_dfd,tmp,0);
+	return 0;
+}
+
+static int
+put_object(Conn *c, const Request *r)
+{
+	unsigned char sum[32];
+	char tmp[64], etag[128], digest[65];
+	int bad;
+
+	if(receive(c,r,tmp,sizeof(tmp),sum,&bad) == -1)
+		return -1;
+	if(bad)
+		return reply_error(c,400,"Bad Digest","BadDigest");
+	if(make_parents(r->path) == -1 || renameat(store_dfd,tmp,store_dfd,r->path) == -1){
+		unlinkat(store_dfd,tmp,0);
+		return reply_error(c,500,"Internal Server Error","InternalError");
+	}
+
+	hex(sum,16,digest);
+	snprintf(etag,sizeof(etag),"ETag: \"%s\"\r\n",digest);
+	return reply(c,200,"OK",etag,NULL);
+}
+
+static int
+get_object(Conn *c, const Request *r)
+{
+	struct stat sb;
+	off_t off;
+	ssize_t sent;
+	char hdr[128];
+	int fd, n, ret;
+
+	fd = openat(store_dfd,r->path,O_RDONLY);
+	if(fd == -1 || fstat(fd,&sb) == -1 || !S_ISREG(sb.st_mode)){
+		if(fd != -1)
+			close(fd);
+		return reply_error(c,404,"Not Found","NoSuchKey");
+	}
+
+	n = snprintf(hdr,sizeof(hdr),"HTTP/1.1 200 OK\r\nContent-Length: %llu\r\n\r\n",
+		(unsigned long long)sb.st_size);
+	ret = write_all(c->fd,hdr,n);
+	for(off=0; ret == 0 && r->method[0] == 'G' && off < sb.st_size; ){
+		sent = sendfile(c->fd,fd,&off,sb.st_size - off);
+		if(sent == -1 && errno == EINTR)
+			continue;
+		if(sent <= 0)
+			ret = -1;
+	}
+	close(fd);
+
+	return ret;
+}
+
+static void
+upload_remove(const char *upload)
+{
+	char path[PATH_MAX];
+	long i;
+
+	for(i=1; i<=S3_MAX_PARTS; i++){
+		snprintf(path,sizeof(path),"uploads/%s/%ld",upload,i);
+		if(unlinkat(store_dfd,path,0) == -1 && errno == ENOENT)
+			break;
+		snprintf(path,sizeof(path),"uploads/%s/%ld.sum",upload,i);
+		unlinkat(store_dfd,path,0);
+	}
+	snprintf(path,sizeof(path),"uploads/%s",upload);
+	unlinkat(store_dfd,path,AT_REMOVEDIR);
+}
+
+/*
+  Upload IDs are base64 as long as real ones, '+', '/' and '=' in
+  them, so clients have to encode them; the directory of an upload is
+  its ID with those turned into '-', '_' and '.'. NULL for an ID this
+  store never gave out.
+*/
+static char *
+upload_dir(char *id)
+{
+	char *p;
+
+	for(p=id; *p != '\0'; p++){
+		if(*p == '+')
+			*p = '-';
+		else if(*p == '/')
+			*p = '_';
+		else if(*p == '=')
+			*p = '.';
+		else if(!((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9')))
+			return NULL;
+	}
+	return p - id > 2 ? id : NULL;
+}
+
+static int
+create_upload(Conn *c, const Request *r)
+{
+	unsigned char raw[S3_UPLOAD_ID_BYTES];
+	char id[2 * S3_UPLOAD_ID_BYTES], dir[2 * S3_UPLOAD_ID_BYTES], path[PATH_MAX], body[PATH_MAX + 1024];
+	const char *key;
+	uint64_t x;
+	size_t i;
+
+	x = (uint64_t)time(NULL) << 32 ^ __atomic_fetch_add(&serial,1,__ATOMIC_RELAXED) ^ (uint64_t)getpid() << 48;
+	for(i=0; i<sizeof(raw); i++){
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		raw[i] = x >> 24;
+	}
+	base64(raw,sizeof(raw),id);
+	strcpy(dir,id);
+	upload_dir(dir);
+	snprintf(path,sizeof(path),"uploads/%s",dir);
+	if(mkdirat(store_dfd,path,0755) == -1)
+		return reply_error(c,500,"Internal Server Error","InternalError");
+
+	key = strchr(r->path,'/');
+	snprintf(body,sizeof(body),"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<InitiateMultipartUploadResult><Bucket>%.*s</Bucket><Key>%s</Key>"
+		"<UploadId>%s</UploadId></InitiateMultipartUploadResult>",
+		(int)(key - r->path),r->path,key + 1,id);
+	return reply(c,200,"OK",NULL,body);
+}
+
+/* A part is kept with its SHA-256, which is its ETag too */
+static int
+put_part(Conn *c, const Request *r)
+{
+	unsigned char sum[32];
+	char tmp[64], path[PATH_MAX], etag[128], digest[65];
+	int bad, fd;
+
+	snprintf(path,sizeof(path),"uploads/%s",r->upload);
+	if(faccessat(store_dfd,path,F_OK,0) == -1)
+		return read_body(c,r->length,-1,NULL) == -1 ? -1 : reply_error(c,404,"Not Found","NoSuchUpload");
+	if(receive(c,r,tmp,sizeof(tmp),sum,&bad) == -1)
+		return -1;
+	if(bad)
+		return reply_error(c,400,"Bad Digest","BadDigest");
+
+	snprintf(path,sizeof(path),"uploads/%s/%ld.sum",r->upload,r->part);
+	fd = openat(store_dfd,path,O_CREAT|O_TRUNC|O_WRONLY,0644);
+	if(fd == -1 || write_all(fd,(const char *)sum,sizeof(sum)) == -1 || close(fd) == -1){
+		unlinkat(store_dfd,tmp,0);
+		return reply_error(c,500,"Internal Server Error","InternalError");
+	}
+	snprintf(path,sizeof(path),"uploads/%s/%ld",r->upload,r->part);
+	if(renameat(store_dfd,tmp,store_dfd,path) == -1){
+		unlinkat(store_dfd,tmp,0);
+		return reply_error(c,500,"Internal Server Error","InternalError");
+	}
+
+	hex(sum,32,digest);
+	snprintf(etag,sizeof(etag),"ETag: \"%s\"\r\n",digest);
+	return reply(c,200,"OK",etag,NULL);
+}
+
+/*
+  Join the parts listed, in their order, after checking every ETag. The
+  checksum of the object is the SHA-256 of the part sums, "-N" added, as
+  S3 has it for multipart uploads.
+*/
+static int
+complete_upload(Conn *c, const Request *r)
+{
+	unsigned char sum[32], sums[32];
+	char *xml, *p, etag[80], path[PATH_MAX], tmp[64], digest[65], b64[64], body[PATH_MAX + 512];
+	Sha256 all;
+	long part, last, nparts;
+	off_t off;
+	ssize_t n;
+	int in, out, ok;
+
+	if(r->length > (size_t)S3_MAX_PARTS * 512)
+		return -1;
+	xml = (char *)malloc(r->length + 1);
+	if(xml == NULL)
+		return -1;
+	for(n=0; (size_t)n < r->length; n++){
+		if(c->pos == c->len && fill(c) == -1){
+			free(xml);
+			return -1;
+		}
+		xml[n] = c->buf[c->pos++];
+	}
+	xml[n] = '\0';
+
+	snprintf(tmp,sizeof(tmp),"tmp/%d.%lu",(int)getpid(),__atomic_fetch_add(&serial,1,__ATOMIC_RELAXED));
+	out = openat(store_dfd,tmp,O_CREAT|O_EXCL|O_WRONLY,0644);
+	ok = out != -1;
+	sha256_init(&all);
+	last = nparts = 0;
+
+	for(p=xml; ok && (p = strstr(p,"<PartNumber>")) != NULL; ){
+		part = strtol(p + 12,&p,10);
+		p = strstr(p,"<ETag>");
+		ok = p != NULL && part > last && sscanf(p + 6,"%79[^<]",etag) == 1;
+		if(!ok)
+			break;
+		last = part;
+		nparts++;
+
+		snprintf(path,sizeof(path),"uploads/%s/%ld.sum",r->upload,part);
+		in = openat(store_dfd,path,O_RDONLY);
+		ok = in != -1 && read(in,sums,sizeof(sums)) == sizeof(sums);
+		if(in != -1)
+			close(in);
+		hex(sums,32,digest);
+		ok = ok && strstr(etag,digest) != NULL;
+		if(!ok)
+			break;
+		sha256_update(&all,sums,sizeof(sums));
+
+		snprintf(path,sizeof(path),"uploads/%s/%ld",r->upload,part);
+		in = openat(store_dfd,path,O_RDONLY);
+		ok = in != -1;
+		for(off=0; ok && (n = copy_file_range(in,NULL,out,NULL,1 << 30,0)) != 0; off += n)
+			ok = n > 0;
+		if(in != -1)
+			close(in);
+	}
+	free(xml);
+
+	ok = ok && nparts > 0 && close(out) == 0;
+	out = -1;
+	if(ok)
+		ok = make_parents(r->path) == 0 && renameat(store_dfd,tmp,store_dfd,r->path) == 0;
+	if(!ok){
+		unlinkat(store_dfd,tmp,0);
+		return reply_error(c,400,"Invalid Part","InvalidPart");
+	}
+	upload_remove(r->upload);
+
+	sha256_final(&all,sum);
+	hex(sum,16,digest);
+	base64(sum,32,b64);
+	snprintf(body,sizeof(body),"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<CompleteMultipartUploadResult><Key>%s</Key><ETag>\"%s-%ld\"</ETag>"
+		"<ChecksumSHA256>%s-%ld</ChecksumSHA256></CompleteMultipartUploadResult>",
+		r->path,digest,nparts,b64,nparts);
+	return reply(c,200,"OK",NULL,body);
+}
+
+/* Method, path and the query parameters this store knows of */
+static int
+parse_target(Request *r, char *target)
+{
+	char *query, *param, *save;
+
+	query = strchr(target,'?');
+	if(query != NULL)
+		*query++ = '\0';
+	if(target[0] != '/' || decode(target + 1) == NULL || strchr(target + 1,'/') == NULL
+	   || strlen(target + 1) >= sizeof(r->path) || strncmp(target + 1,"tmp/",4) == 0
+	   || strncmp(target + 1,"uploads/",8) == 0)
+		return -1;
+	strcpy(r->path,target + 1);
+
+	for(param=query != NULL ? strtok_r(query,"&",&save) : NULL; param != NULL; param=strtok_r(NULL,"&",&save)){
+		if(strcmp(param,"uploads") == 0 || strcmp(param,"uploads=") == 0)
+			r->uploads = 1;
+		else if(strncmp(param,"partNumber=",11) == 0)
+			r->part = strtol(param + 11,NULL,10);
+		else if(strncmp(param,"uploadId=",9) == 0 && strlen(param + 9) < sizeof(r->upload))
+			strcpy(r->upload,param + 9);
+	}
+	if(r->upload[0] != '\0'){
+		unescape(r->upload);
+		if(upload_dir(r->upload) == NULL)
+			return -1;
+	}
+	if(r->part < 0 || r->part > S3_MAX_PARTS)
+		return -1;
+
+	return 0;
+}
+
+static void *
+serve(void *arg)
+{
+	Conn *c;
+	Request r;
+	char line[S3_MAX_LINE], target[S3_MAX_LINE];
+	int ret;
+
+	c = (Conn *)arg;
+	for(r.keep=1; r.keep; ){
+		if(read_line(c,line,sizeof(line)) == -1)
+			break;
+		if(line[0] == '\0')
+			continue;
+
+		memset(&r,0,sizeof(r));
+		r.keep = 1;
+		if(sscanf(line,"%15s %8191s HTTP/1.%*d",r.method,target) != 2)
+			break;
+
+		while((ret = read_line(c,line,sizeof(line))) == 0 && line[0] != '\0'){
+			if(strncasecmp(line,"Content-Length:",15) == 0)
+				r.length = strtoull(line + 15,NULL,10);
+			else if(strncasecmp(line,"Connection:",11) == 0 && strcasestr(line + 11,"close") != NULL)
+				r.keep = 0;
+			else if(strncasecmp(line,"x-amz-checksum-sha256:",22) == 0)
+				snprintf(r.checksum,sizeof(r.checksum),"%s",line + 22 + strspn(line + 22," "));
+			else if(strncasecmp(line,"Transfer-Encoding:",18) == 0)
+				ret = -1;
+		}
+		if(ret == -1)
+			break;
+
+		if(parse_target(&r,target) == -1)
+			ret = read_body(c,r.length,-1,NULL) == -1 ? -1 : reply_error(c,400,"Bad Request","InvalidRequest");
+		else if(strcmp(r.method,"PUT") == 0 && r.upload[0] != '\0' && r.part > 0)
+			ret = put_part(c,&r);
+		else if(strcmp(r.method,"PUT") == 0)
+			ret = put_object(c,&r);
+		else if(strcmp(r.method,"POST") == 0 && r.uploads)
+			ret = read_body(c,r.length,-1,NULL) == -1 ? -1 : create_upload(c,&r);
+		else if(strcmp(r.method,"POST") == 0 && r.upload[0] != '\0')
+			ret = complete_upload(c,&r);
+		else if(strcmp(r.method,"DELETE") == 0 && r.upload[0] != '\0'){
+			upload_remove(r.upload);
+			ret = read_body(c,r.length,-1,NULL) == -1 ? -1 : reply(c,204,"No Content",NULL,NULL);
+		}else if(strcmp(r.method,"DELETE") == 0){
+			unlinkat(store_dfd,r.path,0);
+			ret = read_body(c,r.length,-1,NULL) == -1 ? -1 : reply(c,204,"No Content",NULL,NULL);
+		}else if(strcmp(r.method,"GET") == 0 || strcmp(r.method,"HEAD") == 0)
+			ret = read_body(c,r.length,-1,NULL) == -1 ? -1 : get_object(c,&r);
+		else
+			ret = read_body(c,r.length,-1,NULL) == -1 ? -1 : reply_error(c,405,"Method Not Allowed","MethodNotAllowed");
+
+		if(ret == -1)
+			break;
+	}
+
+	close(c->fd);
+	free(c);
+
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct addrinfo hints, *res;
+	pthread_attr_t attr;
+	pthread_t tid;
+	const char *addr, *port;
+	Conn *c;
+	int lfd, fd, one, opt;
+
+	addr = "127.0.0.1";
+	port = "9000";
+	while((opt = getopt(argc,argv,"a:p:h")) != -1){
+		switch(opt){
+		case 'a':
+			addr = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(argc - optind != 1)
+		usage(argv[0]);
+
+	if(mkdir(argv[optind],0755) == -1 && errno != EEXIST)
+		err_exit(argv[optind]);
+	store_dfd = open(argv[optind],O_RDONLY|O_DIRECTORY);
+	if(store_dfd == -1)
+		err_exit(argv[optind]);
+	if((mkdirat(store_dfd,"uploads",0755) == -1 && errno != EEXIST)
+	   || (mkdirat(store_dfd,"tmp",0755) == -1 && errno != EEXIST))
+		err_exit("mkdirat()");
+
+	memset(&hints,0,sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if(getaddrinfo(addr,port,&hints,&res) != 0){
+		fprintf(stderr,"%s: cannot resolve %s:%s\n",argv[0],addr,port);
+		return EXIT_FAILURE;
+	}
+
+	lfd = socket(res->ai_family,res->ai_socktype | SOCK_CLOEXEC,res->ai_protocol);
+	if(lfd == -1)
+		err_exit("socket()");
+	one = 1;
+	setsockopt(lfd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+	if(bind(lfd,res->ai_addr,res->ai_addrlen) == -1 || listen(lfd,128) == -1)
+		err_exit("bind()");
+	freeaddrinfo(res);
+
+	signal(SIGPIPE,SIG_IGN);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+
+	for(;;){
+		fd = accept4(lfd,NULL,NULL,SOCK_CLOEXEC);
+		if(fd == -1){
+			if(errno == EINTR || errno == ECONNABORTED || errno == EMFILE)
+				continue;
+			err_exit("accept4()");
+		}
+		setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+
+		c = (Conn *)malloc(sizeof(Conn));
+		if(c == NULL)
+			err_exit("malloc()");
+		c->fd = fd;
+		c->len = 0;
+		c->pos = 0;
+		if(pthread_create(&tid,&attr,serve,c) != 0){
+			close(fd);
+			free(c);
+		}
+	}
+}
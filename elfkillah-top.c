@@ -0,0 +1,300 @@
+/*
+  Copyright (C) 2014 Fabrizio Curcio aka spike
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Show what an elfkillah run with --live is doing. The segment is
+  mapped read-only and every worker slot is copied under its seqlock,
+  so any sampling rate leaves the workers alone. Without a pid the
+  newest live run is shown; the view ends with the run.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "elfkillah.h"
+
+#define SLOT_RETRIES 10000
+
+static const char *state_names[] = {"idle", "busy", "done", "failed"};
+
+static void
+err_exit(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static void
+usage(const char *pname)
+{
+	fprintf(stderr,"%s [-i <ms>] [-n <samples>] [pid]\n\n",pname);
+	fprintf(stderr,"  -i <ms>         sample every <ms> milliseconds (default 1000)\n");
+	fprintf(stderr,"  -n <samples>    stop after <samples> samples\n");
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+alive(pid_t pid)
+{
+	return kill(pid,0) == 0 || errno == EPERM;
+}
+
+/* The live segment of the most recently started running elfkillah */
+static pid_t
+find_newest(void)
+{
+	DIR *d;
+	struct dirent *e;
+	struct stat st;
+	char path[PATH_MAX];
+	time_t newest;
+	pid_t pid, found;
+
+	d = opendir(ELFKILLAH_LIVE_DIR);
+	if(d == NULL)
+		err_exit("opendir()");
+
+	found = 0;
+	newest = 0;
+	while((e = readdir(d)) != NULL){
+		if(strncmp(e->d_name,"elfkillah.",10) != 0)
+			continue;
+		pid = atoi(e->d_name + 10);
+		snprintf(path,sizeof(path),"%s/%s",ELFKILLAH_LIVE_DIR,e->d_name);
+		if(pid <= 0 || !alive(pid) || stat(path,&st) == -1)
+			continue;
+		if(found == 0 || st.st_mtime >= newest){
+			found = pid;
+			newest = st.st_mtime;
+		}
+	}
+	closedir(d);
+
+	return found;
+}
+
+static const ElfkillahLive *
+attach(pid_t pid)
+{
+	const ElfkillahLive *live;
+	char path[PATH_MAX];
+	struct stat st;
+	int fd, i;
+
+	snprintf(path,sizeof(path),"%s/elfkillah.%d",ELFKILLAH_LIVE_DIR,(int)pid);
+	fd = open(path,O_RDONLY);
+	if(fd == -1)
+		err_exit(path);
+	if(fstat(fd,&st) == -1)
+		err_exit("fstat()");
+	if(st.st_size < (off_t)sizeof(ElfkillahLive))
+		usleep(100000);
+	if(fstat(fd,&st) == -1 || st.st_size < (off_t)sizeof(ElfkillahLive)){
+		fprintf(stderr,"%s: not a live segment\n",path);
+		exit(EXIT_FAILURE);
+	}
+
+	live = (const ElfkillahLive *)mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	if(live == MAP_FAILED)
+		err_exit("mmap()");
+	close(fd);
+
+	/* The run writes the magic once the rest of the header is there */
+	for(i=0; i<100 && __atomic_load_n(&live->magic,__ATOMIC_ACQUIRE) != ELFKILLAH_LIVE_MAGIC; i++)
+		usleep(10000);
+	if(live->magic != ELFKILLAH_LIVE_MAGIC
+	   || sizeof(ElfkillahLive) + live->nworkers * sizeof(ElfkillahLiveWorker) > (size_t)st.st_size){
+		fprintf(stderr,"%s: not a live segment\n",path);
+		exit(EXIT_FAILURE);
+	}
+
+	return live;
+}
+
+/* Copy a consistent slot; a writer killed halfway leaves it as it is */
+static void
+read_slot(const ElfkillahLiveWorker *src, ElfkillahLiveWorker *dst)
+{
+	uint32_t seq;
+	int i;
+
+	for(i=0; i<SLOT_RETRIES; i++){
+		seq = __atomic_load_n(&src->seq,__ATOMIC_ACQUIRE);
+		if(seq & 1){
+			sched_yield();
+			continue;
+		}
+		memcpy(dst,src,sizeof(*dst));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&src->seq,__ATOMIC_RELAXED) == seq)
+			break;
+	}
+	if(i == SLOT_RETRIES)
+		memcpy(dst,src,sizeof(*dst));
+	dst->file[ELFKILLAH_LIVE_PATH - 1] = '\0';
+}
+
+static void
+show(const ElfkillahLive *live, ElfkillahLiveWorker *cur, ElfkillahLiveWorker *prev,
+	uint64_t elapsed, uint64_t interval, int tty)
+{
+	ElfkillahLiveWorker *w;
+	uint64_t files, bytes, dfiles, dbytes, busy, queued, t;
+	uint32_t i, state;
+
+	files = bytes = dfiles = dbytes = busy = 0;
+	for(i=0; i<live->nworkers; i++){
+		files += cur[i].files;
+		bytes += cur[i].bytes;
+		dfiles += cur[i].files - prev[i].files;
+		dbytes += cur[i].bytes - prev[i].bytes;
+		busy += cur[i].state == ELFKILLAH_LIVE_BUSY;
+	}
+	queued = live->jobs > files + busy ? live->jobs - files - busy : 0;
+	state = __atomic_load_n(&live->state,__ATOMIC_ACQUIRE);
+
+	if(tty)
+		printf("\033[H\033[J");
+	printf("elfkillah %u  %s  %s  %.1fs  %u workers\n",live->pid,live->mode,
+		state == ELFKILLAH_LIVE_BUSY ? "running" : state_names[state & 3],
+		elapsed / 1e9,live->nworkers);
+	printf("files %" PRIu64 "/%" PRIu64 "  queued %" PRIu64 "  errors %u  %.1f files/s  %.1f MiB/s\n",
+		files,live->jobs,queued,__atomic_load_n(&live->errors,__ATOMIC_RELAXED),
+		dfiles / (interval / 1e9),dbytes / (interval / 1e9) / (1 << 20));
+	if(state == ELFKILLAH_LIVE_FAILED)
+		printf("failed: %.*s (%s)\n",(int)sizeof(live->message) - 1,live->message,strerror(live->error));
+
+	printf("\n%6s %-6s %9s %9s %9s %9s %9s %9s %9s %9s  %s\n","worker","state","files","MiB",
+		"files/s","map(us)","write(us)","patch(us)","unmap(us)","buffered","current");
+	for(i=0; i<live->nworkers; i++){
+		w = &cur[i];
+		t = w->files > 0 ? w->files : 1;
+		printf("%6u %-6s %9" PRIu64 " %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9" PRIu64 "  %s",
+			i,state_names[w->state & 3],w->files,w->bytes / (double)(1 << 20),
+			(w->files - prev[i].files) / (interval / 1e9),
+			w->stage_ns[1] / 1e3 / t,w->stage_ns[2] / 1e3 / t,
+			w->stage_ns[3] / 1e3 / t,w->stage_ns[4] / 1e3 / t,
+			w->buffered,w->file);
+		if(w->state == ELFKILLAH_LIVE_BUSY)
+			printf(" (%.1fms)",(now_ns() - w->file_start) / 1e6);
+		printf("\n");
+	}
+	if(!tty)
+		printf("\n");
+	fflush(stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const ElfkillahLive *live;
+	ElfkillahLiveWorker *cur, *prev, *tmp;
+	struct timespec ts;
+	uint64_t last, now;
+	long interval, samples, n;
+	uint32_t i, state;
+	pid_t pid;
+	int c, tty;
+
+	interval = 1000;
+	samples = 0;
+	while((c = getopt(argc,argv,"i:n:h")) != -1){
+		switch(c){
+		case 'i':
+			interval = atol(optarg);
+			if(interval < 1)
+				usage(argv[0]);
+			break;
+		case 'n':
+			samples = atol(optarg);
+			if(samples < 1)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(argc - optind > 1)
+		usage(argv[0]);
+
+	pid = optind < argc ? atoi(argv[optind]) : find_newest();
+	if(pid <= 0){
+		fprintf(stderr,"%s: no live elfkillah run in %s\n",argv[0],ELFKILLAH_LIVE_DIR);
+		return EXIT_FAILURE;
+	}
+
+	live = attach(pid);
+	cur = (ElfkillahLiveWorker *)calloc(live->nworkers,sizeof(ElfkillahLiveWorker));
+	prev = (ElfkillahLiveWorker *)calloc(live->nworkers,sizeof(ElfkillahLiveWorker));
+	if(cur == NULL || prev == NULL)
+		err_exit("calloc()");
+
+	tty = isatty(STDOUT_FILENO);
+	ts.tv_sec = interval / 1000;
+	ts.tv_nsec = (interval % 1000) * 1000000;
+
+	for(i=0; i<live->nworkers; i++)
+		read_slot(&live->workers[i],&prev[i]);
+	last = now_ns();
+
+	for(n=0; samples == 0 || n < samples; n++){
+		nanosleep(&ts,NULL);
+
+		state = __atomic_load_n(&live->state,__ATOMIC_ACQUIRE);
+		for(i=0; i<live->nworkers; i++)
+			read_slot(&live->workers[i],&cur[i]);
+		now = now_ns();
+		show(live,cur,prev,now - live->start,now - last,tty);
+
+		/* Gone without saying so: killed */
+		if(state != ELFKILLAH_LIVE_BUSY || !alive(pid)){
+			if(state == ELFKILLAH_LIVE_BUSY)
+				printf("process %d is gone\n",(int)pid);
+			break;
+		}
+
+		tmp = prev;
+		prev = cur;
+		cur = tmp;
+		last = now;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -30,253 +30,9781 @@
   analysis.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
 #include <elf.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/statvfs.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <sys/sysmacros.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <linux/fuse.h>
+#include <linux/futex.h>
+#include <zlib.h>
+#include <lzma.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "elfkillah.h"
     
 #define ELF_32 ELFCLASS32
 #define ELF_64 ELFCLASS64
 
+/*
+  Latency histograms are log-linear, HDR style: values below
+  HIST_SUB_COUNT get a bucket each, then every power of two is split
+  into HIST_SUB_COUNT linear sub-buckets, so the relative error of a
+  reported percentile stays below 1/HIST_SUB_COUNT.
+*/
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+#define SIZE_CLASSES 5
+
+/*
+  Every worker formats its JSON-lines events into a private buffer and
+  hands it to stdout only when EVENT_BUF_SIZE would be exceeded, so the
+  lock around the write is taken once per batch, not once per file.
+  A record never exceeds EVENT_MAX_RECORD: paths are cut to PATH_MAX
+  and messages to EVENT_MAX_MESSAGE before escaping.
+*/
+#define EVENT_BUF_SIZE (128 << 10)
+#define EVENT_MAX_MESSAGE 256
+#define EVENT_MAX_RECORD (6 * (2 * PATH_MAX + EVENT_MAX_MESSAGE) + 512)
+
+/*
+  --record writes one line per stripped file, layout and stage timings
+  but no names or contents, buffered per worker like the events.
+*/
+#define RECORD_BUF_SIZE (64 << 10)
+#define RECORD_MAX_LINE 256
+#define RECORD_HEADER "# elfkillah trace 1\n" \
+	"# size e_shoff class strtbloff strtblsize truncated" \
+	" total_ns map_ns write_ns patch_ns unmap_ns\n"
+
+#define COPY_PARALLEL_MIN (64UL << 20)
+#define COPY_CHUNK_SIZE (16UL << 20)
+#define COPY_MAX_THREADS 64
+
+#define ZIP_LOCAL_SIG 0x04034b50
+#define ZIP_CENTRAL_SIG 0x02014b50
+#define ZIP_END_SIG 0x06054b50
+#define ZIP_DESC_SIG 0x08074b50
+#define ZIP_LOCAL_LEN 30
+#define ZIP_CENTRAL_LEN 46
+#define ZIP_END_LEN 22
+#define ZIP_STORED 0
+#define ZIP_DEFLATED 8
+#define ZIP_FLAG_ENCRYPTED 0x0001
+#define ZIP_FLAG_DESCRIPTOR 0x0008
+#define ZIP_ALIGN_TAG 0xd935
+
+/*
+  Packages are rewritten as streams: every payload is decompressed
+  twice, once to find the ELF members and read their section headers,
+  once to write them out cut. Only the part of a member from its
+  section header table on is captured, up to CAPTURE_MAX bytes.
+*/
+#define STREAM_BUF (64 << 10)
+#define CAPTURE_MAX (1 << 20)
+#define DEB_CONTROL_MAX (64 << 20)
+
+#define CODEC_NONE 0
+#define CODEC_GZIP 1
+#define CODEC_XZ 2
+
+/* Numbered as RPM numbers its digest algorithms */
+#define DIGEST_MD5 1
+#define DIGEST_SHA256 8
+#define DIGEST_MAX_LEN 32
+
+#define TAR_BLOCK 512
+#define CPIO_HDR_LEN 110
+#define AR_MAGIC "!<arch>\n"
+#define AR_MAGIC_LEN 8
+#define AR_HDR_LEN 60
+#define AR_MAX_MEMBERS 16
+
+#define RPM_LEAD_LEN 96
+#define RPM_HEADER_MAGIC "\x8e\xad\xe8\x01\0\0\0\0"
+#define RPM_HEADER_INTRO 16
+#define RPM_MAX_INDEX 0x10000
+#define RPM_MAX_STORE (256 << 20)
+
+#define RPM_INT16_TYPE 3
+#define RPM_INT32_TYPE 4
+#define RPM_INT64_TYPE 5
+#define RPM_STRING_TYPE 6
+#define RPM_BIN_TYPE 7
+#define RPM_STRING_ARRAY_TYPE 8
+#define RPM_I18NSTRING_TYPE 9
+
+#define RPMSIGTAG_SIZE 1000
+#define RPMSIGTAG_PGP 1002
+#define RPMSIGTAG_MD5 1004
+#define RPMSIGTAG_GPG 1005
+#define RPMSIGTAG_PAYLOADSIZE 1007
+#define RPMSIGTAG_HEADERSIGNATURES 62
+#define RPMSIGTAG_DSA 267
+#define RPMSIGTAG_RSA 268
+#define RPMSIGTAG_SHA1 269
+#define RPMSIGTAG_LONGSIZE 270
+#define RPMSIGTAG_LONGARCHIVESIZE 271
+#define RPMSIGTAG_SHA256 273
+
+#define RPMTAG_SIZE 1009
+#define RPMTAG_FILESIZES 1028
+#define RPMTAG_FILEDIGESTS 1035
+#define RPMTAG_DIRINDEXES 1116
+#define RPMTAG_BASENAMES 1117
+#define RPMTAG_DIRNAMES 1118
+#define RPMTAG_PAYLOADCOMPRESSOR 1125
+#define RPMTAG_FILEDIGESTALGO 5011
+#define RPMTAG_LONGFILESIZES 5008
+#define RPMTAG_LONGSIZE 5009
+#define RPMTAG_PAYLOADDIGEST 5092
+#define RPMTAG_PAYLOADDIGESTALGO 5093
+#define RPMTAG_PAYLOADDIGESTALT 5097
+
+/*
+  SquashFS 4.0. Metadata (inodes, directories and the lookup tables)
+  lives in blocks of SQFS_META_SIZE bytes behind a 16 bit length word;
+  file data lives in blocks of the image block size, listed by 32 bit
+  size words, with file tails packed together into fragment blocks.
+*/
+#define SQFS_MAGIC 0x73717368
+#define SQFS_SUPER_LEN 96
+#define SQFS_META_SIZE 8192
+#define SQFS_META_RAW 0x8000
+#define SQFS_BLOCK_RAW (1 << 24)
+#define SQFS_NONE 0xffffffffU
+#define SQFS_INVALID UINT64_MAX
+#define SQFS_MAX_DEPTH 4096
+#define SQFS_DIR_COUNT 256
+
+#define SQFS_GZIP 1
+#define SQFS_XZ 4
+
+#define SQFS_FLAG_RAW_INODES 0x0001
+#define SQFS_FLAG_RAW_DATA 0x0002
+#define SQFS_FLAG_RAW_FRAGMENTS 0x0008
+#define SQFS_FLAG_NO_FRAGMENTS 0x0010
+#define SQFS_FLAG_EXPORT 0x0080
+#define SQFS_FLAG_COMP_OPTS 0x0400
+
+#define SQFS_DIR 1
+#define SQFS_FILE 2
+#define SQFS_SYMLINK 3
+#define SQFS_BLKDEV 4
+#define SQFS_CHRDEV 5
+#define SQFS_FIFO 6
+#define SQFS_SOCKET 7
+#define SQFS_LDIR 8
+#define SQFS_LFILE 9
+#define SQFS_LSYMLINK 10
+#define SQFS_LBLKDEV 11
+#define SQFS_LCHRDEV 12
+#define SQFS_LFIFO 13
+#define SQFS_LSOCKET 14
+
+/*
+  --mount serves a read-only FUSE view of a source tree in which every
+  ELF file reads as its stripped copy. Requests are read into buffers
+  of MOUNT_REQ_BUF bytes, reads answered with up to MOUNT_MAX_READ.
+  Attributes and entries are cached by the kernel for MOUNT_TIMEOUT
+  seconds.
+*/
+#define MOUNT_REQ_BUF (64 << 10)
+#define MOUNT_MAX_READ (1 << 20)
+#define MOUNT_MAX_WRITE 4096
+#define MOUNT_TIMEOUT 1
+#define MOUNT_NODES_MIN 1024
+
+#define MOUNT_UNKNOWN 0
+#define MOUNT_PLAIN 1
+#define MOUNT_ELF 2
+
+/*
+  --cache shares stripped results between every elfkillah on the host
+  using the same directory. Its index file maps inputs, known by
+  device, inode, size and change times, to results kept next to it;
+  lookups lock a window of CACHE_PROBE slots, each behind a robust
+  process-shared mutex. The first to miss claims the slot and strips,
+  the others sleep on the slot's futex until it is filled, or take it
+  over once its owner is gone. Results are reflinked where the
+  filesystem can, so keep the cache on the output filesystem.
+*/
+#define CACHE_MAGIC 0x31434b45	/* "EKC1" */
+#define CACHE_SLOTS 16384
+#define CACHE_PROBE 8
+#define CACHE_WAIT_NS (50 * 1000000)
+
+#define CACHE_EMPTY 0
+#define CACHE_BUSY 1
+#define CACHE_READY 2
+
+#define CACHE_BYPASS 0
+#define CACHE_MISS 1
+#define CACHE_HIT 2
+
+/*
+  --remote consults an HTTP/1.1 cache in the way of bazel-remote: the
+  result for an input is kept at /ac/<SHA-256 of REMOTE_SALT and the
+  input>. One thread hashes the inputs in job order and pipelines GET
+  requests for up to REMOTE_AHEAD of them on one connection, ahead of
+  the workers; another reads the responses and writes hits straight
+  to their outputs. Workers strip the misses and upload them with PUT
+  on a connection of their own. The remote only ever saves work: once
+  it fails everything left misses.
+*/
+#define REMOTE_SALT "elfkillah 1\n"
+#define REMOTE_AHEAD 64
+#define REMOTE_BUF (64 << 10)
+
+#define REMOTE_PENDING 0
+#define REMOTE_HIT 1
+#define REMOTE_MISS 2
+#define REMOTE_SKIP 3
+
+/*
+  --s3 streams outputs into an S3 compatible bucket instead of files.
+  The kept bytes go from the input mapping into part buffers, are
+  patched there and hashed once: the SHA-256 of a part signs its
+  request with SigV4, when AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY
+  are set, and goes along as x-amz-checksum-sha256 for the server to
+  check. Outputs of up to S3_PART bytes are a single PUT, larger ones
+  multipart uploads with up to copy-threads parts in flight, each on a
+  keep-alive connection of its own.
+*/
+#define S3_PART (8UL << 20)
+#define S3_MAX_PARTS 10000
+#define S3_MAX_PATH (PATH_MAX * 3 + 64)
+#define S3_MAX_UPLOAD_ID 512
+#define S3_MAX_QUERY (S3_MAX_UPLOAD_ID * 3 + 64)
+
+/*
+  --bundle writes every output into one file laid out as elfkillah.h
+  has it, a page stored once however many outputs hold it. A worker
+  cuts, patches and hashes BUNDLE_BATCH pages of its output unlocked,
+  then takes the bundle lock to look them up and number the new ones,
+  which it writes once unlocked. A page whose hash is known only counts
+  as stored once compared with the stored copy; one still pending in
+  another worker's write does not count. The index is written at the
+  end, when the file is renamed into place.
+*/
+#define BUNDLE_BATCH 64
+#define BUNDLE_SLOTS_MIN 4096
+
+/*
+  --publish builds the stripped tree as a sibling of the one it
+  replaces: ELF files are stripped into it by the workers, everything
+  else is reflinked, links and special files are made again and hard
+  links stay hard links. The staged tree is synced and swapped with the
+  live one by a single RENAME_EXCHANGE, so readers see either tree and
+  never a mix; the old one is deleted by a child in the background.
+*/
+#define PUBLISH_LINKS_MIN 1024
+#define PUBLISH_DENTS 8192
+
+/*
+  --per-device queues the inputs by st_dev and caps how many workers
+  one device gets at a time, so a slow volume cannot hold every worker.
+  Workers belong to no device: one whose device is at its cap takes a
+  job of another. Each cap follows the device's latency, see sched_tune().
+*/
+#define DEVICE_WINDOW 32
+#define DEVICE_FIXED_BYTES (64 << 10)
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+enum {
+	STAGE_TOTAL,
+	STAGE_MAP,
+	STAGE_WRITE,
+	STAGE_PATCH,
+	STAGE_UNMAP,
+	STAGE_COUNT
+};
+
+/*
+  Read-only view over the bytes of an ELF image. elf_view() checks the
+  header and both header tables against the image size once and stores
+  their geometry here already widened, so the accessors below need no
+  bounds checks of their own. The section header table is normally
+  part of the image, but callers which stream an image may hand it in
+  separately.
+*/
 typedef struct {
-	int type;
+	const unsigned char *base;
+	const unsigned char *shdrs;
 	size_t size;
-	size_t mmapped;
+	int type;
+	size_t ehsize;
+	size_t phoff;
+	size_t phentsize;
+	size_t phnum;
+	size_t shoff;
+	size_t shentsize;
+	size_t shnum;
+	size_t shstrndx;
 	size_t strtbloff;
 	size_t strtblsize;
+} ElfView;
+
+typedef struct {
+	int type;
+	size_t size;
+	size_t mmapped;
+	ElfView view;
 	union {
 		Elf32_Ehdr *elf32;
 		Elf64_Ehdr *elf64;
 	};
 } ElfContainer;
 
-static void
-err_exit(const char *format, ...)
-{
-	va_list args;
-	va_start(args,format);
-	vfprintf(stderr,format,args);
-	va_end(args);
-	exit(EXIT_FAILURE);
+typedef struct {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+} Histogram;
+
+typedef struct {
+	Histogram hist[SIZE_CLASSES][STAGE_COUNT];
+} Stats;
+
+typedef struct {
+	const char *in_file;
+	const char *out_file;
+	const char *engine;
+	size_t size;
+	size_t shoff;
+	size_t truncated;
+	size_t strtbloff;
+	size_t strtblsize;	/* bytes of string table cleared */
+	int type;
+	uint64_t start;
+} Event;
+
+typedef struct {
+	int fd;
+	const unsigned char *src;
+	size_t size;
+	size_t next;
+	int error;
+} CopyJob;
+
+typedef struct {
+	size_t central;
+	size_t central_len;
+	size_t local;
+	size_t data;
+	size_t end;
+	int flags;
+	int method;
+	uint32_t crc;
+	size_t csize;
+	size_t usize;
+	unsigned char *out;
+	size_t out_csize;
+	size_t out_usize;
+	uint32_t out_crc;
+	size_t zeroed;
+} ZipEntry;
+
+typedef struct {
+	const unsigned char *base;
+	ZipEntry *entries;
+	size_t *todo;
+	size_t ntodo;
+	size_t next;
+} ZipJob;
+
+typedef struct {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime;
+	uint64_t ctime;
+} CacheKey;
+
+typedef struct {
+	pthread_mutex_t lock;
+	uint32_t state;		/* futex word */
+	int32_t owner;
+	CacheKey key;
+	uint64_t used;
+	uint64_t shoff;
+	uint64_t strtbloff;
+	uint64_t strtblsize;
+	uint64_t cut;
+	int32_t type;
+} CacheSlot;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t nslots;
+	uint32_t slot_size;
+	CacheSlot slots[];
+} CacheIndex;
+
+typedef struct {
+	int fd;
+	size_t len;
+	size_t pos;
+	char buf[REMOTE_BUF];
+} HttpConn;
+
+typedef struct {
+	char *host;
+	const char *port;
+	HttpConn get;			/* lookups, written and read by two threads */
+	unsigned char *state;		/* per job */
+	unsigned char (*digest)[DIGEST_MAX_LEN];
+	size_t *size;			/* of the inputs */
+	size_t *cut;			/* of the hits */
+	size_t fifo[REMOTE_AHEAD];	/* jobs waiting for their response */
+	size_t head;
+	size_t tail;
+	int hashed;
+	int failed;
+	int running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t hasher;
+	pthread_t receiver;
+} Remote;
+
+typedef struct {
+	char *host;
+	char *port;
+	char *authority;		/* host[:port], as signed */
+	char *bucket;			/* /bucket[/prefix] */
+	const char *access;
+	const char *secret;
+	const char *region;
+} S3;
+
+/* One multipart upload: parts are claimed by the copy threads in turn */
+typedef struct {
+	const ElfView *view;
+	const unsigned char *hdr;
+	const char *path;
+	char *upload;			/* UploadId, percent-encoded */
+	HttpConn *conns;
+	size_t size;
+	size_t part;
+	size_t nparts;
+	size_t next;
+	char (*etags)[72];
+	unsigned char (*sums)[DIGEST_MAX_LEN];
+	int conn;
+	int status;			/* of the first failed part */
+} S3Job;
+
+typedef struct {
+	uint64_t hash;
+	uint32_t page;			/* 0 for a free slot, page 0 is the header */
+	uint32_t pending;		/* not yet written */
+} BundleSlot;
+
+typedef struct {
+	int fd;
+	pthread_mutex_t lock;
+	BundleSlot *slots;		/* open addressing, at most half used */
+	size_t mask;
+	size_t used;
+	uint64_t pages;			/* stored, page 0 included */
+	uint64_t refs;			/* pages of all outputs */
+	ElfkillahBundleEntry *entries;	/* by job */
+	uint32_t **lists;
+} Bundle;
+
+typedef struct {
+	pthread_t tid;
+	int id;
+	Stats *stats;
+	Event cur;
+	char *events;
+	size_t events_len;
+	char *records;
+	size_t records_len;
+	uint64_t lat[STAGE_COUNT];
+	ElfkillahLiveWorker *live;
+	HttpConn *put;
+	pid_t pid;			/* --isolate: the worker process, */
+	size_t job;			/* the job it holds */
+	int error;			/* and why it gave up on it */
+	char message[EVENT_MAX_MESSAGE];
+	int device;			/* --per-device: the device it holds a slot of */
+	HttpConn *s3;			/* --s3: one connection per copy thread */
+} Worker;
+
+/*
+  What the workers share: the next job to claim and the locks of the
+  outputs. Under --isolate it lives in memory shared with the worker
+  processes, with process-shared robust locks.
+*/
+typedef struct {
+	size_t next_job;
+	pthread_mutex_t events_lock;
+	pthread_mutex_t record_lock;
+} Queue;
+
+typedef struct {
+	dev_t dev;
+	size_t first;			/* its jobs, at sched_order[first, first + count) */
+	size_t count;
+	size_t next;
+	size_t done;
+	int active;
+	int limit;
+	double window;			/* sum of ns per byte over the window */
+	double best;			/* lowest window mean seen */
+	uint64_t busy_ns;
+} Device;
+
+/* Shared with the worker processes of --isolate, as the Queue is */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	size_t ndevices;
+	size_t rr;			/* the device the next claim looks at first */
+	Device devices[];
+} Scheduler;
+
+typedef struct {
+	int algo;
+	uint64_t len;
+	uint32_t h[8];
+	unsigned char buf[64];
+} Digest;
+
+typedef struct {
+	int codec;
+	const unsigned char *src;
+	size_t len;
+	size_t pos;
+	int eof;
+	z_stream zs;
+	lzma_stream xs;
+} Inflow;
+
+typedef struct {
+	int codec;
+	FILE *file;
+	z_stream zs;
+	lzma_stream xs;
+	Digest *raw;
+	Digest *packed;
+	uint64_t raw_len;
+	uint64_t packed_len;
+} Outflow;
+
+/* Cut planned for the member with the given ordinal in its archive */
+typedef struct {
+	size_t member;
+	ElfView view;
+	unsigned char hdr[sizeof(Elf64_Ehdr)];
+	size_t zeroed;
+} StripPlan;
+
+typedef struct {
+	char *path;
+	uint64_t size;
+	uint64_t old_size;
+	char digest[2 * DIGEST_MAX_LEN + 1];
+} StripResult;
+
+typedef struct {
+	int digest_algo;
+	StripPlan *plans;
+	size_t nplans;
+	size_t plans_cap;
+	size_t cursor;
+	StripResult *results;
+	size_t nresults;
+	size_t results_cap;
+	unsigned char *capture;
+	size_t member;
+	size_t zeroed;
+} Package;
+
+typedef struct {
+	unsigned char *blob;
+	size_t len;
+	size_t nindex;
+	size_t hsize;
+} RpmHeader;
+
+typedef struct {
+	char *path;
+	size_t index;
+} RpmFile;
+
+/* A metadata table, decompressed whole */
+typedef struct {
+	unsigned char *data;
+	size_t len;
+	uint64_t *blocks;
+	size_t nblocks;
+} SqfsTable;
+
+/* A metadata table being written */
+typedef struct {
+	unsigned char cur[SQFS_META_SIZE];
+	size_t cur_len;
+	unsigned char *out;
+	size_t out_len;
+	size_t out_cap;
+} SqfsMeta;
+
+/*
+  The data of one file, shared by the inodes of deduplicated copies.
+  The old_ fields describe it in the input image, the others in the
+  output; a stripped file gets new size words and, for the blocks the
+  cut or the patch touched, new compressed blocks.
+*/
+typedef struct {
+	size_t inode;
+	uint64_t old_start;
+	uint64_t old_size;
+	uint32_t old_fragment;
+	uint32_t old_frag_offset;
+	size_t old_nblocks;
+	const unsigned char *old_sizes;
+	uint64_t *old_offsets;
+	uint64_t span;
+	int elf;
+	ElfView view;
+	unsigned char hdr[sizeof(Elf64_Ehdr)];
+	uint64_t start;
+	uint64_t size;
+	uint32_t fragment;
+	uint32_t frag_offset;
+	size_t nblocks;
+	uint32_t *sizes;
+	unsigned char **blocks;
+	uint64_t sparse;
+} SqfsRun;
+
+typedef struct {
+	size_t pos;
+	size_t len;
+	int type;
+	uint32_t number;
+	SqfsRun *run;
+	uint64_t ref;
+	int done;
+} SqfsInode;
+
+typedef struct {
+	const unsigned char *name;
+	size_t name_len;
+	int type;
+	SqfsInode *inode;
+} SqfsEntry;
+
+/* A block to cut and patch; a tail goes to a new fragment instead */
+typedef struct {
+	SqfsRun *run;
+	size_t index;
+	unsigned char *frag;
+} SqfsBlock;
+
+typedef struct {
+	unsigned char *data;
+	size_t len;
+	unsigned char *out;
+	uint32_t word;
+} SqfsFrag;
+
+typedef struct {
+	const unsigned char *base;
+	size_t size;
+	size_t origin;
+	uint32_t inode_count;
+	int compressor;
+	size_t block_size;
+	int level;
+	int window;
+	uint32_t dict_size;
+	unsigned flags;
+	SqfsTable itable;
+	SqfsTable dtable;
+	SqfsInode *inodes;
+	size_t ninodes;
+	SqfsRun *runs;
+	size_t nruns;
+	const unsigned char *old_frags;
+	unsigned char *old_frags_buf;
+	uint32_t old_nfrags;
+	uint32_t *frag_map;
+	uint32_t nkept;
+	SqfsBlock *jobs;
+	size_t njobs;
+	size_t jobs_cap;
+	SqfsFrag *frags;
+	size_t nfrags;
+	size_t frags_cap;
+	size_t next;
+	SqfsMeta imeta;
+	SqfsMeta dmeta;
+	uint64_t *export;
+	size_t nwritten;
+	size_t zeroed;
+} SqfsImage;
+
+/*
+  What the header-only parse found in a file. It holds as long as size,
+  mtime and ctime of the file do.
+*/
+typedef struct {
+	int state;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	ElfView view;
+	unsigned char hdr[sizeof(Elf64_Ehdr)];
+} MountProbe;
+
+/* The node id is the index into the node table, 0 ends a chain */
+typedef struct {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	uint64_t nlookup;
+	uint64_t generation;
+	size_t next;
+	MountProbe probe;
+} MountNode;
+
+typedef struct {
+	int fd;
+	int root;
+	const char *mnt;
+	int fusermount;
+	int splice;
+	size_t page_size;
+	pthread_mutex_t lock;
+	MountNode *nodes;
+	size_t nnodes;
+	size_t nodes_cap;
+	size_t free_nodes;
+	size_t *buckets;
+	size_t nbuckets;
+	size_t live;
+} MountServer;
+
+typedef struct {
+	pthread_t tid;
+	MountServer *m;
+	unsigned char *req;
+	unsigned char *out;
+	int pipe[2];
+} MountThread;
+
+/* A file with more than one link, known by the staged path of its first */
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+	char *path;
+} PublishLink;
+
+typedef struct {
+	PublishLink *links;
+	size_t nlinks;
+	size_t links_cap;
+	char **jobs;
+	size_t njobs;
+	size_t jobs_cap;
+} Publish;
+
+#ifndef ELFKILLAH_LIBRARY
+
+static const char *stage_names[STAGE_COUNT] = {
+	"total", "open/map", "write", "patch", "unmap"
+};
+
+static const size_t size_class_limits[SIZE_CLASSES - 1] = {
+	64UL << 10, 1UL << 20, 16UL << 20, 256UL << 20
+};
+
+static const char *size_class_names[SIZE_CLASSES] = {
+	"<64K", "<1M", "<16M", "<256M", ">=256M"
+};
+
+static int opt_jobs = 1;
+static int opt_stats = 0;
+static int opt_events = 0;
+static int opt_copy_threads = 4;
+static int opt_zip = 0;
+static int opt_package = 0;
+static int opt_squashfs = 0;
+static int opt_mount = 0;
+static const char *opt_record = NULL;
+static int record_fd = -1;
+static int opt_live = 0;
+static const char *opt_cache = NULL;
+static CacheIndex *cache;
+static int cache_dfd = -1;
+static const char *opt_remote = NULL;
+static Remote remote;
+static const char *opt_s3 = NULL;
+static S3 s3;
+static const char *opt_bundle = NULL;
+static Bundle bundle;
+static char bundle_tmp[PATH_MAX];
+static const char *opt_debug_store = NULL;
+static int debug_dfd = -1;
+static int debug_pack_fd = -1;
+static int debug_journal_fd = -1;
+static pthread_mutex_t debug_lock = PTHREAD_MUTEX_INITIALIZER;
+static ElfkillahLive *live;
+static char live_path[64];
+static int opt_publish = 0;
+static char publish_staging[PATH_MAX];
+static int opt_isolate = 0;
+static Worker *isolate_self;
+static int opt_per_device = 0;
+static Scheduler *sched;
+static size_t *sched_order;
+
+/* Pairs of <infile> <outfile>, handed out to the workers in order */
+static char **jobs;
+static size_t njobs;
+
+static Worker *workers;
+static int nworkers;
+static __thread Worker *self;
+
+static Queue queue_threads = {0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER};
+static Queue *queue = &queue_threads;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t written;
+
+	while(len > 0){
+		written = write(fd,buf,len);
+		if(written == -1 && errno == EINTR)
+			continue;
+		if(written <= 0)
+			return -1;
+		buf += written;
+		len -= written;
+	}
+
+	return 0;
+}
+
+static size_t
+json_string(char *dst, const char *src, size_t max)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
+	size_t n;
+
+	n = 0;
+	dst[n++] = '"';
+
+	for(; *src != '\0' && max > 0; src++, max--){
+		c = (unsigned char)*src;
+		if(c == '"' || c == '\\'){
+			dst[n++] = '\\';
+			dst[n++] = c;
+		}else if(c < 0x20){
+			dst[n++] = '\\';
+			dst[n++] = 'u';
+			dst[n++] = '0';
+			dst[n++] = '0';
+			dst[n++] = hex[c >> 4];
+			dst[n++] = hex[c & 0xf];
+		}else
+			dst[n++] = c;
+	}
+
+	dst[n++] = '"';
+	return n;
+}
+
+/*
+  Only the owning worker appends to its buffer; events_len is published
+  after a record is complete, so err_exit() may flush any worker's
+  buffer without ever writing half a line.
+*/
+/* A worker process killed while writing leaves the output to the next */
+static void
+queue_lock(pthread_mutex_t *lock)
+{
+	if(pthread_mutex_lock(lock) == EOWNERDEAD)
+		pthread_mutex_consistent(lock);
+}
+
+static int
+events_flush(Worker *w)
+{
+	size_t len;
+	int ret;
+
+	queue_lock(&queue->events_lock);
+	len = __atomic_load_n(&w->events_len,__ATOMIC_ACQUIRE);
+	ret = write_all(STDOUT_FILENO,w->events,len);
+	__atomic_store_n(&w->events_len,0,__ATOMIC_RELEASE);
+	pthread_mutex_unlock(&queue->events_lock);
+
+	return ret;
+}
+
+static int
+events_emit(Worker *w, int error, const char *message)
+{
+	Event *ev;
+	char *p;
+	size_t len;
+
+	if(w->events_len + EVENT_MAX_RECORD > EVENT_BUF_SIZE)
+		if(events_flush(w) == -1)
+			return -1;
+
+	ev = &w->cur;
+	p = w->events + w->events_len;
+
+	p += sprintf(p,"{\"in\":");
+	p += json_string(p,ev->in_file,PATH_MAX);
+	p += sprintf(p,",\"out\":");
+	p += json_string(p,ev->out_file,PATH_MAX);
+	p += sprintf(p,",\"size\":%zu,\"e_shoff\":%zu,\"truncated\":%zu"
+		",\"strtblsize\":%zu,\"engine\":\"%s\",\"duration_ns\":%llu"
+		",\"error\":%d",
+		ev->size,ev->shoff,ev->truncated,ev->strtblsize,
+		ev->engine != NULL ? ev->engine : "none",
+		(unsigned long long)(now_ns() - ev->start),error);
+
+	if(message != NULL){
+		p += sprintf(p,",\"message\":");
+		p += json_string(p,message,EVENT_MAX_MESSAGE);
+	}
+
+	p += sprintf(p,"}\n");
+
+	len = p - w->events;
+	__atomic_store_n(&w->events_len,len,__ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static int
+record_flush(Worker *w)
+{
+	int ret;
+
+	queue_lock(&queue->record_lock);
+	ret = write_all(record_fd,w->records,w->records_len);
+	w->records_len = 0;
+	pthread_mutex_unlock(&queue->record_lock);
+
+	return ret;
+}
+
+static int
+record_emit(Worker *w, const uint64_t *lat)
+{
+	const Event *ev;
+
+	if(w->records_len + RECORD_MAX_LINE > RECORD_BUF_SIZE)
+		if(record_flush(w) == -1)
+			return -1;
+
+	ev = &w->cur;
+	w->records_len += snprintf(w->records + w->records_len,RECORD_MAX_LINE,
+		"%zu %zu %d %zu %zu %zu %llu %llu %llu %llu %llu\n",
+		ev->size,ev->shoff,ev->type == ELF_32 ? 32 : 64,ev->strtbloff,
+		ev->strtblsize,ev->truncated,
+		(unsigned long long)lat[STAGE_TOTAL],(unsigned long long)lat[STAGE_MAP],
+		(unsigned long long)lat[STAGE_WRITE],(unsigned long long)lat[STAGE_PATCH],
+		(unsigned long long)lat[STAGE_UNMAP]);
+
+	return 0;
+}
+
+/*
+  Only the owning worker writes its slot and readers never write, so
+  sampling costs the workers nothing beyond their own stores.
+*/
+static void
+live_write_begin(ElfkillahLiveWorker *lw)
+{
+	__atomic_store_n(&lw->seq,lw->seq + 1,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+live_write_end(ElfkillahLiveWorker *lw)
+{
+	__atomic_store_n(&lw->seq,lw->seq + 1,__ATOMIC_RELEASE);
+}
+
+static void
+live_begin(Worker *w, const char *in_file)
+{
+	ElfkillahLiveWorker *lw;
+	size_t len;
+
+	lw = w->live;
+	len = strlen(in_file);
+	if(len >= ELFKILLAH_LIVE_PATH)
+		in_file += len - (ELFKILLAH_LIVE_PATH - 1);
+
+	live_write_begin(lw);
+	lw->state = ELFKILLAH_LIVE_BUSY;
+	lw->file_start = now_ns();
+	strcpy(lw->file,in_file);
+	live_write_end(lw);
+
+	memset(w->lat,0,sizeof(w->lat));
+}
+
+static void
+live_end(Worker *w)
+{
+	ElfkillahLiveWorker *lw;
+	int i;
+
+	lw = w->live;
+	live_write_begin(lw);
+	lw->state = ELFKILLAH_LIVE_IDLE;
+	lw->files++;
+	lw->bytes += w->cur.size;
+	lw->buffered = w->events_len + w->records_len;
+	for(i=0; i<STAGE_COUNT; i++)
+		lw->stage_ns[i] += w->lat[i];
+	lw->file[0] = '\0';
+	live_write_end(lw);
+}
+
+/* Leave the final state to readers which still have it mapped */
+static void
+live_close(int state, int error, const char *message)
+{
+	ElfkillahLive *l;
+
+	l = live;
+	if(l == NULL || !__atomic_compare_exchange_n(&live,&l,NULL,0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+		return;
+
+	if(state == ELFKILLAH_LIVE_FAILED){
+		if(self != NULL && self->live != NULL){
+			live_write_begin(self->live);
+			self->live->state = ELFKILLAH_LIVE_FAILED;
+			live_write_end(self->live);
+		}
+		__atomic_fetch_add(&l->errors,1,__ATOMIC_RELAXED);
+		l->error = error;
+		snprintf(l->message,sizeof(l->message),"%s",message);
+	}
+	__atomic_store_n(&l->state,state,__ATOMIC_RELEASE);
+	unlink(live_path);
+}
+
+/*
+  Empty the directory at dfd. Only getdents64() and the *at() calls are
+  used, so a child forked off any thread can run it.
+*/
+static void
+publish_remove(int dfd)
+{
+	char buf[PUBLISH_DENTS] __attribute__((aligned(8)));
+	struct {
+		uint64_t ino;
+		int64_t off;
+		unsigned short reclen;
+		unsigned char type;
+		char name[];
+	} *d;
+	long n, off;
+	int sub, removed;
+
+	do{
+		removed = 0;
+		lseek(dfd,0,SEEK_SET);
+		while((n = syscall(SYS_getdents64,dfd,buf,sizeof(buf))) > 0)
+			for(off=0; off<n; off += d->reclen){
+				d = (void *)(buf + off);
+				if(d->name[0] == '.' && (d->name[1] == '\0' || (d->name[1] == '.' && d->name[2] == '\0')))
+					continue;
+				if(unlinkat(dfd,d->name,0) == 0){
+					removed = 1;
+					continue;
+				}
+				if(errno != EISDIR && errno != EPERM)
+					continue;
+				sub = openat(dfd,d->name,O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+				if(sub == -1)
+					continue;
+				publish_remove(sub);
+				close(sub);
+				if(unlinkat(dfd,d->name,AT_REMOVEDIR) == 0)
+					removed = 1;
+			}
+	}while(removed);
+}
+
+/* Delete a tree from a child at idle priority and do not wait for it */
+static void
+publish_discard(const char *path)
+{
+	pid_t pid;
+	int dfd;
+
+	pid = fork();
+	if(pid != 0)
+		return;
+
+	setsid();
+	setpriority(PRIO_PROCESS,0,19);
+	syscall(SYS_ioprio_set,1,0,3 << 13);	/* IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE */
+
+	dfd = open(path,O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+	if(dfd != -1){
+		publish_remove(dfd);
+		close(dfd);
+	}
+	rmdir(path);
+	_exit(EXIT_SUCCESS);
+}
+
+static void
+err_exit(const char *format, ...)
+{
+	char message[EVENT_MAX_MESSAGE];
+	size_t len;
+	int i, err;
+	va_list args, copy;
+
+	err = errno;
+
+	va_start(args,format);
+	va_copy(copy,args);
+	vfprintf(stderr,format,args);
+	va_end(args);
+
+	vsnprintf(message,sizeof(message),format,copy);
+	va_end(copy);
+	len = strlen(message);
+	if(len > 0 && message[len - 1] == '\n')
+		message[len - 1] = '\0';
+
+	/* A worker process fails alone, its supervisor reports the file */
+	if(isolate_self != NULL){
+		isolate_self->error = err;
+		snprintf(isolate_self->message,sizeof(isolate_self->message),"%s",message);
+		_exit(EXIT_FAILURE);
+	}
+
+	live_close(ELFKILLAH_LIVE_FAILED,err,message);
+
+	/* A half staged tree is of no use to anyone */
+	if(publish_staging[0] != '\0'){
+		publish_discard(publish_staging);
+		publish_staging[0] = '\0';
+	}
+	if(bundle_tmp[0] != '\0'){
+		unlink(bundle_tmp);
+		bundle_tmp[0] = '\0';
+	}
+
+	if(opt_events){
+		if(self != NULL && self->cur.in_file != NULL)
+			events_emit(self,err != 0 ? err : EINVAL,message);
+
+		/* Hand over what every worker has completed so far */
+		queue_lock(&queue->events_lock);
+		for(i=0; i<nworkers; i++)
+			write_all(STDOUT_FILENO,workers[i].events,
+				__atomic_load_n(&workers[i].events_len,__ATOMIC_ACQUIRE));
+	}
+
+	exit(EXIT_FAILURE);
+}
+
+static void
+live_open(const char *mode)
+{
+	size_t size;
+	int fd, i;
+
+	snprintf(live_path,sizeof(live_path),"%s/elfkillah.%d",ELFKILLAH_LIVE_DIR,(int)getpid());
+	size = sizeof(ElfkillahLive) + nworkers * sizeof(ElfkillahLiveWorker);
+
+	fd = open(live_path,O_CREAT|O_EXCL|O_RDWR,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if(fd == -1)
+		err_exit("live_open() --> open(%s)\n",live_path);
+	if(ftruncate(fd,size) == -1)
+		err_exit("live_open() --> ftruncate()\n");
+	live = (ElfkillahLive *)mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	if(live == MAP_FAILED)
+		err_exit("live_open() --> mmap()\n");
+	close(fd);
+
+	live->pid = getpid();
+	live->nworkers = nworkers;
+	live->state = ELFKILLAH_LIVE_BUSY;
+	live->start = now_ns();
+	live->jobs = njobs;
+	snprintf(live->mode,sizeof(live->mode),"%s",mode);
+	for(i=0; i<nworkers; i++)
+		workers[i].live = &live->workers[i];
+
+	/* Readers check the magic last */
+	__atomic_store_n(&live->magic,ELFKILLAH_LIVE_MAGIC,__ATOMIC_RELEASE);
+}
+
+static void
+usage(const char *pname)
+{
+	fprintf(stderr,"%s a simple ELF-32/64 section stripper\n",pname);
+	fprintf(stderr,"%s [options] <infile> <outfile> [<infile> <outfile> ...]\n",pname);
+	fprintf(stderr,"%s [options] --publish <srctree> <tree>\n",pname);
+	fprintf(stderr,"%s [-j <n>] --mount <srcdir> <mountpoint>\n\n",pname);
+	fprintf(stderr,"  -j, --jobs <n>  strip files with <n> worker threads\n");
+	fprintf(stderr,"  -s, --stats     report per-stage latency percentiles on exit\n");
+	fprintf(stderr,"  -c, --copy-threads <n>\n");
+	fprintf(stderr,"                  copy files above %lu MiB with <n> threads (default %d)\n",
+		COPY_PARALLEL_MIN >> 20,opt_copy_threads);
+	fprintf(stderr,"  -z, --zip       files are ZIP/APK/JAR archives, strip their ELF entries\n");
+	fprintf(stderr,"                  (signed archives have to be signed again)\n");
+	fprintf(stderr,"  -p, --package   files are .deb or .rpm packages, strip their ELF files\n");
+	fprintf(stderr,"                  (signed packages have to be signed again)\n");
+	fprintf(stderr,"  -q, --squashfs  files are SquashFS images or AppImages, strip their ELF files\n");
+	fprintf(stderr,"  --events jsonl  write one JSON record per file to stdout\n");
+	fprintf(stderr,"  --record <file> save the layout and stage timings of every file, not its\n");
+	fprintf(stderr,"                  name or contents, for bench/replay\n");
+	fprintf(stderr,"  --cache <dir>   share results with every elfkillah using <dir>, best kept\n");
+	fprintf(stderr,"                  on the output filesystem to reflink them\n");
+	fprintf(stderr,"  --remote <url>  look results up in an HTTP cache, bazel-remote style, and\n");
+	fprintf(stderr,"                  upload new ones; see elfkillah-cas\n");
+	fprintf(stderr,"  --debug-store <dir>\n");
+	fprintf(stderr,"                  keep debuginfo by build-id in <dir>, for elfkillah-debuginfod\n");
+	fprintf(stderr,"  --publish       stage <srctree> stripped next to <tree>, non-ELF files\n");
+	fprintf(stderr,"                  reflinked, and swap it with <tree> in one rename\n");
+	fprintf(stderr,"  --isolate       run the -j workers as processes, so a file which crashes\n");
+	fprintf(stderr,"                  one fails alone; not with --remote\n");
+	fprintf(stderr,"  --per-device    queue files by the device they are on, each device with\n");
+	fprintf(stderr,"                  as many workers as its latency allows\n");
+	fprintf(stderr,"  --s3 <url>      upload outputs to http://host[:port]/bucket[/prefix] under\n");
+	fprintf(stderr,"                  their <outfile> names instead of writing them; see\n");
+	fprintf(stderr,"                  elfkillah-s3\n");
+	fprintf(stderr,"  --bundle <file> write the outputs into <file> under their <outfile> names,\n");
+	fprintf(stderr,"                  every distinct %d byte page once; see elfkillah-bundle\n",
+		ELFKILLAH_BUNDLE_PAGE);
+	fprintf(stderr,"  --live          publish live counters in %s/elfkillah.<pid>\n",ELFKILLAH_LIVE_DIR);
+	fprintf(stderr,"                  for elfkillah-top\n");
+	fprintf(stderr,"  --mount         show <srcdir> at <mountpoint> read-only, with its ELF files\n");
+	fprintf(stderr,"                  stripped as they are read; -j sets the serving threads\n\n");
+	fprintf(stderr,"Written by Fabrizio Curcio aka spike, 2014.\n");
+	exit(EXIT_SUCCESS);
+}
+
+static long
+align_to_page(size_t size)
+{
+	long pg_size;
+
+	pg_size = sysconf(_SC_PAGESIZE);
+	if(pg_size == -1)
+		err_exit("sysconf()");
+
+	if(size <= pg_size)
+		return pg_size;
+
+	else
+		return size + pg_size - (size % pg_size);
+}
+
+#endif
+
+/* Is [off, off + len) inside an image of the given size? */
+static int
+in_bounds(uint64_t off, uint64_t len, size_t size)
+{
+	return off <= size && len <= size - off;
+}
+
+/*
+  Header tables sit wherever e_shoff and e_phoff say, aligned or not,
+  so entries are copied out before a field is read.
+*/
+#define SHDR_FIELD(v,i,f) ((v)->type == ELF_32 \
+	? view_shdr32(v,i).f : view_shdr64(v,i).f)
+
+#define PHDR_FIELD(v,i,f) ((v)->type == ELF_32 \
+	? view_phdr32(v,i).f : view_phdr64(v,i).f)
+
+static inline const unsigned char *
+view_shdr(const ElfView *v, size_t i)
+{
+	return v->shdrs + i * v->shentsize;
+}
+
+static inline const unsigned char *
+view_phdr(const ElfView *v, size_t i)
+{
+	return v->base + v->phoff + i * v->phentsize;
+}
+
+static inline Elf32_Shdr
+view_shdr32(const ElfView *v, size_t i)
+{
+	Elf32_Shdr s;
+
+	memcpy(&s,view_shdr(v,i),sizeof(s));
+	return s;
+}
+
+static inline Elf64_Shdr
+view_shdr64(const ElfView *v, size_t i)
+{
+	Elf64_Shdr s;
+
+	memcpy(&s,view_shdr(v,i),sizeof(s));
+	return s;
+}
+
+static inline Elf32_Phdr
+view_phdr32(const ElfView *v, size_t i)
+{
+	Elf32_Phdr p;
+
+	memcpy(&p,view_phdr(v,i),sizeof(p));
+	return p;
+}
+
+static inline Elf64_Phdr
+view_phdr64(const ElfView *v, size_t i)
+{
+	Elf64_Phdr p;
+
+	memcpy(&p,view_phdr(v,i),sizeof(p));
+	return p;
+}
+
+/* Number of bytes kept by the cut, the header always among them */
+static inline size_t
+view_cut(const ElfView *v)
+{
+	return v->shoff - 1;
+}
+
+/* Bytes of a string table at [off, off + len) kept by a cut, which the patch clears */
+static inline size_t
+strtbl_cleared(uint64_t off, uint64_t len, size_t cut)
+{
+	if(off >= cut)
+		return 0;
+
+	return off + len < cut ? len : cut - off;
+}
+
+/*
+  Validate the ELF header of an image of the given size; base needs to
+  hold the header only. Returns NULL on success or a short description
+  of what is wrong with the image.
+*/
+static const char *
+elf_view_header(ElfView *v, const void *base, size_t size)
+{
+	const unsigned char *id;
+	const Elf32_Ehdr *e32;
+	const Elf64_Ehdr *e64;
+	size_t shdrsize;
+
+	id = (const unsigned char *)base;
+	v->base = id;
+	v->size = size;
+
+	if(size < EI_NIDENT || id[EI_MAG0] != ELFMAG0 || id[EI_MAG1] != ELFMAG1
+	   || id[EI_MAG2] != ELFMAG2 || id[EI_MAG3] != ELFMAG3)
+		return "bad file";
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if(id[EI_DATA] != ELFDATA2LSB)
+#else
+	if(id[EI_DATA] != ELFDATA2MSB)
+#endif
+		return "foreign byte order";
+
+	if(id[EI_CLASS] == ELF_32){
+		e32 = (const Elf32_Ehdr *)base;
+		v->ehsize = sizeof(Elf32_Ehdr);
+		shdrsize = sizeof(Elf32_Shdr);
+		if(size < v->ehsize)
+			return "truncated header";
+		v->phoff = e32->e_phoff;
+		v->phentsize = e32->e_phentsize;
+		v->phnum = e32->e_phnum;
+		v->shoff = e32->e_shoff;
+		v->shentsize = e32->e_shentsize;
+		v->shnum = e32->e_shnum;
+		v->shstrndx = e32->e_shstrndx;
+	}else if(id[EI_CLASS] == ELF_64){
+		e64 = (const Elf64_Ehdr *)base;
+		v->ehsize = sizeof(Elf64_Ehdr);
+		shdrsize = sizeof(Elf64_Shdr);
+		if(size < v->ehsize)
+			return "truncated header";
+		if(e64->e_phoff > SIZE_MAX || e64->e_shoff > SIZE_MAX)
+			return "header table out of bounds";
+		v->phoff = e64->e_phoff;
+		v->phentsize = e64->e_phentsize;
+		v->phnum = e64->e_phnum;
+		v->shoff = e64->e_shoff;
+		v->shentsize = e64->e_shentsize;
+		v->shnum = e64->e_shnum;
+		v->shstrndx = e64->e_shstrndx;
+	}else
+		return "bad class";
+	v->type = id[EI_CLASS];
+
+	/* The cut keeps shoff - 1 bytes, the whole header has to survive it */
+	if(v->shoff <= v->ehsize)
+		return "no section headers";
+	if(v->shentsize < shdrsize || !in_bounds(v->shoff,v->shentsize,size))
+		return "section header table out of bounds";
+
+	return NULL;
+}
+
+/*
+  Validate the section header table, of which avail bytes are at shdrs,
+  and everything found through it.
+*/
+static const char *
+elf_view_sections(ElfView *v, const unsigned char *shdrs, size_t avail)
+{
+	size_t phdrsize;
+	uint64_t offset, len;
+	uint32_t type;
+
+	v->shdrs = shdrs;
+	phdrsize = v->type == ELF_32 ? sizeof(Elf32_Phdr) : sizeof(Elf64_Phdr);
+
+	if(avail < v->shentsize)
+		return "section header table out of bounds";
+
+	/* Section 0 holds the real counts once they overflow the header */
+	if(v->shnum == 0)
+		v->shnum = SHDR_FIELD(v,0,sh_size);
+	if(v->shstrndx == SHN_XINDEX)
+		v->shstrndx = SHDR_FIELD(v,0,sh_link);
+	if(v->phnum == PN_XNUM)
+		v->phnum = SHDR_FIELD(v,0,sh_info);
+
+	if(v->shnum == 0 || v->shnum > (v->size - v->shoff) / v->shentsize
+	   || v->shnum > avail / v->shentsize)
+		return "section header table out of bounds";
+
+	if(v->phnum != 0 && (v->phentsize < phdrsize
+	   || !in_bounds(v->phoff,(uint64_t)v->phnum * v->phentsize,v->size)))
+		return "program header table out of bounds";
+
+	v->strtbloff = 0;
+	v->strtblsize = 0;
+	if(v->shstrndx == SHN_UNDEF)
+		return NULL;
+	if(v->shstrndx >= v->shnum)
+		return "bad string table index";
+
+	offset = SHDR_FIELD(v,v->shstrndx,sh_offset);
+	len = SHDR_FIELD(v,v->shstrndx,sh_size);
+	type = SHDR_FIELD(v,v->shstrndx,sh_type);
+
+	if(type == SHT_NOBITS)
+		return NULL;
+	if(!in_bounds(offset,len,v->size))
+		return "string table out of bounds";
+
+	v->strtbloff = offset;
+	v->strtblsize = len;
+
+	return NULL;
+}
+
+/* Validate a whole image held in memory */
+static const char *
+elf_view(ElfView *v, const void *base, size_t size)
+{
+	const char *err;
+
+	err = elf_view_header(v,base,size);
+	if(err != NULL)
+		return err;
+
+	return elf_view_sections(v,v->base + v->shoff,size - v->shoff);
+}
+
+#ifndef ELFKILLAH_LIBRARY
+
+static void
+get_string_table(ElfContainer *elfc)
+{
+	const char *err;
+
+	err = elf_view(&elfc->view,elfc->elf64,elfc->size);
+	if(err != NULL)
+		err_exit("get_string_table() --> %s\n",err);
+}
+
+/*
+  Inputs are mapped read-only and private, so running binaries and
+  files the caller cannot write strip all the same; only an output,
+  whose header is adjusted in place, is opened writable.
+*/
+static ElfContainer *
+build_container(const char *file, int writable)
+{
+	ElfContainer *elfc;
+	unsigned char *id;
+	void *ptr;
+	int fd;
+	size_t size;
+	size_t mmapped;
+	struct stat sb;
+
+	fd = open(file,writable ? O_RDWR : O_RDONLY);
+	if(fd == -1)
+		err_exit("build_container() --> open(%s)\n",file);
+
+	if(fstat(fd,&sb) == -1)
+		err_exit("build_container() --> fstat()\n");
+
+	size = sb.st_size;
+	mmapped = align_to_page(size);
+  
+	ptr = mmap(NULL,mmapped,writable ? PROT_READ|PROT_WRITE : PROT_READ,writable ? MAP_SHARED : MAP_PRIVATE,fd,0);
+
+	if(ptr == MAP_FAILED)
+		err_exit("build_container() --> mmap()\n");
+  
+	id = (unsigned char *)ptr;
+	if(size < EI_NIDENT || id[EI_MAG0] != ELFMAG0 || id[EI_MAG1] != ELFMAG1
+	   || id[EI_MAG2] != ELFMAG2 || id[EI_MAG3] != ELFMAG3)
+		err_exit("build_container() --> bad file\n");
+
+	elfc = (ElfContainer *)malloc(sizeof(ElfContainer));
+
+	if(elfc == NULL)
+		err_exit("build_container() --> malloc()\n");
+
+	elfc->size = size;
+	elfc->mmapped = mmapped;
+  
+	if(id[EI_CLASS] == ELF_32){
+		elfc->type = ELF_32;
+		elfc->elf32 = (Elf32_Ehdr *)ptr;
+	}else if(id[EI_CLASS] == ELF_64){
+		elfc->type = ELF_64;
+		elfc->elf64 = (Elf64_Ehdr *)ptr;
+	}else{
+		free(elfc);
+		err_exit("build_container() --> bad class\n");
+	}
+
+	close(fd);
+
+	return elfc;
+}
+
+static void
+destroy_container(ElfContainer *elfc)
+{
+	if(elfc == NULL)
+		err_exit("destroy_container()\n");
+	else if(elfc->type == ELF_32){
+		munmap(elfc->elf32,elfc->mmapped);
+	}else
+		munmap(elfc->elf64,elfc->mmapped);
+
+	free(elfc);
+}
+
+#endif
+
+/*
+  Patch the bytes kept by the cut, wherever they live: clear the section
+  header fields of the ELF header and the string table contents.
+*/
+static size_t
+patch_image(unsigned char *ptr, size_t size, const ElfView *view)
+{
+	Elf32_Ehdr *e32;
+	Elf64_Ehdr *e64;
+	size_t end;
+
+	if(view->type == ELF_32){
+		e32 = (Elf32_Ehdr *)ptr;
+		e32->e_shoff = 0;
+		e32->e_shentsize = 0;
+		e32->e_shnum = 0;
+		e32->e_shstrndx = 0;
+	}else{
+		e64 = (Elf64_Ehdr *)ptr;
+		e64->e_shoff = 0;
+		e64->e_shentsize = 0;
+		e64->e_shnum = 0;
+		e64->e_shstrndx = 0;
+	}
+
+	/* Clear content of string table, as far as it survived the cut */
+	end = view->strtbloff + view->strtblsize;
+	if(end > size)
+		end = size;
+	if(view->strtbloff >= end)
+		return 0;
+
+	memset(ptr + view->strtbloff,0,end - view->strtbloff);
+
+	return end - view->strtbloff;
+}
+
+#ifndef ELFKILLAH_LIBRARY
+
+/*
+  Patch [off, off + len) of an image on its way out: bytes of the
+  header come from hdr, already passed through patch_image(), bytes of
+  the string table are cleared.
+*/
+static void
+patch_range(unsigned char *buf, size_t off, size_t len, const ElfView *view,
+	    const unsigned char *hdr)
+{
+	size_t lo, hi;
+
+	if(off < view->ehsize)
+		memcpy(buf,hdr + off,(view->ehsize - off < len ? view->ehsize - off : len));
+
+	lo = view->strtbloff > off ? view->strtbloff : off;
+	hi = view->strtbloff + view->strtblsize;
+	if(hi > off + len)
+		hi = off + len;
+	if(lo < hi)
+		memset(buf + (lo - off),0,hi - lo);
+}
+
+static size_t
+adjust_header(ElfContainer *elfc, const ElfView *view)
+{
+	return patch_image((unsigned char *)elfc->elf64,elfc->size,view);
+}
+
+/*
+  Past COPY_PARALLEL_MIN bytes the kept part of the file is cut into
+  COPY_CHUNK_SIZE ranges which the copy threads claim in turn and
+  pwrite() at their own offsets. The header is patched afterwards
+  through a fresh mapping of the output, so it is always applied last.
+*/
+static void *
+copy_range(void *arg)
+{
+	CopyJob *job;
+	size_t off, len;
+	ssize_t written;
+
+	job = (CopyJob *)arg;
+
+	while((off = __atomic_fetch_add(&job->next,COPY_CHUNK_SIZE,__ATOMIC_RELAXED)) < job->size){
+		len = job->size - off;
+		if(len > COPY_CHUNK_SIZE)
+			len = COPY_CHUNK_SIZE;
+
+		while(len > 0){
+			written = pwrite(job->fd,job->src + off,len,off);
+			if(written == -1 && errno == EINTR)
+				continue;
+			if(written <= 0){
+				__atomic_store_n(&job->error,written == -1 ? errno : EIO,__ATOMIC_RELAXED);
+				return NULL;
+			}
+			off += written;
+			len -= written;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+copy_parallel(int fd, const void *ptr, size_t size)
+{
+	CopyJob job;
+	pthread_t tids[COPY_MAX_THREADS];
+	size_t chunks;
+	int i, n;
+
+	job.fd = fd;
+	job.src = (const unsigned char *)ptr;
+	job.size = size;
+	job.next = 0;
+	job.error = 0;
+
+	if(ftruncate(fd,size) == -1)
+		err_exit("write_elf() --> ftruncate()\n");
+
+	chunks = (size + COPY_CHUNK_SIZE - 1) / COPY_CHUNK_SIZE;
+	n = opt_copy_threads < chunks ? opt_copy_threads : chunks;
+
+	/* The calling worker copies too, so start one thread less */
+	for(i=0; i<n - 1; i++)
+		if(pthread_create(&tids[i],NULL,copy_range,&job) != 0)
+			err_exit("write_elf() --> pthread_create()\n");
+
+	copy_range(&job);
+
+	for(i=0; i<n - 1; i++)
+		pthread_join(tids[i],NULL);
+
+	if(job.error != 0){
+		errno = job.error;
+		err_exit("write_elf() --> pwrite()\n");
+	}
+}
+
+static const char *
+write_elf(const ElfView *view, const char *out_file)
+{
+	int fd, flags;
+	mode_t mode;
+	size_t size;
+	const void *ptr;
+	const char *engine;
+
+	flags = O_CREAT|O_RDWR|O_TRUNC;
+	mode = S_IRWXU|S_IRGRP|S_IWGRP;
+
+	fd = open(out_file,flags,mode);
+	if(fd == -1)
+		err_exit("open()\n");
+
+	size = view_cut(view);
+	ptr = view->base;
+
+	if(size >= COPY_PARALLEL_MIN && opt_copy_threads > 1){
+		copy_parallel(fd,ptr,size);
+		engine = "pwrite";
+	}else{
+		if(size == 0 || write_all(fd,ptr,size) == -1)
+			err_exit("write_elf() --> write()\n");
+		engine = "write";
+	}
+
+	close(fd);
+
+	return engine;
+}
+
+/*
+  Copy size bytes of src into dst, both at offset 0: share the extents
+  when the filesystem allows, else copy in the kernel, else by hand.
+  Returns the way it went, or NULL with errno set.
+*/
+static const char *
+clone_fd(int dst, int src, size_t size)
+{
+	const void *ptr;
+	loff_t in, out;
+	ssize_t n;
+	int ret;
+
+	if(ioctl(dst,FICLONE,src) == 0)
+		return "reflink";
+
+	in = out = 0;
+	while((size_t)out < size){
+		n = copy_file_range(src,&in,dst,&out,size - out,0);
+		if(n == -1 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			break;
+	}
+	if((size_t)out == size)
+		return "copy_file_range";
+	if(out != 0)
+		return NULL;
+
+	ptr = mmap(NULL,size,PROT_READ,MAP_PRIVATE,src,0);
+	if(ptr == MAP_FAILED)
+		return NULL;
+	ret = write_all(dst,(const char *)ptr,size);
+	munmap((void *)ptr,size);
+
+	return ret == 0 ? "write" : NULL;
+}
+
+static int
+futex_op(uint32_t *word, int op, uint32_t val, const struct timespec *timeout)
+{
+	return syscall(SYS_futex,word,op,val,timeout,NULL,0);
+}
+
+static void
+cache_name(char *name, size_t len, const CacheKey *key)
+{
+	snprintf(name,len,"%llx-%llx-%llx-%llx-%llx",(unsigned long long)key->dev,
+		(unsigned long long)key->ino,(unsigned long long)key->size,
+		(unsigned long long)key->mtime,(unsigned long long)key->ctime);
+}
+
+/* A slot left locked by a dead process may be half written: drop it */
+static void
+cache_lock(CacheSlot *slot)
+{
+	int ret;
+
+	ret = pthread_mutex_lock(&slot->lock);
+	if(ret == EOWNERDEAD){
+		slot->state = CACHE_EMPTY;
+		pthread_mutex_consistent(&slot->lock);
+	}else if(ret != 0){
+		errno = ret;
+		err_exit("cache_lock() --> pthread_mutex_lock()\n");
+	}
+}
+
+static void
+cache_unlock(CacheSlot *slot)
+{
+	pthread_mutex_unlock(&slot->lock);
+}
+
+/*
+  The first elfkillah to use the directory builds the index aside and
+  links it in; whoever loses the race maps the winner's.
+*/
+static void
+cache_open(const char *dir)
+{
+	pthread_mutexattr_t attr;
+	char tmp[64];
+	size_t size, i;
+	struct stat sb;
+	int fd;
+
+	if(mkdir(dir,S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) == -1 && errno != EEXIST)
+		err_exit("cache_open() --> mkdir(%s)\n",dir);
+	cache_dfd = open(dir,O_RDONLY|O_DIRECTORY);
+	if(cache_dfd == -1)
+		err_exit("cache_open() --> open(%s)\n",dir);
+
+	size = sizeof(CacheIndex) + CACHE_SLOTS * sizeof(CacheSlot);
+	fd = openat(cache_dfd,"index",O_RDWR);
+	if(fd == -1 && errno == ENOENT){
+		snprintf(tmp,sizeof(tmp),"index.%d",(int)getpid());
+		fd = openat(cache_dfd,tmp,O_CREAT|O_EXCL|O_RDWR,S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+		if(fd == -1 || ftruncate(fd,size) == -1)
+			err_exit("cache_open() --> openat(%s)\n",tmp);
+		cache = (CacheIndex *)mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+		if(cache == MAP_FAILED)
+			err_exit("cache_open() --> mmap()\n");
+
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr,PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr,PTHREAD_MUTEX_ROBUST);
+		for(i=0; i<CACHE_SLOTS; i++)
+			pthread_mutex_init(&cache->slots[i].lock,&attr);
+		pthread_mutexattr_destroy(&attr);
+		cache->nslots = CACHE_SLOTS;
+		cache->slot_size = sizeof(CacheSlot);
+		cache->magic = CACHE_MAGIC;
+		munmap(cache,size);
+
+		if(linkat(cache_dfd,tmp,cache_dfd,"index",0) == -1 && errno != EEXIST)
+			err_exit("cache_open() --> linkat()\n");
+		unlinkat(cache_dfd,tmp,0);
+		close(fd);
+		fd = openat(cache_dfd,"index",O_RDWR);
+	}
+	if(fd == -1 || fstat(fd,&sb) == -1)
+		err_exit("cache_open() --> openat(index)\n");
+
+	cache = (CacheIndex *)mmap(NULL,sb.st_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	if(cache == MAP_FAILED)
+		err_exit("cache_open() --> mmap()\n");
+	close(fd);
+
+	if((size_t)sb.st_size < sizeof(CacheIndex) || cache->magic != CACHE_MAGIC
+	   || cache->slot_size != sizeof(CacheSlot) || cache->nslots < CACHE_PROBE
+	   || sb.st_size != sizeof(CacheIndex) + (uint64_t)cache->nslots * sizeof(CacheSlot))
+		err_exit("cache_open() --> %s/index is not a cache index\n",dir);
+}
+
+/*
+  Look the input up. A hit copies the slot into *meta; a miss leaves
+  the slot claimed for cache_fill(), whose index is stored in *index.
+  When every slot of the window is being filled the input bypasses
+  the cache.
+*/
+static int
+cache_claim(const CacheKey *key, CacheSlot *meta, size_t *index)
+{
+	struct timespec timeout;
+	CacheSlot *window, *s, *found, *victim;
+	char name[128];
+	uint64_t h;
+	size_t i;
+	pid_t pid;
+	int ret;
+
+	/* FNV-1a; windows never wrap, so locking them in order cannot deadlock */
+	h = 0xcbf29ce484222325ULL;
+	for(i=0; i<sizeof(*key); i++)
+		h = (h ^ ((const unsigned char *)key)[i]) * 0x100000001b3ULL;
+	window = &cache->slots[h % (cache->nslots - CACHE_PROBE + 1)];
+	pid = getpid();
+
+	for(;;){
+		found = victim = NULL;
+		for(i=0; i<CACHE_PROBE; i++){
+			s = &window[i];
+			cache_lock(s);
+			if(s->state != CACHE_EMPTY && memcmp(&s->key,key,sizeof(*key)) == 0)
+				found = s;
+			else if(s->state == CACHE_EMPTY)
+				victim = victim != NULL && victim->state == CACHE_EMPTY ? victim : s;
+			else if(s->state == CACHE_READY
+				&& (victim == NULL || (victim->state == CACHE_READY && s->used < victim->used)))
+				victim = s;
+		}
+
+		ret = CACHE_MISS;
+		if(found != NULL && found->state == CACHE_READY){
+			found->used = now_ns();
+			*meta = *found;
+			ret = CACHE_HIT;
+		}else if(found != NULL && (kill(found->owner,0) == 0 || errno == EPERM)){
+			/* Being filled: sleep until it is, then look again */
+			for(i=0; i<CACHE_PROBE; i++)
+				cache_unlock(&window[i]);
+			timeout.tv_sec = 0;
+			timeout.tv_nsec = CACHE_WAIT_NS;
+			futex_op(&found->state,FUTEX_WAIT,CACHE_BUSY,&timeout);
+			continue;
+		}else if(found != NULL){
+			found->owner = pid;
+			victim = found;
+		}else if(victim != NULL){
+			if(victim->state == CACHE_READY){
+				cache_name(name,sizeof(name),&victim->key);
+				unlinkat(cache_dfd,name,0);
+			}
+			victim->state = CACHE_BUSY;
+			victim->owner = pid;
+			victim->key = *key;
+		}else
+			ret = CACHE_BYPASS;
+
+		for(i=0; i<CACHE_PROBE; i++)
+			cache_unlock(&window[i]);
+
+		if(ret == CACHE_MISS)
+			*index = victim - cache->slots;
+		return ret;
+	}
+}
+
+/* Publish the result of a claimed slot, or with out_file NULL give it up */
+static void
+cache_fill(size_t index, const CacheKey *key, const char *out_file, const ElfView *view)
+{
+	CacheSlot *s;
+	char name[128], tmp[160];
+	int src, dst, ok;
+
+	ok = 0;
+	cache_name(name,sizeof(name),key);
+	snprintf(tmp,sizeof(tmp),"%s.%d.%d",name,(int)getpid(),self != NULL ? self->id : 0);
+
+	if(out_file != NULL){
+		src = open(out_file,O_RDONLY);
+		dst = openat(cache_dfd,tmp,O_CREAT|O_TRUNC|O_WRONLY,S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+		if(src != -1 && dst != -1 && clone_fd(dst,src,view_cut(view)) != NULL
+		   && renameat(cache_dfd,tmp,cache_dfd,name) == 0)
+			ok = 1;
+		if(src != -1)
+			close(src);
+		if(dst != -1)
+			close(dst);
+		if(!ok)
+			unlinkat(cache_dfd,tmp,0);
+	}
+
+	/* The slot may have been taken over meanwhile */
+	s = &cache->slots[index];
+	cache_lock(s);
+	if(s->state == CACHE_BUSY && s->owner == getpid() && memcmp(&s->key,key,sizeof(*key)) == 0){
+		if(ok){
+			s->used = now_ns();
+			s->shoff = view->shoff;
+			s->strtbloff = view->strtbloff;
+			s->strtblsize = view->strtblsize;
+			s->cut = view_cut(view);
+			s->type = view->type;
+		}
+		__atomic_store_n(&s->state,ok ? CACHE_READY : CACHE_EMPTY,__ATOMIC_RELEASE);
+	}
+	cache_unlock(s);
+	futex_op(&s->state,FUTEX_WAKE,INT_MAX,NULL);
+}
+
+/* Write a cached result to out_file, NULL when it is gone */
+static const char *
+cache_fetch(const CacheSlot *meta, const char *out_file)
+{
+	const char *engine;
+	char name[128];
+	int src, dst;
+
+	cache_name(name,sizeof(name),&meta->key);
+	src = openat(cache_dfd,name,O_RDONLY);
+	if(src == -1)
+		return NULL;
+
+	dst = open(out_file,O_CREAT|O_RDWR|O_TRUNC,S_IRWXU|S_IRGRP|S_IWGRP);
+	if(dst == -1)
+		err_exit("cache_fetch() --> open(%s)\n",out_file);
+
+	engine = clone_fd(dst,src,meta->cut);
+	if(engine == NULL)
+		err_exit("cache_fetch() --> clone_fd()\n");
+
+	close(dst);
+	close(src);
+
+	return engine;
+}
+
+/* The build-id of an image, from its first GNU build-id note; 0 without */
+static size_t
+debug_build_id(const ElfView *v, unsigned char *id)
+{
+	const unsigned char *p, *end, *name;
+	uint32_t namesz, descsz, type;
+	size_t i, align;
+	uint64_t off, len;
+
+	for(i=1; i<v->shnum; i++){
+		if(SHDR_FIELD(v,i,sh_type) != SHT_NOTE)
+			continue;
+		off = SHDR_FIELD(v,i,sh_offset);
+		len = SHDR_FIELD(v,i,sh_size);
+		if(!in_bounds(off,len,v->size))
+			continue;
+		align = SHDR_FIELD(v,i,sh_addralign) == 8 ? 8 : 4;
+
+		p = v->base + off;
+		end = p + len;
+		while(end - p >= 12){
+			memcpy(&namesz,p,4);
+			memcpy(&descsz,p + 4,4);
+			memcpy(&type,p + 8,4);
+			p += 12;
+			name = p;
+			if(namesz > (size_t)(end - p) || (namesz + align - 1) / align * align > (size_t)(end - p))
+				break;
+			p += (namesz + align - 1) / align * align;
+			if(descsz > (size_t)(end - p))
+				break;
+			if(type == NT_GNU_BUILD_ID && namesz == 4 && memcmp(name,"GNU",4) == 0
+			   && descsz > 0 && descsz <= ELFKILLAH_BUILD_ID_MAX){
+				memcpy(id,p,descsz);
+				return descsz;
+			}
+			if((descsz + align - 1) / align * align > (size_t)(end - p))
+				break;
+			p += (descsz + align - 1) / align * align;
+		}
+	}
+
+	return 0;
+}
+
+static void
+debug_set_shdr(const ElfView *v, unsigned char *p, uint32_t type, uint64_t off)
+{
+	Elf32_Shdr s32;
+	Elf64_Shdr s64;
+
+	if(v->type == ELF_32){
+		memcpy(&s32,p,sizeof(s32));
+		s32.sh_type = type;
+		s32.sh_offset = off;
+		memcpy(p,&s32,sizeof(s32));
+	}else{
+		memcpy(&s64,p,sizeof(s64));
+		s64.sh_type = type;
+		s64.sh_offset = off;
+		memcpy(p,&s64,sizeof(s64));
+	}
+}
+
+/* Does the debuginfo file keep the contents of section i? */
+static int
+debug_section_kept(const ElfView *v, size_t i)
+{
+	uint32_t type;
+
+	type = SHDR_FIELD(v,i,sh_type);
+	if(type == SHT_NOBITS || ((SHDR_FIELD(v,i,sh_flags) & SHF_ALLOC) && type != SHT_NOTE))
+		return 0;
+
+	return in_bounds(SHDR_FIELD(v,i,sh_offset),SHDR_FIELD(v,i,sh_size),v->size);
+}
+
+/*
+  What the strip hides from a debugger, as a debuginfo file in the way
+  of objcopy --only-keep-debug: the header, the section header table,
+  and the contents of the sections not loaded at run time, notes
+  included. Loaded sections stay in the table as SHT_NOBITS.
+*/
+static unsigned char *
+debug_object(const ElfView *v, size_t *len)
+{
+	Elf32_Ehdr e32;
+	Elf64_Ehdr e64;
+	unsigned char *out, *shdrs;
+	size_t i, cap, off, align, table;
+	uint64_t soff, ssize;
+	uint32_t type;
+
+	/* Room for the kept sections only, each aligned to at most 4096 */
+	table = v->shnum * v->shentsize;
+	cap = v->ehsize + table + 8;
+	for(i=1; i<v->shnum; i++)
+		if(debug_section_kept(v,i)
+		   && (__builtin_add_overflow(cap,SHDR_FIELD(v,i,sh_size),&cap)
+		   || __builtin_add_overflow(cap,4096,&cap)))
+			err_exit("debug_object() --> sections too large\n");
+
+	shdrs = (unsigned char *)malloc(table);
+	out = (unsigned char *)malloc(cap);
+	if(shdrs == NULL || out == NULL)
+		err_exit("debug_object() --> malloc()\n");
+	memcpy(shdrs,v->shdrs,table);
+	memcpy(out,v->base,v->ehsize);
+
+	off = v->ehsize;
+	for(i=1; i<v->shnum; i++){
+		if(!debug_section_kept(v,i)){
+			debug_set_shdr(v,shdrs + i * v->shentsize,SHT_NOBITS,off);
+			continue;
+		}
+
+		type = SHDR_FIELD(v,i,sh_type);
+		soff = SHDR_FIELD(v,i,sh_offset);
+		ssize = SHDR_FIELD(v,i,sh_size);
+
+		align = SHDR_FIELD(v,i,sh_addralign);
+		if(align < 1 || align > 4096 || (align & (align - 1)) != 0)
+			align = align > 4096 ? 4096 : 1;
+		off = (off + align - 1) & ~(align - 1);
+		memcpy(out + off,v->base + soff,ssize);
+		debug_set_shdr(v,shdrs + i * v->shentsize,type,off);
+		off += ssize;
+	}
+
+	off = (off + 7) & ~(size_t)7;
+	memcpy(out + off,shdrs,table);
+	free(shdrs);
+
+	/* Nothing left to load: no program headers */
+	if(v->type == ELF_32){
+		memcpy(&e32,out,sizeof(e32));
+		e32.e_shoff = off;
+		e32.e_phoff = 0;
+		e32.e_phentsize = 0;
+		e32.e_phnum = 0;
+		memcpy(out,&e32,sizeof(e32));
+	}else{
+		memcpy(&e64,out,sizeof(e64));
+		e64.e_shoff = off;
+		e64.e_phoff = 0;
+		e64.e_phentsize = 0;
+		e64.e_phnum = 0;
+		memcpy(out,&e64,sizeof(e64));
+	}
+
+	*len = off + table;
+	return out;
+}
+
+static void
+debug_store_open(const char *dir)
+{
+	if(mkdir(dir,S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) == -1 && errno != EEXIST)
+		err_exit("debug_store_open() --> mkdir(%s)\n",dir);
+	debug_dfd = open(dir,O_RDONLY|O_DIRECTORY);
+	if(debug_dfd == -1)
+		err_exit("debug_store_open() --> open(%s)\n",dir);
+
+	debug_pack_fd = openat(debug_dfd,"pack",O_CREAT|O_WRONLY|O_APPEND,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	debug_journal_fd = openat(debug_dfd,"journal",O_CREAT|O_RDWR|O_APPEND,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if(debug_pack_fd == -1 || debug_journal_fd == -1)
+		err_exit("debug_store_open() --> openat()\n");
+}
+
+/*
+  Append the debuginfo of an image to the pack and its record to the
+  journal. The pack's flock orders writers of every process.
+*/
+static void
+debug_keep(const ElfView *v)
+{
+	ElfkillahDebugRecord rec;
+	unsigned char *obj;
+	struct stat sb;
+	size_t len;
+
+	memset(&rec,0,sizeof(rec));
+	rec.id_len = debug_build_id(v,rec.id);
+	if(rec.id_len == 0)
+		return;
+	obj = debug_object(v,&len);
+
+	pthread_mutex_lock(&debug_lock);
+	if(flock(debug_pack_fd,LOCK_EX) == -1 || fstat(debug_pack_fd,&sb) == -1)
+		err_exit("debug_keep() --> flock()\n");
+	rec.offset = sb.st_size;
+	rec.size = len;
+	if(write_all(debug_pack_fd,(const char *)obj,len) == -1
+	   || write_all(debug_journal_fd,(const char *)&rec,sizeof(rec)) == -1)
+		err_exit("debug_keep() --> write()\n");
+	flock(debug_pack_fd,LOCK_UN);
+	pthread_mutex_unlock(&debug_lock);
+
+	free(obj);
+}
+
+/* Cache and remote hits skip the strip, not the debuginfo */
+static void
+debug_keep_file(const char *in_file)
+{
+	ElfContainer *elfc;
+
+	elfc = build_container(in_file,0);
+	get_string_table(elfc);
+	debug_keep(&elfc->view);
+	destroy_container(elfc);
+}
+
+/* By build-id, then by age through the reserved field while merging */
+static int
+debug_cmp(const void *a, const void *b)
+{
+	const ElfkillahDebugRecord *x, *y;
+	int c;
+
+	x = (const ElfkillahDebugRecord *)a;
+	y = (const ElfkillahDebugRecord *)b;
+	c = memcmp(x->id,y->id,ELFKILLAH_BUILD_ID_MAX);
+	if(c == 0)
+		c = x->id_len < y->id_len ? -1 : x->id_len > y->id_len;
+	if(c == 0)
+		c = x->reserved < y->reserved ? -1 : x->reserved > y->reserved;
+	return c;
+}
+
+/* Lay sorted[] out in Eytzinger order: node k has children 2k and 2k + 1 */
+static size_t
+debug_eytzinger(const ElfkillahDebugRecord *sorted, ElfkillahDebugRecord *out,
+		size_t n, size_t i, size_t k)
+{
+	if(k <= n){
+		i = debug_eytzinger(sorted,out,n,i,2 * k);
+		out[k - 1] = sorted[i++];
+		i = debug_eytzinger(sorted,out,n,i,2 * k + 1);
+	}
+	return i;
+}
+
+/* Fold the journal into a fresh index, renamed over the old one */
+static void
+debug_store_close(void)
+{
+	ElfkillahDebugIndex hdr;
+	ElfkillahDebugRecord *recs, *tree;
+	struct stat jb, ib;
+	size_t n, old, i, j;
+	int fd;
+
+	if(flock(debug_pack_fd,LOCK_EX) == -1 || fstat(debug_journal_fd,&jb) == -1)
+		err_exit("debug_store_close() --> flock()\n");
+	if(jb.st_size == 0){
+		flock(debug_pack_fd,LOCK_UN);
+		return;
+	}
+
+	old = 0;
+	fd = openat(debug_dfd,"index",O_RDONLY);
+	if(fd != -1){
+		if(fstat(fd,&ib) == -1 || read(fd,&hdr,sizeof(hdr)) != sizeof(hdr)
+		   || hdr.magic != ELFKILLAH_DEBUG_MAGIC
+		   || ib.st_size != sizeof(hdr) + (off_t)hdr.count * sizeof(ElfkillahDebugRecord))
+			err_exit("debug_store_close() --> bad index\n");
+		old = hdr.count;
+	}
+
+	n = old + jb.st_size / sizeof(ElfkillahDebugRecord);
+	recs = (ElfkillahDebugRecord *)malloc((n + 1) * sizeof(ElfkillahDebugRecord));
+	tree = (ElfkillahDebugRecord *)malloc((n + 1) * sizeof(ElfkillahDebugRecord));
+	if(recs == NULL || tree == NULL)
+		err_exit("debug_store_close() --> malloc()\n");
+
+	if(fd != -1){
+		if(read(fd,recs,old * sizeof(*recs)) != (ssize_t)(old * sizeof(*recs)))
+			err_exit("debug_store_close() --> read()\n");
+		close(fd);
+	}
+	if(pread(debug_journal_fd,recs + old,(n - old) * sizeof(*recs),0) != (ssize_t)((n - old) * sizeof(*recs)))
+		err_exit("debug_store_close() --> pread()\n");
+
+	/* The newest record of a build-id wins */
+	for(i=0; i<n; i++)
+		recs[i].reserved = i;
+	qsort(recs,n,sizeof(*recs),debug_cmp);
+	for(i=0, j=0; i<n; i++){
+		if(i + 1 < n && recs[i + 1].id_len == recs[i].id_len
+		   && memcmp(recs[i + 1].id,recs[i].id,ELFKILLAH_BUILD_ID_MAX) == 0)
+			continue;
+		recs[j] = recs[i];
+		recs[j++].reserved = 0;
+	}
+	n = j;
+	debug_eytzinger(recs,tree,n,0,1);
+
+	hdr.magic = ELFKILLAH_DEBUG_MAGIC;
+	hdr.count = n;
+	hdr.reserved = 0;
+	fd = openat(debug_dfd,"index.new",O_CREAT|O_TRUNC|O_WRONLY,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if(fd == -1 || write_all(fd,(const char *)&hdr,sizeof(hdr)) == -1
+	   || write_all(fd,(const char *)tree,n * sizeof(*tree)) == -1 || fsync(fd) == -1)
+		err_exit("debug_store_close() --> write()\n");
+	close(fd);
+
+	if(renameat(debug_dfd,"index.new",debug_dfd,"index") == -1 || ftruncate(debug_journal_fd,0) == -1)
+		err_exit("debug_store_close() --> renameat()\n");
+	flock(debug_pack_fd,LOCK_UN);
+
+	free(tree);
+	free(recs);
+}
+
+static int
+hist_index(uint64_t value)
+{
+	int shift;
+
+	if(value < HIST_SUB_COUNT)
+		return value;
+
+	/* Position of the highest bit above the sub-bucket bits */
+	shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+
+	return ((shift + 1) << HIST_SUB_BITS)
+		+ ((value >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+static uint64_t
+hist_value(int index)
+{
+	int shift;
+	uint64_t low;
+
+	if(index < HIST_SUB_COUNT)
+		return index;
+
+	/* Report the highest value that falls into the bucket */
+	shift = (index >> HIST_SUB_BITS) - 1;
+	low = (uint64_t)(HIST_SUB_COUNT + (index & (HIST_SUB_COUNT - 1))) << shift;
+
+	return low + ((uint64_t)1 << shift) - 1;
+}
+
+static void
+hist_record(Histogram *h, uint64_t value)
+{
+	h->buckets[hist_index(value)]++;
+	h->count++;
+	if(value > h->max)
+		h->max = value;
+}
+
+static void
+hist_merge(Histogram *dst, const Histogram *src)
+{
+	int i;
+
+	for(i=0; i<HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+
+	dst->count += src->count;
+	if(src->max > dst->max)
+		dst->max = src->max;
+}
+
+static uint64_t
+hist_percentile(const Histogram *h, double q)
+{
+	uint64_t rank, seen;
+	int i;
+
+	rank = (uint64_t)(q * h->count + 0.5);
+	if(rank == 0)
+		rank = 1;
+
+	seen = 0;
+	for(i=0; i<HIST_BUCKETS; i++){
+		seen += h->buckets[i];
+		if(seen >= rank)
+			break;
+	}
+
+	if(i == HIST_BUCKETS || hist_value(i) > h->max)
+		return h->max;
+
+	return hist_value(i);
+}
+
+static int
+size_class(size_t size)
+{
+	int i;
+
+	for(i=0; i<SIZE_CLASSES - 1; i++)
+		if(size < size_class_limits[i])
+			break;
+
+	return i;
+}
+
+static void
+print_stats(const Stats *stats)
+{
+	const Histogram *h;
+	int i, j;
+
+	fprintf(stderr,"%-8s %-9s %10s %10s %10s %10s %10s %10s\n",
+		"size","stage","files","p50(us)","p90(us)","p99(us)","p99.9(us)","max(us)");
+
+	for(i=0; i<SIZE_CLASSES; i++){
+		for(j=0; j<STAGE_COUNT; j++){
+			h = &stats->hist[i][j];
+			if(h->count == 0)
+				continue;
+
+			fprintf(stderr,"%-8s %-9s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+				size_class_names[i],stage_names[j],
+				(unsigned long long)h->count,
+				hist_percentile(h,0.50) / 1e3,
+				hist_percentile(h,0.90) / 1e3,
+				hist_percentile(h,0.99) / 1e3,
+				hist_percentile(h,0.999) / 1e3,
+				h->max / 1e3);
+		}
+	}
+}
+
+static uint32_t
+le16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t
+le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void
+put16(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+#if defined(__x86_64__)
+/*
+  CRC-32 by carry-less multiplication, folding four 128 bit lanes at a
+  time ("Fast CRC Computation for Generic Polynomials Using PCLMULQDQ",
+  Intel, 2009), reflected constants for the zip polynomial. Takes the
+  inverted running crc and a multiple of 16 bytes, at least 64.
+*/
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t
+crc32_pclmul(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	static const uint64_t __attribute__((aligned(16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+	static const uint64_t __attribute__((aligned(16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+	static const uint64_t __attribute__((aligned(16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+	static const uint64_t __attribute__((aligned(16))) poly[] = { 0x01db710641, 0x01f7011641 };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1,_mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+	buf += 64;
+	len -= 64;
+
+	/* Fold 64 bytes per round into the four lanes */
+	while(len >= 64){
+		x5 = _mm_clmulepi64_si128(x1,x0,0x00);
+		x6 = _mm_clmulepi64_si128(x2,x0,0x00);
+		x7 = _mm_clmulepi64_si128(x3,x0,0x00);
+		x8 = _mm_clmulepi64_si128(x4,x0,0x00);
+		x1 = _mm_clmulepi64_si128(x1,x0,0x11);
+		x2 = _mm_clmulepi64_si128(x2,x0,0x11);
+		x3 = _mm_clmulepi64_si128(x3,x0,0x11);
+		x4 = _mm_clmulepi64_si128(x4,x0,0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1,x5),_mm_loadu_si128((const __m128i *)(buf + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2,x6),_mm_loadu_si128((const __m128i *)(buf + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3,x7),_mm_loadu_si128((const __m128i *)(buf + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4,x8),_mm_loadu_si128((const __m128i *)(buf + 0x30)));
+		buf += 64;
+		len -= 64;
+	}
+
+	/* Fold the lanes into one, then 16 bytes per round */
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+	x5 = _mm_clmulepi64_si128(x1,x0,0x00);
+	x1 = _mm_clmulepi64_si128(x1,x0,0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1,x2),x5);
+	x5 = _mm_clmulepi64_si128(x1,x0,0x00);
+	x1 = _mm_clmulepi64_si128(x1,x0,0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1,x3),x5);
+	x5 = _mm_clmulepi64_si128(x1,x0,0x00);
+	x1 = _mm_clmulepi64_si128(x1,x0,0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1,x4),x5);
+
+	while(len >= 16){
+		x2 = _mm_loadu_si128((const __m128i *)buf);
+		x5 = _mm_clmulepi64_si128(x1,x0,0x00);
+		x1 = _mm_clmulepi64_si128(x1,x0,0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1,x2),x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	/* 128 to 64 bits, 64 to 32 bits, then Barrett reduction */
+	x2 = _mm_clmulepi64_si128(x1,x0,0x10);
+	x3 = _mm_setr_epi32(~0,0,~0,0);
+	x1 = _mm_srli_si128(x1,8);
+	x1 = _mm_xor_si128(x1,x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+	x2 = _mm_srli_si128(x1,4);
+	x1 = _mm_and_si128(x1,x3);
+	x1 = _mm_clmulepi64_si128(x1,x0,0x00);
+	x1 = _mm_xor_si128(x1,x2);
+
+	x0 = _mm_load_si128((const __m128i *)poly);
+	x2 = _mm_and_si128(x1,x3);
+	x2 = _mm_clmulepi64_si128(x2,x0,0x10);
+	x2 = _mm_and_si128(x2,x3);
+	x2 = _mm_clmulepi64_si128(x2,x0,0x00);
+	x1 = _mm_xor_si128(x1,x2);
+
+	return _mm_extract_epi32(x1,1);
+}
+#endif
+
+/* zlib's crc32() semantics, carry-less multiplication where available */
+static uint32_t
+crc32_fast(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	size_t chunk;
+
+#if defined(__x86_64__)
+	if(len >= 64 && __builtin_cpu_supports("pclmul")){
+		chunk = len & ~(size_t)15;
+		crc = ~crc32_pclmul(~crc,buf,chunk);
+		buf += chunk;
+		len -= chunk;
+	}
+#endif
+
+	while(len > 0){
+		chunk = len > UINT_MAX ? UINT_MAX : len;
+		crc = crc32(crc,buf,chunk);
+		buf += chunk;
+		len -= chunk;
+	}
+
+	return crc;
+}
+
+static unsigned char *
+zip_deflate(const unsigned char *src, size_t len, size_t *out_len)
+{
+	z_stream zs;
+	unsigned char *out;
+	size_t bound;
+
+	memset(&zs,0,sizeof(zs));
+	if(deflateInit2(&zs,Z_DEFAULT_COMPRESSION,Z_DEFLATED,-MAX_WBITS,8,
+	   Z_DEFAULT_STRATEGY) != Z_OK)
+		err_exit("zip_deflate() --> deflateInit2()\n");
+
+	bound = deflateBound(&zs,len);
+	out = (unsigned char *)malloc(bound);
+	if(out == NULL)
+		err_exit("zip_deflate() --> malloc()\n");
+
+	zs.next_in = (Bytef *)src;
+	zs.avail_in = len;
+	zs.next_out = out;
+	zs.avail_out = bound;
+
+	if(deflate(&zs,Z_FINISH) != Z_STREAM_END)
+		err_exit("zip_deflate() --> deflate()\n");
+
+	*out_len = zs.total_out;
+	deflateEnd(&zs);
+
+	return out;
+}
+
+/*
+  Inflate a deflated entry. Only its identification bytes are inflated
+  before it is known to be an ELF file, so other entries cost neither
+  their size in memory nor a full decompression. Returns NULL for
+  anything that is not an ELF file or does not inflate to the size the
+  directory promised.
+*/
+static unsigned char *
+zip_inflate(const unsigned char *src, const ZipEntry *e)
+{
+	z_stream zs;
+	unsigned char ident[EI_NIDENT];
+	unsigned char *buf;
+	int ret;
+
+	memset(&zs,0,sizeof(zs));
+	if(inflateInit2(&zs,-MAX_WBITS) != Z_OK)
+		err_exit("zip_inflate() --> inflateInit2()\n");
+
+	zs.next_in = (Bytef *)src;
+	zs.avail_in = e->csize;
+	zs.next_out = ident;
+	zs.avail_out = EI_NIDENT;
+
+	ret = inflate(&zs,Z_SYNC_FLUSH);
+	if((ret != Z_OK && ret != Z_STREAM_END) || zs.total_out != EI_NIDENT
+	   || memcmp(ident,ELFMAG,SELFMAG) != 0){
+		inflateEnd(&zs);
+		return NULL;
+	}
+
+	buf = (unsigned char *)malloc(e->usize);
+	if(buf == NULL)
+		err_exit("zip_inflate() --> malloc()\n");
+	memcpy(buf,ident,EI_NIDENT);
+
+	zs.next_out = buf + EI_NIDENT;
+	zs.avail_out = e->usize - EI_NIDENT;
+	if(ret == Z_OK)
+		ret = inflate(&zs,Z_FINISH);
+
+	inflateEnd(&zs);
+
+	if(ret != Z_STREAM_END || zs.total_out != e->usize){
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/* Cut and patch one entry in memory, entries which are not ELF stay as they are */
+static void
+zip_strip_entry(ZipEntry *e, const unsigned char *base)
+{
+	ElfView view;
+	unsigned char *buf;
+	size_t cut;
+
+	if(e->method == ZIP_STORED){
+		if(elf_view(&view,base + e->data,e->usize) != NULL)
+			return;
+		cut = view_cut(&view);
+		buf = (unsigned char *)malloc(cut);
+		if(buf == NULL)
+			err_exit("zip_strip_entry() --> malloc()\n");
+		memcpy(buf,base + e->data,cut);
+	}else{
+		buf = zip_inflate(base + e->data,e);
+		if(buf == NULL)
+			return;
+		if(elf_view(&view,buf,e->usize) != NULL){
+			free(buf);
+			return;
+		}
+		cut = view_cut(&view);
+	}
+
+	e->zeroed = patch_image(buf,cut,&view);
+	e->out_usize = cut;
+	e->out_crc = crc32_fast(0,buf,cut);
+
+	if(e->method == ZIP_STORED){
+		e->out = buf;
+		e->out_csize = cut;
+	}else{
+		e->out = zip_deflate(buf,cut,&e->out_csize);
+		free(buf);
+	}
+}
+
+static void *
+zip_strip_range(void *arg)
+{
+	ZipJob *job;
+	size_t i;
+
+	job = (ZipJob *)arg;
+
+	while((i = __atomic_fetch_add(&job->next,1,__ATOMIC_RELAXED)) < job->ntodo)
+		zip_strip_entry(&job->entries[job->todo[i]],job->base);
+
+	return NULL;
+}
+
+/*
+  Length of the extra field without zipalign padding: the well formed
+  records in front, minus any previous alignment record.
+*/
+static size_t
+zip_clean_extra(unsigned char *dst, const unsigned char *extra, size_t len)
+{
+	size_t pos, n, rec;
+
+	pos = 0;
+	n = 0;
+	while(len - pos >= 4){
+		rec = 4 + le16(extra + pos + 2);
+		if(rec > len - pos)
+			break;
+		if(le16(extra + pos) != ZIP_ALIGN_TAG){
+			memmove(dst + n,extra + pos,rec);
+			n += rec;
+		}
+		pos += rec;
+	}
+
+	return n;
+}
+
+/*
+  Write the local header of an entry. Stored entries keep the alignment
+  their data had in the input (4 KiB for page aligned libraries, 4 for
+  zipalign'ed resources), padding the extra field like zipalign does.
+*/
+static void
+zip_write_local(FILE *out, const unsigned char *base, const ZipEntry *e, off_t pos)
+{
+	unsigned char hdr[ZIP_LOCAL_LEN], extra[0xffff];
+	const unsigned char *local, *name;
+	size_t name_len, extra_len, align, pad;
+
+	local = base + e->local;
+	name = local + ZIP_LOCAL_LEN;
+	name_len = le16(local + 26);
+	extra_len = le16(local + 28);
+
+	memcpy(hdr,local,ZIP_LOCAL_LEN);
+	if(e->out != NULL){
+		put16(hdr + 6,e->flags & ~ZIP_FLAG_DESCRIPTOR);
+		put32(hdr + 14,e->out_crc);
+		put32(hdr + 18,e->out_csize);
+		put32(hdr + 22,e->out_usize);
+	}
+
+	memcpy(extra,name + name_len,extra_len);
+	if(e->method == ZIP_STORED){
+		align = e->data % 4096 == 0 ? 4096 : e->data % 4 == 0 ? 4 : 1;
+		extra_len = zip_clean_extra(extra,extra,extra_len);
+		pad = (align - (pos + ZIP_LOCAL_LEN + name_len + extra_len) % align) % align;
+		if(extra_len + pad > sizeof(extra))
+			pad = 0;
+		memset(extra + extra_len,0,pad);
+		extra_len += pad;
+	}
+	put16(hdr + 28,extra_len);
+
+	fwrite(hdr,1,ZIP_LOCAL_LEN,out);
+	fwrite(name,1,name_len,out);
+	fwrite(extra,1,extra_len,out);
+}
+
+/* Events, records and statistics of a file, from its stage timestamps */
+static void
+process_done(Worker *w, const uint64_t *ts)
+{
+	uint64_t lat[STAGE_COUNT];
+	int i, class;
+
+	if(opt_events && events_emit(w,0,NULL) == -1)
+		err_exit("process_file() --> events_emit()\n");
+	w->cur.in_file = NULL;
+
+	lat[STAGE_TOTAL] = ts[5] - ts[0];
+	lat[STAGE_MAP] = (ts[1] - ts[0]) + (ts[3] - ts[2]);
+	lat[STAGE_WRITE] = ts[2] - ts[1];
+	lat[STAGE_PATCH] = ts[4] - ts[3];
+	lat[STAGE_UNMAP] = ts[5] - ts[4];
+
+	if(opt_record != NULL && record_emit(w,lat) == -1)
+		err_exit("process_file() --> record_emit()\n");
+	if(w->live != NULL)
+		memcpy(w->lat,lat,sizeof(lat));
+
+	if(w->stats == NULL)
+		return;
+
+	class = size_class(w->cur.size);
+	for(i=0; i<STAGE_COUNT; i++)
+		hist_record(&w->stats->hist[class][i],lat[i]);
+}
+
+/*
+  A cache hit has nothing to map or patch: the lookup counts as the
+  map stage, writing the result as the write stage.
+*/
+static int
+process_cached(Worker *w, const char *in_file, const char *out_file, uint64_t *ts,
+	       CacheKey *key, size_t *index)
+{
+	CacheSlot meta;
+	struct stat sb;
+	int claim;
+
+	if(stat(in_file,&sb) == -1)
+		return CACHE_BYPASS;
+
+	memset(key,0,sizeof(*key));
+	key->dev = sb.st_dev;
+	key->ino = sb.st_ino;
+	key->size = sb.st_size;
+	key->mtime = (uint64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+	key->ctime = (uint64_t)sb.st_ctim.tv_sec * 1000000000 + sb.st_ctim.tv_nsec;
+
+	memset(&meta,0,sizeof(meta));
+	claim = cache_claim(key,&meta,index);
+	if(claim != CACHE_HIT)
+		return claim;
+
+	ts[1] = now_ns();
+	w->cur.engine = cache_fetch(&meta,out_file);
+	if(w->cur.engine == NULL)
+		return CACHE_BYPASS;
+
+	w->cur.size = sb.st_size;
+	w->cur.shoff = meta.shoff;
+	w->cur.strtbloff = meta.strtbloff;
+	w->cur.strtblsize = strtbl_cleared(meta.strtbloff,meta.strtblsize,meta.cut);
+	w->cur.type = meta.type;
+	w->cur.truncated = sb.st_size - meta.cut;
+
+	ts[2] = ts[3] = ts[4] = ts[5] = now_ns();
+	process_done(w,ts);
+
+	return CACHE_HIT;
+}
+
+static void
+process_file(Worker *w, const char *in_file, const char *out_file)
+{
+	ElfContainer *elfc_in, *elfc_out;
+	CacheKey key;
+	uint64_t ts[6];
+	size_t size, index;
+	int claim;
+
+	errno = 0;
+	ts[0] = now_ns();
+	index = 0;
+
+	memset(&w->cur,0,sizeof(Event));
+	w->cur.in_file = in_file;
+	w->cur.out_file = out_file;
+	w->cur.start = ts[0];
+
+	claim = cache != NULL ? process_cached(w,in_file,out_file,ts,&key,&index) : CACHE_BYPASS;
+	if(claim == CACHE_HIT){
+		if(opt_debug_store != NULL)
+			debug_keep_file(in_file);
+		return;
+	}
+
+	elfc_in = build_container(in_file,0);
+	get_string_table(elfc_in);
+	size = elfc_in->size;
+
+	w->cur.size = size;
+	w->cur.strtbloff = elfc_in->view.strtbloff;
+	w->cur.shoff = elfc_in->view.shoff;
+	w->cur.type = elfc_in->view.type;
+	w->cur.truncated = size - view_cut(&elfc_in->view);
+
+	ts[1] = now_ns();
+	w->cur.engine = write_elf(&elfc_in->view,out_file);
+	if(opt_debug_store != NULL)
+		debug_keep(&elfc_in->view);
+
+	/* The section headers are gone from the output, take them from the input */
+	ts[2] = now_ns();
+	elfc_out = build_container(out_file,1);
+
+	ts[3] = now_ns();
+	w->cur.strtblsize = adjust_header(elfc_out,&elfc_in->view);
+
+	/* Publishing to the cache counts as unmapping */
+	ts[4] = now_ns();
+	destroy_container(elfc_out);
+	if(claim == CACHE_MISS)
+		cache_fill(index,&key,out_file,&elfc_in->view);
+	destroy_container(elfc_in);
+
+	ts[5] = now_ns();
+	process_done(w,ts);
+}
+
+/*
+  Strip the ELF entries of a ZIP, APK or JAR archive. Entries which are
+  not ELF files are copied raw, compressed data included; the ELF ones
+  are inflated, cut, patched and deflated again by up to copy-threads
+  threads. Anything between the last entry and the central directory,
+  an APK signing block for instance, is dropped: signed archives have
+  to be signed again.
+*/
+static void
+process_zip(Worker *w, const char *in_file, const char *out_file)
+{
+	ZipJob job;
+	ZipEntry *entries, *e;
+	pthread_t tids[COPY_MAX_THREADS];
+	unsigned char central[ZIP_CENTRAL_LEN];
+	const unsigned char *base, *eocd;
+	size_t size, off, count, cdoff, cdsize, cdend, pos, desc, i;
+	off_t *locals, cdstart, cdstop;
+	FILE *out;
+	struct stat sb;
+	int fd, n;
+
+	errno = 0;
+	memset(&w->cur,0,sizeof(Event));
+	w->cur.in_file = in_file;
+	w->cur.out_file = out_file;
+	w->cur.engine = "zip";
+	w->cur.start = now_ns();
+
+	fd = open(in_file,O_RDONLY);
+	if(fd == -1)
+		err_exit("process_zip() --> open(%s)\n",in_file);
+	if(fstat(fd,&sb) == -1)
+		err_exit("process_zip() --> fstat()\n");
+
+	size = sb.st_size;
+	if(size < ZIP_END_LEN)
+		err_exit("process_zip() --> bad zip\n");
+
+	base = (const unsigned char *)mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+	if(base == MAP_FAILED)
+		err_exit("process_zip() --> mmap()\n");
+	close(fd);
+	w->cur.size = size;
+
+	/* The end record sits in front of a comment of up to 64 KiB */
+	for(off = size - ZIP_END_LEN; ; off--){
+		if(le32(base + off) == ZIP_END_SIG
+		   && off + ZIP_END_LEN + le16(base + off + 20) == size)
+			break;
+		if(off == 0 || size - off >= ZIP_END_LEN + 0xffff)
+			err_exit("process_zip() --> bad zip\n");
+	}
+
+	eocd = base + off;
+	count = le16(eocd + 10);
+	cdsize = le32(eocd + 12);
+	cdoff = le32(eocd + 16);
+
+	if(le16(eocd + 4) != 0 || le16(eocd + 6) != 0 || le16(eocd + 8) != count)
+		err_exit("process_zip() --> multi-disk zip\n");
+	if(count == 0xffff || cdsize == 0xffffffff || cdoff == 0xffffffff)
+		err_exit("process_zip() --> zip64 not supported\n");
+	if(!in_bounds(cdoff,cdsize,off))
+		err_exit("process_zip() --> bad central directory\n");
+
+	entries = (ZipEntry *)calloc(count + 1,sizeof(ZipEntry));
+	locals = (off_t *)malloc((count + 1) * sizeof(off_t));
+	job.todo = (size_t *)malloc((count + 1) * sizeof(size_t));
+	if(entries == NULL || locals == NULL || job.todo == NULL)
+		err_exit("process_zip() --> malloc()\n");
+
+	job.base = base;
+	job.entries = entries;
+	job.ntodo = 0;
+	job.next = 0;
+
+	pos = cdoff;
+	cdend = cdoff + cdsize;
+	for(i=0; i<count; i++){
+		e = &entries[i];
+
+		if(!in_bounds(pos,ZIP_CENTRAL_LEN,cdend) || le32(base + pos) != ZIP_CENTRAL_SIG)
+			err_exit("process_zip() --> bad central directory\n");
+
+		e->central = pos;
+		e->central_len = ZIP_CENTRAL_LEN + le16(base + pos + 28)
+			+ le16(base + pos + 30) + le16(base + pos + 32);
+		if(!in_bounds(pos,e->central_len,cdend))
+			err_exit("process_zip() --> bad central directory\n");
+
+		e->flags = le16(base + pos + 8);
+		e->method = le16(base + pos + 10);
+		e->crc = le32(base + pos + 16);
+		e->csize = le32(base + pos + 20);
+		e->usize = le32(base + pos + 24);
+		e->local = le32(base + pos + 42);
+		if(e->csize == 0xffffffff || e->usize == 0xffffffff || e->local == 0xffffffff)
+			err_exit("process_zip() --> zip64 not supported\n");
+
+		if(!in_bounds(e->local,ZIP_LOCAL_LEN,cdoff)
+		   || le32(base + e->local) != ZIP_LOCAL_SIG)
+			err_exit("process_zip() --> bad local header\n");
+
+		e->data = e->local + ZIP_LOCAL_LEN + le16(base + e->local + 26)
+			+ le16(base + e->local + 28);
+		if(!in_bounds(e->data,e->csize,cdoff))
+			err_exit("process_zip() --> bad local header\n");
+
+		e->end = e->data + e->csize;
+		if(e->flags & ZIP_FLAG_DESCRIPTOR){
+			desc = in_bounds(e->end,4,cdoff) && le32(base + e->end) == ZIP_DESC_SIG ? 16 : 12;
+			if(!in_bounds(e->end,desc,cdoff))
+				err_exit("process_zip() --> bad data descriptor\n");
+			e->end += desc;
+		}
+
+		pos += e->central_len;
+
+		if(e->flags & ZIP_FLAG_ENCRYPTED || e->usize < EI_NIDENT)
+			continue;
+
+		/* A stored entry is viewed in place, it has to hold what it claims */
+		if(e->method == ZIP_STORED && e->usize != e->csize)
+			err_exit("process_zip() --> bad stored entry\n");
+		if(e->method == ZIP_STORED && memcmp(base + e->data,ELFMAG,SELFMAG) == 0)
+			job.todo[job.ntodo++] = i;
+		else if(e->method == ZIP_DEFLATED)
+			job.todo[job.ntodo++] = i;
+	}
+
+	/* ELF entries are stripped and deflated concurrently */
+	n = opt_copy_threads < job.ntodo ? opt_copy_threads : job.ntodo;
+	for(i=0; i+1<n; i++)
+		if(pthread_create(&tids[i],NULL,zip_strip_range,&job) != 0)
+			err_exit("process_zip() --> pthread_create()\n");
+
+	zip_strip_range(&job);
+
+	for(i=0; i+1<n; i++)
+		pthread_join(tids[i],NULL);
+
+	fd = open(out_file,O_CREAT|O_WRONLY|O_TRUNC,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if(fd == -1 || (out = fdopen(fd,"w")) == NULL)
+		err_exit("process_zip() --> open(%s)\n",out_file);
+	setvbuf(out,NULL,_IOFBF,1 << 20);
+
+	for(i=0; i<count; i++){
+		e = &entries[i];
+		locals[i] = ftello(out);
+
+		if(e->out == NULL && e->method != ZIP_STORED){
+			fwrite(base + e->local,1,e->end - e->local,out);
+			continue;
+		}
+
+		zip_write_local(out,base,e,locals[i]);
+		if(e->out != NULL){
+			fwrite(e->out,1,e->out_csize,out);
+			w->cur.strtblsize += e->zeroed;
+			free(e->out);
+		}else
+			fwrite(base + e->data,1,e->end - e->data,out);
+	}
+
+	cdstart = ftello(out);
+	for(i=0; i<count; i++){
+		e = &entries[i];
+
+		memcpy(central,base + e->central,ZIP_CENTRAL_LEN);
+		if(e->out != NULL){
+			put16(central + 8,e->flags & ~ZIP_FLAG_DESCRIPTOR);
+			put32(central + 16,e->out_crc);
+			put32(central + 20,e->out_csize);
+			put32(central + 24,e->out_usize);
+		}
+		put32(central + 42,locals[i]);
+
+		fwrite(central,1,ZIP_CENTRAL_LEN,out);
+		fwrite(base + e->central + ZIP_CENTRAL_LEN,1,e->central_len - ZIP_CENTRAL_LEN,out);
+	}
+
+	cdstop = ftello(out);
+	if(cdstop > 0xffffffff)
+		err_exit("process_zip() --> output needs zip64\n");
+
+	memcpy(central,eocd,ZIP_END_LEN);
+	put32(central + 12,cdstop - cdstart);
+	put32(central + 16,cdstart);
+	fwrite(central,1,ZIP_END_LEN,out);
+	fwrite(eocd + ZIP_END_LEN,1,size - off - ZIP_END_LEN,out);
+
+	if(ferror(out) || fclose(out) != 0)
+		err_exit("process_zip() --> write()\n");
+
+	/* Entries padded for alignment can make the output the larger one */
+	pos = cdstop + (size - off);
+	w->cur.truncated = pos < size ? size - pos : 0;
+
+	munmap((void *)base,size);
+	free(job.todo);
+	free(locals);
+	free(entries);
+
+	if(opt_events && events_emit(w,0,NULL) == -1)
+		err_exit("process_zip() --> events_emit()\n");
+	w->cur.in_file = NULL;
+
+	if(w->stats != NULL)
+		hist_record(&w->stats->hist[size_class(size)][STAGE_TOTAL],now_ns() - w->cur.start);
+}
+
+static uint32_t
+be32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void
+putbe32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint64_t
+be64(const unsigned char *p)
+{
+	return (uint64_t)be32(p) << 32 | be32(p + 4);
+}
+
+static void
+putbe64(unsigned char *p, uint64_t v)
+{
+	putbe32(p,v >> 32);
+	putbe32(p + 4,v);
+}
+
+static const uint32_t md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+	0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+	0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+	0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+	0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+	0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+	0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+	0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+	0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned char md5_r[16] = {
+	7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21
+};
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROL32(x,n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROR32(x,n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+md5_block(uint32_t *h, const unsigned char *p)
+{
+	uint32_t w[16], a, b, c, d, f, t;
+	int i, g;
+
+	for(i=0; i<16; i++)
+		w[i] = le32(p + 4 * i);
+
+	a = h[0];
+	b = h[1];
+	c = h[2];
+	d = h[3];
+
+	for(i=0; i<64; i++){
+		if(i < 16){
+			f = (b & c) | (~b & d);
+			g = i;
+		}else if(i < 32){
+			f = (d & b) | (~d & c);
+			g = (5 * i + 1) & 15;
+		}else if(i < 48){
+			f = b ^ c ^ d;
+			g = (3 * i + 5) & 15;
+		}else{
+			f = c ^ (b | ~d);
+			g = (7 * i) & 15;
+		}
+		t = d;
+		d = c;
+		c = b;
+		b += ROL32(a + f + md5_k[i] + w[g],md5_r[(i >> 4) * 4 + (i & 3)]);
+		a = t;
+	}
+
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+}
+
+static void
+sha256_block(uint32_t *h, const unsigned char *p)
+{
+	uint32_t w[64], v[8], s0, s1, t1, t2;
+	int i;
+
+	for(i=0; i<16; i++)
+		w[i] = be32(p + 4 * i);
+	for(i=16; i<64; i++){
+		s0 = ROR32(w[i - 15],7) ^ ROR32(w[i - 15],18) ^ (w[i - 15] >> 3);
+		s1 = ROR32(w[i - 2],17) ^ ROR32(w[i - 2],19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	memcpy(v,h,sizeof(v));
+
+	for(i=0; i<64; i++){
+		t1 = v[7] + (ROR32(v[4],6) ^ ROR32(v[4],11) ^ ROR32(v[4],25))
+			+ ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[i] + w[i];
+		t2 = (ROR32(v[0],2) ^ ROR32(v[0],13) ^ ROR32(v[0],22))
+			+ ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+		memmove(v + 1,v,7 * sizeof(uint32_t));
+		v[4] += t1;
+		v[0] = t1 + t2;
+	}
+
+	for(i=0; i<8; i++)
+		h[i] += v[i];
+}
+
+static void
+digest_init(Digest *d, int algo)
+{
+	static const uint32_t md5_iv[4] = {
+		0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476
+	};
+	static const uint32_t sha256_iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	d->algo = algo;
+	d->len = 0;
+	if(algo == DIGEST_MD5)
+		memcpy(d->h,md5_iv,sizeof(md5_iv));
+	else
+		memcpy(d->h,sha256_iv,sizeof(sha256_iv));
+}
+
+static void
+digest_update(Digest *d, const void *data, size_t len)
+{
+	const unsigned char *p;
+	size_t used, n;
+
+	p = (const unsigned char *)data;
+	used = d->len % 64;
+	d->len += len;
+
+	while(len > 0){
+		if(used == 0 && len >= 64){
+			if(d->algo == DIGEST_MD5)
+				md5_block(d->h,p);
+			else
+				sha256_block(d->h,p);
+			p += 64;
+			len -= 64;
+			continue;
+		}
+
+		n = 64 - used < len ? 64 - used : len;
+		memcpy(d->buf + used,p,n);
+		used += n;
+		p += n;
+		len -= n;
+
+		if(used == 64){
+			if(d->algo == DIGEST_MD5)
+				md5_block(d->h,d->buf);
+			else
+				sha256_block(d->h,d->buf);
+			used = 0;
+		}
+	}
+}
+
+/* Finish a digest into out, as hex into hex if that is not NULL */
+static size_t
+digest_final(Digest *d, unsigned char *out, char *hex)
+{
+	static const char digits[] = "0123456789abcdef";
+	unsigned char pad[72];
+	uint64_t bits;
+	size_t n, i;
+
+	bits = d->len * 8;
+	n = 64 - (d->len + 8) % 64;
+	memset(pad,0,sizeof(pad));
+	pad[0] = 0x80;
+
+	for(i=0; i<8; i++){
+		if(d->algo == DIGEST_MD5)
+			pad[n + i] = bits >> (8 * i);
+		else
+			pad[n + i] = bits >> (56 - 8 * i);
+	}
+	digest_update(d,pad,n + 8);
+
+	if(d->algo == DIGEST_MD5){
+		for(i=0; i<4; i++)
+			put32(out + 4 * i,d->h[i]);
+		n = 16;
+	}else{
+		for(i=0; i<8; i++)
+			putbe32(out + 4 * i,d->h[i]);
+		n = 32;
+	}
+
+	if(hex != NULL){
+		for(i=0; i<n; i++){
+			hex[2 * i] = digits[out[i] >> 4];
+			hex[2 * i + 1] = digits[out[i] & 15];
+		}
+		hex[2 * n] = '\0';
+	}
+
+	return n;
+}
+
+/* Host and port of a remote given as [http://]host[:port][/] */
+static void
+remote_parse(const char *spec)
+{
+	char *colon, *slash;
+
+	if(strncmp(spec,"http://",7) == 0)
+		spec += 7;
+	remote.host = strdup(spec);
+	if(remote.host == NULL)
+		err_exit("remote_parse() --> strdup()\n");
+
+	slash = strchr(remote.host,'/');
+	if(slash != NULL)
+		*slash = '\0';
+	colon = strrchr(remote.host,':');
+	remote.port = "8080";
+	if(colon != NULL){
+		*colon = '\0';
+		remote.port = colon + 1;
+	}
+	if(*remote.host == '\0' || *remote.port == '\0')
+		err_exit("remote_parse() --> bad remote %s\n",spec);
+}
+
+static int
+http_connect(HttpConn *c, const char *host, const char *port)
+{
+	struct addrinfo hints, *res, *ai;
+	int one;
+
+	memset(&hints,0,sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(host,port,&hints,&res) != 0)
+		return -1;
+
+	c->fd = -1;
+	for(ai=res; ai != NULL && c->fd == -1; ai=ai->ai_next){
+		c->fd = socket(ai->ai_family,ai->ai_socktype | SOCK_CLOEXEC,ai->ai_protocol);
+		if(c->fd != -1 && connect(c->fd,ai->ai_addr,ai->ai_addrlen) == -1){
+			close(c->fd);
+			c->fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	if(c->fd == -1)
+		return -1;
+
+	one = 1;
+	setsockopt(c->fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+	c->len = 0;
+	c->pos = 0;
+
+	return 0;
+}
+
+static void
+http_close(HttpConn *c)
+{
+	if(c->fd != -1)
+		close(c->fd);
+	c->fd = -1;
+}
+
+/* One header line without its CRLF, -1 on a broken connection */
+static int
+http_line(HttpConn *c, char *line, size_t max)
+{
+	size_t n;
+	ssize_t got;
+	char ch;
+
+	for(n=0; ; ){
+		if(c->pos == c->len){
+			got = read(c->fd,c->buf,sizeof(c->buf));
+			if(got == -1 && errno == EINTR)
+				continue;
+			if(got <= 0)
+				return -1;
+			c->len = got;
+			c->pos = 0;
+		}
+		ch = c->buf[c->pos++];
+		if(ch == '\n')
+			break;
+		if(n + 1 >= max)
+			return -1;
+		line[n++] = ch;
+	}
+	if(n > 0 && line[n - 1] == '\r')
+		n--;
+	line[n] = '\0';
+
+	return 0;
+}
+
+/* Status and body length of the next response; chunked bodies are refused */
+static int
+http_response(HttpConn *c, int *status, size_t *length)
+{
+	char line[512];
+
+	if(http_line(c,line,sizeof(line)) == -1 || sscanf(line,"HTTP/1.%*d %d",status) != 1)
+		return -1;
+
+	*length = 0;
+	for(;;){
+		if(http_line(c,line,sizeof(line)) == -1)
+			return -1;
+		if(line[0] == '\0')
+			return 0;
+		if(strncasecmp(line,"Content-Length:",15) == 0)
+			*length = strtoull(line + 15,NULL,10);
+		else if(strncasecmp(line,"Transfer-Encoding:",18) == 0)
+			return -1;
+	}
+}
+
+/* Move a body of len bytes to fd, or drop it with fd -1 */
+static int
+http_body(HttpConn *c, size_t len, int fd)
+{
+	size_t n;
+	ssize_t got;
+
+	while(len > 0){
+		if(c->pos == c->len){
+			got = read(c->fd,c->buf,sizeof(c->buf));
+			if(got == -1 && errno == EINTR)
+				continue;
+			if(got <= 0)
+				return -1;
+			c->len = got;
+			c->pos = 0;
+		}
+		n = c->len - c->pos < len ? c->len - c->pos : len;
+		if(fd != -1 && write_all(fd,c->buf + c->pos,n) == -1)
+			err_exit("http_body() --> write()\n");
+		c->pos += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+  Everything not looked up yet misses, without a digest to upload under.
+  The job at the head is the receiver's to settle: it may be writing
+  that output still.
+*/
+static void
+remote_fail(const char *what)
+{
+	size_t i, held;
+
+	pthread_mutex_lock(&remote.lock);
+	if(!remote.failed){
+		fprintf(stderr,"remote %s:%s: %s, going on without it\n",remote.host,remote.port,what);
+		remote.failed = 1;
+		if(remote.get.fd != -1)
+			shutdown(remote.get.fd,SHUT_RDWR);
+	}
+	held = remote.head < remote.tail ? remote.fifo[remote.head % REMOTE_AHEAD] : SIZE_MAX;
+	for(i=0; i<njobs; i++)
+		if(remote.state[i] == REMOTE_PENDING && i != held)
+			remote.state[i] = REMOTE_SKIP;
+	pthread_cond_broadcast(&remote.cond);
+	pthread_mutex_unlock(&remote.lock);
+}
+
+static int
+remote_digest(const char *in_file, unsigned char *md, char *hex, size_t *size)
+{
+	Digest d;
+	struct stat sb;
+	void *ptr;
+	int fd;
+
+	fd = open(in_file,O_RDONLY);
+	if(fd == -1)
+		return -1;
+	if(fstat(fd,&sb) == -1 || sb.st_size == 0){
+		close(fd);
+		return -1;
+	}
+	ptr = mmap(NULL,sb.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if(ptr == MAP_FAILED)
+		return -1;
+	madvise(ptr,sb.st_size,MADV_SEQUENTIAL);
+
+	digest_init(&d,DIGEST_SHA256);
+	digest_update(&d,REMOTE_SALT,strlen(REMOTE_SALT));
+	digest_update(&d,ptr,sb.st_size);
+	digest_final(&d,md,hex);
+	munmap(ptr,sb.st_size);
+	*size = sb.st_size;
+
+	return 0;
+}
+
+/*
+  Hash the inputs in job order and send a GET for each, up to
+  REMOTE_AHEAD of them waiting for their response at a time.
+*/
+static void *
+remote_hasher(void *arg)
+{
+	char req[512], hex[2 * DIGEST_MAX_LEN + 1];
+	size_t job;
+	int len;
+
+	(void)arg;
+	for(job=0; job<njobs; job++){
+		if(remote_digest(jobs[2 * job],remote.digest[job],hex,&remote.size[job]) == -1){
+			pthread_mutex_lock(&remote.lock);
+			remote.state[job] = REMOTE_SKIP;
+			pthread_cond_broadcast(&remote.cond);
+			pthread_mutex_unlock(&remote.lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&remote.lock);
+		while(remote.tail - remote.head == REMOTE_AHEAD && !remote.failed)
+			pthread_cond_wait(&remote.cond,&remote.lock);
+		if(remote.failed){
+			pthread_mutex_unlock(&remote.lock);
+			break;
+		}
+		remote.fifo[remote.tail++ % REMOTE_AHEAD] = job;
+		pthread_cond_broadcast(&remote.cond);
+		pthread_mutex_unlock(&remote.lock);
+
+		len = snprintf(req,sizeof(req),"GET /ac/%s HTTP/1.1\r\nHost: %s\r\n\r\n",hex,remote.host);
+		if(write_all(remote.get.fd,req,len) == -1){
+			remote_fail("lookup failed");
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&remote.lock);
+	remote.hashed = 1;
+	pthread_cond_broadcast(&remote.cond);
+	pthread_mutex_unlock(&remote.lock);
+
+	return NULL;
+}
+
+/*
+  Responses come back in request order; hits go straight to their
+  outputs. A hit longer than its input or without an ELF header is not
+  one: the output is stripped again, over whatever was written.
+*/
+static void *
+remote_receiver(void *arg)
+{
+	unsigned char id[SELFMAG];
+	size_t job, length;
+	int status, fd, state;
+
+	(void)arg;
+	for(;;){
+		pthread_mutex_lock(&remote.lock);
+		while(remote.head == remote.tail && !remote.hashed && !remote.failed)
+			pthread_cond_wait(&remote.cond,&remote.lock);
+		if(remote.head == remote.tail || remote.failed){
+			pthread_mutex_unlock(&remote.lock);
+			break;
+		}
+		job = remote.fifo[remote.head % REMOTE_AHEAD];
+		pthread_mutex_unlock(&remote.lock);
+
+		if(http_response(&remote.get,&status,&length) == -1){
+			remote_fail("bad response");
+			break;
+		}
+
+		fd = -1;
+		state = REMOTE_MISS;
+		if(status == 200 && length >= SELFMAG && length <= remote.size[job]){
+			fd = open(jobs[2 * job + 1],O_CREAT|O_RDWR|O_TRUNC,S_IRWXU|S_IRGRP|S_IWGRP);
+			if(fd == -1)
+				err_exit("remote_receiver() --> open(%s)\n",jobs[2 * job + 1]);
+			remote.cut[job] = length;
+			state = REMOTE_HIT;
+		}
+		if(http_body(&remote.get,length,fd) == -1){
+			if(fd != -1)
+				close(fd);
+			remote_fail("connection lost");
+			break;
+		}
+		if(fd != -1){
+			if(pread(fd,id,SELFMAG,0) != SELFMAG || memcmp(id,ELFMAG,SELFMAG) != 0)
+				state = REMOTE_MISS;
+			close(fd);
+		}
+
+		pthread_mutex_lock(&remote.lock);
+		remote.state[job] = state;
+		remote.head++;
+		pthread_cond_broadcast(&remote.cond);
+		pthread_mutex_unlock(&remote.lock);
+	}
+
+	/* Leaving with a job in hand, nothing writes its output any more */
+	pthread_mutex_lock(&remote.lock);
+	if(remote.head < remote.tail && remote.state[remote.fifo[remote.head % REMOTE_AHEAD]] == REMOTE_PENDING)
+		remote.state[remote.fifo[remote.head % REMOTE_AHEAD]] = REMOTE_SKIP;
+	pthread_cond_broadcast(&remote.cond);
+	pthread_mutex_unlock(&remote.lock);
+
+	return NULL;
+}
+
+static void
+remote_start(void)
+{
+	remote.state = (unsigned char *)calloc(njobs,1);
+	remote.digest = (unsigned char (*)[DIGEST_MAX_LEN])malloc(njobs * DIGEST_MAX_LEN);
+	remote.size = (size_t *)malloc(njobs * sizeof(size_t));
+	remote.cut = (size_t *)malloc(njobs * sizeof(size_t));
+	if(remote.state == NULL || remote.digest == NULL || remote.size == NULL || remote.cut == NULL)
+		err_exit("remote_start() --> malloc()\n");
+	pthread_mutex_init(&remote.lock,NULL);
+	pthread_cond_init(&remote.cond,NULL);
+
+	/* A server hanging up must not take the run down */
+	signal(SIGPIPE,SIG_IGN);
+
+	if(http_connect(&remote.get,remote.host,remote.port) == -1){
+		remote.get.fd = -1;
+		remote_fail("cannot connect");
+		return;
+	}
+
+	if(pthread_create(&remote.hasher,NULL,remote_hasher,NULL) != 0
+	   || pthread_create(&remote.receiver,NULL,remote_receiver,NULL) != 0)
+		err_exit("remote_start() --> pthread_create()\n");
+	remote.running = 1;
+}
+
+static void
+remote_stop(void)
+{
+	if(remote.running){
+		pthread_join(remote.hasher,NULL);
+		pthread_join(remote.receiver,NULL);
+	}
+	http_close(&remote.get);
+}
+
+/*
+  Wait for the lookup of a job; on a hit its output is already written,
+  so what is left is reporting it. Waiting counts as the map stage.
+*/
+static int
+process_remote(Worker *w, size_t job)
+{
+	unsigned char id[EI_NIDENT];
+	uint64_t ts[6];
+	struct stat sb;
+	int state, fd;
+
+	ts[0] = now_ns();
+	pthread_mutex_lock(&remote.lock);
+	while((state = remote.state[job]) == REMOTE_PENDING)
+		pthread_cond_wait(&remote.cond,&remote.lock);
+	pthread_mutex_unlock(&remote.lock);
+
+	if(state != REMOTE_HIT)
+		return 0;
+
+	memset(&w->cur,0,sizeof(Event));
+	w->cur.in_file = jobs[2 * job];
+	w->cur.out_file = jobs[2 * job + 1];
+	w->cur.start = ts[0];
+	w->cur.engine = "remote";
+	if(stat(w->cur.in_file,&sb) == 0)
+		w->cur.size = sb.st_size;
+	w->cur.shoff = remote.cut[job] + 1;
+	w->cur.truncated = w->cur.size - remote.cut[job];
+
+	/* The layout beyond the cut is not kept remotely, the class is */
+	fd = open(w->cur.out_file,O_RDONLY);
+	if(fd != -1 && pread(fd,id,EI_NIDENT,0) == EI_NIDENT)
+		w->cur.type = id[EI_CLASS];
+	if(fd != -1)
+		close(fd);
+	if(opt_debug_store != NULL)
+		debug_keep_file(w->cur.in_file);
+
+	ts[1] = ts[2] = ts[3] = ts[4] = ts[5] = now_ns();
+	process_done(w,ts);
+
+	return 1;
+}
+
+/* Upload a fresh result; failures only cost the upload */
+static void
+remote_put(Worker *w, size_t job)
+{
+	char req[512], hex[2 * DIGEST_MAX_LEN + 1];
+	static const char digits[] = "0123456789abcdef";
+	struct stat sb;
+	size_t length, i;
+	off_t off;
+	ssize_t sent;
+	int fd, len, status, ok;
+
+	if(remote.state[job] != REMOTE_MISS || remote.failed)
+		return;
+
+	if(w->put == NULL){
+		w->put = (HttpConn *)malloc(sizeof(HttpConn));
+		if(w->put == NULL)
+			err_exit("remote_put() --> malloc()\n");
+		w->put->fd = -1;
+	}
+	if(w->put->fd == -1 && http_connect(w->put,remote.host,remote.port) == -1)
+		return;
+
+	fd = open(jobs[2 * job + 1],O_RDONLY);
+	if(fd == -1)
+		return;
+	if(fstat(fd,&sb) == -1){
+		close(fd);
+		return;
+	}
+
+	for(i=0; i<DIGEST_MAX_LEN; i++){
+		hex[2 * i] = digits[remote.digest[job][i] >> 4];
+		hex[2 * i + 1] = digits[remote.digest[job][i] & 15];
+	}
+	hex[2 * DIGEST_MAX_LEN] = '\0';
+
+	len = snprintf(req,sizeof(req),"PUT /ac/%s HTTP/1.1\r\nHost: %s\r\n"
+		"Content-Length: %llu\r\n\r\n",hex,remote.host,(unsigned long long)sb.st_size);
+	ok = write_all(w->put->fd,req,len) == 0;
+	for(off=0; ok && off < sb.st_size; ){
+		sent = sendfile(w->put->fd,fd,&off,sb.st_size - off);
+		if(sent == -1 && errno == EINTR)
+			continue;
+		ok = sent > 0;
+	}
+	close(fd);
+
+	if(!ok || http_response(w->put,&status,&length) == -1 || http_body(w->put,length,-1) == -1)
+		http_close(w->put);
+}
+
+/* <url> is [http://]host[:port]/bucket[/prefix]; credentials from the environment */
+static void
+s3_parse(const char *url)
+{
+	char *colon, *slash, *spec;
+	size_t len;
+
+	if(strncmp(url,"http://",7) == 0)
+		url += 7;
+	else if(strstr(url,"://") != NULL)
+		err_exit("s3_parse() --> only http:// is spoken: %s\n",url);
+
+	spec = strdup(url);
+	s3.host = spec;
+	slash = spec != NULL ? strchr(spec,'/') : NULL;
+	if(slash == NULL || slash[1] == '\0' || slash == spec)
+		err_exit("s3_parse() --> no bucket in %s\n",url);
+
+	len = strlen(slash);
+	while(len > 1 && slash[len - 1] == '/')
+		slash[--len] = '\0';
+	s3.bucket = strdup(slash);
+	*slash = '\0';
+	s3.authority = strdup(spec);
+	if(s3.bucket == NULL || s3.authority == NULL)
+		err_exit("s3_parse() --> strdup()\n");
+
+	colon = strrchr(spec,':');
+	s3.port = "80";
+	if(colon != NULL){
+		*colon = '\0';
+		s3.port = colon + 1;
+	}
+
+	s3.access = getenv("AWS_ACCESS_KEY_ID");
+	s3.secret = getenv("AWS_SECRET_ACCESS_KEY");
+	s3.region = getenv("AWS_REGION") != NULL ? getenv("AWS_REGION") : "us-east-1";
+	if(s3.access == NULL || s3.secret == NULL)
+		s3.access = s3.secret = NULL;
+
+	/* A server hanging up is an error of the output, not a signal */
+	signal(SIGPIPE,SIG_IGN);
+}
+
+static void
+hmac_sha256(const void *key, size_t key_len, const void *msg, size_t len, unsigned char *out)
+{
+	unsigned char pad[64], inner[DIGEST_MAX_LEN];
+	Digest d;
+	size_t i;
+
+	memset(pad,0,sizeof(pad));
+	if(key_len > sizeof(pad)){
+		digest_init(&d,DIGEST_SHA256);
+		digest_update(&d,key,key_len);
+		digest_final(&d,pad,NULL);
+	}else
+		memcpy(pad,key,key_len);
+
+	for(i=0; i<sizeof(pad); i++)
+		pad[i] ^= 0x36;
+	digest_init(&d,DIGEST_SHA256);
+	digest_update(&d,pad,sizeof(pad));
+	digest_update(&d,msg,len);
+	digest_final(&d,inner,NULL);
+
+	for(i=0; i<sizeof(pad); i++)
+		pad[i] ^= 0x36 ^ 0x5c;
+	digest_init(&d,DIGEST_SHA256);
+	digest_update(&d,pad,sizeof(pad));
+	digest_update(&d,inner,sizeof(inner));
+	digest_final(&d,out,NULL);
+}
+
+static void
+base64(const unsigned char *src, size_t len, char *dst)
+{
+	static const char digits[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint32_t v;
+	size_t i;
+
+	for(i=0; i<len; i += 3){
+		v = src[i] << 16 | (i + 1 < len ? src[i + 1] << 8 : 0) | (i + 2 < len ? src[i + 2] : 0);
+		*dst++ = digits[v >> 18];
+		*dst++ = digits[(v >> 12) & 63];
+		*dst++ = i + 1 < len ? digits[(v >> 6) & 63] : '=';
+		*dst++ = i + 2 < len ? digits[v & 63] : '=';
+	}
+	*dst = '\0';
+}
+
+/* Percent-encode all but the unreserved characters, and '/' if asked */
+static size_t
+s3_encode(char *dst, const char *src, int keep_slash)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	char *p;
+
+	for(p=dst; *src != '\0'; src++){
+		if((*src >= 'A' && *src <= 'Z') || (*src >= 'a' && *src <= 'z') || (*src >= '0' && *src <= '9')
+		   || *src == '-' || *src == '_' || *src == '.' || *src == '~' || (*src == '/' && keep_slash))
+			*p++ = *src;
+		else{
+			*p++ = '%';
+			*p++ = digits[(unsigned char)*src >> 4];
+			*p++ = digits[*src & 15];
+		}
+	}
+	*p = '\0';
+
+	return p - dst;
+}
+
+/*
+  The Authorization header of a request, AWS Signature Version 4 over
+  host, x-amz-content-sha256 and x-amz-date. query is canonical already:
+  sorted, encoded, every key with its '='.
+*/
+static void
+s3_sign(char *auth, size_t max, const char *method, const char *path, const char *query,
+	const char *date, const char *payload)
+{
+	unsigned char key[DIGEST_MAX_LEN], hash[DIGEST_MAX_LEN];
+	char canonical[S3_MAX_PATH + S3_MAX_QUERY + 512], sts[256], secret[256], scope[128];
+	char hex[2 * DIGEST_MAX_LEN + 1];
+	Digest d;
+	int len;
+
+	len = snprintf(canonical,sizeof(canonical),"%s\n%s\n%s\nhost:%s\nx-amz-content-sha256:%s\n"
+		"x-amz-date:%s\n\nhost;x-amz-content-sha256;x-amz-date\n%s",
+		method,path,query,s3.authority,payload,date,payload);
+	digest_init(&d,DIGEST_SHA256);
+	digest_update(&d,canonical,len);
+	digest_final(&d,hash,hex);
+
+	snprintf(scope,sizeof(scope),"%.8s/%s/s3/aws4_request",date,s3.region);
+	len = snprintf(sts,sizeof(sts),"AWS4-HMAC-SHA256\n%s\n%s\n%s",date,scope,hex);
+
+	len = snprintf(secret,sizeof(secret),"AWS4%s",s3.secret);
+	hmac_sha256(secret,len,date,8,key);
+	hmac_sha256(key,sizeof(key),s3.region,strlen(s3.region),key);
+	hmac_sha256(key,sizeof(key),"s3",2,key);
+	hmac_sha256(key,sizeof(key),"aws4_request",12,key);
+	hmac_sha256(key,sizeof(key),sts,strlen(sts),hash);
+	for(len=0; len<DIGEST_MAX_LEN; len++)
+		sprintf(hex + 2 * len,"%02x",hash[len]);
+	snprintf(auth,max,"Authorization: AWS4-HMAC-SHA256 Credential=%s/%s, "
+		"SignedHeaders=host;x-amz-content-sha256;x-amz-date, Signature=%s\r\n",
+		s3.access,scope,hex);
+}
+
+/*
+  One request on c, connecting first if need be; a connection the
+  server closed meanwhile is opened again once. The body may be NULL,
+  its SHA-256 sum is computed unless given. Returns the status, with up
+  to max - 1 bytes of the response body in resp and the ETag in etag,
+  or -1 when the server cannot be talked to.
+*/
+static int
+s3_request(HttpConn *c, const char *method, const char *path, const char *query,
+	   const void *body, size_t len, const unsigned char *sum,
+	   char *resp, size_t max, char *etag)
+{
+	unsigned char own[DIGEST_MAX_LEN];
+	char head[S3_MAX_PATH + S3_MAX_QUERY + 1024], auth[512], line[512], hex[2 * DIGEST_MAX_LEN + 1];
+	char checksum[96], date[32];
+	static const char digits[] = "0123456789abcdef";
+	struct tm tm;
+	time_t now;
+	size_t length, got, i;
+	Digest d;
+	int attempt, status, n, ok;
+
+	if(sum == NULL){
+		digest_init(&d,DIGEST_SHA256);
+		digest_update(&d,body,len);
+		digest_final(&d,own,NULL);
+		sum = own;
+	}
+	for(i=0; i<DIGEST_MAX_LEN; i++){
+		hex[2 * i] = digits[sum[i] >> 4];
+		hex[2 * i + 1] = digits[sum[i] & 15];
+	}
+	hex[2 * DIGEST_MAX_LEN] = '\0';
+	/* Bodies of PUTs are checked; parts only once the upload asked for it */
+	checksum[0] = '\0';
+	if(strcmp(method,"PUT") == 0){
+		memcpy(checksum,"x-amz-checksum-sha256: ",23);
+		base64(sum,DIGEST_MAX_LEN,checksum + 23);
+		strcat(checksum,"\r\n");
+	}else if(strcmp(query,"uploads=") == 0)
+		strcpy(checksum,"x-amz-checksum-algorithm: SHA256\r\n");
+
+	for(attempt=0; attempt<2; attempt++){
+		now = time(NULL);
+		gmtime_r(&now,&tm);
+		strftime(date,sizeof(date),"%Y%m%dT%H%M%SZ",&tm);
+		auth[0] = '\0';
+		if(s3.access != NULL)
+			s3_sign(auth,sizeof(auth),method,path,query,date,hex);
+
+		n = snprintf(head,sizeof(head),"%s %s%s%s HTTP/1.1\r\nHost: %s\r\nx-amz-date: %s\r\n"
+			"x-amz-content-sha256: %s\r\n%s%sContent-Length: %zu\r\n\r\n",
+			method,path,query[0] != '\0' ? "?" : "",query,s3.authority,date,hex,checksum,auth,len);
+		if(n >= (int)sizeof(head)){
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		if(c->fd == -1 && http_connect(c,s3.host,s3.port) == -1)
+			return -1;
+		ok = write_all(c->fd,head,n) == 0 && (len == 0 || write_all(c->fd,body,len) == 0);
+
+		/* The status line, then the headers of interest */
+		ok = ok && http_line(c,line,sizeof(line)) == 0 && sscanf(line,"HTTP/1.%*d %d",&status) == 1;
+		length = 0;
+		while(ok && (ok = http_line(c,line,sizeof(line)) == 0) && line[0] != '\0'){
+			if(strncasecmp(line,"Content-Length:",15) == 0)
+				length = strtoull(line + 15,NULL,10);
+			else if(strncasecmp(line,"ETag:",5) == 0 && etag != NULL)
+				snprintf(etag,72,"%s",line + 5 + strspn(line + 5," "));
+			else if(strncasecmp(line,"Transfer-Encoding:",18) == 0)
+				ok = 0;
+		}
+
+		if(ok && resp != NULL){
+			got = length < max - 1 ? length : max - 1;
+			for(i=0; ok && i<got; ){
+				if(c->pos == c->len){
+					n = read(c->fd,c->buf,sizeof(c->buf));
+					if(n == -1 && errno == EINTR)
+						continue;
+					if(n <= 0){
+						ok = 0;
+						break;
+					}
+					c->len = n;
+					c->pos = 0;
+				}
+				n = c->len - c->pos < got - i ? c->len - c->pos : got - i;
+				memcpy(resp + i,c->buf + c->pos,n);
+				c->pos += n;
+				i += n;
+			}
+			resp[i] = '\0';
+			length -= i;
+		}
+		if(ok && http_body(c,length,-1) == 0)
+			return status;
+
+		http_close(c);
+	}
+
+	return -1;
+}
+
+/* Copy, patch and hash a part of the output into buf, which holds len bytes */
+static void
+s3_fill(unsigned char *buf, const ElfView *view, const unsigned char *hdr, size_t off, size_t len,
+	unsigned char *sum)
+{
+	Digest d;
+
+	memcpy(buf,view->base + off,len);
+	patch_range(buf,off,len,view,hdr);
+
+	digest_init(&d,DIGEST_SHA256);
+	digest_update(&d,buf,len);
+	digest_final(&d,sum,NULL);
+}
+
+static void *
+s3_parts(void *arg)
+{
+	S3Job *job;
+	HttpConn *c;
+	unsigned char *buf;
+	char *query;
+	size_t i, off, len, max;
+	int status;
+
+	job = (S3Job *)arg;
+	c = &job->conns[__atomic_fetch_add(&job->conn,1,__ATOMIC_RELAXED)];
+	max = strlen(job->upload) + 64;
+	buf = (unsigned char *)malloc(job->part);
+	query = (char *)malloc(max);
+	if(buf == NULL || query == NULL){
+		free(buf);
+		free(query);
+		__atomic_store_n(&job->status,-1,__ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	while((i = __atomic_fetch_add(&job->next,1,__ATOMIC_RELAXED)) < job->nparts
+	      && __atomic_load_n(&job->status,__ATOMIC_RELAXED) == 0){
+		off = i * job->part;
+		len = job->size - off < job->part ? job->size - off : job->part;
+		s3_fill(buf,job->view,job->hdr,off,len,job->sums[i]);
+
+		snprintf(query,max,"partNumber=%zu&uploadId=%s",i + 1,job->upload);
+		status = s3_request(c,"PUT",job->path,query,buf,len,job->sums[i],NULL,0,job->etags[i]);
+		if(status != 200)
+			__atomic_store_n(&job->status,status,__ATOMIC_RELAXED);
+	}
+
+	free(query);
+	free(buf);
+	return NULL;
+}
+
+/*
+  Upload the stripped image to <bucket>/<out_file>. A failed upload is
+  aborted and fails the file as a failed write would.
+*/
+static const char *
+s3_put(Worker *w, const ElfView *view, const char *out_file)
+{
+	S3Job job;
+	pthread_t tids[COPY_MAX_THREADS];
+	unsigned char hdr[sizeof(Elf64_Ehdr)], sum[DIGEST_MAX_LEN], *buf;
+	char path[S3_MAX_PATH], resp[1024], *id, *end, *query, *xml, *p;
+	char b64[64];
+	size_t size, i;
+	int status, n;
+
+	if(w->s3 == NULL){
+		w->s3 = (HttpConn *)malloc(opt_copy_threads * sizeof(HttpConn));
+		if(w->s3 == NULL)
+			err_exit("s3_put() --> malloc()\n");
+		for(n=0; n<opt_copy_threads; n++)
+			w->s3[n].fd = -1;
+	}
+
+	n = snprintf(path,sizeof(path),"%s/",s3.bucket);
+	while(*out_file == '/')
+		out_file++;
+	s3_encode(path + n,out_file,1);
+
+	size = view_cut(view);
+	memcpy(hdr,view->base,view->ehsize);
+	patch_image(hdr,view->ehsize,view);
+
+	if(size <= S3_PART){
+		buf = (unsigned char *)malloc(size > 0 ? size : 1);
+		if(buf == NULL)
+			err_exit("s3_put() --> malloc()\n");
+		s3_fill(buf,view,hdr,0,size,sum);
+		status = s3_request(&w->s3[0],"PUT",path,"",buf,size,sum,resp,sizeof(resp),NULL);
+		free(buf);
+		if(status != 200)
+			err_exit("s3_put() --> PUT %s: %d %s\n",path,status,resp);
+		return "s3";
+	}
+
+	memset(&job,0,sizeof(job));
+	job.view = view;
+	job.hdr = hdr;
+	job.path = path;
+	job.conns = w->s3;
+	job.size = size;
+	job.part = S3_PART;
+	if(size / job.part >= S3_MAX_PARTS)
+		job.part = ((size / S3_MAX_PARTS + 1 + (1 << 20) - 1) >> 20) << 20;
+	job.nparts = (size + job.part - 1) / job.part;
+	job.etags = (char (*)[72])calloc(job.nparts,sizeof(*job.etags));
+	job.sums = (unsigned char (*)[DIGEST_MAX_LEN])calloc(job.nparts,DIGEST_MAX_LEN);
+	xml = (char *)malloc(job.nparts * 256 + 128);
+	if(job.etags == NULL || job.sums == NULL || xml == NULL)
+		err_exit("s3_put() --> calloc()\n");
+
+	status = s3_request(&w->s3[0],"POST",path,"uploads=",NULL,0,NULL,resp,sizeof(resp),NULL);
+	id = status == 200 ? strstr(resp,"<UploadId>") : NULL;
+	end = id != NULL ? strstr(id,"</UploadId>") : NULL;
+	if(end == NULL)
+		err_exit("s3_put() --> POST %s?uploads: %d %s\n",path,status,resp);
+	*end = '\0';
+	id += 10;
+	if(end - id > S3_MAX_UPLOAD_ID){
+		errno = EPROTO;
+		err_exit("s3_put() --> POST %s?uploads: UploadId of %zu bytes\n",path,(size_t)(end - id));
+	}
+	job.upload = (char *)malloc(3 * (end - id) + 1);
+	query = (char *)malloc(3 * (end - id) + 16);
+	if(job.upload == NULL || query == NULL)
+		err_exit("s3_put() --> malloc()\n");
+	s3_encode(job.upload,id,0);
+	sprintf(query,"uploadId=%s",job.upload);
+
+	n = opt_copy_threads < job.nparts ? opt_copy_threads : job.nparts;
+	for(i=0; i<(size_t)n - 1; i++)
+		if(pthread_create(&tids[i],NULL,s3_parts,&job) != 0)
+			err_exit("s3_put() --> pthread_create()\n");
+	s3_parts(&job);
+	for(i=0; i<(size_t)n - 1; i++)
+		pthread_join(tids[i],NULL);
+
+	if(job.status != 0){
+		s3_request(&w->s3[0],"DELETE",path,query,NULL,0,NULL,NULL,0,NULL);
+		err_exit("s3_put() --> PUT %s part: %d\n",path,job.status);
+	}
+
+	p = xml + sprintf(xml,"<CompleteMultipartUpload>");
+	for(i=0; i<job.nparts; i++){
+		base64(job.sums[i],DIGEST_MAX_LEN,b64);
+		p += sprintf(p,"<Part><PartNumber>%zu</PartNumber><ETag>%s</ETag>"
+			"<ChecksumSHA256>%s</ChecksumSHA256></Part>",i + 1,job.etags[i],b64);
+	}
+	p += sprintf(p,"</CompleteMultipartUpload>");
+
+	/* A completion can fail with 200 and an error document */
+	status = s3_request(&w->s3[0],"POST",path,query,xml,p - xml,NULL,resp,sizeof(resp),NULL);
+	if(status != 200 || strstr(resp,"<Error>") != NULL){
+		s3_request(&w->s3[0],"DELETE",path,query,NULL,0,NULL,NULL,0,NULL);
+		err_exit("s3_put() --> POST %s?uploadId: %d %s\n",path,status,resp);
+	}
+
+	free(query);
+	free(job.upload);
+	free(xml);
+	free(job.sums);
+	free(job.etags);
+
+	return "s3-multipart";
+}
+
+/* Strip an input straight into the bucket, no output file in between */
+static void
+process_s3(Worker *w, const char *in_file, const char *out_file)
+{
+	ElfContainer *elfc;
+	uint64_t ts[6];
+
+	errno = 0;
+	ts[0] = now_ns();
+
+	memset(&w->cur,0,sizeof(Event));
+	w->cur.in_file = in_file;
+	w->cur.out_file = out_file;
+	w->cur.start = ts[0];
+
+	elfc = build_container(in_file,0);
+	get_string_table(elfc);
+
+	w->cur.size = elfc->size;
+	w->cur.strtbloff = elfc->view.strtbloff;
+	w->cur.strtblsize = strtbl_cleared(elfc->view.strtbloff,elfc->view.strtblsize,view_cut(&elfc->view));
+	w->cur.shoff = elfc->view.shoff;
+	w->cur.type = elfc->view.type;
+	w->cur.truncated = elfc->size - view_cut(&elfc->view);
+
+	ts[1] = now_ns();
+	w->cur.engine = s3_put(w,&elfc->view,out_file);
+	if(opt_debug_store != NULL)
+		debug_keep(&elfc->view);
+
+	/* The parts were patched on their way out */
+	ts[2] = ts[3] = ts[4] = now_ns();
+	destroy_container(elfc);
+
+	ts[5] = now_ns();
+	process_done(w,ts);
+}
+
+/* Written aside and renamed by bundle_close(), so a failed run leaves no bundle */
+static void
+bundle_open(const char *path)
+{
+	snprintf(bundle_tmp,sizeof(bundle_tmp),"%s.elfkillah.%d",path,(int)getpid());
+	bundle.fd = open(bundle_tmp,O_CREAT|O_EXCL|O_RDWR,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if(bundle.fd == -1){
+		bundle_tmp[0] = '\0';
+		err_exit("bundle_open() --> open(%s)\n",path);
+	}
+
+	pthread_mutex_init(&bundle.lock,NULL);
+	bundle.mask = BUNDLE_SLOTS_MIN - 1;
+	bundle.slots = (BundleSlot *)calloc(BUNDLE_SLOTS_MIN,sizeof(BundleSlot));
+	bundle.entries = (ElfkillahBundleEntry *)calloc(njobs,sizeof(ElfkillahBundleEntry));
+	bundle.lists = (uint32_t **)calloc(njobs,sizeof(uint32_t *));
+	if(bundle.slots == NULL || bundle.entries == NULL || bundle.lists == NULL)
+		err_exit("bundle_open() --> calloc()\n");
+	bundle.pages = 1;
+}
+
+/* Four independent multiply chains over the page, folded */
+static uint64_t
+bundle_hash(const unsigned char *page)
+{
+	uint64_t h[4], v;
+	size_t i, j;
+
+	h[0] = h[1] = h[2] = h[3] = 0;
+	for(i=0; i<ELFKILLAH_BUNDLE_PAGE; i += 32){
+		for(j=0; j<4; j++){
+			memcpy(&v,page + i + 8 * j,8);
+			h[j] = (h[j] ^ v) * 0x9e3779b97f4a7c15ULL;
+			h[j] ^= h[j] >> 29;
+		}
+	}
+
+	v = h[0] ^ (h[1] << 16 | h[1] >> 48) ^ (h[2] << 32 | h[2] >> 32) ^ (h[3] << 48 | h[3] >> 16);
+	v = (v ^ v >> 33) * 0xff51afd7ed558ccdULL;
+	return v ^ v >> 33;
+}
+
+static void
+bundle_grow(void)
+{
+	BundleSlot *old;
+	size_t mask, i, j;
+
+	old = bundle.slots;
+	mask = bundle.mask;
+	bundle.mask = 2 * mask + 1;
+	bundle.slots = (BundleSlot *)calloc(bundle.mask + 1,sizeof(BundleSlot));
+	if(bundle.slots == NULL)
+		err_exit("bundle_grow() --> calloc()\n");
+
+	for(i=0; i<=mask; i++){
+		if(old[i].page == 0)
+			continue;
+		for(j=old[i].hash & bundle.mask; bundle.slots[j].page != 0; j=(j + 1) & bundle.mask)
+			;
+		bundle.slots[j] = old[i];
+	}
+	free(old);
+}
+
+/*
+  The stored page equal to page, or 0 with *slot free for it. Pages
+  from first on are still in batch, earlier pending ones in the batch
+  of another worker. Called with the bundle lock held.
+*/
+static uint32_t
+bundle_find(uint64_t hash, const unsigned char *page, const unsigned char *batch, uint64_t first,
+	unsigned char *scratch, size_t *slot)
+{
+	const unsigned char *stored;
+	size_t i;
+
+	for(i=hash & bundle.mask; bundle.slots[i].page != 0; i=(i + 1) & bundle.mask){
+		if(bundle.slots[i].hash != hash || (bundle.slots[i].pending && bundle.slots[i].page < first))
+			continue;
+
+		if(bundle.slots[i].page >= first)
+			stored = batch + (bundle.slots[i].page - first) * ELFKILLAH_BUNDLE_PAGE;
+		else{
+			if(pread(bundle.fd,scratch,ELFKILLAH_BUNDLE_PAGE,
+				 (off_t)bundle.slots[i].page * ELFKILLAH_BUNDLE_PAGE) != ELFKILLAH_BUNDLE_PAGE)
+				err_exit("bundle_find() --> pread()\n");
+			stored = scratch;
+		}
+		if(memcmp(stored,page,ELFKILLAH_BUNDLE_PAGE) == 0)
+			return bundle.slots[i].page;
+	}
+
+	*slot = i;
+	return 0;
+}
+
+/* Pages [first, first + n) are written, called with the bundle lock held */
+static void
+bundle_written(const uint64_t *hashes, uint64_t first, size_t n)
+{
+	size_t i, j;
+
+	for(i=0; i<n; i++){
+		for(j=hashes[i] & bundle.mask; bundle.slots[j].page != first + i; j=(j + 1) & bundle.mask)
+			;
+		bundle.slots[j].pending = 0;
+	}
+}
+
+/*
+  Add an output to the bundle, a batch of pages at a time. The new
+  pages of a batch are moved to its front as they are found, so they
+  go out in a single write, numbered in order from the first free page.
+*/
+static void
+bundle_put(const ElfView *view, size_t job, mode_t mode)
+{
+	unsigned char hdr[sizeof(Elf64_Ehdr)], *batch, *scratch;
+	uint64_t hashes[BUNDLE_BATCH], first;
+	uint32_t *list, page;
+	size_t size, npages, done, n, len, fresh, slot, i;
+
+	size = view_cut(view);
+	memcpy(hdr,view->base,view->ehsize);
+	patch_image(hdr,view->ehsize,view);
+
+	npages = (size + ELFKILLAH_BUNDLE_PAGE - 1) / ELFKILLAH_BUNDLE_PAGE;
+	list = (uint32_t *)malloc((npages > 0 ? npages : 1) * sizeof(uint32_t));
+	batch = (unsigned char *)malloc((BUNDLE_BATCH + 1) * ELFKILLAH_BUNDLE_PAGE);
+	if(list == NULL || batch == NULL)
+		err_exit("bundle_put() --> malloc()\n");
+	scratch = batch + BUNDLE_BATCH * ELFKILLAH_BUNDLE_PAGE;
+
+	for(done=0; done<npages; done += n){
+		n = npages - done < BUNDLE_BATCH ? npages - done : BUNDLE_BATCH;
+		len = size - done * ELFKILLAH_BUNDLE_PAGE;
+		if(len > n * ELFKILLAH_BUNDLE_PAGE)
+			len = n * ELFKILLAH_BUNDLE_PAGE;
+		memcpy(batch,view->base + done * ELFKILLAH_BUNDLE_PAGE,len);
+		patch_range(batch,done * ELFKILLAH_BUNDLE_PAGE,len,view,hdr);
+		memset(batch + len,0,n * ELFKILLAH_BUNDLE_PAGE - len);
+		for(i=0; i<n; i++)
+			hashes[i] = bundle_hash(batch + i * ELFKILLAH_BUNDLE_PAGE);
+
+		pthread_mutex_lock(&bundle.lock);
+		first = bundle.pages;
+		if(first + n > UINT32_MAX){
+			errno = EFBIG;
+			err_exit("bundle_put() --> more than %u pages\n",UINT32_MAX);
+		}
+		slot = 0;
+		for(i=fresh=0; i<n; i++){
+			page = bundle_find(hashes[i],batch + i * ELFKILLAH_BUNDLE_PAGE,batch,first,scratch,&slot);
+			if(page == 0){
+				page = first + fresh;
+				if(fresh != i)
+					memcpy(batch + fresh * ELFKILLAH_BUNDLE_PAGE,batch + i * ELFKILLAH_BUNDLE_PAGE,
+						ELFKILLAH_BUNDLE_PAGE);
+				bundle.slots[slot].hash = hashes[i];
+				bundle.slots[slot].page = page;
+				bundle.slots[slot].pending = 1;
+				hashes[fresh++] = hashes[i];
+				if(++bundle.used * 2 > bundle.mask)
+					bundle_grow();
+			}
+			list[done + i] = page;
+		}
+		bundle.pages += fresh;
+		bundle.refs += n;
+		pthread_mutex_unlock(&bundle.lock);
+		if(fresh == 0)
+			continue;
+
+		if(pwrite(bundle.fd,batch,fresh * ELFKILLAH_BUNDLE_PAGE,
+			  first * ELFKILLAH_BUNDLE_PAGE) != (ssize_t)(fresh * ELFKILLAH_BUNDLE_PAGE))
+			err_exit("bundle_put() --> pwrite()\n");
+		pthread_mutex_lock(&bundle.lock);
+		bundle_written(hashes,first,fresh);
+		pthread_mutex_unlock(&bundle.lock);
+	}
+	free(batch);
+
+	bundle.entries[job].size = size;
+	bundle.entries[job].mode = mode & 07777;
+	bundle.lists[job] = list;
+}
+
+/* Strip an input into the bundle, under its <outfile> name */
+static void
+process_bundle(Worker *w, size_t job)
+{
+	ElfContainer *elfc;
+	struct stat sb;
+	uint64_t ts[6];
+
+	errno = 0;
+	ts[0] = now_ns();
+
+	memset(&w->cur,0,sizeof(Event));
+	w->cur.in_file = jobs[2 * job];
+	w->cur.out_file = jobs[2 * job + 1];
+	w->cur.start = ts[0];
+	w->cur.engine = "bundle";
+
+	if(stat(jobs[2 * job],&sb) == -1)
+		err_exit("process_bundle() --> stat(%s)\n",jobs[2 * job]);
+	elfc = build_container(jobs[2 * job],0);
+	get_string_table(elfc);
+
+	w->cur.size = elfc->size;
+	w->cur.strtbloff = elfc->view.strtbloff;
+	w->cur.strtblsize = strtbl_cleared(elfc->view.strtbloff,elfc->view.strtblsize,view_cut(&elfc->view));
+	w->cur.shoff = elfc->view.shoff;
+	w->cur.type = elfc->view.type;
+	w->cur.truncated = elfc->size - view_cut(&elfc->view);
+
+	ts[1] = now_ns();
+	bundle_put(&elfc->view,job,sb.st_mode);
+	if(opt_debug_store != NULL)
+		debug_keep(&elfc->view);
+
+	/* Pages were patched on their way in */
+	ts[2] = ts[3] = ts[4] = now_ns();
+	destroy_container(elfc);
+
+	ts[5] = now_ns();
+	process_done(w,ts);
+}
+
+/* Write the index after the pages, then the header, and rename the bundle into place */
+static void
+bundle_close(const char *path)
+{
+	ElfkillahBundle head;
+	FILE *out;
+	const char *name;
+	uint64_t first, names;
+	size_t i, n;
+
+	memset(&head,0,sizeof(head));
+	head.magic = ELFKILLAH_BUNDLE_MAGIC;
+	head.count = njobs;
+	head.pages = bundle.pages;
+	head.entries = bundle.pages * ELFKILLAH_BUNDLE_PAGE;
+	head.list = head.entries + njobs * sizeof(ElfkillahBundleEntry);
+
+	first = names = 0;
+	for(i=0; i<njobs; i++){
+		bundle.entries[i].first = first;
+		bundle.entries[i].name = names;
+		first += (bundle.entries[i].size + ELFKILLAH_BUNDLE_PAGE - 1) / ELFKILLAH_BUNDLE_PAGE;
+		for(name=jobs[2 * i + 1]; *name == '/'; name++)
+			;
+		names += strlen(name) + 1;
+	}
+	head.names = head.list + first * sizeof(uint32_t);
+	head.size = head.names + names;
+
+	if(lseek(bundle.fd,head.entries,SEEK_SET) == -1)
+		err_exit("bundle_close() --> lseek()\n");
+	out = fdopen(bundle.fd,"w");
+	if(out == NULL)
+		err_exit("bundle_close() --> fdopen()\n");
+	fwrite(bundle.entries,sizeof(ElfkillahBundleEntry),njobs,out);
+	for(i=0; i<njobs; i++){
+		n = (bundle.entries[i].size + ELFKILLAH_BUNDLE_PAGE - 1) / ELFKILLAH_BUNDLE_PAGE;
+		fwrite(bundle.lists[i],sizeof(uint32_t),n,out);
+		free(bundle.lists[i]);
+	}
+	for(i=0; i<njobs; i++){
+		for(name=jobs[2 * i + 1]; *name == '/'; name++)
+			;
+		fwrite(name,1,strlen(name) + 1,out);
+	}
+	if(fflush(out) != 0 || pwrite(bundle.fd,&head,sizeof(head),0) != sizeof(head))
+		err_exit("bundle_close() --> write()\n");
+	if(fclose(out) != 0)
+		err_exit("bundle_close() --> fclose()\n");
+
+	if(rename(bundle_tmp,path) == -1)
+		err_exit("bundle_close() --> rename(%s)\n",path);
+	bundle_tmp[0] = '\0';
+
+	free(bundle.lists);
+	free(bundle.entries);
+	free(bundle.slots);
+}
+
+static void
+bundle_print(void)
+{
+	fprintf(stderr,"\n%-12s %10s %12s %12s %10s\n","bundle","outputs","pages","stored","dedup");
+	fprintf(stderr,"%-12s %10zu %12llu %12llu %9.1f%%\n","",njobs,(unsigned long long)bundle.refs,
+		(unsigned long long)bundle.pages - 1,
+		bundle.refs > 0 ? 100.0 * (bundle.refs - (bundle.pages - 1)) / bundle.refs : 0.0);
+}
+
+static void
+inflow_open(Inflow *in, int codec, const unsigned char *src, size_t len)
+{
+	memset(in,0,sizeof(Inflow));
+	in->codec = codec;
+	in->src = src;
+	in->len = len;
+
+	if(codec == CODEC_GZIP){
+		if(inflateInit2(&in->zs,16 + MAX_WBITS) != Z_OK)
+			err_exit("inflow_open() --> inflateInit2()\n");
+	}else if(codec == CODEC_XZ){
+		in->xs = (lzma_stream)LZMA_STREAM_INIT;
+		if(lzma_stream_decoder(&in->xs,UINT64_MAX,LZMA_CONCATENATED) != LZMA_OK)
+			err_exit("inflow_open() --> lzma_stream_decoder()\n");
+		in->xs.next_in = src;
+		in->xs.avail_in = len;
+	}
+}
+
+static void
+inflow_close(Inflow *in)
+{
+	if(in->codec == CODEC_GZIP)
+		inflateEnd(&in->zs);
+	else if(in->codec == CODEC_XZ)
+		lzma_end(&in->xs);
+}
+
+/* Read up to len bytes, fewer only at the end of the stream */
+static size_t
+inflow_read(Inflow *in, void *buf, size_t len)
+{
+	size_t n;
+	int ret;
+	lzma_ret lret;
+
+	if(in->eof)
+		return 0;
+
+	if(in->codec == CODEC_NONE){
+		n = in->len - in->pos < len ? in->len - in->pos : len;
+		memcpy(buf,in->src + in->pos,n);
+		in->pos += n;
+		return n;
+	}
+
+	if(in->codec == CODEC_XZ){
+		in->xs.next_out = (uint8_t *)buf;
+		in->xs.avail_out = len;
+		while(in->xs.avail_out > 0){
+			lret = lzma_code(&in->xs,LZMA_FINISH);
+			if(lret == LZMA_STREAM_END){
+				in->eof = 1;
+				break;
+			}
+			if(lret != LZMA_OK)
+				err_exit("inflow_read() --> lzma_code()\n");
+		}
+		return len - in->xs.avail_out;
+	}
+
+	in->zs.next_out = (Bytef *)buf;
+	in->zs.avail_out = len;
+	while(in->zs.avail_out > 0){
+		if(in->zs.avail_in == 0 && in->pos < in->len){
+			n = in->len - in->pos < (1U << 30) ? in->len - in->pos : (1U << 30);
+			in->zs.next_in = (Bytef *)in->src + in->pos;
+			in->zs.avail_in = n;
+			in->pos += n;
+		}
+
+		ret = inflate(&in->zs,Z_NO_FLUSH);
+		if(ret == Z_STREAM_END){
+			/* gzip members may follow each other */
+			if(in->zs.avail_in == 0 && in->pos == in->len){
+				in->eof = 1;
+				break;
+			}
+			inflateReset(&in->zs);
+		}else if(ret != Z_OK)
+			err_exit("inflow_read() --> inflate()\n");
+	}
+
+	return len - in->zs.avail_out;
+}
+
+static void
+inflow_need(Inflow *in, void *buf, size_t len)
+{
+	if(inflow_read(in,buf,len) != len)
+		err_exit("inflow_need() --> truncated archive\n");
+}
+
+static void
+outflow_open(Outflow *o, int codec, FILE *file)
+{
+	memset(o,0,sizeof(Outflow));
+	o->codec = codec;
+	o->file = file;
+
+	if(codec == CODEC_GZIP){
+		if(deflateInit2(&o->zs,Z_BEST_COMPRESSION,Z_DEFLATED,16 + MAX_WBITS,8,
+		   Z_DEFAULT_STRATEGY) != Z_OK)
+			err_exit("outflow_open() --> deflateInit2()\n");
+	}else if(codec == CODEC_XZ){
+		o->xs = (lzma_stream)LZMA_STREAM_INIT;
+		if(lzma_easy_encoder(&o->xs,LZMA_PRESET_DEFAULT,LZMA_CHECK_CRC64) != LZMA_OK)
+			err_exit("outflow_open() --> lzma_easy_encoder()\n");
+	}
+}
+
+static void
+outflow_emit(Outflow *o, const unsigned char *buf, size_t len)
+{
+	if(len == 0)
+		return;
+	if(fwrite(buf,1,len,o->file) != len)
+		err_exit("outflow_emit() --> fwrite()\n");
+	if(o->packed != NULL)
+		digest_update(o->packed,buf,len);
+	o->packed_len += len;
+}
+
+static void
+outflow_code(Outflow *o, const void *buf, size_t len, int finish)
+{
+	unsigned char obuf[STREAM_BUF];
+	lzma_ret lret;
+	int ret;
+
+	if(o->codec == CODEC_NONE){
+		outflow_emit(o,(const unsigned char *)buf,len);
+		return;
+	}
+
+	if(o->codec == CODEC_XZ){
+		o->xs.next_in = (const uint8_t *)buf;
+		o->xs.avail_in = len;
+		do{
+			o->xs.next_out = obuf;
+			o->xs.avail_out = sizeof(obuf);
+			lret = lzma_code(&o->xs,finish ? LZMA_FINISH : LZMA_RUN);
+			if(lret != LZMA_OK && lret != LZMA_STREAM_END)
+				err_exit("outflow_code() --> lzma_code()\n");
+			outflow_emit(o,obuf,sizeof(obuf) - o->xs.avail_out);
+		}while(o->xs.avail_out == 0 || (finish && lret != LZMA_STREAM_END));
+		return;
+	}
+
+	o->zs.next_in = (Bytef *)buf;
+	o->zs.avail_in = len;
+	do{
+		o->zs.next_out = obuf;
+		o->zs.avail_out = sizeof(obuf);
+		ret = deflate(&o->zs,finish ? Z_FINISH : Z_NO_FLUSH);
+		if(ret == Z_STREAM_ERROR)
+			err_exit("outflow_code() --> deflate()\n");
+		outflow_emit(o,obuf,sizeof(obuf) - o->zs.avail_out);
+	}while(o->zs.avail_out == 0 || (finish && ret != Z_STREAM_END));
+}
+
+static void
+outflow_write(Outflow *o, const void *buf, size_t len)
+{
+	const unsigned char *p;
+	size_t n;
+
+	if(o->raw != NULL)
+		digest_update(o->raw,buf,len);
+	o->raw_len += len;
+
+	for(p = (const unsigned char *)buf; len > 0; p += n, len -= n){
+		n = len < STREAM_BUF ? len : STREAM_BUF;
+		outflow_code(o,p,n,0);
+	}
+}
+
+static void
+outflow_close(Outflow *o)
+{
+	outflow_code(o,NULL,0,1);
+
+	if(o->codec == CODEC_GZIP)
+		deflateEnd(&o->zs);
+	else if(o->codec == CODEC_XZ)
+		lzma_end(&o->xs);
+}
+
+/* Pass len bytes from in to out, or just skip them without an out */
+static void
+member_copy(Inflow *in, Outflow *out, uint64_t len)
+{
+	unsigned char buf[STREAM_BUF];
+	size_t n;
+
+	while(len > 0){
+		n = len < sizeof(buf) ? len : sizeof(buf);
+		inflow_need(in,buf,n);
+		if(out != NULL)
+			outflow_write(out,buf,n);
+		len -= n;
+	}
+}
+
+/* Pass everything up to the end of the stream */
+static void
+member_copy_rest(Inflow *in, Outflow *out)
+{
+	unsigned char buf[STREAM_BUF];
+	size_t n;
+
+	while((n = inflow_read(in,buf,sizeof(buf))) > 0)
+		outflow_write(out,buf,n);
+}
+
+/* Copy the part of [off, off + n) of a stream which falls into the capture window */
+static void
+capture_range(unsigned char *dst, uint64_t start, uint64_t len,
+	      const unsigned char *src, uint64_t off, size_t n)
+{
+	uint64_t lo, hi;
+
+	lo = off > start ? off : start;
+	hi = off + n < start + len ? off + n : start + len;
+	if(lo < hi)
+		memcpy(dst + (lo - start),src + (lo - off),hi - lo);
+}
+
+static void
+package_init(Package *pkg, int digest_algo)
+{
+	memset(pkg,0,sizeof(Package));
+	pkg->digest_algo = digest_algo;
+	pkg->capture = (unsigned char *)malloc(CAPTURE_MAX);
+	if(pkg->capture == NULL)
+		err_exit("package_init() --> malloc()\n");
+}
+
+static void
+package_free(Package *pkg)
+{
+	size_t i;
+
+	for(i=0; i<pkg->nresults; i++)
+		free(pkg->results[i].path);
+	free(pkg->results);
+	free(pkg->plans);
+	free(pkg->capture);
+}
+
+/*
+  Planning pass over one member: read it through, keeping its ELF
+  header and as much of its section header table as fits the capture
+  buffer, and plan the cut if both validate.
+*/
+static void
+strip_plan(Package *pkg, Inflow *in, uint64_t size)
+{
+	unsigned char hdr[sizeof(Elf64_Ehdr)], buf[STREAM_BUF];
+	ElfView view;
+	StripPlan *plan;
+	uint64_t off, avail, end;
+	size_t n;
+
+	n = size < sizeof(hdr) ? size : sizeof(hdr);
+	inflow_need(in,hdr,n);
+	if(elf_view_header(&view,hdr,size) != NULL){
+		member_copy(in,NULL,size - n);
+		return;
+	}
+
+	avail = size - view.shoff;
+	if(avail > CAPTURE_MAX)
+		avail = CAPTURE_MAX;
+
+	capture_range(pkg->capture,view.shoff,avail,hdr,0,n);
+	for(off = n; off < size; off += n){
+		n = size - off < sizeof(buf) ? size - off : sizeof(buf);
+		inflow_need(in,buf,n);
+		capture_range(pkg->capture,view.shoff,avail,buf,off,n);
+	}
+
+	if(elf_view_sections(&view,pkg->capture,avail) != NULL)
+		return;
+
+	if(pkg->nplans == pkg->plans_cap){
+		pkg->plans_cap = pkg->plans_cap ? 2 * pkg->plans_cap : 64;
+		pkg->plans = (StripPlan *)realloc(pkg->plans,pkg->plans_cap * sizeof(StripPlan));
+		if(pkg->plans == NULL)
+			err_exit("strip_plan() --> realloc()\n");
+	}
+
+	plan = &pkg->plans[pkg->nplans++];
+	plan->member = pkg->member;
+	plan->view = view;
+	plan->view.base = NULL;
+	plan->view.shdrs = NULL;
+	memcpy(plan->hdr,hdr,view.ehsize);
+	patch_image(plan->hdr,view.ehsize,&plan->view);
+
+	end = view.strtbloff + view.strtblsize;
+	if(end > view_cut(&view))
+		end = view_cut(&view);
+	plan->zeroed = end > view.strtbloff ? end - view.strtbloff : 0;
+}
+
+/* The plan of the current member, if the planning pass made one */
+static StripPlan *
+strip_planned(Package *pkg)
+{
+	if(pkg->cursor < pkg->nplans && pkg->plans[pkg->cursor].member == pkg->member)
+		return &pkg->plans[pkg->cursor++];
+
+	return NULL;
+}
+
+/*
+  Rewriting pass over one planned member: emit the bytes kept by the
+  cut, patched on the fly, and remember their size and digest under
+  the member's path.
+*/
+static void
+strip_emit(Package *pkg, Inflow *in, Outflow *out, uint64_t size,
+	   const StripPlan *plan, const char *name)
+{
+	unsigned char buf[STREAM_BUF], md[DIGEST_MAX_LEN];
+	StripResult *r;
+	Digest d;
+	uint64_t off, keep;
+	size_t n, k;
+
+	keep = view_cut(&plan->view);
+	digest_init(&d,pkg->digest_algo);
+
+	for(off = 0; off < size; off += n){
+		n = size - off < sizeof(buf) ? size - off : sizeof(buf);
+		inflow_need(in,buf,n);
+		if(off >= keep)
+			continue;
+
+		k = keep - off < n ? keep - off : n;
+		patch_range(buf,off,k,&plan->view,plan->hdr);
+		digest_update(&d,buf,k);
+		outflow_write(out,buf,k);
+	}
+
+	if(pkg->nresults == pkg->results_cap){
+		pkg->results_cap = pkg->results_cap ? 2 * pkg->results_cap : 64;
+		pkg->results = (StripResult *)realloc(pkg->results,pkg->results_cap * sizeof(StripResult));
+		if(pkg->results == NULL)
+			err_exit("strip_emit() --> realloc()\n");
+	}
+
+	r = &pkg->results[pkg->nresults++];
+
+	/* Archives name ./usr/bin/foo or usr/bin/foo, packages want /usr/bin/foo */
+	if(name[0] == '.' && name[1] == '/')
+		name++;
+	r->path = (char *)malloc(strlen(name) + 2);
+	if(r->path == NULL)
+		err_exit("strip_emit() --> malloc()\n");
+	sprintf(r->path,"%s%s",name[0] == '/' ? "" : "/",name);
+
+	r->size = keep;
+	r->old_size = size;
+	digest_final(&d,md,r->digest);
+
+	pkg->zeroed += plan->zeroed;
+}
+
+static int
+result_cmp(const void *a, const void *b)
+{
+	return strcmp(((const StripResult *)a)->path,((const StripResult *)b)->path);
+}
+
+static StripResult *
+result_find(Package *pkg, const char *path)
+{
+	StripResult key;
+
+	key.path = (char *)path;
+	return (StripResult *)bsearch(&key,pkg->results,pkg->nresults,
+		sizeof(StripResult),result_cmp);
+}
+
+static uint64_t
+tar_number(const unsigned char *field, size_t len)
+{
+	uint64_t v;
+	size_t i;
+
+	/* GNU base-256 for values which do not fit the octal digits */
+	if(field[0] & 0x80){
+		v = field[0] & 0x7f;
+		for(i=1; i<len; i++)
+			v = v << 8 | field[i];
+		return v;
+	}
+
+	v = 0;
+	for(i=0; i<len && (field[i] == ' ' || field[i] == '\0'); i++)
+		;
+	for(; i<len && field[i] >= '0' && field[i] <= '7'; i++)
+		v = v * 8 + field[i] - '0';
+
+	return v;
+}
+
+static uint32_t
+tar_sum(const unsigned char *hdr)
+{
+	uint32_t sum;
+	int i;
+
+	sum = 0;
+	for(i=0; i<TAR_BLOCK; i++)
+		sum += i >= 148 && i < 156 ? ' ' : hdr[i];
+
+	return sum;
+}
+
+static void
+tar_set_size(unsigned char *hdr, uint64_t size)
+{
+	char field[13];
+	int i;
+
+	if(size <= 077777777777ULL){
+		snprintf(field,sizeof(field),"%011llo",(unsigned long long)size);
+		memcpy(hdr + 124,field,12);
+	}else{
+		hdr[124] = 0x80;
+		for(i=11; i>0; i--, size >>= 8)
+			hdr[124 + i] = size;
+	}
+
+	snprintf(field,sizeof(field),"%06o",tar_sum(hdr));
+	memcpy(hdr + 148,field,7);
+	hdr[155] = ' ';
+}
+
+static void
+tar_name(const unsigned char *hdr, const char *longname, char *name)
+{
+	if(longname[0] != '\0')
+		snprintf(name,PATH_MAX,"%s",longname);
+	else if(memcmp(hdr + 257,"ustar",5) == 0 && hdr[345] != '\0')
+		snprintf(name,PATH_MAX,"%.155s/%.100s",hdr + 345,hdr);
+	else
+		snprintf(name,PATH_MAX,"%.100s",hdr);
+}
+
+/*
+  Walk a tar stream. Without an output this is the planning pass; with
+  one every member is copied through, except that planned members are
+  cut on the way and their header announces the new size.
+*/
+static void
+tar_rewrite(Package *pkg, Inflow *in, Outflow *out)
+{
+	static const unsigned char zero[TAR_BLOCK];
+	unsigned char hdr[TAR_BLOCK];
+	char name[PATH_MAX], longname[PATH_MAX];
+	char *p, *end, *rec;
+	StripPlan *plan;
+	uint64_t size, keep, pax_size;
+	size_t n;
+	int type, regular;
+
+	longname[0] = '\0';
+	pax_size = UINT64_MAX;
+
+	for(;;){
+		n = inflow_read(in,hdr,TAR_BLOCK);
+		if(n == 0)
+			break;
+		if(n != TAR_BLOCK)
+			err_exit("tar_rewrite() --> truncated tar\n");
+
+		/* End of archive, whatever follows goes through untouched */
+		if(memcmp(hdr,zero,TAR_BLOCK) == 0){
+			if(out != NULL){
+				outflow_write(out,hdr,TAR_BLOCK);
+				member_copy_rest(in,out);
+			}
+			break;
+		}
+
+		if(tar_number(hdr + 148,8) != tar_sum(hdr))
+			err_exit("tar_rewrite() --> bad tar checksum\n");
+
+		size = pax_size != UINT64_MAX ? pax_size : tar_number(hdr + 124,12);
+		type = hdr[156];
+		regular = (type == '0' || type == '\0' || type == '7') && pax_size == UINT64_MAX;
+		tar_name(hdr,longname,name);
+		longname[0] = '\0';
+		pax_size = UINT64_MAX;
+
+		plan = NULL;
+		if(out != NULL && regular)
+			plan = strip_planned(pkg);
+
+		if(plan != NULL){
+			keep = view_cut(&plan->view);
+			tar_set_size(hdr,keep);
+			outflow_write(out,hdr,TAR_BLOCK);
+			strip_emit(pkg,in,out,size,plan,name);
+			outflow_write(out,zero,(TAR_BLOCK - keep % TAR_BLOCK) % TAR_BLOCK);
+			member_copy(in,NULL,(TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+		}else if((type == 'L' || type == 'x') && size < CAPTURE_MAX){
+			/* GNU long names and pax records describe the next member */
+			if(out != NULL)
+				outflow_write(out,hdr,TAR_BLOCK);
+			n = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+			inflow_need(in,pkg->capture,n);
+			if(out != NULL)
+				outflow_write(out,pkg->capture,n);
+			pkg->capture[size] = '\0';
+
+			if(type == 'L')
+				snprintf(longname,sizeof(longname),"%s",(char *)pkg->capture);
+
+			p = (char *)pkg->capture;
+			end = p + size;
+			while(type == 'x' && p < end){
+				n = strtoul(p,&rec,10);
+				if(n == 0 || n > (size_t)(end - p) || *rec != ' ')
+					break;
+				rec++;
+				if(strncmp(rec,"path=",5) == 0)
+					snprintf(longname,sizeof(longname),"%.*s",(int)(p + n - 1 - rec - 5),rec + 5);
+				else if(strncmp(rec,"size=",5) == 0)
+					pax_size = strtoull(rec + 5,NULL,10);
+				p += n;
+			}
+		}else{
+			if(out != NULL)
+				outflow_write(out,hdr,TAR_BLOCK);
+			if(out == NULL && regular)
+				strip_plan(pkg,in,size);
+			else
+				member_copy(in,out,size);
+			member_copy(in,out,(TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+		}
+
+		pkg->member++;
+	}
+}
+
+static uint32_t
+cpio_number(const unsigned char *field)
+{
+	char buf[9];
+
+	memcpy(buf,field,8);
+	buf[8] = '\0';
+
+	return strtoul(buf,NULL,16);
+}
+
+/*
+  Walk a cpio (newc) stream, the payload format of RPM, the same way
+  tar_rewrite() walks a tar stream.
+*/
+static void
+cpio_rewrite(Package *pkg, Inflow *in, Outflow *out)
+{
+	static const unsigned char zero[4];
+	unsigned char hdr[CPIO_HDR_LEN];
+	char name[PATH_MAX + 1], field[9];
+	StripPlan *plan;
+	uint64_t size, keep;
+	size_t n, namesize;
+	int regular;
+
+	for(;;){
+		n = inflow_read(in,hdr,CPIO_HDR_LEN);
+		if(n == 0)
+			break;
+		if(n != CPIO_HDR_LEN || memcmp(hdr,"07070",5) != 0 || (hdr[5] != '1' && hdr[5] != '2'))
+			err_exit("cpio_rewrite() --> bad cpio header\n");
+
+		size = cpio_number(hdr + 54);
+		namesize = cpio_number(hdr + 94);
+		if(namesize == 0 || namesize > sizeof(name))
+			err_exit("cpio_rewrite() --> bad cpio name\n");
+
+		inflow_need(in,name,namesize);
+		name[namesize - 1] = '\0';
+		n = (4 - (CPIO_HDR_LEN + namesize) % 4) % 4;
+
+		if(strcmp(name,"TRAILER!!!") == 0){
+			if(out != NULL){
+				outflow_write(out,hdr,CPIO_HDR_LEN);
+				outflow_write(out,name,namesize);
+				member_copy(in,out,n);
+				member_copy_rest(in,out);
+			}
+			break;
+		}
+
+		/* newc with checksums (070702) would need the sum before the data */
+		regular = S_ISREG(cpio_number(hdr + 14)) && hdr[5] == '1' && size > 0;
+
+		plan = NULL;
+		if(out != NULL && regular)
+			plan = strip_planned(pkg);
+
+		if(plan != NULL){
+			keep = view_cut(&plan->view);
+			snprintf(field,sizeof(field),"%08llx",(unsigned long long)keep);
+			memcpy(hdr + 54,field,8);
+		}
+
+		if(out != NULL){
+			outflow_write(out,hdr,CPIO_HDR_LEN);
+			outflow_write(out,name,namesize);
+		}
+		member_copy(in,out,n);
+
+		if(plan != NULL){
+			strip_emit(pkg,in,out,size,plan,name);
+			outflow_write(out,zero,(4 - keep % 4) % 4);
+			member_copy(in,NULL,(4 - size % 4) % 4);
+		}else{
+			if(out == NULL && regular)
+				strip_plan(pkg,in,size);
+			else
+				member_copy(in,out,size);
+			member_copy(in,out,(4 - size % 4) % 4);
+		}
+
+		pkg->member++;
+	}
+}
+
+static int
+codec_by_name(const char *name)
+{
+	if(strcmp(name,"") == 0)
+		return CODEC_NONE;
+	if(strcmp(name,".gz") == 0 || strcmp(name,"gzip") == 0)
+		return CODEC_GZIP;
+	if(strcmp(name,".xz") == 0 || strcmp(name,"xz") == 0)
+		return CODEC_XZ;
+
+	err_exit("codec_by_name() --> unsupported compression %s\n",name);
+	return -1;
+}
+
+/* Both passes over a payload, the second one writing to out */
+static void
+package_payload(Package *pkg, int codec, const unsigned char *src, size_t len,
+		Outflow *out, void (*walk)(Package *, Inflow *, Outflow *))
+{
+	Inflow in;
+
+	inflow_open(&in,codec,src,len);
+	walk(pkg,&in,NULL);
+	inflow_close(&in);
+
+	pkg->member = 0;
+	inflow_open(&in,codec,src,len);
+	walk(pkg,&in,out);
+	inflow_close(&in);
+	outflow_close(out);
+
+	qsort(pkg->results,pkg->nresults,sizeof(StripResult),result_cmp);
+}
+
+static void
+copy_stream(FILE *src, FILE *dst)
+{
+	unsigned char buf[STREAM_BUF];
+	size_t n;
+
+	rewind(src);
+	while((n = fread(buf,1,sizeof(buf),src)) > 0)
+		if(fwrite(buf,1,n,dst) != n)
+			err_exit("copy_stream() --> fwrite()\n");
+	if(ferror(src))
+		err_exit("copy_stream() --> fread()\n");
+}
+
+/*
+  Rewrite control.tar so md5sums lists the digests of the stripped
+  files. The control archive is small and read into memory whole; a
+  digest keeps its length, so only the hex digits change.
+*/
+static void
+deb_control(Package *pkg, int codec, const unsigned char *src, size_t len, FILE *dst)
+{
+	unsigned char *buf, *hdr, *p, *end, *eol;
+	StripResult *r;
+	Outflow out;
+	Inflow in;
+	size_t size, cap, n, pos;
+	char name[PATH_MAX], path[PATH_MAX + 1];
+
+	cap = 1 << 20;
+	size = 0;
+	buf = NULL;
+	inflow_open(&in,codec,src,len);
+	do{
+		if(size == cap || buf == NULL){
+			cap = buf == NULL ? cap : 2 * cap;
+			if(cap > DEB_CONTROL_MAX)
+				err_exit("deb_control() --> control archive too large\n");
+			buf = (unsigned char *)realloc(buf,cap);
+			if(buf == NULL)
+				err_exit("deb_control() --> realloc()\n");
+		}
+		n = inflow_read(&in,buf + size,cap - size);
+		size += n;
+	}while(n > 0);
+	inflow_close(&in);
+
+	for(pos = 0; pos + TAR_BLOCK <= size; pos += TAR_BLOCK + (n + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK){
+		hdr = buf + pos;
+		n = tar_number(hdr + 124,12);
+		if(hdr[0] == '\0' || !in_bounds(pos + TAR_BLOCK,n,size))
+			break;
+
+		tar_name(hdr,"",name);
+		if(strcmp(name,"./md5sums") != 0 && strcmp(name,"md5sums") != 0)
+			continue;
+
+		/* Lines are "<md5>  <path>", the path relative to / */
+		p = hdr + TAR_BLOCK;
+		end = p + n;
+		for(; p < end; p = eol + 1){
+			eol = (unsigned char *)memchr(p,'\n',end - p);
+			if(eol == NULL)
+				eol = end;
+			if(eol - p < 35 || eol - p - 34 > PATH_MAX - 1)
+				continue;
+
+			snprintf(path,sizeof(path),"/%.*s",(int)(eol - p - 34),p + 34);
+			r = result_find(pkg,path);
+			if(r != NULL)
+				memcpy(p,r->digest,32);
+		}
+	}
+
+	outflow_open(&out,codec,dst);
+	outflow_write(&out,buf,size);
+	outflow_close(&out);
+	free(buf);
+}
+
+/*
+  A .deb is an ar archive of debian-binary, control.tar.* and
+  data.tar.*. The data member is rewritten into a temporary file first,
+  because the control member in front of it lists the new digests.
+*/
+static void
+process_deb(Worker *w, const unsigned char *base, size_t size, FILE *out)
+{
+	unsigned char hdr[AR_HDR_LEN];
+	char names[AR_MAX_MEMBERS][17], field[11];
+	size_t offs[AR_MAX_MEMBERS], lens[AR_MAX_MEMBERS];
+	size_t pos, len, i, count, data, control;
+	FILE *tmp[AR_MAX_MEMBERS];
+	Package pkg;
+	Outflow o;
+	int n;
+
+	count = 0;
+	data = control = AR_MAX_MEMBERS;
+	for(pos = AR_MAGIC_LEN; pos < size; pos += AR_HDR_LEN + len + (len & 1)){
+		if(count == AR_MAX_MEMBERS || !in_bounds(pos,AR_HDR_LEN,size)
+		   || memcmp(base + pos + 58,"`\n",2) != 0)
+			err_exit("process_deb() --> bad ar archive\n");
+
+		memcpy(field,base + pos + 48,10);
+		field[10] = '\0';
+		len = strtoull(field,NULL,10);
+		if(!in_bounds(pos + AR_HDR_LEN,len,size))
+			err_exit("process_deb() --> bad ar archive\n");
+
+		memcpy(names[count],base + pos,16);
+		for(n = 16; n > 0 && (names[count][n - 1] == ' ' || names[count][n - 1] == '/'); n--)
+			;
+		names[count][n] = '\0';
+
+		if(strncmp(names[count],"data.tar",8) == 0)
+			data = count;
+		else if(strncmp(names[count],"control.tar",11) == 0)
+			control = count;
+
+		offs[count] = pos;
+		lens[count] = len;
+		tmp[count] = NULL;
+		count++;
+	}
+
+	if(data == AR_MAX_MEMBERS || control == AR_MAX_MEMBERS)
+		err_exit("process_deb() --> no control or data member\n");
+
+	package_init(&pkg,DIGEST_MD5);
+
+	tmp[data] = tmpfile();
+	if(tmp[data] == NULL)
+		err_exit("process_deb() --> tmpfile()\n");
+	outflow_open(&o,codec_by_name(names[data] + 8),tmp[data]);
+	package_payload(&pkg,o.codec,base + offs[data] + AR_HDR_LEN,lens[data],&o,tar_rewrite);
+
+	tmp[control] = tmpfile();
+	if(tmp[control] == NULL)
+		err_exit("process_deb() --> tmpfile()\n");
+	deb_control(&pkg,codec_by_name(names[control] + 11),
+		base + offs[control] + AR_HDR_LEN,lens[control],tmp[control]);
+
+	fwrite(base,1,AR_MAGIC_LEN,out);
+	for(i=0; i<count; i++){
+		if(tmp[i] == NULL){
+			len = lens[i];
+			fwrite(base + offs[i],1,AR_HDR_LEN + len + (len & 1),out);
+			continue;
+		}
+
+		fflush(tmp[i]);
+		len = ftello(tmp[i]);
+		memcpy(hdr,base + offs[i],AR_HDR_LEN);
+		snprintf(field,sizeof(field),"%-10zu",len);
+		memcpy(hdr + 48,field,10);
+		fwrite(hdr,1,AR_HDR_LEN,out);
+		copy_stream(tmp[i],out);
+		if(len & 1)
+			fputc('\n',out);
+		fclose(tmp[i]);
+	}
+
+	w->cur.strtblsize = pkg.zeroed;
+	package_free(&pkg);
+}
+
+/*
+  Read an RPM header structure (signature or main header) at off:
+  index entries and data store, checked against the file size.
+*/
+static void
+rpm_header(RpmHeader *h, const unsigned char *base, size_t size, size_t off)
+{
+	if(!in_bounds(off,RPM_HEADER_INTRO,size) || memcmp(base + off,RPM_HEADER_MAGIC,8) != 0)
+		err_exit("rpm_header() --> bad header\n");
+
+	h->nindex = be32(base + off + 8);
+	h->hsize = be32(base + off + 12);
+	if(h->nindex > RPM_MAX_INDEX || h->hsize > RPM_MAX_STORE)
+		err_exit("rpm_header() --> header too large\n");
+
+	h->len = RPM_HEADER_INTRO + h->nindex * 16 + h->hsize;
+	if(!in_bounds(off,h->len,size))
+		err_exit("rpm_header() --> truncated header\n");
+
+	h->blob = (unsigned char *)malloc(h->len + 16);
+	if(h->blob == NULL)
+		err_exit("rpm_header() --> malloc()\n");
+	memcpy(h->blob,base + off,h->len);
+}
+
+static unsigned char *
+rpm_store(const RpmHeader *h)
+{
+	return h->blob + RPM_HEADER_INTRO + h->nindex * 16;
+}
+
+/* Bytes taken in the data store by an entry, or 0 if it runs out of it */
+static size_t
+rpm_data_len(const RpmHeader *h, uint32_t type, uint32_t offset, uint32_t count)
+{
+	const unsigned char *store;
+	size_t len, i;
+	const void *nul;
+
+	store = rpm_store(h);
+	if(offset > h->hsize)
+		return 0;
+
+	switch(type){
+	case RPM_INT16_TYPE:
+		len = (uint64_t)count * 2;
+		break;
+	case RPM_INT32_TYPE:
+		len = (uint64_t)count * 4;
+		break;
+	case RPM_INT64_TYPE:
+		len = (uint64_t)count * 8;
+		break;
+	case RPM_STRING_TYPE:
+	case RPM_STRING_ARRAY_TYPE:
+	case RPM_I18NSTRING_TYPE:
+		if(type == RPM_STRING_TYPE)
+			count = 1;
+		for(len = 0, i = 0; i < count; i++){
+			nul = memchr(store + offset + len,'\0',h->hsize - offset - len);
+			if(nul == NULL)
+				return 0;
+			len = (const unsigned char *)nul - (store + offset) + 1;
+		}
+		break;
+	default:
+		len = count;
+	}
+
+	return len <= h->hsize - offset ? len : 0;
+}
+
+/* Data of a tag, NULL if the header does not carry it with that type */
+static unsigned char *
+rpm_find(const RpmHeader *h, uint32_t tag, uint32_t type, uint32_t *count)
+{
+	const unsigned char *e;
+	size_t i;
+
+	for(i=0; i<h->nindex; i++){
+		e = h->blob + RPM_HEADER_INTRO + i * 16;
+		if(be32(e) != tag)
+			continue;
+		if(be32(e + 4) != type || rpm_data_len(h,type,be32(e + 8),be32(e + 12)) == 0)
+			return NULL;
+		if(count != NULL)
+			*count = be32(e + 12);
+		return rpm_store(h) + be32(e + 8);
+	}
+
+	return NULL;
+}
+
+/* Pointers to the strings of a string array, checked by rpm_find() */
+static char **
+rpm_strings(unsigned char *data, uint32_t count)
+{
+	char **v;
+	uint32_t i;
+
+	v = (char **)malloc((count + 1) * sizeof(char *));
+	if(v == NULL)
+		err_exit("rpm_strings() --> malloc()\n");
+
+	for(i=0; i<count; i++){
+		v[i] = (char *)data;
+		data += strlen((char *)data) + 1;
+	}
+
+	return v;
+}
+
+static int
+rpm_file_cmp(const void *a, const void *b)
+{
+	return strcmp(((const RpmFile *)a)->path,((const RpmFile *)b)->path);
+}
+
+/*
+  Put the results of the rewrite into the main header: file sizes and
+  digests of the stripped files, the installed size and the payload
+  digests. Digests keep their length, so the header keeps its layout.
+*/
+static void
+rpm_update_header(RpmHeader *h, Package *pkg, const char *payload, const char *payload_raw)
+{
+	unsigned char *basenames, *dirnames, *dirindexes, *sizes, *lsizes, *digests, *v;
+	uint32_t nfiles, ndirs, n, dir;
+	char **bases, **dirs, **sums, *digest;
+	RpmFile *files, key, *f;
+	StripResult *r;
+	uint64_t delta, old;
+	size_t i;
+
+	basenames = rpm_find(h,RPMTAG_BASENAMES,RPM_STRING_ARRAY_TYPE,&nfiles);
+	dirnames = rpm_find(h,RPMTAG_DIRNAMES,RPM_STRING_ARRAY_TYPE,&ndirs);
+	dirindexes = rpm_find(h,RPMTAG_DIRINDEXES,RPM_INT32_TYPE,&n);
+	if(basenames == NULL || dirnames == NULL || dirindexes == NULL || n != nfiles)
+		err_exit("rpm_update_header() --> no file list\n");
+
+	sizes = rpm_find(h,RPMTAG_FILESIZES,RPM_INT32_TYPE,&n);
+	if(sizes != NULL && n != nfiles)
+		sizes = NULL;
+	lsizes = rpm_find(h,RPMTAG_LONGFILESIZES,RPM_INT64_TYPE,&n);
+	if(lsizes != NULL && n != nfiles)
+		lsizes = NULL;
+	digests = rpm_find(h,RPMTAG_FILEDIGESTS,RPM_STRING_ARRAY_TYPE,&n);
+	if(digests == NULL || n != nfiles)
+		err_exit("rpm_update_header() --> no file digests\n");
+
+	bases = rpm_strings(basenames,nfiles);
+	dirs = rpm_strings(dirnames,ndirs);
+	sums = rpm_strings(digests,nfiles);
+
+	files = (RpmFile *)malloc((nfiles + 1) * sizeof(RpmFile));
+	if(files == NULL)
+		err_exit("rpm_update_header() --> malloc()\n");
+	for(i=0; i<nfiles; i++){
+		dir = be32(dirindexes + 4 * i);
+		if(dir >= ndirs)
+			err_exit("rpm_update_header() --> bad file list\n");
+		files[i].path = (char *)malloc(strlen(dirs[dir]) + strlen(bases[i]) + 1);
+		if(files[i].path == NULL)
+			err_exit("rpm_update_header() --> malloc()\n");
+		sprintf(files[i].path,"%s%s",dirs[dir],bases[i]);
+		files[i].index = i;
+	}
+	qsort(files,nfiles,sizeof(RpmFile),rpm_file_cmp);
+
+	delta = 0;
+	for(i=0; i<pkg->nresults; i++){
+		r = &pkg->results[i];
+		key.path = r->path;
+		f = (RpmFile *)bsearch(&key,files,nfiles,sizeof(RpmFile),rpm_file_cmp);
+		if(f == NULL)
+			continue;
+
+		if(sizes != NULL){
+			old = be32(sizes + 4 * f->index);
+			putbe32(sizes + 4 * f->index,r->size);
+		}else if(lsizes != NULL){
+			old = be64(lsizes + 8 * f->index);
+			putbe64(lsizes + 8 * f->index,r->size);
+		}else
+			old = r->old_size;
+		delta += old - r->size;
+
+		digest = sums[f->index];
+		if(strlen(digest) != strlen(r->digest))
+			err_exit("rpm_update_header() --> unexpected digest length\n");
+		memcpy(digest,r->digest,strlen(digest));
+	}
+
+	v = rpm_find(h,RPMTAG_SIZE,RPM_INT32_TYPE,NULL);
+	if(v != NULL)
+		putbe32(v,be32(v) - delta);
+	v = rpm_find(h,RPMTAG_LONGSIZE,RPM_INT64_TYPE,NULL);
+	if(v != NULL)
+		putbe64(v,be64(v) - delta);
+
+	v = rpm_find(h,RPMTAG_PAYLOADDIGEST,RPM_STRING_ARRAY_TYPE,NULL);
+	if(v != NULL && strlen((char *)v) == strlen(payload))
+		memcpy(v,payload,strlen(payload));
+	v = rpm_find(h,RPMTAG_PAYLOADDIGESTALT,RPM_STRING_ARRAY_TYPE,NULL);
+	if(v != NULL && strlen((char *)v) == strlen(payload_raw))
+		memcpy(v,payload_raw,strlen(payload_raw));
+
+	for(i=0; i<nfiles; i++)
+		free(files[i].path);
+	free(files);
+	free(sums);
+	free(dirs);
+	free(bases);
+}
+
+/*
+  Copy the signature header without the signatures, which stripping
+  invalidates, and with room for the digests that get recomputed. The
+  region trailer is moved along with the remaining entries.
+*/
+static void
+rpm_drop_signatures(RpmHeader *h)
+{
+	static const uint32_t dropped[] = {
+		RPMSIGTAG_DSA, RPMSIGTAG_RSA, RPMSIGTAG_SHA1,
+		RPMSIGTAG_PGP, RPMSIGTAG_GPG
+	};
+	unsigned char *blob, *index, *store, *e, *src;
+	uint32_t tag, type, count, trailer;
+	size_t i, j, n, len, pos, align, region;
+
+	blob = (unsigned char *)malloc(h->len + 16);
+	if(blob == NULL)
+		err_exit("rpm_drop_signatures() --> malloc()\n");
+
+	index = blob + RPM_HEADER_INTRO;
+	store = index + h->nindex * 16;
+	n = 0;
+	pos = 0;
+	region = h->nindex;
+
+	for(i=0; i<h->nindex; i++){
+		e = h->blob + RPM_HEADER_INTRO + i * 16;
+		tag = be32(e);
+		type = be32(e + 4);
+		count = be32(e + 12);
+
+		for(j=0; j<sizeof(dropped) / sizeof(dropped[0]); j++)
+			if(tag == dropped[j])
+				break;
+		if(j < sizeof(dropped) / sizeof(dropped[0]))
+			continue;
+
+		if(tag == RPMSIGTAG_HEADERSIGNATURES && i == 0){
+			/* The trailer is read below, it has to be a whole one */
+			if(type != RPM_BIN_TYPE || count != 16 || !in_bounds(be32(e + 8),16,h->hsize))
+				err_exit("rpm_drop_signatures() --> bad signature header\n");
+			region = n;
+			memcpy(index + 16 * n++,e,16);
+			continue;
+		}
+
+		len = rpm_data_len(h,type,be32(e + 8),count);
+		if(len == 0)
+			err_exit("rpm_drop_signatures() --> bad signature header\n");
+
+		align = type == RPM_INT16_TYPE ? 2 : type == RPM_INT32_TYPE ? 4
+			: type == RPM_INT64_TYPE ? 8 : 1;
+		while(pos % align != 0)
+			store[pos++] = '\0';
+
+		src = rpm_store(h) + be32(e + 8);
+		memmove(store + pos,src,len);
+		memcpy(index + 16 * n,e,16);
+		putbe32(index + 16 * n + 8,pos);
+		pos += len;
+		n++;
+	}
+
+	/* The trailer points back over the entries of the region */
+	if(region != h->nindex){
+		e = index + 16 * region;
+		src = rpm_store(h) + be32(e + 8);
+		trailer = be32(src + 8) + 16 * (h->nindex - n);
+		memcpy(store + pos,src,16);
+		putbe32(store + pos + 8,trailer);
+		putbe32(e + 8,pos);
+		pos += 16;
+	}
+
+	memmove(index + 16 * n,store,pos);
+	memcpy(blob,h->blob,RPM_HEADER_INTRO);
+	putbe32(blob + 8,n);
+	putbe32(blob + 12,pos);
+
+	free(h->blob);
+	h->blob = blob;
+	h->nindex = n;
+	h->hsize = pos;
+	h->len = RPM_HEADER_INTRO + n * 16 + pos;
+}
+
+/*
+  An RPM is a lead, a signature header padded to 8 bytes, the main
+  header and the compressed cpio payload. Headers are written as
+  placeholders of their final size first, the payload is streamed
+  behind them, and both headers are written again once the sizes and
+  digests of the payload are known.
+*/
+static void
+process_rpm(Worker *w, const unsigned char *base, size_t size, FILE *out)
+{
+	unsigned char buf[STREAM_BUF], md[DIGEST_MAX_LEN], *v, *algo;
+	char payload[2 * DIGEST_MAX_LEN + 1], payload_raw[2 * DIGEST_MAX_LEN + 1];
+	char hex[2 * DIGEST_MAX_LEN + 1];
+	RpmHeader sig, hdr;
+	Digest packed, raw, d;
+	Package pkg;
+	Outflow o;
+	size_t off, n;
+	off_t hdr_off, end, pos;
+	int codec, digest_algo;
+	static const unsigned char pad[8];
+
+	off = RPM_LEAD_LEN;
+	rpm_header(&sig,base,size,off);
+	off += sig.len + (8 - sig.len % 8) % 8;
+	rpm_header(&hdr,base,size,off);
+	off += hdr.len;
+
+	v = rpm_find(&hdr,RPMTAG_PAYLOADCOMPRESSOR,RPM_STRING_TYPE,NULL);
+	codec = codec_by_name(v != NULL ? (char *)v : "gzip");
+
+	algo = rpm_find(&hdr,RPMTAG_FILEDIGESTALGO,RPM_INT32_TYPE,NULL);
+	digest_algo = algo != NULL ? be32(algo) : DIGEST_MD5;
+	if(digest_algo != DIGEST_MD5 && digest_algo != DIGEST_SHA256)
+		err_exit("process_rpm() --> unsupported file digest\n");
+
+	algo = rpm_find(&hdr,RPMTAG_PAYLOADDIGESTALGO,RPM_INT32_TYPE,NULL);
+	if(algo != NULL && be32(algo) != DIGEST_SHA256)
+		err_exit("process_rpm() --> unsupported payload digest\n");
+
+	rpm_drop_signatures(&sig);
+
+	fwrite(base,1,RPM_LEAD_LEN,out);
+	fwrite(sig.blob,1,sig.len,out);
+	fwrite(pad,1,(8 - sig.len % 8) % 8,out);
+	hdr_off = ftello(out);
+	fwrite(hdr.blob,1,hdr.len,out);
+
+	package_init(&pkg,digest_algo);
+	outflow_open(&o,codec,out);
+	digest_init(&packed,DIGEST_SHA256);
+	digest_init(&raw,DIGEST_SHA256);
+	o.packed = &packed;
+	o.raw = &raw;
+	package_payload(&pkg,codec,base + off,size - off,&o,cpio_rewrite);
+
+	digest_final(&packed,md,payload);
+	digest_final(&raw,md,payload_raw);
+	rpm_update_header(&hdr,&pkg,payload,payload_raw);
+
+	end = ftello(out);
+	if(fseeko(out,hdr_off,SEEK_SET) == -1)
+		err_exit("process_rpm() --> fseeko()\n");
+	fwrite(hdr.blob,1,hdr.len,out);
+	if(fflush(out) != 0)
+		err_exit("process_rpm() --> fwrite()\n");
+
+	/* The signature covers header and payload, read back what was written */
+	digest_init(&d,DIGEST_MD5);
+	digest_update(&d,hdr.blob,hdr.len);
+	for(pos = hdr_off + hdr.len; pos < end; pos += n){
+		n = end - pos < (off_t)sizeof(buf) ? end - pos : sizeof(buf);
+		if(pread(fileno(out),buf,n,pos) != (ssize_t)n)
+			err_exit("process_rpm() --> pread()\n");
+		digest_update(&d,buf,n);
+	}
+
+	v = rpm_find(&sig,RPMSIGTAG_MD5,RPM_BIN_TYPE,NULL);
+	if(v != NULL)
+		digest_final(&d,v,NULL);
+
+	digest_init(&d,DIGEST_SHA256);
+	digest_update(&d,hdr.blob,hdr.len);
+	digest_final(&d,md,hex);
+	v = rpm_find(&sig,RPMSIGTAG_SHA256,RPM_STRING_TYPE,NULL);
+	if(v != NULL && strlen((char *)v) == strlen(hex))
+		memcpy(v,hex,strlen(hex));
+
+	v = rpm_find(&sig,RPMSIGTAG_SIZE,RPM_INT32_TYPE,NULL);
+	if(v != NULL)
+		putbe32(v,end - hdr_off);
+	v = rpm_find(&sig,RPMSIGTAG_LONGSIZE,RPM_INT64_TYPE,NULL);
+	if(v != NULL)
+		putbe64(v,end - hdr_off);
+	v = rpm_find(&sig,RPMSIGTAG_PAYLOADSIZE,RPM_INT32_TYPE,NULL);
+	if(v != NULL)
+		putbe32(v,o.raw_len);
+	v = rpm_find(&sig,RPMSIGTAG_LONGARCHIVESIZE,RPM_INT64_TYPE,NULL);
+	if(v != NULL)
+		putbe64(v,o.raw_len);
+
+	if(fseeko(out,RPM_LEAD_LEN,SEEK_SET) == -1)
+		err_exit("process_rpm() --> fseeko()\n");
+	fwrite(sig.blob,1,sig.len,out);
+	fseeko(out,end,SEEK_SET);
+
+	w->cur.strtblsize = pkg.zeroed;
+	package_free(&pkg);
+	free(sig.blob);
+	free(hdr.blob);
+}
+
+/*
+  Strip the ELF files packed into a Debian or RPM package. Payloads are
+  decompressed twice rather than held in memory, and the metadata which
+  describes the files (md5sums, RPM file sizes and digests, payload
+  digests and sizes) is rewritten to match. RPM signatures are dropped:
+  stripped packages have to be signed again.
+*/
+static void
+process_package(Worker *w, const char *in_file, const char *out_file)
+{
+	const unsigned char *base;
+	size_t size;
+	off_t end;
+	FILE *out;
+	struct stat sb;
+	int fd;
+
+	errno = 0;
+	memset(&w->cur,0,sizeof(Event));
+	w->cur.in_file = in_file;
+	w->cur.out_file = out_file;
+	w->cur.start = now_ns();
+
+	fd = open(in_file,O_RDONLY);
+	if(fd == -1)
+		err_exit("process_package() --> open(%s)\n",in_file);
+	if(fstat(fd,&sb) == -1)
+		err_exit("process_package() --> fstat()\n");
+
+	size = sb.st_size;
+	if(size < RPM_LEAD_LEN)
+		err_exit("process_package() --> bad package\n");
+
+	base = (const unsigned char *)mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+	if(base == MAP_FAILED)
+		err_exit("process_package() --> mmap()\n");
+	close(fd);
+	w->cur.size = size;
+
+	/* RPM needs to read back what it wrote, for the signature digest */
+	fd = open(out_file,O_CREAT|O_RDWR|O_TRUNC,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if(fd == -1 || (out = fdopen(fd,"w+")) == NULL)
+		err_exit("process_package() --> open(%s)\n",out_file);
+	setvbuf(out,NULL,_IOFBF,1 << 20);
+
+	if(memcmp(base,AR_MAGIC,AR_MAGIC_LEN) == 0){
+		w->cur.engine = "deb";
+		process_deb(w,base,size,out);
+	}else if(be32(base) == 0xedabeedb){
+		w->cur.engine = "rpm";
+		process_rpm(w,base,size,out);
+	}else
+		err_exit("process_package() --> neither deb nor rpm\n");
+
+	if(fseeko(out,0,SEEK_END) == -1 || (end = ftello(out)) == -1)
+		err_exit("process_package() --> ftello()\n");
+	if(ferror(out) || fclose(out) != 0)
+		err_exit("process_package() --> write()\n");
+
+	w->cur.truncated = size > (size_t)end ? size - end : 0;
+
+	munmap((void *)base,size);
+
+	if(opt_events && events_emit(w,0,NULL) == -1)
+		err_exit("process_package() --> events_emit()\n");
+	w->cur.in_file = NULL;
+
+	if(w->stats != NULL)
+		hist_record(&w->stats->hist[size_class(size)][STAGE_TOTAL],now_ns() - w->cur.start);
+}
+
+static uint64_t
+le64(const unsigned char *p)
+{
+	return le32(p) | (uint64_t)le32(p + 4) << 32;
+}
+
+static void
+put64(unsigned char *p, uint64_t v)
+{
+	put32(p,v);
+	put32(p + 4,v >> 32);
+}
+
+static uint64_t
+sqfs_tell(const SqfsImage *img, FILE *out)
+{
+	off_t pos;
+
+	pos = ftello(out);
+	if(pos == -1)
+		err_exit("sqfs_tell() --> ftello()\n");
+
+	return pos - img->origin;
+}
+
+/* Decompress a block into dst, stopping after want bytes; returns bytes produced */
+static size_t
+sqfs_inflate(const SqfsImage *img, const unsigned char *src, size_t len,
+	     unsigned char *dst, size_t want)
+{
+	z_stream zs;
+	lzma_stream xs = LZMA_STREAM_INIT;
+	lzma_ret lret;
+	size_t produced;
+	int ret;
+
+	if(img->compressor == SQFS_XZ){
+		if(lzma_stream_decoder(&xs,UINT64_MAX,0) != LZMA_OK)
+			err_exit("sqfs_inflate() --> lzma_stream_decoder()\n");
+		xs.next_in = src;
+		xs.avail_in = len;
+		xs.next_out = dst;
+		xs.avail_out = want;
+		do
+			lret = lzma_code(&xs,LZMA_FINISH);
+		while(lret == LZMA_OK && xs.avail_out > 0);
+		if(lret != LZMA_OK && lret != LZMA_STREAM_END)
+			err_exit("sqfs_inflate() --> lzma_code()\n");
+		produced = want - xs.avail_out;
+		lzma_end(&xs);
+		return produced;
+	}
+
+	memset(&zs,0,sizeof(zs));
+	if(inflateInit(&zs) != Z_OK)
+		err_exit("sqfs_inflate() --> inflateInit()\n");
+	zs.next_in = (Bytef *)src;
+	zs.avail_in = len;
+	zs.next_out = dst;
+	zs.avail_out = want;
+	do
+		ret = inflate(&zs,Z_FINISH);
+	while(ret == Z_OK && zs.avail_out > 0);
+	if(ret != Z_OK && ret != Z_STREAM_END && !(ret == Z_BUF_ERROR && zs.avail_out == 0))
+		err_exit("sqfs_inflate() --> inflate()\n");
+	produced = want - zs.avail_out;
+	inflateEnd(&zs);
+
+	return produced;
+}
+
+/*
+  Compress a block into dst, which has room for len bytes. Returns the
+  compressed length, or len with SQFS_BLOCK_RAW set when the block is
+  stored as it is, because it does not shrink or raw was asked for.
+*/
+static uint32_t
+sqfs_deflate(const SqfsImage *img, const unsigned char *src, size_t len,
+	     unsigned char *dst, int raw)
+{
+	z_stream zs;
+	lzma_options_lzma opt;
+	lzma_filter filters[2];
+	size_t pos;
+	int ret;
+
+	if(!raw && img->compressor == SQFS_XZ){
+		if(lzma_lzma_preset(&opt,LZMA_PRESET_DEFAULT))
+			err_exit("sqfs_deflate() --> lzma_lzma_preset()\n");
+		/* The kernel decoder allocates a dictionary of the block size at most */
+		opt.dict_size = img->dict_size;
+		filters[0].id = LZMA_FILTER_LZMA2;
+		filters[0].options = &opt;
+		filters[1].id = LZMA_VLI_UNKNOWN;
+		pos = 0;
+		if(lzma_stream_buffer_encode(filters,LZMA_CHECK_CRC32,NULL,src,len,dst,&pos,len) == LZMA_OK
+		   && pos < len)
+			return pos;
+	}else if(!raw){
+		memset(&zs,0,sizeof(zs));
+		if(deflateInit2(&zs,img->level,Z_DEFLATED,img->window,8,Z_DEFAULT_STRATEGY) != Z_OK)
+			err_exit("sqfs_deflate() --> deflateInit2()\n");
+		zs.next_in = (Bytef *)src;
+		zs.avail_in = len;
+		zs.next_out = dst;
+		zs.avail_out = len;
+		ret = deflate(&zs,Z_FINISH);
+		pos = len - zs.avail_out;
+		deflateEnd(&zs);
+		if(ret == Z_STREAM_END && pos < len)
+			return pos;
+	}
+
+	memcpy(dst,src,len);
+	return len | SQFS_BLOCK_RAW;
+}
+
+/* Read the metadata block at *pos into dst and step over it; returns its length */
+static size_t
+sqfs_meta_read(const SqfsImage *img, uint64_t *pos, unsigned char *dst)
+{
+	size_t len, n;
+	uint32_t word;
+
+	if(!in_bounds(*pos,2,img->size))
+		err_exit("sqfs_meta_read() --> metadata out of bounds\n");
+
+	word = le16(img->base + *pos);
+	len = word & ~SQFS_META_RAW;
+	if(len == 0 || len > SQFS_META_SIZE || !in_bounds(*pos + 2,len,img->size))
+		err_exit("sqfs_meta_read() --> bad metadata block\n");
+
+	if(word & SQFS_META_RAW){
+		memcpy(dst,img->base + *pos + 2,len);
+		n = len;
+	}else
+		n = sqfs_inflate(img,img->base + *pos + 2,len,dst,SQFS_META_SIZE);
+
+	*pos += 2 + len;
+
+	return n;
+}
+
+/* Decompress the metadata blocks in [start, end) */
+static void
+sqfs_table_read(const SqfsImage *img, SqfsTable *t, uint64_t start, uint64_t end)
+{
+	uint64_t pos;
+	size_t cap, n;
+
+	memset(t,0,sizeof(SqfsTable));
+	if(start > end || end > img->size)
+		err_exit("sqfs_table_read() --> table out of bounds\n");
+
+	cap = 0;
+	for(pos = start; pos < end; ){
+		if(t->nblocks == cap){
+			cap = cap ? 2 * cap : 64;
+			t->blocks = (uint64_t *)realloc(t->blocks,cap * sizeof(uint64_t));
+			t->data = (unsigned char *)realloc(t->data,cap * SQFS_META_SIZE);
+			if(t->blocks == NULL || t->data == NULL)
+				err_exit("sqfs_table_read() --> realloc()\n");
+		}
+
+		/* Only the last block may be short, references count on it */
+		if(t->len % SQFS_META_SIZE != 0)
+			err_exit("sqfs_table_read() --> short metadata block\n");
+
+		t->blocks[t->nblocks++] = pos - start;
+		n = sqfs_meta_read(img,&pos,t->data + t->len);
+		t->len += n;
+	}
+}
+
+static void
+sqfs_table_free(SqfsTable *t)
+{
+	free(t->data);
+	free(t->blocks);
+}
+
+/* Offset in the decompressed table of a block/offset reference */
+static size_t
+sqfs_table_pos(const SqfsTable *t, uint64_t block, size_t offset)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = t->nblocks;
+	while(lo < hi){
+		mid = (lo + hi) / 2;
+		if(t->blocks[mid] < block)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if(lo == t->nblocks || t->blocks[lo] != block || offset >= SQFS_META_SIZE
+	   || lo * SQFS_META_SIZE + offset >= t->len)
+		err_exit("sqfs_table_pos() --> bad metadata reference\n");
+
+	return lo * SQFS_META_SIZE + offset;
+}
+
+/* Read a table of len bytes listed by the block pointers at lookup */
+static unsigned char *
+sqfs_lookup_read(const SqfsImage *img, uint64_t lookup, size_t len)
+{
+	unsigned char *data;
+	uint64_t pos;
+	size_t n, i, got;
+
+	n = (len + SQFS_META_SIZE - 1) / SQFS_META_SIZE;
+	if(!in_bounds(lookup,8 * n,img->size))
+		err_exit("sqfs_lookup_read() --> table out of bounds\n");
+
+	data = (unsigned char *)malloc(n * SQFS_META_SIZE + 1);
+	if(data == NULL)
+		err_exit("sqfs_lookup_read() --> malloc()\n");
+
+	got = 0;
+	for(i=0; i<n; i++){
+		pos = le64(img->base + lookup + 8 * i);
+		if(got % SQFS_META_SIZE != 0)
+			err_exit("sqfs_lookup_read() --> short metadata block\n");
+		got += sqfs_meta_read(img,&pos,data + got);
+	}
+
+	if(got < len)
+		err_exit("sqfs_lookup_read() --> short table\n");
+
+	return data;
+}
+
+static void
+sqfs_meta_flush(const SqfsImage *img, SqfsMeta *m)
+{
+	uint32_t word;
+
+	if(m->cur_len == 0)
+		return;
+
+	if(m->out_len + 2 + SQFS_META_SIZE > m->out_cap){
+		m->out_cap = m->out_cap ? 2 * m->out_cap : 1 << 16;
+		m->out = (unsigned char *)realloc(m->out,m->out_cap);
+		if(m->out == NULL)
+			err_exit("sqfs_meta_flush() --> realloc()\n");
+	}
+
+	word = sqfs_deflate(img,m->cur,m->cur_len,m->out + m->out_len + 2,
+		img->flags & SQFS_FLAG_RAW_INODES);
+	if(word & SQFS_BLOCK_RAW)
+		word = (word & ~SQFS_BLOCK_RAW) | SQFS_META_RAW;
+	put16(m->out + m->out_len,word);
+	m->out_len += 2 + (word & ~SQFS_META_RAW);
+	m->cur_len = 0;
+}
+
+static void
+sqfs_meta_put(const SqfsImage *img, SqfsMeta *m, const void *data, size_t len)
+{
+	const unsigned char *p;
+	size_t n;
+
+	for(p = (const unsigned char *)data; len > 0; p += n, len -= n){
+		n = SQFS_META_SIZE - m->cur_len < len ? SQFS_META_SIZE - m->cur_len : len;
+		memcpy(m->cur + m->cur_len,p,n);
+		m->cur_len += n;
+		if(m->cur_len == SQFS_META_SIZE)
+			sqfs_meta_flush(img,m);
+	}
+}
+
+/* Reference of the next byte written: block position and offset in it */
+static uint64_t
+sqfs_meta_ref(const SqfsMeta *m)
+{
+	if(m->out_len > UINT32_MAX)
+		err_exit("sqfs_meta_ref() --> metadata table too large\n");
+
+	return (uint64_t)m->out_len << 16 | m->cur_len;
+}
+
+/* Write a table as metadata blocks and a lookup of their positions, returns the lookup's */
+static uint64_t
+sqfs_lookup_write(const SqfsImage *img, FILE *out, const unsigned char *data, size_t len)
+{
+	SqfsMeta m;
+	unsigned char ptr[8];
+	uint64_t start, pos;
+	size_t i;
+
+	memset(&m,0,sizeof(SqfsMeta));
+	start = sqfs_tell(img,out);
+
+	for(i=0; i<len; i+=SQFS_META_SIZE)
+		sqfs_meta_put(img,&m,data + i,len - i < SQFS_META_SIZE ? len - i : SQFS_META_SIZE);
+	sqfs_meta_flush(img,&m);
+	fwrite(m.out,1,m.out_len,out);
+
+	pos = sqfs_tell(img,out);
+	for(i=0; i<m.out_len; i+=2 + (le16(m.out + i) & ~SQFS_META_RAW)){
+		put64(ptr,start + i);
+		fwrite(ptr,1,8,out);
+	}
+
+	free(m.out);
+
+	return pos;
+}
+
+/*
+  Copy the blocks of a table as they are and write a new lookup of
+  them, behind hdr if there is one. Returns the position of hdr or of
+  the lookup.
+*/
+static uint64_t
+sqfs_lookup_copy(const SqfsImage *img, FILE *out, uint64_t lookup, size_t len,
+		 const unsigned char *hdr, size_t hdr_len)
+{
+	unsigned char ptr[8];
+	uint64_t *ptrs, pos;
+	size_t n, i, blen;
+
+	n = (len + SQFS_META_SIZE - 1) / SQFS_META_SIZE;
+	if(!in_bounds(lookup,8 * n,img->size))
+		err_exit("sqfs_lookup_copy() --> table out of bounds\n");
+
+	ptrs = (uint64_t *)malloc((n + 1) * sizeof(uint64_t));
+	if(ptrs == NULL)
+		err_exit("sqfs_lookup_copy() --> malloc()\n");
+
+	for(i=0; i<n; i++){
+		pos = le64(img->base + lookup + 8 * i);
+		if(!in_bounds(pos,2,img->size))
+			err_exit("sqfs_lookup_copy() --> table out of bounds\n");
+		blen = 2 + (le16(img->base + pos) & ~SQFS_META_RAW);
+		if(!in_bounds(pos,blen,img->size))
+			err_exit("sqfs_lookup_copy() --> table out of bounds\n");
+		ptrs[i] = sqfs_tell(img,out);
+		fwrite(img->base + pos,1,blen,out);
+	}
+
+	pos = sqfs_tell(img,out);
+	if(hdr != NULL)
+		fwrite(hdr,1,hdr_len,out);
+	for(i=0; i<n; i++){
+		put64(ptr,ptrs[i]);
+		fwrite(ptr,1,8,out);
+	}
+	free(ptrs);
+
+	return pos;
+}
+
+/*
+  Go through the inode table once, recording where every inode starts
+  and how long it is. Inodes of regular files are checked against the
+  block size, so their block lists can be used without further checks.
+*/
+static void
+sqfs_parse_inodes(SqfsImage *img)
+{
+	const unsigned char *p;
+	SqfsInode *ino;
+	size_t pos, cap, len, i, count;
+	uint64_t size;
+	uint32_t frag;
+
+	cap = 0;
+	for(pos = 0; pos < img->itable.len; pos += len){
+		if(img->ninodes == cap){
+			cap = cap ? 2 * cap : 1024;
+			img->inodes = (SqfsInode *)realloc(img->inodes,cap * sizeof(SqfsInode));
+			if(img->inodes == NULL)
+				err_exit("sqfs_parse_inodes() --> realloc()\n");
+		}
+
+		if(!in_bounds(pos,16,img->itable.len))
+			err_exit("sqfs_parse_inodes() --> truncated inode\n");
+		p = img->itable.data + pos;
+
+		ino = &img->inodes[img->ninodes++];
+		memset(ino,0,sizeof(SqfsInode));
+		ino->pos = pos;
+		ino->type = le16(p);
+		ino->number = le32(p + 12);
+
+		len = 0;
+		switch(ino->type){
+		case SQFS_DIR:
+			len = 32;
+			break;
+		case SQFS_LDIR:
+			if(!in_bounds(pos,40,img->itable.len))
+				break;
+			count = le16(p + 32);
+			for(len = 40, i = 0; i < count && in_bounds(pos,len + 12,img->itable.len); i++)
+				len += 12 + le32(p + len + 8) + 1;
+			break;
+		case SQFS_FILE:
+		case SQFS_LFILE:
+			len = ino->type == SQFS_FILE ? 32 : 56;
+			if(!in_bounds(pos,len,img->itable.len))
+				break;
+			size = ino->type == SQFS_FILE ? le32(p + 28) : le64(p + 24);
+			frag = ino->type == SQFS_FILE ? le32(p + 20) : le32(p + 44);
+			count = frag == SQFS_NONE ? (size + img->block_size - 1) / img->block_size
+				: size / img->block_size;
+			if(count > img->itable.len / 4)
+				err_exit("sqfs_parse_inodes() --> bad file inode\n");
+			len += 4 * count;
+			break;
+		case SQFS_SYMLINK:
+		case SQFS_LSYMLINK:
+			if(in_bounds(pos,24,img->itable.len))
+				len = 24 + le32(p + 20) + (ino->type == SQFS_LSYMLINK ? 4 : 0);
+			break;
+		case SQFS_BLKDEV:
+		case SQFS_CHRDEV:
+			len = 24;
+			break;
+		case SQFS_LBLKDEV:
+		case SQFS_LCHRDEV:
+			len = 28;
+			break;
+		case SQFS_FIFO:
+		case SQFS_SOCKET:
+			len = 20;
+			break;
+		case SQFS_LFIFO:
+		case SQFS_LSOCKET:
+			len = 24;
+			break;
+		default:
+			err_exit("sqfs_parse_inodes() --> bad inode type\n");
+		}
+
+		if(len == 0 || !in_bounds(pos,len,img->itable.len))
+			err_exit("sqfs_parse_inodes() --> truncated inode\n");
+		ino->len = len;
+	}
+}
+
+static SqfsInode *
+sqfs_inode_at(const SqfsImage *img, uint64_t ref)
+{
+	size_t pos, lo, hi, mid;
+
+	pos = sqfs_table_pos(&img->itable,ref >> 16,ref & 0xffff);
+
+	lo = 0;
+	hi = img->ninodes;
+	while(lo < hi){
+		mid = (lo + hi) / 2;
+		if(img->inodes[mid].pos < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if(lo == img->ninodes || img->inodes[lo].pos != pos)
+		err_exit("sqfs_inode_at() --> bad inode reference\n");
+
+	return &img->inodes[lo];
+}
+
+static int
+sqfs_run_cmp(const void *a, const void *b)
+{
+	const SqfsRun *x, *y;
+
+	x = (const SqfsRun *)a;
+	y = (const SqfsRun *)b;
+
+	if(x->old_start != y->old_start)
+		return x->old_start < y->old_start ? -1 : 1;
+	if(x->old_size != y->old_size)
+		return x->old_size < y->old_size ? -1 : 1;
+	if(x->old_fragment != y->old_fragment)
+		return x->old_fragment < y->old_fragment ? -1 : 1;
+	if(x->old_frag_offset != y->old_frag_offset)
+		return x->old_frag_offset < y->old_frag_offset ? -1 : 1;
+
+	return memcmp(x->old_sizes,y->old_sizes,4 * x->old_nblocks);
+}
+
+/*
+  Collect the data of the regular files, in the order it sits in the
+  image. Files which mksquashfs deduplicated share their blocks, and
+  share a run here, so they are stripped and written only once.
+*/
+static void
+sqfs_collect_runs(SqfsImage *img)
+{
+	const unsigned char *p;
+	SqfsInode *ino;
+	SqfsRun *r;
+	size_t i, j, n, len;
+	int basic;
+
+	img->runs = (SqfsRun *)calloc(img->ninodes + 1,sizeof(SqfsRun));
+	if(img->runs == NULL)
+		err_exit("sqfs_collect_runs() --> calloc()\n");
+
+	n = 0;
+	for(i=0; i<img->ninodes; i++){
+		ino = &img->inodes[i];
+		if(ino->type != SQFS_FILE && ino->type != SQFS_LFILE)
+			continue;
+
+		p = img->itable.data + ino->pos;
+		basic = ino->type == SQFS_FILE;
+		r = &img->runs[n++];
+		r->old_start = basic ? le32(p + 16) : le64(p + 16);
+		r->old_size = basic ? le32(p + 28) : le64(p + 24);
+		r->old_fragment = basic ? le32(p + 20) : le32(p + 44);
+		r->old_frag_offset = basic ? le32(p + 24) : le32(p + 48);
+		r->old_sizes = p + (basic ? 32 : 56);
+		r->old_nblocks = (ino->len - (basic ? 32 : 56)) / 4;
+		r->inode = i;
+
+		if(r->old_fragment != SQFS_NONE && (r->old_fragment >= img->old_nfrags
+		   || r->old_frag_offset >= img->block_size
+		   || r->old_size % img->block_size > img->block_size - r->old_frag_offset))
+			err_exit("sqfs_collect_runs() --> bad fragment reference\n");
+
+		for(j=0; j<r->old_nblocks; j++){
+			len = le32(r->old_sizes + 4 * j) & ~SQFS_BLOCK_RAW;
+			if(len > img->block_size)
+				err_exit("sqfs_collect_runs() --> bad block size\n");
+			r->span += len;
+		}
+		if(r->old_nblocks > 0 && !in_bounds(r->old_start,r->span,img->size))
+			err_exit("sqfs_collect_runs() --> file data out of bounds\n");
+	}
+
+	qsort(img->runs,n,sizeof(SqfsRun),sqfs_run_cmp);
+
+	img->nruns = 0;
+	for(i=0; i<n; i++){
+		ino = &img->inodes[img->runs[i].inode];
+		if(img->nruns == 0 || sqfs_run_cmp(&img->runs[img->nruns - 1],&img->runs[i]) != 0)
+			img->runs[img->nruns++] = img->runs[i];
+		ino->run = &img->runs[img->nruns - 1];
+	}
+
+	for(i=0; i<img->nruns; i++)
+		img->runs[i].fragment = SQFS_NONE;
+}
+
+/* Length of block i of a file of the given size */
+static size_t
+sqfs_block_len(const SqfsImage *img, uint64_t size, size_t i)
+{
+	uint64_t off;
+
+	off = (uint64_t)i * img->block_size;
+	return size - off < img->block_size ? size - off : img->block_size;
+}
+
+/* First want bytes of block i of a run, as it is in the input image */
+static void
+sqfs_block_read(const SqfsImage *img, const SqfsRun *r, size_t i, unsigned char *dst, size_t want)
+{
+	uint32_t word;
+	size_t len;
+
+	word = le32(r->old_sizes + 4 * i);
+	len = word & ~SQFS_BLOCK_RAW;
+
+	/* A size of zero marks a hole */
+	if(len == 0)
+		memset(dst,0,want);
+	else if(word & SQFS_BLOCK_RAW){
+		if(len < want)
+			err_exit("sqfs_block_read() --> short block\n");
+		memcpy(dst,img->base + r->old_offsets[i],want);
+	}else if(sqfs_inflate(img,img->base + r->old_offsets[i],len,dst,want) != want)
+		err_exit("sqfs_block_read() --> short block\n");
+}
+
+/* Decompress fragment block i of the input image, returns its length */
+static size_t
+sqfs_frag_read(const SqfsImage *img, uint32_t i, unsigned char *dst)
+{
+	const unsigned char *e;
+	uint64_t start;
+	uint32_t word;
+	size_t len;
+
+	e = img->old_frags + 16 * i;
+	start = le64(e);
+	word = le32(e + 8);
+	len = word & ~SQFS_BLOCK_RAW;
+
+	if(len == 0 || len > img->block_size || !in_bounds(start,len,img->size))
+		err_exit("sqfs_frag_read() --> bad fragment\n");
+
+	if(word & SQFS_BLOCK_RAW){
+		memcpy(dst,img->base + start,len);
+		return len;
+	}
+
+	return sqfs_inflate(img,img->base + start,len,dst,img->block_size);
+}
+
+/*
+  Read [off, off + len) of a file of the input image, for the planning
+  pass. The last fragment block read is kept in frag, *cached tells
+  which one it is.
+*/
+static void
+sqfs_read(const SqfsImage *img, const SqfsRun *r, uint64_t off, size_t len,
+	  unsigned char *dst, unsigned char *block, unsigned char *frag, uint32_t *cached)
+{
+	uint64_t tail;
+	size_t i, in, n, flen;
+
+	tail = (uint64_t)r->old_nblocks * img->block_size;
+
+	while(len > 0){
+		if(off < tail){
+			i = off / img->block_size;
+			in = off % img->block_size;
+			n = sqfs_block_len(img,r->old_size,i) - in < len ? sqfs_block_len(img,r->old_size,i) - in : len;
+			sqfs_block_read(img,r,i,block,in + n);
+			memcpy(dst,block + in,n);
+		}else{
+			if(*cached != r->old_fragment){
+				*cached = SQFS_NONE;
+				flen = sqfs_frag_read(img,r->old_fragment,frag);
+				if(r->old_frag_offset + (r->old_size - tail) > flen)
+					err_exit("sqfs_read() --> bad fragment reference\n");
+				*cached = r->old_fragment;
+			}
+			n = len;
+			memcpy(dst,frag + r->old_frag_offset + (off - tail),n);
+		}
+
+		dst += n;
+		off += n;
+		len -= n;
+	}
+}
+
+static SqfsBlock *
+sqfs_job(SqfsImage *img)
+{
+	if(img->njobs == img->jobs_cap){
+		img->jobs_cap = img->jobs_cap ? 2 * img->jobs_cap : 64;
+		img->jobs = (SqfsBlock *)realloc(img->jobs,img->jobs_cap * sizeof(SqfsBlock));
+		if(img->jobs == NULL)
+			err_exit("sqfs_job() --> realloc()\n");
+	}
+
+	return &img->jobs[img->njobs++];
+}
+
+/* Room for a tail of len bytes in the new fragment blocks */
+static unsigned char *
+sqfs_frag_alloc(SqfsImage *img, size_t len, uint32_t *index, uint32_t *offset)
+{
+	SqfsFrag *f;
+
+	f = img->nfrags ? &img->frags[img->nfrags - 1] : NULL;
+	if(f == NULL || f->len + len > img->block_size){
+		if(img->nfrags == img->frags_cap){
+			img->frags_cap = img->frags_cap ? 2 * img->frags_cap : 16;
+			img->frags = (SqfsFrag *)realloc(img->frags,img->frags_cap * sizeof(SqfsFrag));
+			if(img->frags == NULL)
+				err_exit("sqfs_frag_alloc() --> realloc()\n");
+		}
+		f = &img->frags[img->nfrags++];
+		memset(f,0,sizeof(SqfsFrag));
+		f->data = (unsigned char *)malloc(img->block_size);
+		if(f->data == NULL)
+			err_exit("sqfs_frag_alloc() --> malloc()\n");
+	}
+
+	*index = img->nfrags - 1;
+	*offset = f->len;
+	f->len += len;
+
+	return f->data + *offset;
+}
+
+/*
+  Planning pass over one file: read its ELF header and section header
+  table and, if both validate, plan the cut. Blocks before the cut
+  which neither the header patch nor the string table touch keep their
+  compressed bytes; the others become jobs for the copy threads.
+*/
+static void
+sqfs_plan(SqfsImage *img, SqfsRun *r, unsigned char *capture, unsigned char *block,
+	  unsigned char *frag, uint32_t *cached)
+{
+	unsigned char hdr[sizeof(Elf64_Ehdr)];
+	ElfView view;
+	SqfsBlock *job;
+	uint64_t off, avail, end, pos;
+	size_t i, n, len, tail;
+	int use_frag;
+
+	n = r->old_size < sizeof(hdr) ? r->old_size : sizeof(hdr);
+	if(n < EI_NIDENT)
+		return;
+
+	r->old_offsets = (uint64_t *)malloc((r->old_nblocks + 1) * sizeof(uint64_t));
+	if(r->old_offsets == NULL)
+		err_exit("sqfs_plan() --> malloc()\n");
+	for(pos = r->old_start, i = 0; i < r->old_nblocks; i++){
+		r->old_offsets[i] = pos;
+		pos += le32(r->old_sizes + 4 * i) & ~SQFS_BLOCK_RAW;
+	}
+
+	sqfs_read(img,r,0,n,hdr,block,frag,cached);
+	if(elf_view_header(&view,hdr,r->old_size) != NULL)
+		return;
+
+	avail = r->old_size - view.shoff;
+	if(avail > CAPTURE_MAX)
+		avail = CAPTURE_MAX;
+	sqfs_read(img,r,view.shoff,avail,capture,block,frag,cached);
+	if(elf_view_sections(&view,capture,avail) != NULL)
+		return;
+
+	r->elf = 1;
+	r->view = view;
+	r->view.base = NULL;
+	r->view.shdrs = NULL;
+	memcpy(r->hdr,hdr,view.ehsize);
+	patch_image(r->hdr,view.ehsize,&r->view);
+
+	end = view.strtbloff + view.strtblsize;
+	if(end > view_cut(&view))
+		end = view_cut(&view);
+	img->zeroed += end > view.strtbloff ? end - view.strtbloff : 0;
+
+	/* Keep the tail where mksquashfs put it, in a fragment or a block of its own */
+	r->size = view_cut(&view);
+	use_frag = r->old_fragment != SQFS_NONE && !(img->flags & SQFS_FLAG_NO_FRAGMENTS);
+	r->nblocks = use_frag ? r->size / img->block_size
+		: (r->size + img->block_size - 1) / img->block_size;
+	tail = use_frag ? r->size % img->block_size : 0;
+
+	r->sizes = (uint32_t *)malloc((r->nblocks + 1) * sizeof(uint32_t));
+	r->blocks = (unsigned char **)calloc(r->nblocks + 1,sizeof(unsigned char *));
+	if(r->sizes == NULL || r->blocks == NULL)
+		err_exit("sqfs_plan() --> malloc()\n");
+
+	for(i=0; i<r->nblocks; i++){
+		off = (uint64_t)i * img->block_size;
+		len = sqfs_block_len(img,r->size,i);
+		r->sizes[i] = le32(r->old_sizes + 4 * i);
+		if(len == sqfs_block_len(img,r->old_size,i) && off >= view.ehsize
+		   && (off + len <= view.strtbloff || off >= end)){
+			if(r->sizes[i] == 0)
+				r->sparse += len;
+			continue;
+		}
+
+		job = sqfs_job(img);
+		job->run = r;
+		job->index = i;
+		job->frag = NULL;
+	}
+
+	if(tail > 0){
+		job = sqfs_job(img);
+		job->run = r;
+		job->index = r->nblocks;
+		job->frag = sqfs_frag_alloc(img,tail,&r->fragment,&r->frag_offset);
+	}
+}
+
+/* Cut and patch one block of a stripped file, on a copy thread */
+static void
+sqfs_strip_block(SqfsImage *img, SqfsBlock *job, unsigned char *buf,
+		 unsigned char *frag, uint32_t *cached)
+{
+	SqfsRun *r;
+	uint64_t off, tail;
+	size_t len, flen;
+
+	r = job->run;
+	off = (uint64_t)job->index * img->block_size;
+	tail = (uint64_t)r->old_nblocks * img->block_size;
+	len = sqfs_block_len(img,r->size,job->index);
+
+	if(off < tail)
+		sqfs_block_read(img,r,job->index,buf,len);
+	else{
+		if(*cached != r->old_fragment){
+			*cached = SQFS_NONE;
+			flen = sqfs_frag_read(img,r->old_fragment,frag);
+			if(r->old_frag_offset + (r->old_size - tail) > flen)
+				err_exit("sqfs_strip_block() --> bad fragment reference\n");
+			*cached = r->old_fragment;
+		}
+		memcpy(buf,frag + r->old_frag_offset + (off - tail),len);
+	}
+
+	/* Tails of other files only move to a new fragment */
+	if(r->elf)
+		patch_range(buf,off,len,&r->view,r->hdr);
+
+	if(job->frag != NULL){
+		memcpy(job->frag,buf,len);
+		return;
+	}
+
+	r->blocks[job->index] = (unsigned char *)malloc(len);
+	if(r->blocks[job->index] == NULL)
+		err_exit("sqfs_strip_block() --> malloc()\n");
+	r->sizes[job->index] = sqfs_deflate(img,buf,len,r->blocks[job->index],
+		img->flags & SQFS_FLAG_RAW_DATA);
+}
+
+/* Copy thread: strip the planned blocks */
+static void *
+sqfs_strip_range(void *arg)
+{
+	SqfsImage *img;
+	unsigned char *buf, *frag;
+	uint32_t cached;
+	size_t i;
+
+	img = (SqfsImage *)arg;
+	buf = (unsigned char *)malloc(img->block_size);
+	frag = (unsigned char *)malloc(img->block_size);
+	if(buf == NULL || frag == NULL)
+		err_exit("sqfs_strip_range() --> malloc()\n");
+	cached = SQFS_NONE;
+
+	while((i = __atomic_fetch_add(&img->next,1,__ATOMIC_RELAXED)) < img->njobs)
+		sqfs_strip_block(img,&img->jobs[i],buf,frag,&cached);
+
+	free(frag);
+	free(buf);
+
+	return NULL;
+}
+
+/* Copy thread: compress the new fragment blocks, once all tails are in */
+static void *
+sqfs_frag_range(void *arg)
+{
+	SqfsImage *img;
+	SqfsFrag *f;
+	size_t i;
+
+	img = (SqfsImage *)arg;
+
+	while((i = __atomic_fetch_add(&img->next,1,__ATOMIC_RELAXED)) < img->nfrags){
+		f = &img->frags[i];
+		f->out = (unsigned char *)malloc(f->len);
+		if(f->out == NULL)
+			err_exit("sqfs_frag_range() --> malloc()\n");
+		f->word = sqfs_deflate(img,f->data,f->len,f->out,img->flags & SQFS_FLAG_RAW_FRAGMENTS);
+	}
+
+	return NULL;
+}
+
+/* Run fn on the calling worker and up to copy-threads - 1 more threads */
+static void
+sqfs_parallel(SqfsImage *img, void *(*fn)(void *), size_t n)
+{
+	pthread_t tids[COPY_MAX_THREADS];
+	size_t i;
+
+	img->next = 0;
+	n = opt_copy_threads < n ? opt_copy_threads : n;
+	for(i=0; i+1<n; i++)
+		if(pthread_create(&tids[i],NULL,fn,img) != 0)
+			err_exit("sqfs_parallel() --> pthread_create()\n");
+
+	fn(img);
+
+	for(i=0; i+1<n; i++)
+		pthread_join(tids[i],NULL);
+}
+
+/*
+  Write the file data: runs of unchanged files are copied compressed
+  as they are, stripped files block by block, old compressed blocks
+  where possible. Fragment blocks still in use follow, then the new
+  ones holding the tails of stripped files. Returns the new fragment
+  table.
+*/
+static unsigned char *
+sqfs_write_data(SqfsImage *img, FILE *out)
+{
+	const unsigned char *e;
+	unsigned char *table;
+	SqfsRun *r;
+	SqfsFrag *f;
+	uint64_t start;
+	uint32_t word;
+	size_t i, j, len;
+
+	for(i=0; i<img->nruns; i++){
+		r = &img->runs[i];
+		r->start = sqfs_tell(img,out);
+		if(!r->elf){
+			fwrite(img->base + r->old_start,1,r->span,out);
+			continue;
+		}
+
+		for(j=0; j<r->nblocks; j++){
+			len = r->sizes[j] & ~SQFS_BLOCK_RAW;
+			fwrite(r->blocks[j] != NULL ? r->blocks[j] : img->base + r->old_offsets[j],1,len,out);
+			free(r->blocks[j]);
+			r->blocks[j] = NULL;
+		}
+	}
+
+	table = (unsigned char *)calloc(img->nkept + img->nfrags + 1,16);
+	if(table == NULL)
+		err_exit("sqfs_write_data() --> calloc()\n");
+
+	for(i=0; i<img->old_nfrags; i++){
+		if(img->frag_map[i] == SQFS_NONE)
+			continue;
+
+		e = img->old_frags + 16 * i;
+		start = le64(e);
+		word = le32(e + 8);
+		len = word & ~SQFS_BLOCK_RAW;
+		if(!in_bounds(start,len,img->size))
+			err_exit("sqfs_write_data() --> bad fragment\n");
+
+		put64(table + 16 * img->frag_map[i],sqfs_tell(img,out));
+		put32(table + 16 * img->frag_map[i] + 8,word);
+		fwrite(img->base + start,1,len,out);
+	}
+
+	for(i=0; i<img->nfrags; i++){
+		f = &img->frags[i];
+		put64(table + 16 * (img->nkept + i),sqfs_tell(img,out));
+		put32(table + 16 * (img->nkept + i) + 8,f->word);
+		fwrite(f->out,1,f->word & ~SQFS_BLOCK_RAW,out);
+	}
+
+	return table;
+}
+
+/* Note the new reference of an inode about to be written */
+static void
+sqfs_inode_ref(SqfsImage *img, SqfsInode *ino)
+{
+	if(ino->number == 0 || ino->number > img->inode_count)
+		err_exit("sqfs_inode_ref() --> bad inode number\n");
+
+	ino->ref = sqfs_meta_ref(&img->imeta);
+	ino->done = 1;
+	img->export[ino->number - 1] = ino->ref;
+	img->nwritten++;
+}
+
+/* Write any inode but a directory, pointing files at their new data */
+static void
+sqfs_write_inode(SqfsImage *img, SqfsInode *ino)
+{
+	unsigned char buf[56], word[4];
+	const unsigned char *p;
+	SqfsRun *r;
+	size_t i;
+	int ext;
+
+	p = img->itable.data + ino->pos;
+	sqfs_inode_ref(img,ino);
+
+	if(ino->type != SQFS_FILE && ino->type != SQFS_LFILE){
+		sqfs_meta_put(img,&img->imeta,p,ino->len);
+		return;
+	}
+
+	r = ino->run;
+	ext = ino->type == SQFS_LFILE;
+	memcpy(buf,p,16);
+
+	if(!ext && r->start <= UINT32_MAX && r->size <= UINT32_MAX){
+		put32(buf + 16,r->start);
+		put32(buf + 20,r->fragment);
+		put32(buf + 24,r->frag_offset);
+		put32(buf + 28,r->size);
+		sqfs_meta_put(img,&img->imeta,buf,32);
+	}else{
+		put16(buf,SQFS_LFILE);
+		put64(buf + 16,r->start);
+		put64(buf + 24,r->size);
+		put64(buf + 32,!ext ? 0 : r->elf ? r->sparse : le64(p + 32));
+		put32(buf + 40,ext ? le32(p + 40) : 1);
+		put32(buf + 44,r->fragment);
+		put32(buf + 48,r->frag_offset);
+		put32(buf + 52,ext ? le32(p + 52) : SQFS_NONE);
+		sqfs_meta_put(img,&img->imeta,buf,56);
+	}
+
+	if(!r->elf){
+		sqfs_meta_put(img,&img->imeta,r->old_sizes,4 * r->old_nblocks);
+		return;
+	}
+
+	for(i=0; i<r->nblocks; i++){
+		put32(word,r->sizes[i]);
+		sqfs_meta_put(img,&img->imeta,word,4);
+	}
+}
+
+/* The entries of a directory in the input image */
+static SqfsEntry *
+sqfs_read_dir(const SqfsImage *img, const SqfsInode *dir, size_t *count)
+{
+	const unsigned char *p, *list, *end;
+	SqfsEntry *entries;
+	size_t pos, size, n, cap, i, name_len;
+	uint64_t block;
+
+	p = img->itable.data + dir->pos;
+	if(dir->type == SQFS_DIR){
+		block = le32(p + 16);
+		size = le16(p + 24);
+		pos = le16(p + 26);
+	}else{
+		size = le32(p + 20);
+		block = le32(p + 24);
+		pos = le16(p + 34);
+	}
+
+	entries = NULL;
+	*count = 0;
+	if(size <= 3)
+		return NULL;
+
+	pos = sqfs_table_pos(&img->dtable,block,pos);
+	if(!in_bounds(pos,size - 3,img->dtable.len))
+		err_exit("sqfs_read_dir() --> directory out of bounds\n");
+
+	list = img->dtable.data + pos;
+	end = list + size - 3;
+	cap = 0;
+
+	while(list < end){
+		if(end - list < 12)
+			err_exit("sqfs_read_dir() --> bad directory\n");
+		n = le32(list) + 1;
+		block = le32(list + 4);
+		if(n > SQFS_DIR_COUNT)
+			err_exit("sqfs_read_dir() --> bad directory\n");
+		list += 12;
+
+		for(i=0; i<n; i++){
+			if(end - list < 8)
+				err_exit("sqfs_read_dir() --> bad directory\n");
+			name_len = le16(list + 6) + 1;
+			if(name_len > (size_t)(end - list) - 8)
+				err_exit("sqfs_read_dir() --> bad directory\n");
+
+			if(*count == cap){
+				cap = cap ? 2 * cap : 64;
+				entries = (SqfsEntry *)realloc(entries,cap * sizeof(SqfsEntry));
+				if(entries == NULL)
+					err_exit("sqfs_read_dir() --> realloc()\n");
+			}
+
+			entries[*count].inode = sqfs_inode_at(img,block << 16 | le16(list));
+			entries[*count].type = le16(list + 4);
+			entries[*count].name = list + 8;
+			entries[*count].name_len = name_len;
+			(*count)++;
+
+			list += 8 + name_len;
+		}
+	}
+
+	return entries;
+}
+
+/*
+  Write a directory tree depth first: the inodes of the children, then
+  the directory listing, which refers to them, then the directory inode,
+  which refers to the listing. Every reference is known by the time it
+  is written, so both tables are compressed as they fill up.
+*/
+static void
+sqfs_write_tree(SqfsImage *img, SqfsInode *dir, int depth)
+{
+	unsigned char buf[40], *index;
+	const unsigned char *p;
+	SqfsEntry *entries, *e;
+	SqfsInode *child;
+	uint64_t ref, block;
+	size_t count, i, j, k, listing, index_len, nindex;
+	uint32_t base;
+	int ext;
+
+	if(depth > SQFS_MAX_DEPTH)
+		err_exit("sqfs_write_tree() --> directory tree too deep\n");
+	dir->done = 1;
+
+	entries = sqfs_read_dir(img,dir,&count);
+
+	for(i=0; i<count; i++){
+		child = entries[i].inode;
+		if(child->type == SQFS_DIR || child->type == SQFS_LDIR){
+			if(child->done)
+				err_exit("sqfs_write_tree() --> directory loop\n");
+			sqfs_write_tree(img,child,depth + 1);
+		}else if(!child->done)
+			sqfs_write_inode(img,child);
+	}
+
+	/*
+	  Entries are grouped under a header per inode block, and indexed
+	  wherever the listing crosses into a new directory block, so
+	  lookups in large directories can skip ahead.
+	*/
+	ref = sqfs_meta_ref(&img->dmeta);
+	block = img->dmeta.out_len;
+	listing = 0;
+	index = NULL;
+	index_len = 0;
+	nindex = 0;
+
+	for(i=0; i<count; i=j){
+		base = entries[i].inode->number;
+		for(j=i; j<count && j - i < SQFS_DIR_COUNT
+		    && entries[j].inode->ref >> 16 == entries[i].inode->ref >> 16
+		    && (int64_t)entries[j].inode->number - base >= INT16_MIN
+		    && (int64_t)entries[j].inode->number - base <= INT16_MAX; j++)
+			;
+
+		if(img->dmeta.out_len != block){
+			index = (unsigned char *)realloc(index,index_len + 12 + entries[i].name_len);
+			if(index == NULL)
+				err_exit("sqfs_write_tree() --> realloc()\n");
+			put32(index + index_len,listing);
+			put32(index + index_len + 4,img->dmeta.out_len);
+			put32(index + index_len + 8,entries[i].name_len - 1);
+			memcpy(index + index_len + 12,entries[i].name,entries[i].name_len);
+			index_len += 12 + entries[i].name_len;
+			nindex++;
+			block = img->dmeta.out_len;
+		}
+
+		put32(buf,j - i - 1);
+		put32(buf + 4,entries[i].inode->ref >> 16);
+		put32(buf + 8,base);
+		sqfs_meta_put(img,&img->dmeta,buf,12);
+		listing += 12;
+
+		for(k=i; k<j; k++){
+			e = &entries[k];
+			put16(buf,e->inode->ref & 0xffff);
+			put16(buf + 2,(uint16_t)(e->inode->number - base));
+			put16(buf + 4,e->type);
+			put16(buf + 6,e->name_len - 1);
+			sqfs_meta_put(img,&img->dmeta,buf,8);
+			sqfs_meta_put(img,&img->dmeta,e->name,e->name_len);
+			listing += 8 + e->name_len;
+		}
+	}
+
+	/* Listing sizes count the . and .. the kernel adds */
+	listing += 3;
+	p = img->itable.data + dir->pos;
+	ext = dir->type == SQFS_LDIR || listing > 0xffff || nindex > 0;
+	sqfs_inode_ref(img,dir);
+	memcpy(buf,p,16);
+
+	if(!ext){
+		put32(buf + 16,ref >> 16);
+		put32(buf + 20,le32(p + 20));
+		put16(buf + 24,listing);
+		put16(buf + 26,ref & 0xffff);
+		put32(buf + 28,le32(p + 28));
+		sqfs_meta_put(img,&img->imeta,buf,32);
+	}else{
+		put16(buf,SQFS_LDIR);
+		put32(buf + 16,dir->type == SQFS_DIR ? le32(p + 20) : le32(p + 16));
+		put32(buf + 20,listing);
+		put32(buf + 24,ref >> 16);
+		put32(buf + 28,le32(p + 28));
+		put16(buf + 32,nindex);
+		put16(buf + 34,ref & 0xffff);
+		put32(buf + 36,dir->type == SQFS_LDIR ? le32(p + 36) : SQFS_NONE);
+		sqfs_meta_put(img,&img->imeta,buf,40);
+		sqfs_meta_put(img,&img->imeta,index,index_len);
+	}
+
+	free(index);
+	free(entries);
+}
+
+/* Copy the xattr tables; references into them are relative and stay valid */
+static uint64_t
+sqfs_xattr_copy(const SqfsImage *img, FILE *out, uint64_t pos)
+{
+	unsigned char hdr[16];
+	uint64_t kv, first, ids, n;
+
+	if(!in_bounds(pos,16,img->size))
+		err_exit("sqfs_xattr_copy() --> xattr table out of bounds\n");
+
+	kv = le64(img->base + pos);
+	ids = le32(img->base + pos + 8);
+	n = (16 * ids + SQFS_META_SIZE - 1) / SQFS_META_SIZE;
+	if(!in_bounds(pos + 16,8 * n,img->size))
+		err_exit("sqfs_xattr_copy() --> xattr table out of bounds\n");
+
+	first = n > 0 ? le64(img->base + pos + 16) : pos;
+	if(kv > first || first > img->size)
+		err_exit("sqfs_xattr_copy() --> bad xattr table\n");
+
+	memcpy(hdr,img->base + pos,16);
+	put64(hdr,sqfs_tell(img,out));
+	fwrite(img->base + kv,1,first - kv,out);
+
+	return sqfs_lookup_copy(img,out,pos + 16,16 * ids,hdr,16);
+}
+
+static void
+sqfs_free(SqfsImage *img)
+{
+	size_t i;
+
+	for(i=0; i<img->nruns; i++){
+		free(img->runs[i].old_offsets);
+		free(img->runs[i].sizes);
+		free(img->runs[i].blocks);
+	}
+	for(i=0; i<img->nfrags; i++){
+		free(img->frags[i].data);
+		free(img->frags[i].out);
+	}
+	free(img->frags);
+	free(img->jobs);
+	free(img->runs);
+	free(img->inodes);
+	free(img->frag_map);
+	free(img->old_frags_buf);
+	free(img->export);
+	free(img->imeta.out);
+	free(img->dmeta.out);
+	sqfs_table_free(&img->itable);
+	sqfs_table_free(&img->dtable);
+}
+
+/*
+  Rebuild a SquashFS image, or the one an AppImage carries behind its
+  runtime, with the ELF files in it stripped. Data blocks are reused
+  compressed wherever the cut does not reach; only the blocks it
+  changes are recompressed, by up to copy-threads threads. The inode
+  and directory tables are rewritten, since the block lists of the
+  stripped files shrink.
+*/
+static void
+process_squashfs(Worker *w, const char *in_file, const char *out_file)
+{
+	SqfsImage img;
+	SqfsInode *root;
+	SqfsRun *r;
+	SqfsBlock *job;
+	ElfView view;
+	unsigned char sb[SQFS_SUPER_LEN], opts[SQFS_META_SIZE], pad[4096];
+	unsigned char *capture, *block, *frag, *frags, *export;
+	const unsigned char *map, *base;
+	uint64_t pos, itab, dtab, dend, ftab, etab, idtab, xtab, bytes, cand[8];
+	uint32_t cached, frag_count, id_count;
+	size_t size, origin, i, n;
+	FILE *out;
+	struct stat st;
+	int fd;
+
+	errno = 0;
+	memset(&w->cur,0,sizeof(Event));
+	w->cur.in_file = in_file;
+	w->cur.out_file = out_file;
+	w->cur.engine = "squashfs";
+	w->cur.start = now_ns();
+
+	fd = open(in_file,O_RDONLY);
+	if(fd == -1)
+		err_exit("process_squashfs() --> open(%s)\n",in_file);
+	if(fstat(fd,&st) == -1)
+		err_exit("process_squashfs() --> fstat()\n");
+
+	size = st.st_size;
+	if(size < SQFS_SUPER_LEN)
+		err_exit("process_squashfs() --> bad image\n");
+
+	map = (const unsigned char *)mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+	if(map == MAP_FAILED)
+		err_exit("process_squashfs() --> mmap()\n");
+	close(fd);
+	w->cur.size = size;
+
+	/* An AppImage runtime finds its image behind its own section headers, keep it whole */
+	origin = 0;
+	if(memcmp(map,ELFMAG,SELFMAG) == 0){
+		if(elf_view(&view,map,size) != NULL)
+			err_exit("process_squashfs() --> bad AppImage runtime\n");
+		origin = view.shoff + view.shnum * view.shentsize;
+	}
+	if(!in_bounds(origin,SQFS_SUPER_LEN,size))
+		err_exit("process_squashfs() --> bad image\n");
+
+	base = map + origin;
+	memset(&img,0,sizeof(SqfsImage));
+	img.base = base;
+	img.size = size - origin;
+	img.origin = origin;
+
+	if(le32(base) != SQFS_MAGIC || le16(base + 28) != 4 || le16(base + 30) != 0)
+		err_exit("process_squashfs() --> not a SquashFS 4.0 image\n");
+
+	img.block_size = le32(base + 12);
+	if(img.block_size < 4096 || img.block_size > (1 << 20)
+	   || le16(base + 22) > 20 || img.block_size != (size_t)1 << le16(base + 22))
+		err_exit("process_squashfs() --> bad block size\n");
+
+	img.compressor = le16(base + 20);
+	if(img.compressor != SQFS_GZIP && img.compressor != SQFS_XZ)
+		err_exit("process_squashfs() --> unsupported compressor %d\n",img.compressor);
+
+	img.flags = le16(base + 24);
+	img.level = Z_BEST_COMPRESSION;
+	img.window = MAX_WBITS;
+	img.dict_size = img.block_size;
+
+	/* Compression options follow the superblock as a metadata block */
+	pos = SQFS_SUPER_LEN;
+	if(img.flags & SQFS_FLAG_COMP_OPTS){
+		n = sqfs_meta_read(&img,&pos,opts);
+		if(img.compressor == SQFS_GZIP && n >= 6){
+			img.level = le32(opts);
+			img.window = le16(opts + 4);
+			if(img.level < 1 || img.level > 9 || img.window < 8 || img.window > 15)
+				err_exit("process_squashfs() --> bad compression options\n");
+		}else if(img.compressor == SQFS_XZ && n >= 4){
+			img.dict_size = le32(opts);
+			if(img.dict_size < 4096 || img.dict_size > img.block_size)
+				img.dict_size = img.block_size;
+		}
+	}
+
+	img.inode_count = le32(base + 4);
+	frag_count = le32(base + 16);
+	id_count = le16(base + 26);
+	bytes = le64(base + 40);
+	idtab = le64(base + 48);
+	xtab = le64(base + 56);
+	itab = le64(base + 64);
+	dtab = le64(base + 72);
+	ftab = le64(base + 80);
+	etab = le64(base + 88);
+
+	if(bytes > img.size || img.inode_count == 0 || img.inode_count > img.size
+	   || frag_count > img.size / 16)
+		err_exit("process_squashfs() --> bad superblock\n");
+
+	/* The directory table ends where the first table behind it starts */
+	cand[0] = ftab;
+	cand[1] = frag_count > 0 && in_bounds(ftab,8,img.size) ? le64(base + ftab) : SQFS_INVALID;
+	cand[2] = etab;
+	cand[3] = etab != SQFS_INVALID && in_bounds(etab,8,img.size) ? le64(base + etab) : SQFS_INVALID;
+	cand[4] = idtab;
+	cand[5] = in_bounds(idtab,8,img.size) ? le64(base + idtab) : SQFS_INVALID;
+	cand[6] = xtab;
+	cand[7] = xtab != SQFS_INVALID && in_bounds(xtab,8,img.size) ? le64(base + xtab) : SQFS_INVALID;
+	dend = bytes;
+	for(i=0; i<8; i++)
+		if(cand[i] > dtab && cand[i] < dend)
+			dend = cand[i];
+
+	if(frag_count > 0)
+		img.old_frags = img.old_frags_buf = sqfs_lookup_read(&img,ftab,16 * frag_count);
+	img.old_nfrags = frag_count;
+
+	sqfs_table_read(&img,&img.itable,itab,dtab);
+	sqfs_table_read(&img,&img.dtable,dtab,dend);
+	sqfs_parse_inodes(&img);
+	sqfs_collect_runs(&img);
+
+	/* Plan the cuts, in data order so fragments are mostly read once */
+	capture = (unsigned char *)malloc(CAPTURE_MAX);
+	block = (unsigned char *)malloc(img.block_size);
+	frag = (unsigned char *)malloc(img.block_size);
+	if(capture == NULL || block == NULL || frag == NULL)
+		err_exit("process_squashfs() --> malloc()\n");
+	cached = SQFS_NONE;
+	for(i=0; i<img.nruns; i++)
+		sqfs_plan(&img,&img.runs[i],capture,block,frag,&cached);
+	free(capture);
+	free(block);
+	free(frag);
+
+	/*
+	  Fragment blocks holding the tail of a stripped file are packed
+	  anew, along with the other tails in them; the rest are kept.
+	*/
+	img.frag_map = (uint32_t *)malloc((frag_count + 1) * sizeof(uint32_t));
+	if(img.frag_map == NULL)
+		err_exit("process_squashfs() --> malloc()\n");
+	memset(img.frag_map,0,(frag_count + 1) * sizeof(uint32_t));
+	for(i=0; i<img.nruns; i++)
+		if(img.runs[i].elf && img.runs[i].old_fragment != SQFS_NONE)
+			img.frag_map[img.runs[i].old_fragment] = SQFS_NONE;
+
+	for(i=0; i<img.nruns; i++){
+		r = &img.runs[i];
+		if(r->elf || r->old_fragment == SQFS_NONE)
+			continue;
+		r->size = r->old_size;
+		if(img.frag_map[r->old_fragment] != SQFS_NONE)
+			continue;
+
+		job = sqfs_job(&img);
+		job->run = r;
+		job->index = r->old_nblocks;
+		job->frag = sqfs_frag_alloc(&img,r->old_size % img.block_size,&r->fragment,&r->frag_offset);
+	}
+
+	for(i=0; i<frag_count; i++)
+		if(img.frag_map[i] != SQFS_NONE)
+			img.frag_map[i] = img.nkept++;
+
+	for(i=0; i<img.nruns; i++){
+		r = &img.runs[i];
+		if(!r->elf)
+			r->size = r->old_size;
+		if(r->fragment != SQFS_NONE)
+			r->fragment += img.nkept;
+		else if(!r->elf && r->old_fragment != SQFS_NONE){
+			r->fragment = img.frag_map[r->old_fragment];
+			r->frag_offset = r->old_frag_offset;
+		}
+	}
+
+	sqfs_parallel(&img,sqfs_strip_range,img.njobs);
+	sqfs_parallel(&img,sqfs_frag_range,img.nfrags);
+
+	fd = open(out_file,O_CREAT|O_WRONLY|O_TRUNC,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if(fd == -1 || (out = fdopen(fd,"w")) == NULL)
+		err_exit("process_squashfs() --> open(%s)\n",out_file);
+	setvbuf(out,NULL,_IOFBF,1 << 20);
+
+	/* Runtime, superblock placeholder and compression options */
+	fwrite(map,1,origin + pos,out);
+
+	frags = sqfs_write_data(&img,out);
+
+	img.export = (uint64_t *)calloc(img.inode_count,sizeof(uint64_t));
+	if(img.export == NULL)
+		err_exit("process_squashfs() --> calloc()\n");
+
+	root = sqfs_inode_at(&img,le64(base + 32));
+	if(root->type != SQFS_DIR && root->type != SQFS_LDIR)
+		err_exit("process_squashfs() --> bad root inode\n");
+	sqfs_write_tree(&img,root,0);
+	if(img.nwritten != img.ninodes)
+		err_exit("process_squashfs() --> unreferenced inodes\n");
+
+	sqfs_meta_flush(&img,&img.imeta);
+	sqfs_meta_flush(&img,&img.dmeta);
+
+	memcpy(sb,base,SQFS_SUPER_LEN);
+	put64(sb + 32,root->ref);
+	put64(sb + 64,sqfs_tell(&img,out));
+	fwrite(img.imeta.out,1,img.imeta.out_len,out);
+	put64(sb + 72,sqfs_tell(&img,out));
+	fwrite(img.dmeta.out,1,img.dmeta.out_len,out);
+
+	put32(sb + 16,img.nkept + img.nfrags);
+	put64(sb + 80,sqfs_lookup_write(&img,out,frags,16 * (img.nkept + img.nfrags)));
+	free(frags);
+
+	if(etab != SQFS_INVALID){
+		export = (unsigned char *)malloc(8 * (size_t)img.inode_count);
+		if(export == NULL)
+			err_exit("process_squashfs() --> malloc()\n");
+		for(i=0; i<img.inode_count; i++)
+			put64(export + 8 * i,img.export[i]);
+		put64(sb + 88,sqfs_lookup_write(&img,out,export,8 * (size_t)img.inode_count));
+		free(export);
+	}
+
+	put64(sb + 48,sqfs_lookup_copy(&img,out,idtab,4 * id_count,NULL,0));
+	if(xtab != SQFS_INVALID)
+		put64(sb + 56,sqfs_xattr_copy(&img,out,xtab));
+
+	/* Images are padded to 4 KiB for the loop device */
+	bytes = sqfs_tell(&img,out);
+	put64(sb + 40,bytes);
+	memset(pad,0,sizeof(pad));
+	fwrite(pad,1,(4096 - bytes % 4096) % 4096,out);
+
+	if(fseeko(out,origin,SEEK_SET) == -1)
+		err_exit("process_squashfs() --> fseeko()\n");
+	fwrite(sb,1,SQFS_SUPER_LEN,out);
+	if(fseeko(out,0,SEEK_END) == -1)
+		err_exit("process_squashfs() --> fseeko()\n");
+
+	pos = ftello(out);
+	if(ferror(out) || fclose(out) != 0)
+		err_exit("process_squashfs() --> write()\n");
+
+	w->cur.truncated = size > pos ? size - pos : 0;
+	w->cur.strtblsize = img.zeroed;
+
+	sqfs_free(&img);
+	munmap((void *)map,size);
+
+	if(opt_events && events_emit(w,0,NULL) == -1)
+		err_exit("process_squashfs() --> events_emit()\n");
+	w->cur.in_file = NULL;
+
+	if(w->stats != NULL)
+		hist_record(&w->stats->hist[size_class(size)][STAGE_TOTAL],now_ns() - w->cur.start);
+}
+
+/*
+  Mounted view. The kernel talks to us over /dev/fuse; every node the
+  kernel holds a lookup on is kept in the node table with its path
+  below the source root and what the header-only parse found there, so
+  a stripped file is never materialized: reads of an ELF file return
+  the source bytes up to the cut, with the patched header and the
+  cleared string table put in on the way.
+*/
+static size_t
+mount_bucket(const MountServer *m, dev_t dev, ino_t ino)
+{
+	uint64_t h;
+
+	h = ((uint64_t)dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)ino;
+	h *= 0xff51afd7ed558ccdULL;
+	return (h >> 32) & (m->nbuckets - 1);
+}
+
+/* All mount_node_* calls are made with the lock held */
+static size_t
+mount_node_find(MountServer *m, dev_t dev, ino_t ino)
+{
+	size_t i;
+
+	for(i=m->buckets[mount_bucket(m,dev,ino)]; i != 0; i=m->nodes[i].next)
+		if(m->nodes[i].dev == dev && m->nodes[i].ino == ino)
+			return i;
+
+	return 0;
+}
+
+static int
+mount_node_grow(MountServer *m)
+{
+	MountNode *nodes;
+	size_t *buckets;
+	size_t i, b, nbuckets;
+
+	if(m->nnodes == m->nodes_cap){
+		nodes = (MountNode *)realloc(m->nodes,2 * m->nodes_cap * sizeof(MountNode));
+		if(nodes == NULL)
+			return -1;
+		m->nodes = nodes;
+		m->nodes_cap *= 2;
+	}
+
+	if(m->live < m->nbuckets)
+		return 0;
+
+	nbuckets = 2 * m->nbuckets;
+	buckets = (size_t *)calloc(nbuckets,sizeof(size_t));
+	if(buckets == NULL)
+		return -1;
+
+	free(m->buckets);
+	m->buckets = buckets;
+	m->nbuckets = nbuckets;
+	for(i=FUSE_ROOT_ID; i<m->nnodes; i++){
+		if(m->nodes[i].path == NULL)
+			continue;
+		b = mount_bucket(m,m->nodes[i].dev,m->nodes[i].ino);
+		m->nodes[i].next = m->buckets[b];
+		m->buckets[b] = i;
+	}
+
+	return 0;
+}
+
+static size_t
+mount_node_add(MountServer *m, const char *path, const struct stat *st)
+{
+	MountNode *n;
+	size_t i, b;
+	char *copy;
+
+	if(mount_node_grow(m) == -1)
+		return 0;
+
+	copy = strdup(path);
+	if(copy == NULL)
+		return 0;
+
+	/* A reused slot gets a new generation, so the pair stays unique */
+	if(m->free_nodes != 0){
+		i = m->free_nodes;
+		m->free_nodes = m->nodes[i].next;
+		m->nodes[i].generation++;
+	}else{
+		i = m->nnodes++;
+		m->nodes[i].generation = 0;
+	}
+
+	n = &m->nodes[i];
+	n->path = copy;
+	n->dev = st->st_dev;
+	n->ino = st->st_ino;
+	n->nlookup = 0;
+	n->probe.state = MOUNT_UNKNOWN;
+
+	b = mount_bucket(m,n->dev,n->ino);
+	n->next = m->buckets[b];
+	m->buckets[b] = i;
+	m->live++;
+
+	return i;
+}
+
+static void
+mount_node_forget(MountServer *m, uint64_t nodeid, uint64_t nlookup)
+{
+	MountNode *n;
+	size_t *link;
+
+	if(nodeid <= FUSE_ROOT_ID || nodeid >= m->nnodes || m->nodes[nodeid].path == NULL)
+		return;
+
+	n = &m->nodes[nodeid];
+	n->nlookup = nlookup < n->nlookup ? n->nlookup - nlookup : 0;
+	if(n->nlookup != 0)
+		return;
+
+	for(link=&m->buckets[mount_bucket(m,n->dev,n->ino)]; *link != nodeid;
+	    link=&m->nodes[*link].next)
+		;
+	*link = n->next;
+
+	free(n->path);
+	n->path = NULL;
+	n->next = m->free_nodes;
+	m->free_nodes = nodeid;
+	m->live--;
+}
+
+/* Copy out the path of a node, relative to the source root */
+static int
+mount_node_path(MountServer *m, uint64_t nodeid, char *path)
+{
+	int ret;
+
+	ret = 0;
+	pthread_mutex_lock(&m->lock);
+	if(nodeid < FUSE_ROOT_ID || nodeid >= m->nnodes || m->nodes[nodeid].path == NULL)
+		ret = ESTALE;
+	else
+		strcpy(path,m->nodes[nodeid].path);
+	pthread_mutex_unlock(&m->lock);
+
+	return ret;
+}
+
+static int
+mount_fresh(const MountProbe *p, const struct stat *st)
+{
+	return p->state != MOUNT_UNKNOWN && p->size == st->st_size
+		&& p->mtime.tv_sec == st->st_mtim.tv_sec
+		&& p->mtime.tv_nsec == st->st_mtim.tv_nsec
+		&& p->ctime.tv_sec == st->st_ctim.tv_sec
+		&& p->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/*
+  Parse the ELF header and the section header table of an open file,
+  nothing else of it is read. Anything which would not be stripped
+  reads as it is.
+*/
+static void
+mount_probe(int fd, const struct stat *st, MountProbe *p)
+{
+	unsigned char *shdrs;
+	size_t avail, want;
+	ssize_t n;
+
+	p->state = MOUNT_PLAIN;
+	p->size = st->st_size;
+	p->mtime = st->st_mtim;
+	p->ctime = st->st_ctim;
+
+	if(!S_ISREG(st->st_mode))
+		return;
+
+	want = (size_t)st->st_size < sizeof(p->hdr) ? (size_t)st->st_size : sizeof(p->hdr);
+	n = pread(fd,p->hdr,want,0);
+	if(n != (ssize_t)want || elf_view_header(&p->view,p->hdr,st->st_size) != NULL)
+		return;
+
+	avail = st->st_size - p->view.shoff;
+	if(avail > CAPTURE_MAX)
+		avail = CAPTURE_MAX;
+	shdrs = (unsigned char *)malloc(avail);
+	if(shdrs == NULL)
+		return;
+
+	n = pread(fd,shdrs,avail,p->view.shoff);
+	if(n == (ssize_t)avail && elf_view_sections(&p->view,shdrs,avail) == NULL){
+		patch_image(p->hdr,p->view.ehsize,&p->view);
+		p->state = MOUNT_ELF;
+	}
+
+	free(shdrs);
+	p->view.base = NULL;
+	p->view.shdrs = NULL;
+}
+
+/* Keep a probe with the node, unless the node went or changed meanwhile */
+static void
+mount_store(MountServer *m, uint64_t nodeid, const struct stat *st, const MountProbe *p)
+{
+	pthread_mutex_lock(&m->lock);
+	if(nodeid < m->nnodes && m->nodes[nodeid].path != NULL
+	   && m->nodes[nodeid].dev == st->st_dev && m->nodes[nodeid].ino == st->st_ino)
+		m->nodes[nodeid].probe = *p;
+	pthread_mutex_unlock(&m->lock);
+}
+
+/* stat() a path and find out how it reads, from the cache if still valid */
+static int
+mount_examine(MountServer *m, const char *path, struct stat *st, MountProbe *p)
+{
+	size_t i;
+	int fd, fresh;
+
+	if(fstatat(m->root,path,st,AT_SYMLINK_NOFOLLOW) == -1)
+		return errno;
+
+	pthread_mutex_lock(&m->lock);
+	i = mount_node_find(m,st->st_dev,st->st_ino);
+	fresh = i != 0 && mount_fresh(&m->nodes[i].probe,st);
+	if(fresh)
+		*p = m->nodes[i].probe;
+	pthread_mutex_unlock(&m->lock);
+
+	if(fresh)
+		return 0;
+
+	if(!S_ISREG(st->st_mode)){
+		mount_probe(-1,st,p);
+		return 0;
+	}
+
+	fd = openat(m->root,path,O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if(fd == -1)
+		return errno;
+	mount_probe(fd,st,p);
+	close(fd);
+
+	return 0;
+}
+
+static void
+mount_attr(struct fuse_attr *attr, const struct stat *st, const MountProbe *p)
+{
+	memset(attr,0,sizeof(*attr));
+	attr->ino = st->st_ino;
+	attr->size = st->st_size;
+	attr->blocks = st->st_blocks;
+	attr->atime = st->st_atim.tv_sec;
+	attr->atimensec = st->st_atim.tv_nsec;
+	attr->mtime = st->st_mtim.tv_sec;
+	attr->mtimensec = st->st_mtim.tv_nsec;
+	attr->ctime = st->st_ctim.tv_sec;
+	attr->ctimensec = st->st_ctim.tv_nsec;
+	attr->mode = st->st_mode;
+	attr->nlink = st->st_nlink;
+	attr->uid = st->st_uid;
+	attr->gid = st->st_gid;
+	attr->rdev = st->st_rdev;
+	attr->blksize = st->st_blksize;
+
+	if(p->state == MOUNT_ELF){
+		attr->size = view_cut(&p->view);
+		attr->blocks = (attr->size + 511) / 512;
+	}
+}
+
+static void
+mount_reply(MountThread *t, uint64_t unique, int error, const void *data, size_t len)
+{
+	struct fuse_out_header out;
+	struct iovec iov[2];
+	int n;
+
+	out.len = sizeof(out);
+	out.error = -error;
+	out.unique = unique;
+	iov[0].iov_base = &out;
+	iov[0].iov_len = sizeof(out);
+	n = 1;
+	if(error == 0 && len > 0){
+		out.len += len;
+		iov[1].iov_base = (void *)data;
+		iov[1].iov_len = len;
+		n = 2;
+	}
+
+	/* ENOENT only means the request was interrupted meanwhile */
+	if(writev(t->m->fd,iov,n) == -1 && errno != ENOENT && errno != ENODEV)
+		err_exit("mount_reply() --> writev()\n");
+}
+
+static void
+mount_init(MountThread *t, uint64_t unique, const struct fuse_init_in *in)
+{
+	struct fuse_init_out out;
+	uint32_t want;
+
+	memset(&out,0,sizeof(out));
+	out.major = FUSE_KERNEL_VERSION;
+	out.minor = FUSE_KERNEL_MINOR_VERSION;
+
+	/* A newer kernel asks again with our major version */
+	if(in->major > FUSE_KERNEL_VERSION){
+		mount_reply(t,unique,0,&out,sizeof(out));
+		return;
+	}
+	if(in->major < FUSE_KERNEL_VERSION){
+		mount_reply(t,unique,EPROTO,NULL,0);
+		return;
+	}
+
+	want = FUSE_ASYNC_READ | FUSE_AUTO_INVAL_DATA | FUSE_PARALLEL_DIROPS
+		| FUSE_MAX_PAGES;
+	if(t->pipe[0] != -1)
+		want |= FUSE_SPLICE_WRITE;
+
+	out.flags = in->flags & want;
+	out.max_readahead = in->max_readahead;
+	out.max_background = 16;
+	out.congestion_threshold = 12;
+	out.max_write = MOUNT_MAX_WRITE;
+	out.time_gran = 1;
+	out.max_pages = MOUNT_MAX_READ / t->m->page_size;
+
+	__atomic_store_n(&t->m->splice,(out.flags & FUSE_SPLICE_WRITE) != 0,__ATOMIC_RELEASE);
+
+	mount_reply(t,unique,0,&out,
+		in->minor < 23 ? FUSE_COMPAT_22_INIT_OUT_SIZE : sizeof(out));
+}
+
+static void
+mount_lookup(MountThread *t, const struct fuse_in_header *h, const char *name)
+{
+	MountServer *m;
+	struct fuse_entry_out out;
+	struct stat st;
+	MountProbe p;
+	char path[PATH_MAX];
+	size_t i, len;
+	int err;
+	char *copy;
+
+	m = t->m;
+	err = mount_node_path(m,h->nodeid,path);
+	if(err != 0){
+		mount_reply(t,h->unique,err,NULL,0);
+		return;
+	}
+
+	if(strchr(name,'/') != NULL || strcmp(name,".") == 0 || strcmp(name,"..") == 0){
+		mount_reply(t,h->unique,ENOENT,NULL,0);
+		return;
+	}
+
+	len = strlen(path);
+	if(len + strlen(name) + 2 > PATH_MAX){
+		mount_reply(t,h->unique,ENAMETOOLONG,NULL,0);
+		return;
+	}
+	if(strcmp(path,".") == 0)
+		strcpy(path,name);
+	else
+		sprintf(path + len,"/%s",name);
+
+	err = mount_examine(m,path,&st,&p);
+	if(err != 0){
+		mount_reply(t,h->unique,err,NULL,0);
+		return;
+	}
+
+	memset(&out,0,sizeof(out));
+	pthread_mutex_lock(&m->lock);
+	i = mount_node_find(m,st.st_dev,st.st_ino);
+	if(i == 0)
+		i = mount_node_add(m,path,&st);
+	else if(strcmp(m->nodes[i].path,path) != 0 && (copy = strdup(path)) != NULL){
+		/* A hard link, or the file moved: follow the name just seen */
+		free(m->nodes[i].path);
+		m->nodes[i].path = copy;
+	}
+	if(i != 0){
+		m->nodes[i].nlookup++;
+		m->nodes[i].probe = p;
+		out.nodeid = i;
+		out.generation = m->nodes[i].generation;
+	}
+	pthread_mutex_unlock(&m->lock);
+
+	if(i == 0){
+		mount_reply(t,h->unique,ENOMEM,NULL,0);
+		return;
+	}
+
+	out.entry_valid = MOUNT_TIMEOUT;
+	out.attr_valid = MOUNT_TIMEOUT;
+	mount_attr(&out.attr,&st,&p);
+	mount_reply(t,h->unique,0,&out,sizeof(out));
+}
+
+static void
+mount_getattr(MountThread *t, const struct fuse_in_header *h)
+{
+	struct fuse_attr_out out;
+	struct stat st;
+	MountProbe p;
+	char path[PATH_MAX];
+	int err;
+
+	err = mount_node_path(t->m,h->nodeid,path);
+	if(err == 0)
+		err = mount_examine(t->m,path,&st,&p);
+	if(err != 0){
+		mount_reply(t,h->unique,err,NULL,0);
+		return;
+	}
+
+	mount_store(t->m,h->nodeid,&st,&p);
+
+	memset(&out,0,sizeof(out));
+	out.attr_valid = MOUNT_TIMEOUT;
+	mount_attr(&out.attr,&st,&p);
+	mount_reply(t,h->unique,0,&out,sizeof(out));
+}
+
+static void
+mount_open(MountThread *t, const struct fuse_in_header *h, const struct fuse_open_in *in)
+{
+	struct fuse_open_out out;
+	char path[PATH_MAX];
+	int err, fd;
+
+	if((in->flags & O_ACCMODE) != O_RDONLY){
+		mount_reply(t,h->unique,EROFS,NULL,0);
+		return;
+	}
+
+	err = mount_node_path(t->m,h->nodeid,path);
+	if(err != 0){
+		mount_reply(t,h->unique,err,NULL,0);
+		return;
+	}
+
+	fd = openat(t->m->root,path,O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if(fd == -1){
+		mount_reply(t,h->unique,errno,NULL,0);
+		return;
+	}
+
+	/* The kernel drops cached pages itself once it sees a new mtime */
+	memset(&out,0,sizeof(out));
+	out.fh = fd;
+	out.open_flags = FOPEN_KEEP_CACHE;
+	mount_reply(t,h->unique,0,&out,sizeof(out));
+}
+
+/* Throw away whatever a failed splice left in the pipe */
+static void
+mount_pipe_reset(MountThread *t)
+{
+	if(t->pipe[0] != -1){
+		close(t->pipe[0]);
+		close(t->pipe[1]);
+	}
+	if(pipe2(t->pipe,O_CLOEXEC) == -1
+	   || fcntl(t->pipe[1],F_SETPIPE_SZ,MOUNT_MAX_READ + t->m->page_size) == -1){
+		if(t->pipe[0] != -1){
+			close(t->pipe[0]);
+			close(t->pipe[1]);
+		}
+		t->pipe[0] = t->pipe[1] = -1;
+	}
+}
+
+/*
+  Answer a read without copying: the reply header and then the file
+  pages go into the pipe, the pipe goes to the device in one piece.
+  Returns -1 with nothing sent if the range could not be moved whole.
+*/
+static int
+mount_splice(MountThread *t, uint64_t unique, int fd, off_t off, size_t len)
+{
+	struct fuse_out_header out;
+	struct iovec iov;
+	loff_t pos;
+	ssize_t n;
+	size_t moved;
+
+	out.len = sizeof(out) + len;
+	out.error = 0;
+	out.unique = unique;
+	iov.iov_base = &out;
+	iov.iov_len = sizeof(out);
+
+	if(vmsplice(t->pipe[1],&iov,1,0) != sizeof(out)){
+		mount_pipe_reset(t);
+		return -1;
+	}
+
+	pos = off;
+	for(moved=0; moved < len; moved += n){
+		n = splice(fd,&pos,t->pipe[1],NULL,len - moved,SPLICE_F_MOVE);
+		if(n == -1 && errno == EINTR){
+			n = 0;
+			continue;
+		}
+		if(n <= 0)
+			break;
+	}
+
+	if(moved < len){
+		mount_pipe_reset(t);
+		return -1;
+	}
+
+	n = splice(t->pipe[0],NULL,t->m->fd,NULL,out.len,SPLICE_F_MOVE);
+	if(n == (ssize_t)out.len)
+		return 0;
+
+	mount_pipe_reset(t);
+	return n == -1 && (errno == ENOENT || errno == ENODEV) ? 0 : -1;
+}
+
+static void
+mount_read(MountThread *t, const struct fuse_in_header *h, const struct fuse_read_in *in)
+{
+	MountServer *m;
+	MountProbe p;
+	struct stat st;
+	size_t size, len, got;
+	ssize_t n;
+	int fd, fresh, patch;
+
+	m = t->m;
+	fd = in->fh;
+	if(fstat(fd,&st) == -1){
+		mount_reply(t,h->unique,errno,NULL,0);
+		return;
+	}
+
+	pthread_mutex_lock(&m->lock);
+	fresh = h->nodeid < m->nnodes && mount_fresh(&m->nodes[h->nodeid].probe,&st);
+	if(fresh)
+		p = m->nodes[h->nodeid].probe;
+	pthread_mutex_unlock(&m->lock);
+
+	if(!fresh){
+		mount_probe(fd,&st,&p);
+		mount_store(m,h->nodeid,&st,&p);
+	}
+
+	size = p.state == MOUNT_ELF ? view_cut(&p.view) : (size_t)st.st_size;
+	if(in->offset >= size){
+		mount_reply(t,h->unique,0,NULL,0);
+		return;
+	}
+
+	len = size - in->offset;
+	if(len > in->size)
+		len = in->size;
+	if(len > MOUNT_MAX_READ)
+		len = MOUNT_MAX_READ;
+
+	patch = p.state == MOUNT_ELF && (in->offset < p.view.ehsize
+		|| (p.view.strtbloff < in->offset + len
+		    && p.view.strtbloff + p.view.strtblsize > in->offset));
+
+	/* Pages nothing has to be patched in go to the kernel untouched */
+	if(!patch && t->pipe[0] != -1 && __atomic_load_n(&m->splice,__ATOMIC_ACQUIRE)
+	   && mount_splice(t,h->unique,fd,in->offset,len) == 0)
+		return;
+
+	for(got=0; got < len; got += n){
+		n = pread(fd,t->out + got,len - got,in->offset + got);
+		if(n == -1 && errno == EINTR){
+			n = 0;
+			continue;
+		}
+		if(n == -1){
+			mount_reply(t,h->unique,errno,NULL,0);
+			return;
+		}
+		if(n == 0)
+			break;
+	}
+
+	if(p.state == MOUNT_ELF)
+		patch_range(t->out,in->offset,got,&p.view,p.hdr);
+
+	mount_reply(t,h->unique,0,t->out,got);
+}
+
+static void
+mount_opendir(MountThread *t, const struct fuse_in_header *h)
+{
+	struct fuse_open_out out;
+	char path[PATH_MAX];
+	DIR *dir;
+	int err, fd;
+
+	err = mount_node_path(t->m,h->nodeid,path);
+	if(err != 0){
+		mount_reply(t,h->unique,err,NULL,0);
+		return;
+	}
+
+	fd = openat(t->m->root,path,O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+	if(fd == -1){
+		mount_reply(t,h->unique,errno,NULL,0);
+		return;
+	}
+
+	dir = fdopendir(fd);
+	if(dir == NULL){
+		err = errno;
+		close(fd);
+		mount_reply(t,h->unique,err,NULL,0);
+		return;
+	}
+
+	memset(&out,0,sizeof(out));
+	out.fh = (uintptr_t)dir;
+	mount_reply(t,h->unique,0,&out,sizeof(out));
+}
+
+/* Offsets handed to the kernel are the d_off cookies of the source */
+static void
+mount_readdir(MountThread *t, const struct fuse_in_header *h, const struct fuse_read_in *in)
+{
+	struct fuse_dirent *de;
+	struct dirent *d;
+	size_t len, namelen, reclen, size;
+	DIR *dir;
+
+	dir = (DIR *)(uintptr_t)in->fh;
+	size = in->size < MOUNT_MAX_READ ? in->size : MOUNT_MAX_READ;
+
+	if(in->offset == 0)
+		rewinddir(dir);
+	else
+		seekdir(dir,in->offset);
+
+	len = 0;
+	errno = 0;
+	while((d = readdir(dir)) != NULL){
+		namelen = strlen(d->d_name);
+		reclen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+		if(len + reclen > size)
+			break;
+
+		de = (struct fuse_dirent *)(t->out + len);
+		de->ino = d->d_ino;
+		de->off = d->d_off;
+		de->namelen = namelen;
+		de->type = d->d_type;
+		memcpy(de->name,d->d_name,namelen);
+		memset(de->name + namelen,0,reclen - FUSE_NAME_OFFSET - namelen);
+		len += reclen;
+	}
+
+	if(d == NULL && errno != 0 && len == 0){
+		mount_reply(t,h->unique,errno,NULL,0);
+		return;
+	}
+
+	mount_reply(t,h->unique,0,t->out,len);
+}
+
+static void
+mount_readlink(MountThread *t, const struct fuse_in_header *h)
+{
+	char path[PATH_MAX];
+	ssize_t n;
+	int err;
+
+	err = mount_node_path(t->m,h->nodeid,path);
+	if(err != 0){
+		mount_reply(t,h->unique,err,NULL,0);
+		return;
+	}
+
+	n = readlinkat(t->m->root,path,(char *)t->out,PATH_MAX);
+	if(n == -1)
+		mount_reply(t,h->unique,errno,NULL,0);
+	else
+		mount_reply(t,h->unique,0,t->out,n);
+}
+
+static void
+mount_statfs(MountThread *t, const struct fuse_in_header *h)
+{
+	struct fuse_statfs_out out;
+	struct statvfs sv;
+
+	if(fstatvfs(t->m->root,&sv) == -1){
+		mount_reply(t,h->unique,errno,NULL,0);
+		return;
+	}
+
+	memset(&out,0,sizeof(out));
+	out.st.blocks = sv.f_blocks;
+	out.st.bfree = sv.f_bfree;
+	out.st.bavail = sv.f_bavail;
+	out.st.files = sv.f_files;
+	out.st.ffree = sv.f_ffree;
+	out.st.bsize = sv.f_bsize;
+	out.st.namelen = sv.f_namemax;
+	out.st.frsize = sv.f_frsize;
+	mount_reply(t,h->unique,0,&out,sizeof(out));
+}
+
+static void
+mount_forget(MountThread *t, const struct fuse_in_header *h, const void *arg, size_t len)
+{
+	const struct fuse_batch_forget_in *batch;
+	const struct fuse_forget_one *one;
+	size_t i;
+
+	pthread_mutex_lock(&t->m->lock);
+	if(h->opcode == FUSE_FORGET){
+		if(len >= sizeof(struct fuse_forget_in))
+			mount_node_forget(t->m,h->nodeid,
+				((const struct fuse_forget_in *)arg)->nlookup);
+	}else if(len >= sizeof(*batch)){
+		batch = (const struct fuse_batch_forget_in *)arg;
+		one = (const struct fuse_forget_one *)(batch + 1);
+		for(i=0; i < batch->count && (i + 1) * sizeof(*one) <= len - sizeof(*batch); i++)
+			mount_node_forget(t->m,one[i].nodeid,one[i].nlookup);
+	}
+	pthread_mutex_unlock(&t->m->lock);
+}
+
+static void
+mount_dispatch(MountThread *t, const struct fuse_in_header *h, const unsigned char *arg,
+	       size_t len)
+{
+	const struct fuse_read_in *rd;
+
+	rd = (const struct fuse_read_in *)arg;
+
+	switch(h->opcode){
+	case FUSE_INIT:
+		if(len < offsetof(struct fuse_init_in,flags2))
+			break;
+		mount_init(t,h->unique,(const struct fuse_init_in *)arg);
+		return;
+	case FUSE_LOOKUP:
+		if(len == 0 || arg[len - 1] != '\0' || len > NAME_MAX + 1)
+			break;
+		mount_lookup(t,h,(const char *)arg);
+		return;
+	case FUSE_FORGET:
+	case FUSE_BATCH_FORGET:
+		mount_forget(t,h,arg,len);
+		return;
+	case FUSE_GETATTR:
+		mount_getattr(t,h);
+		return;
+	case FUSE_READLINK:
+		mount_readlink(t,h);
+		return;
+	case FUSE_OPEN:
+		if(len < sizeof(struct fuse_open_in))
+			break;
+		mount_open(t,h,(const struct fuse_open_in *)arg);
+		return;
+	case FUSE_READ:
+		if(len < sizeof(*rd))
+			break;
+		mount_read(t,h,rd);
+		return;
+	case FUSE_READDIR:
+		if(len < sizeof(*rd))
+			break;
+		mount_readdir(t,h,rd);
+		return;
+	case FUSE_OPENDIR:
+		mount_opendir(t,h);
+		return;
+	case FUSE_RELEASE:
+	case FUSE_RELEASEDIR:
+		if(len < sizeof(struct fuse_release_in))
+			break;
+		if(h->opcode == FUSE_RELEASE)
+			close(((const struct fuse_release_in *)arg)->fh);
+		else
+			closedir((DIR *)(uintptr_t)((const struct fuse_release_in *)arg)->fh);
+		mount_reply(t,h->unique,0,NULL,0);
+		return;
+	case FUSE_FLUSH:
+	case FUSE_FSYNCDIR:
+	case FUSE_FSYNC:
+		mount_reply(t,h->unique,0,NULL,0);
+		return;
+	case FUSE_STATFS:
+		mount_statfs(t,h);
+		return;
+	case FUSE_INTERRUPT:
+		return;
+	case FUSE_DESTROY:
+		mount_reply(t,h->unique,0,NULL,0);
+		return;
+	default:
+		mount_reply(t,h->unique,ENOSYS,NULL,0);
+		return;
+	}
+
+	mount_reply(t,h->unique,EINVAL,NULL,0);
+}
+
+static void *
+mount_thread(void *arg)
+{
+	const struct fuse_in_header *h;
+	MountThread *t;
+	ssize_t n;
+
+	t = (MountThread *)arg;
+	h = (const struct fuse_in_header *)t->req;
+
+	for(;;){
+		n = read(t->m->fd,t->req,MOUNT_REQ_BUF);
+		if(n == -1 && (errno == EINTR || errno == EAGAIN || errno == ENOENT))
+			continue;
+		if(n == -1 && errno == ENODEV)
+			break;
+		if(n == -1)
+			err_exit("mount_thread() --> read()\n");
+		if((size_t)n < sizeof(*h) || h->len != (size_t)n)
+			continue;
+
+		mount_dispatch(t,h,t->req + sizeof(*h),n - sizeof(*h));
+	}
+
+	/* The file system is gone, let the main thread know */
+	kill(getpid(),SIGUSR1);
+	return NULL;
+}
+
+/*
+  Without the right to mount, hand the job to the setuid helper the way
+  libfuse does: it mounts, then sends back the /dev/fuse descriptor
+  over the socket named by _FUSE_COMMFD.
+*/
+static int
+mount_fusermount(const char *mnt, const char *opts)
+{
+	static const char *helpers[] = {"fusermount3", "fusermount"};
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	char env[16], c;
+	int sv[2], fd, status;
+	pid_t pid;
+	size_t i;
+
+	if(socketpair(AF_UNIX,SOCK_STREAM,0,sv) == -1)
+		err_exit("mount_fusermount() --> socketpair()\n");
+
+	pid = fork();
+	if(pid == -1)
+		err_exit("mount_fusermount() --> fork()\n");
+	if(pid == 0){
+		close(sv[0]);
+		snprintf(env,sizeof(env),"%d",sv[1]);
+		setenv("_FUSE_COMMFD",env,1);
+		for(i=0; i<sizeof(helpers) / sizeof(helpers[0]); i++)
+			execlp(helpers[i],helpers[i],"-o",opts,"--",mnt,(char *)NULL);
+		_exit(127);
+	}
+	close(sv[1]);
+
+	memset(&msg,0,sizeof(msg));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+
+	fd = -1;
+	if(recvmsg(sv[0],&msg,0) > 0){
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd,CMSG_DATA(cmsg),sizeof(fd));
+	}
+	close(sv[0]);
+
+	if(waitpid(pid,&status,0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0
+	   || fd == -1)
+		err_exit("mount_fusermount() --> fusermount failed\n");
+
+	fcntl(fd,F_SETFD,FD_CLOEXEC);
+	return fd;
+}
+
+static void
+mount_unmount(MountServer *m)
+{
+	pid_t pid;
+
+	if(!m->fusermount){
+		if(umount2(m->mnt,MNT_DETACH) == -1)
+			err_exit("mount_unmount() --> umount2(%s)\n",m->mnt);
+		return;
+	}
+
+	pid = fork();
+	if(pid == -1)
+		err_exit("mount_unmount() --> fork()\n");
+	if(pid == 0){
+		execlp("fusermount3","fusermount3","-u","-z","--",m->mnt,(char *)NULL);
+		execlp("fusermount","fusermount","-u","-z","--",m->mnt,(char *)NULL);
+		_exit(127);
+	}
+	waitpid(pid,NULL,0);
+}
+
+/*
+  Mount the stripped view of src at mnt and serve it with opt_jobs
+  threads until it is unmounted, or a signal asks us to unmount it.
+*/
+static void
+mount_main(const char *src, const char *mnt)
+{
+	MountServer m;
+	MountThread *threads;
+	struct stat st;
+	sigset_t set;
+	char opts[256];
+	int i, sig;
+
+	memset(&m,0,sizeof(m));
+	m.mnt = mnt;
+	m.page_size = sysconf(_SC_PAGESIZE);
+	pthread_mutex_init(&m.lock,NULL);
+
+	m.root = open(src,O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if(m.root == -1)
+		err_exit("mount_main() --> open(%s)\n",src);
+	if(fstat(m.root,&st) == -1)
+		err_exit("mount_main() --> fstat()\n");
+
+	m.nodes_cap = MOUNT_NODES_MIN;
+	m.nbuckets = MOUNT_NODES_MIN;
+	m.nnodes = FUSE_ROOT_ID;
+	m.nodes = (MountNode *)calloc(m.nodes_cap,sizeof(MountNode));
+	m.buckets = (size_t *)calloc(m.nbuckets,sizeof(size_t));
+	if(m.nodes == NULL || m.buckets == NULL || mount_node_add(&m,".",&st) != FUSE_ROOT_ID)
+		err_exit("mount_main() --> calloc()\n");
+	m.nodes[FUSE_ROOT_ID].nlookup = 1;
+
+	m.fd = open("/dev/fuse",O_RDWR|O_CLOEXEC);
+	if(m.fd == -1)
+		err_exit("mount_main() --> open(/dev/fuse)\n");
+
+	snprintf(opts,sizeof(opts),"fd=%d,rootmode=%o,user_id=%u,group_id=%u"
+		",default_permissions,allow_other",
+		m.fd,st.st_mode & S_IFMT,(unsigned)getuid(),(unsigned)getgid());
+	if(mount("elfkillah",mnt,"fuse.elfkillah",MS_NOSUID|MS_NODEV|MS_RDONLY,opts) == -1){
+		if(errno != EPERM)
+			err_exit("mount_main() --> mount(%s)\n",mnt);
+		close(m.fd);
+		m.fd = mount_fusermount(mnt,"ro,nosuid,nodev,default_permissions"
+			",fsname=elfkillah,subtype=elfkillah");
+		m.fusermount = 1;
+	}
+
+	/* Signals are taken by sigwait() below, in no serving thread */
+	sigemptyset(&set);
+	sigaddset(&set,SIGINT);
+	sigaddset(&set,SIGTERM);
+	sigaddset(&set,SIGHUP);
+	sigaddset(&set,SIGUSR1);
+	pthread_sigmask(SIG_BLOCK,&set,NULL);
+
+	threads = (MountThread *)calloc(opt_jobs,sizeof(MountThread));
+	if(threads == NULL)
+		err_exit("mount_main() --> calloc()\n");
+
+	for(i=0; i<opt_jobs; i++){
+		threads[i].m = &m;
+		threads[i].req = (unsigned char *)malloc(MOUNT_REQ_BUF);
+		threads[i].out = (unsigned char *)malloc(MOUNT_MAX_READ);
+		if(threads[i].req == NULL || threads[i].out == NULL)
+			err_exit("mount_main() --> malloc()\n");
+		threads[i].pipe[0] = threads[i].pipe[1] = -1;
+		mount_pipe_reset(&threads[i]);
+		if(pthread_create(&threads[i].tid,NULL,mount_thread,&threads[i]) != 0)
+			err_exit("mount_main() --> pthread_create()\n");
+	}
+
+	if(sigwait(&set,&sig) == 0 && sig != SIGUSR1)
+		mount_unmount(&m);
+
+	for(i=0; i<opt_jobs; i++)
+		pthread_join(threads[i].tid,NULL);
+
+	exit(EXIT_SUCCESS);
+}
+
+/* The staged path of the first link of a file seen before, or NULL */
+static const char *
+publish_link(Publish *p, const struct stat *st, const char *path)
+{
+	PublishLink *old;
+	size_t i, j, cap;
+
+	if(p->nlinks * 2 >= p->links_cap){
+		old = p->links;
+		cap = p->links_cap;
+		p->links_cap = cap == 0 ? PUBLISH_LINKS_MIN : cap * 2;
+		p->links = (PublishLink *)calloc(p->links_cap,sizeof(PublishLink));
+		if(p->links == NULL)
+			err_exit("publish_link() --> calloc()\n");
+		for(i=0; i<cap; i++){
+			if(old[i].path == NULL)
+				continue;
+			j = (old[i].ino * 0x9e3779b97f4a7c15ULL ^ old[i].dev) & (p->links_cap - 1);
+			while(p->links[j].path != NULL)
+				j = (j + 1) & (p->links_cap - 1);
+			p->links[j] = old[i];
+		}
+		free(old);
+	}
+
+	j = (st->st_ino * 0x9e3779b97f4a7c15ULL ^ st->st_dev) & (p->links_cap - 1);
+	for(; p->links[j].path != NULL; j = (j + 1) & (p->links_cap - 1))
+		if(p->links[j].ino == st->st_ino && p->links[j].dev == st->st_dev)
+			return p->links[j].path;
+
+	p->links[j].dev = st->st_dev;
+	p->links[j].ino = st->st_ino;
+	p->links[j].path = strdup(path);
+	if(p->links[j].path == NULL)
+		err_exit("publish_link() --> strdup()\n");
+	p->nlinks++;
+
+	return NULL;
+}
+
+static void
+publish_job(Publish *p, const char *in_file, const char *out_file)
+{
+	if(p->njobs == p->jobs_cap){
+		p->jobs_cap = p->jobs_cap == 0 ? 256 : p->jobs_cap * 2;
+		p->jobs = (char **)realloc(p->jobs,2 * p->jobs_cap * sizeof(char *));
+		if(p->jobs == NULL)
+			err_exit("publish_job() --> realloc()\n");
+	}
+
+	p->jobs[2 * p->njobs] = strdup(in_file);
+	p->jobs[2 * p->njobs + 1] = strdup(out_file);
+	if(p->jobs[2 * p->njobs] == NULL || p->jobs[2 * p->njobs + 1] == NULL)
+		err_exit("publish_job() --> strdup()\n");
+	p->njobs++;
+}
+
+/* Owner first, as chown() clears the set-id bits, then mode and times */
+static void
+publish_attrs(int dfd, const char *name, const struct stat *st)
+{
+	struct timespec times[2];
+
+	if(fchownat(dfd,name,st->st_uid,st->st_gid,AT_SYMLINK_NOFOLLOW) == -1 && errno != EPERM)
+		err_exit("publish_attrs() --> fchownat(%s)\n",name);
+	if(!S_ISLNK(st->st_mode) && fchmodat(dfd,name,st->st_mode & 07777,0) == -1)
+		err_exit("publish_attrs() --> fchmodat(%s)\n",name);
+
+	times[0] = st->st_atim;
+	times[1] = st->st_mtim;
+	if(utimensat(dfd,name,times,AT_SYMLINK_NOFOLLOW) == -1)
+		err_exit("publish_attrs() --> utimensat(%s)\n",name);
+}
+
+/*
+  Stage every entry of the source directory at sfd, at path, into the
+  directory at dfd, at staged. ELF files are created empty and queued
+  for the workers; their times are set once they are written.
+*/
+static void
+publish_walk(Publish *p, int sfd, int dfd, char *path, char *staged)
+{
+	MountProbe probe;
+	struct dirent *e;
+	struct stat st;
+	const char *first;
+	char target[PATH_MAX];
+	size_t plen, slen;
+	ssize_t n;
+	DIR *d;
+	int src, dst;
+
+	d = fdopendir(dup(sfd));
+	if(d == NULL)
+		err_exit("publish_walk() --> fdopendir(%s)\n",path);
+	plen = strlen(path);
+	slen = strlen(staged);
+
+	while((e = readdir(d)) != NULL){
+		if(strcmp(e->d_name,".") == 0 || strcmp(e->d_name,"..") == 0)
+			continue;
+		if(fstatat(sfd,e->d_name,&st,AT_SYMLINK_NOFOLLOW) == -1)
+			err_exit("publish_walk() --> fstatat(%s/%s)\n",path,e->d_name);
+
+		if(snprintf(path + plen,PATH_MAX - plen,"/%s",e->d_name) >= (int)(PATH_MAX - plen)
+		   || snprintf(staged + slen,PATH_MAX - slen,"/%s",e->d_name) >= (int)(PATH_MAX - slen)){
+			errno = ENAMETOOLONG;
+			err_exit("publish_walk() --> %s/%s\n",path,e->d_name);
+		}
+
+		if(!S_ISDIR(st.st_mode) && st.st_nlink > 1 && (first = publish_link(p,&st,staged)) != NULL){
+			if(linkat(AT_FDCWD,first,dfd,e->d_name,0) == -1)
+				err_exit("publish_walk() --> linkat(%s)\n",staged);
+		}else if(S_ISDIR(st.st_mode)){
+			if(mkdirat(dfd,e->d_name,S_IRWXU) == -1)
+				err_exit("publish_walk() --> mkdirat(%s)\n",staged);
+			src = openat(sfd,e->d_name,O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+			dst = openat(dfd,e->d_name,O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+			if(src == -1 || dst == -1)
+				err_exit("publish_walk() --> openat(%s)\n",path);
+			publish_walk(p,src,dst,path,staged);
+			close(src);
+			close(dst);
+			publish_attrs(dfd,e->d_name,&st);
+		}else if(S_ISLNK(st.st_mode)){
+			n = readlinkat(sfd,e->d_name,target,sizeof(target) - 1);
+			if(n == -1)
+				err_exit("publish_walk() --> readlinkat(%s)\n",path);
+			target[n] = '\0';
+			if(symlinkat(target,dfd,e->d_name) == -1)
+				err_exit("publish_walk() --> symlinkat(%s)\n",staged);
+			publish_attrs(dfd,e->d_name,&st);
+		}else if(S_ISREG(st.st_mode)){
+			src = openat(sfd,e->d_name,O_RDONLY|O_NOFOLLOW);
+			dst = openat(dfd,e->d_name,O_CREAT|O_EXCL|O_WRONLY,S_IRUSR|S_IWUSR);
+			if(src == -1 || dst == -1)
+				err_exit("publish_walk() --> open(%s)\n",path);
+			mount_probe(src,&st,&probe);
+			if(probe.state == MOUNT_ELF)
+				publish_job(p,path,staged);
+			else if(clone_fd(dst,src,st.st_size) == NULL)
+				err_exit("publish_walk() --> clone_fd(%s)\n",path);
+			close(src);
+			close(dst);
+			publish_attrs(dfd,e->d_name,&st);
+		}else{
+			if(mknodat(dfd,e->d_name,st.st_mode & S_IFMT,st.st_rdev) == -1)
+				err_exit("publish_walk() --> mknodat(%s)\n",staged);
+			publish_attrs(dfd,e->d_name,&st);
+		}
+
+		path[plen] = '\0';
+		staged[slen] = '\0';
+	}
+
+	closedir(d);
+}
+
+/* Stage <src> next to <tree> and hand its ELF files to the workers */
+static void
+publish_open(const char *src, const char *tree)
+{
+	Publish p;
+	struct stat st;
+	char path[PATH_MAX], staged[PATH_MAX];
+	const char *base;
+	size_t len;
+	int sfd, dfd;
+
+	len = strlen(tree);
+	while(len > 1 && tree[len - 1] == '/')
+		len--;
+	for(base=tree + len; base > tree && base[-1] != '/'; base--)
+		;
+	if(snprintf(publish_staging,sizeof(publish_staging),"%.*s.%.*s.elfkillah.%d",
+		(int)(base - tree),tree,(int)(tree + len - base),base,(int)getpid()) >= (int)sizeof(publish_staging)){
+		publish_staging[0] = '\0';
+		errno = ENAMETOOLONG;
+		err_exit("publish_open() --> %s\n",tree);
+	}
+
+	sfd = open(src,O_RDONLY|O_DIRECTORY);
+	if(sfd == -1 || fstat(sfd,&st) == -1)
+		err_exit("publish_open() --> open(%s)\n",src);
+	if(mkdir(publish_staging,S_IRWXU) == -1){
+		publish_staging[0] = '\0';
+		err_exit("publish_open() --> mkdir() next to %s\n",tree);
+	}
+	dfd = open(publish_staging,O_RDONLY|O_DIRECTORY);
+	if(dfd == -1)
+		err_exit("publish_open() --> open(%s)\n",publish_staging);
+
+	memset(&p,0,sizeof(p));
+	snprintf(path,sizeof(path),"%s",src);
+	snprintf(staged,sizeof(staged),"%s",publish_staging);
+	publish_walk(&p,sfd,dfd,path,staged);
+	publish_attrs(AT_FDCWD,publish_staging,&st);
+
+	close(sfd);
+	close(dfd);
+
+	jobs = p.jobs;
+	njobs = p.njobs;
+}
+
+/* Once every ELF file is stripped: sync, swap and drop the old tree */
+static void
+publish_swap(const char *tree)
+{
+	struct timespec times[2];
+	struct stat st;
+	size_t i;
+	int fd;
+
+	for(i=0; i<njobs; i++){
+		if(stat(jobs[2 * i],&st) == -1)
+			err_exit("publish_swap() --> stat(%s)\n",jobs[2 * i]);
+		times[0] = st.st_atim;
+		times[1] = st.st_mtim;
+		if(utimensat(AT_FDCWD,jobs[2 * i + 1],times,0) == -1)
+			err_exit("publish_swap() --> utimensat(%s)\n",jobs[2 * i + 1]);
+	}
+
+	/* Nothing of the new tree may be lost once it is visible */
+	fd = open(publish_staging,O_RDONLY|O_DIRECTORY);
+	if(fd == -1 || syncfs(fd) == -1)
+		err_exit("publish_swap() --> syncfs(%s)\n",publish_staging);
+	close(fd);
+
+	if(renameat2(AT_FDCWD,publish_staging,AT_FDCWD,tree,RENAME_EXCHANGE) == 0)
+		publish_discard(publish_staging);
+	else if(errno != ENOENT || renameat2(AT_FDCWD,publish_staging,AT_FDCWD,tree,RENAME_NOREPLACE) == -1)
+		err_exit("publish_swap() --> renameat2(%s)\n",tree);
+	publish_staging[0] = '\0';
+}
+
+#endif
+
+struct Elfkillah {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	ElfkillahJob *queue;
+	size_t head;
+	size_t count;
+	size_t cap;
+	ElfkillahResult *done;
+	size_t ndone;
+	size_t done_cap;
+	size_t reserved;
+	int waiting;
+	int stop;
+	int efd;
+	pthread_t *tids;
+	int nthreads;
+};
+
+static int
+pwrite_all(int fd, const void *buf, size_t len, off_t off)
+{
+	const char *p;
+	ssize_t written;
+
+	for(p=(const char *)buf; len > 0; p += written, off += written, len -= written){
+		written = pwrite(fd,p,len,off);
+		if(written == -1 && errno == EINTR)
+			written = 0;
+		else if(written <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+  Strip one open file into another, reporting instead of exiting on
+  failure: the kept bytes are written straight from the mapped input,
+  the patched header and the cleared string table in their place.
+*/
+static const char *
+strip_fd(int in_fd, int out_fd, ElfkillahResult *res)
+{
+	static const unsigned char zeros[4096];
+	unsigned char hdr[sizeof(Elf64_Ehdr)];
+	const unsigned char *map;
+	const char *err;
+	struct stat st;
+	ElfView view;
+	size_t cut, lo, hi, off, len;
+
+	if(fstat(in_fd,&st) == -1)
+		return "fstat()";
+	if(st.st_size == 0){
+		errno = EINVAL;
+		return "bad file";
+	}
+
+	map = (const unsigned char *)mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,in_fd,0);
+	if(map == MAP_FAILED)
+		return "mmap()";
+
+	res->size = st.st_size;
+	err = elf_view(&view,map,st.st_size);
+	if(err != NULL){
+		munmap((void *)map,st.st_size);
+		errno = EINVAL;
+		return err;
+	}
+
+	cut = view_cut(&view);
+	memcpy(hdr,map,view.ehsize);
+	res->strtblsize = patch_image(hdr,view.ehsize,&view);
+
+	/* The part of the string table past the header goes out as zeros */
+	lo = view.strtbloff > view.ehsize ? view.strtbloff : view.ehsize;
+	hi = view.strtbloff + view.strtblsize;
+	if(hi > cut)
+		hi = cut;
+	if(lo >= hi)
+		lo = hi = cut;
+
+	err = NULL;
+	if(pwrite_all(out_fd,hdr,view.ehsize,0) == -1
+	   || pwrite_all(out_fd,map + view.ehsize,lo - view.ehsize,view.ehsize) == -1
+	   || pwrite_all(out_fd,map + hi,cut - hi,hi) == -1)
+		err = "pwrite()";
+
+	for(off=lo; err == NULL && off < hi; off += len){
+		len = hi - off < sizeof(zeros) ? hi - off : sizeof(zeros);
+		if(pwrite_all(out_fd,zeros,len,off) == -1)
+			err = "pwrite()";
+	}
+
+	if(err == NULL && ftruncate(out_fd,cut) == -1)
+		err = "ftruncate()";
+
+	res->strtblsize += hi - lo;
+	res->truncated = st.st_size - cut;
+	munmap((void *)map,st.st_size);
+
+	return err;
 }
 
 static void
-usage(const char *pname)
+lib_run(const ElfkillahJob *job, ElfkillahResult *res)
 {
-	fprintf(stderr,"%s a simple ELF-32/64 section stripper\n",pname);
-	fprintf(stderr,"%s <infile> <outfile>\n\n",pname);
-	fprintf(stderr,"Written by Fabrizio Curcio aka spike, 2014.\n");
-	exit(EXIT_SUCCESS);
+	int in_fd, out_fd;
+
+	memset(res,0,sizeof(*res));
+	res->arg = job->arg;
+
+	in_fd = job->in_fd;
+	if(job->in_path != NULL){
+		in_fd = open(job->in_path,O_RDONLY|O_CLOEXEC);
+		if(in_fd == -1){
+			res->error = errno;
+			res->message = "open(input)";
+			return;
+		}
+	}
+
+	out_fd = job->out_fd;
+	if(job->out_path != NULL){
+		out_fd = open(job->out_path,O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC,
+			S_IRWXU|S_IRGRP|S_IWGRP);
+		if(out_fd == -1){
+			res->error = errno;
+			res->message = "open(output)";
+		}
+	}
+
+	if(out_fd != -1){
+		res->message = strip_fd(in_fd,out_fd,res);
+		if(res->message != NULL)
+			res->error = errno != 0 ? errno : EIO;
+	}
+
+	if(job->in_path != NULL)
+		close(in_fd);
+	if(job->out_path != NULL && out_fd != -1)
+		close(out_fd);
 }
 
-static long
-align_to_page(size_t size)
+static void *
+lib_thread(void *arg)
 {
-	long pg_size;
+	Elfkillah *ek;
+	ElfkillahJob job;
+	ElfkillahResult res;
+	uint64_t one;
 
-	pg_size = sysconf(_SC_PAGESIZE);
-	if(pg_size == -1)
-		err_exit("sysconf()");
+	ek = (Elfkillah *)arg;
+	one = 1;
 
-	if(size <= pg_size)
-		return pg_size;
+	for(;;){
+		pthread_mutex_lock(&ek->lock);
+		while(ek->count == 0 && !ek->stop){
+			ek->waiting++;
+			pthread_cond_wait(&ek->wake,&ek->lock);
+			ek->waiting--;
+		}
+		if(ek->count == 0){
+			pthread_mutex_unlock(&ek->lock);
+			break;
+		}
+		job = ek->queue[ek->head];
+		ek->head = (ek->head + 1) % ek->cap;
+		ek->count--;
+		pthread_mutex_unlock(&ek->lock);
 
-	else
-		return size + pg_size - (size % pg_size);
+		errno = 0;
+		lib_run(&job,&res);
+
+		if(job.done != NULL){
+			job.done(&res);
+			continue;
+		}
+
+		/* Room for it was reserved when the job was queued */
+		pthread_mutex_lock(&ek->lock);
+		ek->done[ek->ndone++] = res;
+		ek->reserved--;
+		pthread_mutex_unlock(&ek->lock);
+
+		if(write(ek->efd,&one,sizeof(one)) == -1)
+			continue;
+	}
+
+	return NULL;
 }
 
-static void
-get_string_table(ElfContainer *elfc)
+Elfkillah *
+elfkillah_new(int threads)
 {
-	unsigned char *ptr;
+	Elfkillah *ek;
 	int i;
-	size_t offset, size;
 
-	if(elfc->type == ELF_32){
-    
-		/* Make ptr point to the start of the section headers */
-		ptr = (unsigned char *)elfc->elf32;
-		ptr += elfc->elf32->e_shoff;
-    
-		/* Make ptr point to the start of the string table index section header */
-		ptr += (elfc->elf32->e_shstrndx * elfc->elf32->e_shentsize);
-    
-		/* Take offset and size of the string table into the file */    
-		offset = ((Elf32_Shdr *)ptr)->sh_offset;
-		size = ((Elf32_Shdr *)ptr)->sh_size;
-    
-	}else if(elfc->type == ELF_64){
+	if(threads < 1)
+		threads = 1;
 
-		/* Same thing as above, just now for 64 bits */
-		ptr = (unsigned char *)elfc->elf64;
-		ptr += elfc->elf64->e_shoff;
-		ptr += (elfc->elf64->e_shstrndx * elfc->elf64->e_shentsize);
+	ek = (Elfkillah *)calloc(1,sizeof(Elfkillah));
+	if(ek == NULL)
+		return NULL;
 
-		offset = ((Elf64_Shdr *)ptr)->sh_offset;
-		size = ((Elf64_Shdr *)ptr)->sh_size;
+	ek->cap = 1024;
+	ek->done_cap = 1024;
+	ek->queue = (ElfkillahJob *)malloc(ek->cap * sizeof(ElfkillahJob));
+	ek->done = (ElfkillahResult *)malloc(ek->done_cap * sizeof(ElfkillahResult));
+	ek->tids = (pthread_t *)malloc(threads * sizeof(pthread_t));
+	ek->efd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	pthread_mutex_init(&ek->lock,NULL);
+	pthread_cond_init(&ek->wake,NULL);
 
-	}else
-		err_exit("get_string_table()\n");
+	if(ek->queue == NULL || ek->done == NULL || ek->tids == NULL || ek->efd == -1){
+		elfkillah_free(ek);
+		return NULL;
+	}
+
+	for(i=0; i<threads; i++){
+		if(pthread_create(&ek->tids[i],NULL,lib_thread,ek) != 0){
+			elfkillah_free(ek);
+			return NULL;
+		}
+		ek->nthreads++;
+	}
 
-	elfc->strtbloff = offset;
-	elfc->strtblsize = size;
+	return ek;
 }
 
-static ElfContainer *
-build_container(const char *file)
+/*
+  One lock round trip per call whatever n is, and a wakeup only when a
+  thread sits idle, so batches of jobs are cheap to queue. Completion
+  queue room is reserved here for the jobs without a callback, so
+  completing a job never has to allocate.
+*/
+int
+elfkillah_submit(Elfkillah *ek, const ElfkillahJob *jobs, size_t n)
+{
+	ElfkillahJob *queue;
+	ElfkillahResult *done;
+	size_t cap, i, tail, queued;
+
+	for(queued=0, i=0; i<n; i++)
+		if(jobs[i].done == NULL)
+			queued++;
+
+	pthread_mutex_lock(&ek->lock);
+	if(ek->ndone + ek->reserved + queued > ek->done_cap){
+		for(cap=ek->done_cap; cap < ek->ndone + ek->reserved + queued; cap *= 2)
+			;
+		done = (ElfkillahResult *)realloc(ek->done,cap * sizeof(ElfkillahResult));
+		if(done == NULL){
+			pthread_mutex_unlock(&ek->lock);
+			return ENOMEM;
+		}
+		ek->done = done;
+		ek->done_cap = cap;
+	}
+
+	if(ek->count + n > ek->cap){
+		for(cap=ek->cap; cap < ek->count + n; cap *= 2)
+			;
+		queue = (ElfkillahJob *)malloc(cap * sizeof(ElfkillahJob));
+		if(queue == NULL){
+			pthread_mutex_unlock(&ek->lock);
+			return ENOMEM;
+		}
+		for(i=0; i<ek->count; i++)
+			queue[i] = ek->queue[(ek->head + i) % ek->cap];
+		free(ek->queue);
+		ek->queue = queue;
+		ek->cap = cap;
+		ek->head = 0;
+	}
+
+	tail = (ek->head + ek->count) % ek->cap;
+	for(i=0; i<n; i++)
+		ek->queue[(tail + i) % ek->cap] = jobs[i];
+	ek->count += n;
+	ek->reserved += queued;
+
+	if(ek->waiting > 0){
+		if(n > 1)
+			pthread_cond_broadcast(&ek->wake);
+		else
+			pthread_cond_signal(&ek->wake);
+	}
+	pthread_mutex_unlock(&ek->lock);
+
+	return 0;
+}
+
+int
+elfkillah_eventfd(Elfkillah *ek)
+{
+	return ek->efd;
+}
+
+size_t
+elfkillah_reap(Elfkillah *ek, ElfkillahResult *results, size_t max)
+{
+	size_t n;
+
+	pthread_mutex_lock(&ek->lock);
+	n = ek->ndone < max ? ek->ndone : max;
+	memcpy(results,ek->done,n * sizeof(ElfkillahResult));
+	memmove(ek->done,ek->done + n,(ek->ndone - n) * sizeof(ElfkillahResult));
+	ek->ndone -= n;
+	pthread_mutex_unlock(&ek->lock);
+
+	return n;
+}
+
+void
+elfkillah_free(Elfkillah *ek)
+{
+	int i;
+
+	pthread_mutex_lock(&ek->lock);
+	ek->stop = 1;
+	pthread_cond_broadcast(&ek->wake);
+	pthread_mutex_unlock(&ek->lock);
+
+	for(i=0; i<ek->nthreads; i++)
+		pthread_join(ek->tids[i],NULL);
+
+	if(ek->efd != -1)
+		close(ek->efd);
+	pthread_cond_destroy(&ek->wake);
+	pthread_mutex_destroy(&ek->lock);
+	free(ek->tids);
+	free(ek->done);
+	free(ek->queue);
+	free(ek);
+}
+
+#ifndef ELFKILLAH_LIBRARY
+
+/* Worker memory, which the supervisor reads back under --isolate */
+static void *
+worker_alloc(size_t size)
 {
-	ElfContainer *elfc;
-	unsigned char *id;
 	void *ptr;
-	int fd;
-	size_t size;
-	size_t mmapped;
-	struct stat sb;
 
-	fd = open(file,O_RDWR);
-	if(fd == -1)
-		err_exit("build_container() --> open(%s)\n",file);
+	if(!opt_isolate)
+		return calloc(1,size);
 
-	if(fstat(fd,&sb) == -1)
-		err_exit("build_container() --> fstat()\n");
+	ptr = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+	return ptr == MAP_FAILED ? NULL : ptr;
+}
 
-	size = sb.st_size;
-	mmapped = align_to_page(size);
-  
-	ptr = mmap(NULL,mmapped,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+static void
+isolate_queue(void)
+{
+	pthread_mutexattr_t attr;
 
-	if(ptr == MAP_FAILED)
-		err_exit("build_container() --> mmap()\n");
-  
-	id = (unsigned char *)ptr;
-	if(id[EI_MAG0] != ELFMAG0 || id[EI_MAG1] != ELFMAG1
-	   || id[EI_MAG2] != ELFMAG2 || id[EI_MAG3] != ELFMAG3)
-		err_exit("build_container() --> bad file\n");
+	queue = (Queue *)worker_alloc(sizeof(Queue));
+	if(queue == NULL)
+		err_exit("isolate_queue() --> mmap()\n");
 
-	elfc = (ElfContainer *)malloc(sizeof(ElfContainer));
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr,PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr,PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&queue->events_lock,&attr);
+	pthread_mutex_init(&queue->record_lock,&attr);
+	pthread_mutexattr_destroy(&attr);
+}
 
-	if(elfc == NULL)
-		err_exit("build_container() --> malloc()\n");
+/* By device, then in the order given */
+static int
+sched_cmp(const void *a, const void *b)
+{
+	const uint64_t *x, *y;
 
-	elfc->size = size;
-	elfc->mmapped = mmapped;
-  
-	if(id[EI_CLASS] == ELF_32){
-		elfc->type = ELF_32;
-		elfc->elf32 = (Elf32_Ehdr *)ptr;
-	}else if(id[EI_CLASS] == ELF_64){
-		elfc->type = ELF_64;
-		elfc->elf64 = (Elf64_Ehdr *)ptr;
-	}else{
-		free(elfc);
-		err_exit("build_container() --> bad class\n");
+	x = (const uint64_t *)a;
+	y = (const uint64_t *)b;
+	if(x[0] != y[0])
+		return x[0] < y[0] ? -1 : 1;
+	return x[1] < y[1] ? -1 : x[1] > y[1];
+}
+
+/* Queue the jobs by the device of their input, each with its own cap */
+static void
+sched_open(void)
+{
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+	struct stat sb;
+	uint64_t *keys;
+	Device *d;
+	size_t i, n;
+
+	keys = (uint64_t *)malloc(2 * (njobs > 0 ? njobs : 1) * sizeof(uint64_t));
+	sched_order = (size_t *)malloc((njobs > 0 ? njobs : 1) * sizeof(size_t));
+	if(keys == NULL || sched_order == NULL)
+		err_exit("sched_open() --> malloc()\n");
+
+	for(i=0; i<njobs; i++){
+		if(stat(jobs[2 * i],&sb) == -1)
+			err_exit("sched_open() --> stat(%s)\n",jobs[2 * i]);
+		keys[2 * i] = sb.st_dev;
+		keys[2 * i + 1] = i;
 	}
+	qsort(keys,njobs,2 * sizeof(uint64_t),sched_cmp);
 
-	get_string_table(elfc);
+	for(i=0, n=0; i<njobs; i++)
+		n += i == 0 || keys[2 * i] != keys[2 * i - 2];
 
-	close(fd);
+	sched = (Scheduler *)worker_alloc(sizeof(Scheduler) + n * sizeof(Device));
+	if(sched == NULL)
+		err_exit("sched_open() --> calloc()\n");
 
-	return elfc;
+	pthread_mutexattr_init(&mattr);
+	pthread_condattr_init(&cattr);
+	if(opt_isolate){
+		pthread_mutexattr_setpshared(&mattr,PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&mattr,PTHREAD_MUTEX_ROBUST);
+		pthread_condattr_setpshared(&cattr,PTHREAD_PROCESS_SHARED);
+	}
+	pthread_mutex_init(&sched->lock,&mattr);
+	pthread_cond_init(&sched->wake,&cattr);
+	pthread_mutexattr_destroy(&mattr);
+	pthread_condattr_destroy(&cattr);
+
+	/* Every device starts with its share of the workers */
+	for(i=0, d=NULL; i<njobs; i++){
+		if(i == 0 || keys[2 * i] != keys[2 * i - 2]){
+			d = &sched->devices[sched->ndevices++];
+			d->dev = keys[2 * i];
+			d->first = i;
+			d->limit = (nworkers + n - 1) / n;
+		}
+		d->count++;
+		sched_order[i] = keys[2 * i + 1];
+	}
+
+	free(keys);
 }
 
+/*
+  A gradient on the service time: every DEVICE_WINDOW files the mean
+  ns per byte of the window is set against the best window seen. A
+  device which keeps up gets sqrt(limit) more workers, one which slows
+  down as it gets more is queueing and loses them in proportion, down
+  to one. The best window drifts up slowly, so a device which got
+  slower for good is learnt again. However steady, a device never gets
+  the workers kept for the other devices with jobs queued, one each.
+*/
 static void
-destroy_container(ElfContainer *elfc)
+sched_tune(Device *d, double rate)
 {
-	if(elfc == NULL)
-		err_exit("destroy_container()\n");
-	else if(elfc->type == ELF_32){
-		munmap(elfc->elf32,elfc->mmapped);
+	double mean, gradient;
+	size_t i;
+	int limit, bound, root;
+
+	d->window += rate;
+	if(d->done % DEVICE_WINDOW != 0)
+		return;
+
+	mean = d->window / DEVICE_WINDOW;
+	d->window = 0;
+	if(d->best == 0 || mean < d->best)
+		d->best = mean;
+	else
+		d->best *= 1.02;
+
+	bound = nworkers;
+	for(i=0; i<sched->ndevices; i++)
+		if(&sched->devices[i] != d && sched->devices[i].next < sched->devices[i].count)
+			bound--;
+
+	gradient = d->best / mean;
+	if(gradient >= 1){
+		for(root=1; (root + 1) * (root + 1) <= d->limit; root++)
+			;
+		limit = d->limit + root;
 	}else
-		munmap(elfc->elf64,elfc->mmapped);
+		limit = d->limit * (gradient < 0.5 ? 0.5 : gradient);
+	d->limit = limit > bound ? bound : limit < 1 ? 1 : limit;
+}
 
-	free(elfc);
+/* A job of the first device below its cap, SIZE_MAX once none are left */
+static size_t
+sched_claim(Worker *w)
+{
+	Device *d;
+	size_t i, job;
+	int left;
+
+	queue_lock(&sched->lock);
+	for(;;){
+		left = 0;
+		for(i=0; i<sched->ndevices; i++){
+			d = &sched->devices[(sched->rr + i) % sched->ndevices];
+			if(d->next == d->count)
+				continue;
+			left = 1;
+			if(d->active < d->limit)
+				break;
+		}
+
+		if(i < sched->ndevices){
+			i = (sched->rr + i) % sched->ndevices;
+			sched->rr = (i + 1) % sched->ndevices;
+			d->active++;
+			job = sched_order[d->first + d->next++];
+			w->device = i;
+			break;
+		}
+		if(!left){
+			job = SIZE_MAX;
+			break;
+		}
+		if(pthread_cond_wait(&sched->wake,&sched->lock) == EOWNERDEAD)
+			pthread_mutex_consistent(&sched->lock);
+	}
+	pthread_mutex_unlock(&sched->lock);
+
+	return job;
 }
 
+/* Give the slot back and learn from how long the job held it; 0 ns for a failure */
 static void
-adjust_header(ElfContainer *elfc)
+sched_done(Worker *w, uint64_t ns, size_t size)
 {
-	unsigned char *ptr;
-	int i;
+	Device *d;
 
-	if(elfc->type == ELF_32){
-		elfc->elf32->e_shoff = 0;
-		elfc->elf32->e_shentsize = 0;
-		elfc->elf32->e_shnum = 0;
-		elfc->elf32->e_shstrndx = 0;
-		ptr = (unsigned char *)elfc->elf32;
-	}else if(elfc->type == ELF_64){
-		elfc->elf64->e_shoff = 0;
-		elfc->elf64->e_shentsize = 0;
-		elfc->elf64->e_shnum = 0;
-		elfc->elf64->e_shstrndx = 0;
-		ptr = (unsigned char *)elfc->elf64;
-	}
-
-	/* Clear content of string table */
-	ptr += elfc->strtbloff;
-
-	for(i=0; i<elfc->strtblsize; i++)
-		ptr[i] = '\0';
-  
+	queue_lock(&sched->lock);
+	d = &sched->devices[w->device];
+	d->active--;
+	d->busy_ns += ns;
+	if(ns > 0){
+		d->done++;
+		sched_tune(d,(double)ns / (size + DEVICE_FIXED_BYTES));
+	}
+	w->device = -1;
+	pthread_cond_broadcast(&sched->wake);
+	pthread_mutex_unlock(&sched->lock);
+}
+
+static int
+sched_left(void)
+{
+	size_t i;
+
+	if(sched == NULL)
+		return __atomic_load_n(&queue->next_job,__ATOMIC_RELAXED) < njobs;
+
+	for(i=0; i<sched->ndevices; i++)
+		if(__atomic_load_n(&sched->devices[i].next,__ATOMIC_RELAXED) < sched->devices[i].count)
+			return 1;
+	return 0;
 }
 
 static void
-write_elf(ElfContainer *elfc, const char *out_file)
+sched_print(void)
 {
-	int fd, flags;
-	mode_t mode;
-	size_t size;
-	ssize_t written;
-	void *ptr;  
+	const Device *d;
+	size_t i;
 
-	flags = O_CREAT|O_RDWR|O_TRUNC;
-	mode = S_IRWXU|S_IRGRP|S_IWGRP;
+	fprintf(stderr,"\n%-12s %10s %10s %10s %12s\n","device","files","limit","failed","busy(ms)");
+	for(i=0; i<sched->ndevices; i++){
+		d = &sched->devices[i];
+		fprintf(stderr,"%5u:%-6u %10zu %10d %10zu %12.1f\n",major(d->dev),minor(d->dev),
+			d->count,d->limit,d->next - d->done,d->busy_ns / 1e6);
+	}
+}
 
-	fd = open(out_file,flags,mode);
-	if(fd == -1)
-		err_exit("open()\n");
+static size_t
+worker_claim(Worker *w)
+{
+	size_t job;
 
-	if(elfc->type == ELF_32){
-		size = elfc->elf32->e_shoff - 1;
-		ptr = elfc->elf32;
-	}else if(elfc->type == ELF_64){
-		size = elfc->elf64->e_shoff - 1;
-		ptr = elfc->elf64;
-	}else
-		err_exit("write_elf()\n");
+	if(sched != NULL)
+		return sched_claim(w);
+
+	job = __atomic_fetch_add(&queue->next_job,1,__ATOMIC_RELAXED);
+	return job < njobs ? job : SIZE_MAX;
+}
 
-	written = write(fd,ptr,size);
-	if(written == 0 || written == -1)
-		err_exit("write_elf() --> write()\n");
+static void
+worker_run(Worker *w, size_t job)
+{
+	uint64_t start;
 
-	close(fd);
-  
+	start = now_ns();
+	if(w->live != NULL)
+		live_begin(w,jobs[2 * job]);
+
+	if(opt_zip)
+		process_zip(w,jobs[2 * job],jobs[2 * job + 1]);
+	else if(opt_package)
+		process_package(w,jobs[2 * job],jobs[2 * job + 1]);
+	else if(opt_squashfs)
+		process_squashfs(w,jobs[2 * job],jobs[2 * job + 1]);
+	else if(opt_s3 != NULL)
+		process_s3(w,jobs[2 * job],jobs[2 * job + 1]);
+	else if(opt_bundle != NULL)
+		process_bundle(w,job);
+	else if(opt_remote == NULL || !process_remote(w,job)){
+		process_file(w,jobs[2 * job],jobs[2 * job + 1]);
+		if(opt_remote != NULL)
+			remote_put(w,job);
+	}
+
+	if(w->live != NULL)
+		live_end(w);
+	if(sched != NULL)
+		sched_done(w,now_ns() - start,w->cur.size);
+}
+
+static void *
+worker_main(void *arg)
+{
+	Worker *w;
+	size_t job;
+
+	w = (Worker *)arg;
+	self = w;
+
+	while((job = worker_claim(w)) != SIZE_MAX)
+		worker_run(w,job);
+
+	return NULL;
+}
+
+/* A worker process claims jobs until none are left, or it dies on one */
+static void
+isolate_spawn(Worker *w, pid_t supervisor)
+{
+	size_t job;
+	pid_t pid;
+
+	w->job = SIZE_MAX;
+	w->error = 0;
+	w->message[0] = '\0';
+	pid = fork();
+	if(pid == -1)
+		err_exit("isolate_spawn() --> fork()\n");
+	if(pid > 0){
+		w->pid = pid;
+		return;
+	}
+
+	prctl(PR_SET_PDEATHSIG,SIGKILL);
+	if(getppid() != supervisor)
+		_exit(EXIT_FAILURE);
+	isolate_self = w;
+	self = w;
+	publish_staging[0] = '\0';
+
+	/* flock() on a shared description would not keep workers apart */
+	if(debug_pack_fd != -1){
+		close(debug_pack_fd);
+		debug_pack_fd = openat(debug_dfd,"pack",O_WRONLY|O_APPEND);
+		if(debug_pack_fd == -1)
+			err_exit("isolate_spawn() --> openat(pack)\n");
+	}
+
+	while((job = worker_claim(w)) != SIZE_MAX){
+		__atomic_store_n(&w->job,job,__ATOMIC_RELEASE);
+		worker_run(w,job);
+	}
+	__atomic_store_n(&w->job,SIZE_MAX,__ATOMIC_RELEASE);
+
+	_exit(EXIT_SUCCESS);
+}
+
+/*
+  Run the workers as pre-forked processes and wait for them. A worker
+  which dies with a job fails that file alone: the file is reported,
+  its output removed, and a fresh worker takes over the rest of the
+  queue. Returns the number of failed files.
+*/
+static size_t
+isolate_run(void)
+{
+	Worker *w;
+	size_t job, failed;
+	pid_t supervisor, pid;
+	int i, running, status, sig;
+
+	supervisor = getpid();
+	for(i=0; i<nworkers; i++)
+		isolate_spawn(&workers[i],supervisor);
+
+	failed = 0;
+	for(running=nworkers; running > 0; ){
+		pid = waitpid(-1,&status,0);
+		if(pid == -1){
+			if(errno == EINTR)
+				continue;
+			err_exit("isolate_run() --> waitpid()\n");
+		}
+		for(i=0; i<nworkers && workers[i].pid != pid; i++)
+			;
+		if(i == nworkers)
+			continue;
+		w = &workers[i];
+
+		job = __atomic_load_n(&w->job,__ATOMIC_ACQUIRE);
+		if(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS && job == SIZE_MAX){
+			running--;
+			continue;
+		}
+
+		/* Failed on no file: another worker would fail the same way */
+		if(WIFEXITED(status) && job == SIZE_MAX){
+			errno = w->error;
+			err_exit("isolate_run() --> worker %d failed before any file: %s\n",w->id,
+				w->message[0] != '\0' ? w->message : "no reason given");
+		}
+
+		if(WIFSIGNALED(status)){
+			sig = WTERMSIG(status);
+			w->error = sig == SIGSEGV || sig == SIGBUS ? EFAULT : ECANCELED;
+			snprintf(w->message,sizeof(w->message),"killed by signal %d (%s)",sig,strsignal(sig));
+			fprintf(stderr,"isolate_run() --> %s\n",w->message);
+		}
+		if(job != SIZE_MAX){
+			failed++;
+			fprintf(stderr,"isolate_run() --> %s failed, left out\n",jobs[2 * job]);
+			if(!opt_publish)
+				unlink(jobs[2 * job + 1]);
+
+			if(opt_events){
+				if(w->cur.in_file == NULL){
+					memset(&w->cur,0,sizeof(w->cur));
+					w->cur.in_file = jobs[2 * job];
+					w->cur.out_file = jobs[2 * job + 1];
+					w->cur.start = now_ns();
+				}
+				events_emit(w,w->error != 0 ? w->error : EINVAL,w->message);
+				w->cur.in_file = NULL;
+			}
+			if(w->live != NULL){
+				if(w->live->seq & 1)
+					live_write_end(w->live);
+				live_write_begin(w->live);
+				w->live->state = ELFKILLAH_LIVE_FAILED;
+				live_write_end(w->live);
+				__atomic_fetch_add(&live->errors,1,__ATOMIC_RELAXED);
+			}
+		}
+
+		if(sched != NULL && w->device != -1)
+			sched_done(w,0,0);
+
+		/* Died between jobs or on one: either way the queue goes on */
+		if(sched_left())
+			isolate_spawn(w,supervisor);
+		else
+			running--;
+	}
+
+	return failed;
 }
 
 int
 main(int argc, char *argv[])
 {
-	ElfContainer *elfc_in, *elfc_out;
+	static const struct option longopts[] = {
+		{"jobs", required_argument, NULL, 'j'},
+		{"stats", no_argument, NULL, 's'},
+		{"copy-threads", required_argument, NULL, 'c'},
+		{"events", required_argument, NULL, 'e'},
+		{"zip", no_argument, NULL, 'z'},
+		{"package", no_argument, NULL, 'p'},
+		{"squashfs", no_argument, NULL, 'q'},
+		{"mount", no_argument, NULL, 'm'},
+		{"record", required_argument, NULL, 'r'},
+		{"live", no_argument, NULL, 'l'},
+		{"cache", required_argument, NULL, 'k'},
+		{"remote", required_argument, NULL, 'R'},
+		{"debug-store", required_argument, NULL, 'D'},
+		{"publish", no_argument, NULL, 'P'},
+		{"isolate", no_argument, NULL, 'I'},
+		{"per-device", no_argument, NULL, 'V'},
+		{"s3", required_argument, NULL, 'S'},
+		{"bundle", required_argument, NULL, 'B'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	Stats *total;
+	size_t failed;
+	int c, i, j, k;
+
+	while((c = getopt_long(argc,argv,"j:sc:zpqh",longopts,NULL)) != -1){
+		switch(c){
+		case 'j':
+			opt_jobs = atoi(optarg);
+			if(opt_jobs < 1)
+				usage(argv[0]);
+			break;
+		case 's':
+			opt_stats = 1;
+			break;
+		case 'c':
+			opt_copy_threads = atoi(optarg);
+			if(opt_copy_threads < 1 || opt_copy_threads > COPY_MAX_THREADS)
+				usage(argv[0]);
+			break;
+		case 'z':
+			opt_zip = 1;
+			break;
+		case 'p':
+			opt_package = 1;
+			break;
+		case 'q':
+			opt_squashfs = 1;
+			break;
+		case 'm':
+			opt_mount = 1;
+			break;
+		case 'r':
+			opt_record = optarg;
+			break;
+		case 'l':
+			opt_live = 1;
+			break;
+		case 'k':
+			opt_cache = optarg;
+			break;
+		case 'R':
+			opt_remote = optarg;
+			break;
+		case 'D':
+			opt_debug_store = optarg;
+			break;
+		case 'P':
+			opt_publish = 1;
+			break;
+		case 'I':
+			opt_isolate = 1;
+			break;
+		case 'V':
+			opt_per_device = 1;
+			break;
+		case 'S':
+			opt_s3 = optarg;
+			break;
+		case 'B':
+			opt_bundle = optarg;
+			break;
+		case 'e':
+			if(strcmp(optarg,"jsonl") != 0)
+				usage(argv[0]);
+			opt_events = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if(opt_mount){
+		if(argc - optind != 2 || opt_live || opt_isolate)
+			usage(argv[0]);
+		mount_main(argv[optind],argv[optind + 1]);
+	}
 
-	if(argc != 3 || strcmp(argv[1],"--help") == 0)
+	if(argc - optind < 2 || (argc - optind) % 2 != 0)
 		usage(argv[0]);
-  
-	elfc_in = build_container(argv[1]);
-	write_elf(elfc_in,argv[2]);
-  
-	elfc_out = build_container(argv[2]);
-	elfc_out->strtbloff = elfc_in->strtbloff;
-	elfc_out->strtblsize = elfc_in->strtblsize;
-	adjust_header(elfc_out);
 
-	destroy_container(elfc_out);
-	destroy_container(elfc_in);
+	/* Only plain ELF files have a layout and stages to record */
+	if(opt_record != NULL){
+		if(opt_zip || opt_package || opt_squashfs)
+			usage(argv[0]);
+		record_fd = open(opt_record,O_CREAT|O_WRONLY|O_TRUNC,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+		if(record_fd == -1)
+			err_exit("main() --> open(%s)\n",opt_record);
+		if(write_all(record_fd,RECORD_HEADER,strlen(RECORD_HEADER)) == -1)
+			err_exit("main() --> write()\n");
+	}
 
-    
-	exit(EXIT_SUCCESS);
+	/* Results are cached for plain ELF files only */
+	if(opt_cache != NULL){
+		if(opt_zip || opt_package || opt_squashfs)
+			usage(argv[0]);
+		cache_open(opt_cache);
+	}
+	if(opt_remote != NULL){
+		if(opt_zip || opt_package || opt_squashfs || opt_isolate)
+			usage(argv[0]);
+		remote_parse(opt_remote);
+	}
+	if(opt_debug_store != NULL){
+		if(opt_zip || opt_package || opt_squashfs)
+			usage(argv[0]);
+		debug_store_open(opt_debug_store);
+	}
+
+	/* Outputs are object keys, never files to cache or swap in */
+	if(opt_s3 != NULL){
+		if(opt_zip || opt_package || opt_squashfs || opt_cache != NULL || opt_remote != NULL || opt_publish)
+			usage(argv[0]);
+		s3_parse(opt_s3);
+	}
+
+	/* One tree in, one tree out */
+	if(opt_publish){
+		if(argc - optind != 2 || opt_zip || opt_package || opt_squashfs)
+			usage(argv[0]);
+		publish_open(argv[optind],argv[optind + 1]);
+	}else{
+		jobs = argv + optind;
+		njobs = (argc - optind) / 2;
+	}
+	if(opt_jobs > njobs)
+		opt_jobs = njobs > 0 ? njobs : 1;
+
+	/* Outputs are names in one file, which this process alone builds */
+	if(opt_bundle != NULL){
+		if(opt_zip || opt_package || opt_squashfs || opt_cache != NULL || opt_remote != NULL
+		   || opt_s3 != NULL || opt_publish || opt_isolate)
+			usage(argv[0]);
+		bundle_open(opt_bundle);
+	}
+
+	if(opt_isolate)
+		isolate_queue();
+	workers = (Worker *)worker_alloc(opt_jobs * sizeof(Worker));
+	if(workers == NULL)
+		err_exit("main() --> calloc()\n");
+
+	/* Every worker records into its own histograms, merged after join */
+	for(i=0; i<opt_jobs; i++){
+		workers[i].id = i;
+		workers[i].device = -1;
+		if(opt_stats){
+			workers[i].stats = (Stats *)worker_alloc(sizeof(Stats));
+			if(workers[i].stats == NULL)
+				err_exit("main() --> calloc()\n");
+		}
+		if(opt_events){
+			workers[i].events = (char *)worker_alloc(EVENT_BUF_SIZE);
+			if(workers[i].events == NULL)
+				err_exit("main() --> malloc()\n");
+		}
+		if(opt_record != NULL){
+			workers[i].records = (char *)worker_alloc(RECORD_BUF_SIZE);
+			if(workers[i].records == NULL)
+				err_exit("main() --> malloc()\n");
+		}
+	}
+	nworkers = opt_jobs;
+
+	if(opt_per_device)
+		sched_open();
+	if(opt_remote != NULL)
+		remote_start();
+	if(opt_live)
+		live_open(opt_zip ? "zip" : opt_package ? "package" : opt_squashfs ? "squashfs" : "elf");
+
+	failed = 0;
+	if(opt_isolate)
+		failed = isolate_run();
+	else{
+		for(i=0; i<opt_jobs; i++){
+			if(pthread_create(&workers[i].tid,NULL,worker_main,&workers[i]) != 0)
+				err_exit("main() --> pthread_create()\n");
+		}
+
+		for(i=0; i<opt_jobs; i++)
+			pthread_join(workers[i].tid,NULL);
+	}
+	if(opt_remote != NULL)
+		remote_stop();
+	if(opt_debug_store != NULL)
+		debug_store_close();
+	if(opt_bundle != NULL)
+		bundle_close(opt_bundle);
+	if(opt_publish){
+		/* A tree with holes is not published */
+		if(failed > 0){
+			errno = 0;
+			err_exit("main() --> %zu files failed, %s left as it is\n",failed,argv[optind + 1]);
+		}
+		publish_swap(argv[optind + 1]);
+	}
+
+	if(opt_events)
+		for(i=0; i<opt_jobs; i++)
+			if(events_flush(&workers[i]) == -1)
+				err_exit("main() --> events_flush()\n");
+
+	if(opt_record != NULL){
+		for(i=0; i<opt_jobs; i++)
+			if(record_flush(&workers[i]) == -1)
+				err_exit("main() --> record_flush()\n");
+		close(record_fd);
+	}
+
+	if(opt_stats){
+		total = workers[0].stats;
+		for(i=1; i<opt_jobs; i++)
+			for(j=0; j<SIZE_CLASSES; j++)
+				for(k=0; k<STAGE_COUNT; k++)
+					hist_merge(&total->hist[j][k],&workers[i].stats->hist[j][k]);
+
+		print_stats(total);
+		if(sched != NULL)
+			sched_print();
+		if(opt_bundle != NULL)
+			bundle_print();
+	}
+
+	live_close(ELFKILLAH_LIVE_DONE,0,NULL);
+	exit(failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
 }
+
+#endif
@@ -0,0 +1,181 @@
+/*
+  Copyright (C) 2014 Fabrizio Curcio aka spike
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Embedding API. Build elfkillah.c with -DELFKILLAH_LIBRARY to get an
+  object without main() which exports the calls below.
+
+  An instance owns a pool of threads which strip the jobs submitted to
+  it; submitting never blocks on the stripping. A job completes either
+  through its callback, called on a pool thread, or, without one, into
+  the completion queue of the instance: its eventfd becomes readable
+  and elfkillah_reap() hands the results out. Instances share nothing,
+  so any number of them may live in one process.
+*/
+
+#ifndef ELFKILLAH_H
+#define ELFKILLAH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Elfkillah Elfkillah;
+
+typedef struct {
+	void *arg;		/* as given in the job */
+	int error;		/* 0, or an errno value */
+	const char *message;	/* what failed, NULL on success */
+	size_t size;		/* of the input */
+	size_t truncated;	/* bytes cut off */
+	size_t strtblsize;	/* bytes of string table cleared */
+} ElfkillahResult;
+
+/*
+  Input and output are given by path, or by descriptor when the path
+  is NULL. Paths have to stay valid until the job completes; given
+  descriptors are not closed, the output one is written from offset 0
+  and truncated to the stripped size.
+*/
+typedef struct {
+	const char *in_path;
+	const char *out_path;
+	int in_fd;
+	int out_fd;
+	void (*done)(const ElfkillahResult *result);
+	void *arg;
+} ElfkillahJob;
+
+/* Start an instance with the given number of threads, NULL on failure */
+Elfkillah *elfkillah_new(int threads);
+
+/* Queue n jobs, copied; returns 0, or ENOMEM with none queued */
+int elfkillah_submit(Elfkillah *ek, const ElfkillahJob *jobs, size_t n);
+
+/* Readable whenever results wait in the completion queue */
+int elfkillah_eventfd(Elfkillah *ek);
+
+/* Move up to max results out of the completion queue, returns how many */
+size_t elfkillah_reap(Elfkillah *ek, ElfkillahResult *results, size_t max);
+
+/* Finish the queued jobs, then release the instance */
+void elfkillah_free(Elfkillah *ek);
+
+/*
+  Live statistics. Started with --live, the batch engine keeps this
+  segment in ELFKILLAH_LIVE_DIR/elfkillah.<pid> up to date and removes
+  it on exit. Every worker slot is guarded by a seqlock: the worker
+  makes seq odd, writes, makes it even again, so a reader copies a
+  slot, then retries whenever seq was odd or changed meanwhile. The
+  header fields are single words written once or atomically. Times
+  are CLOCK_MONOTONIC nanoseconds.
+*/
+#define ELFKILLAH_LIVE_DIR "/dev/shm"
+#define ELFKILLAH_LIVE_MAGIC 0x31564c45	/* "ELV1" */
+#define ELFKILLAH_LIVE_STAGES 5		/* total, open+map, write, patch, unmap */
+#define ELFKILLAH_LIVE_PATH 256
+
+enum {
+	ELFKILLAH_LIVE_IDLE,
+	ELFKILLAH_LIVE_BUSY,
+	ELFKILLAH_LIVE_DONE,
+	ELFKILLAH_LIVE_FAILED
+};
+
+typedef struct {
+	uint32_t seq;
+	uint32_t state;
+	uint64_t files;		/* completed */
+	uint64_t bytes;		/* of completed inputs */
+	uint64_t buffered;	/* event and record bytes not yet written */
+	uint64_t file_start;
+	uint64_t stage_ns[ELFKILLAH_LIVE_STAGES];	/* summed over files */
+	char file[ELFKILLAH_LIVE_PATH];		/* current input */
+} __attribute__((aligned(64))) ElfkillahLiveWorker;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t pid;
+	uint32_t nworkers;
+	uint32_t state;		/* running, then done or failed */
+	uint32_t errors;
+	int32_t error;		/* errno of the failure */
+	uint64_t start;
+	uint64_t jobs;
+	char mode[16];		/* elf, zip, package or squashfs */
+	char message[128];	/* of the failure */
+	ElfkillahLiveWorker workers[];
+} __attribute__((aligned(64))) ElfkillahLive;
+
+/*
+  Debug store. With --debug-store <dir> elfkillah keeps what the strip
+  hides from debuggers, a debuginfo file per build-id with the section
+  headers and the contents of the sections not loaded at run time,
+  appended to <dir>/pack. <dir>/index finds them: a header, then
+  records sorted by build-id in Eytzinger order, so a lookup walks
+  down from the first record a level at a time. Records stored since
+  the index was last rebuilt wait in <dir>/journal, oldest first; a
+  later record for a build-id replaces an earlier one.
+*/
+#define ELFKILLAH_DEBUG_MAGIC 0x31444b45	/* "EKD1" */
+#define ELFKILLAH_BUILD_ID_MAX 40
+
+typedef struct {
+	uint32_t magic;
+	uint32_t count;
+	uint64_t reserved;
+} ElfkillahDebugIndex;
+
+typedef struct {
+	uint8_t id[ELFKILLAH_BUILD_ID_MAX];	/* zero padded */
+	uint32_t id_len;
+	uint32_t reserved;
+	uint64_t offset;			/* in the pack */
+	uint64_t size;
+} ElfkillahDebugRecord;
+
+/*
+  Bundle. With --bundle <file> the outputs go into one file of
+  ELFKILLAH_BUNDLE_PAGE byte pages, each distinct page stored once.
+  Page 0 holds the header; the stored pages follow, then the entries,
+  one per output in command line order, their page lists and their
+  names, NUL terminated. Output i is made of the list[entries[i].first]
+  and following pages, as many as its size takes, the last one cut at
+  its size. Offsets are from the start of the file but name, which is
+  from the start of the names.
+*/
+#define ELFKILLAH_BUNDLE_MAGIC 0x31424b45	/* "EKB1" */
+#define ELFKILLAH_BUNDLE_PAGE 4096
+
+typedef struct {
+	uint32_t magic;
+	uint32_t count;			/* entries */
+	uint64_t pages;			/* stored, page 0 included */
+	uint64_t entries;
+	uint64_t list;			/* uint32_t page numbers */
+	uint64_t names;
+	uint64_t size;			/* of the whole bundle */
+} ElfkillahBundle;
+
+typedef struct {
+	uint64_t size;
+	uint64_t first;			/* in the page lists */
+	uint64_t name;
+	uint32_t mode;			/* of the input */
+	uint32_t reserved;
+} ElfkillahBundleEntry;
+
+#endif
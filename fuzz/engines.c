@@ -0,0 +1,655 @@
+/*
+  Copyright (C) 2014 Fabrizio Curcio aka spike
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Differential harness for the strip engines. Every input goes through
+  the reference, elf_view() then the cut with patch_image() over it,
+  which is what write_elf() plus adjust_header() do to a file, and
+  through every engine; all of them have to accept the same inputs and
+  produce the same bytes, and report the same number of string table
+  bytes cleared where they report it. The command line engine is the
+  real process_file(), run in a child since it rejects by exiting; the
+  harness therefore builds the whole program, its main() renamed.
+
+  As a libFuzzer target, which reports exec/s itself:
+
+    clang -g -O1 -fsanitize=fuzzer,address -DELFKILLAH_FUZZER \
+      -pthread -o engines fuzz/engines.c -lz -llzma
+    ./engines -max_len=65536 corpus/
+
+  Standalone, it feeds the engines randomized ELF-32/64 images with
+  edge layouts, extended numbering, and truncated or hostile headers:
+
+    cc -O2 -pthread -o engines fuzz/engines.c -lz -llzma
+    ./engines [iterations] [seed]
+
+  A mismatch aborts after saving the input to engines-mismatch.bin.
+*/
+
+#define main elfkillah_main
+#include "../elfkillah.c"
+#undef main
+
+typedef struct {
+	const char *engine;
+	const char *fault;	/* the engine crashed */
+	int ok;
+	unsigned char *out;
+	size_t len;
+	long zeroed;
+} Outcome;
+
+static char scratch[PATH_MAX];
+static int verdict_fd;
+
+static void
+outcome_free(Outcome *o)
+{
+	free(o->out);
+	memset(o,0,sizeof(*o));
+}
+
+static void
+mismatch(const Outcome *ref, const Outcome *o, const uint8_t *data, size_t size,
+	 const char *what)
+{
+	FILE *f;
+
+	fprintf(stderr,"engines: %s differs from %s on %zu bytes of input: %s\n",
+		o->engine,ref->engine,size,what);
+	f = fopen("engines-mismatch.bin","wb");
+	if(f != NULL){
+		fwrite(data,1,size,f);
+		fclose(f);
+	}
+	abort();
+}
+
+static void
+compare(const Outcome *ref, const Outcome *o, const uint8_t *data, size_t size)
+{
+	size_t i;
+
+	if(o->fault != NULL)
+		mismatch(ref,o,data,size,o->fault);
+	if(o->ok < 0)
+		mismatch(ref,o,data,size,"checksum");
+	if(ref->ok != o->ok)
+		mismatch(ref,o,data,size,o->ok ? "accepted" : "rejected");
+	if(!ref->ok)
+		return;
+	if(ref->len != o->len)
+		mismatch(ref,o,data,size,"length");
+	for(i=0; i<ref->len; i++)
+		if(ref->out[i] != o->out[i]){
+			fprintf(stderr,"engines: first difference at byte %zu\n",i);
+			mismatch(ref,o,data,size,"content");
+		}
+	if(o->zeroed != -1 && o->zeroed != ref->zeroed)
+		mismatch(ref,o,data,size,"string table bytes cleared");
+}
+
+static unsigned char *
+slurp(int fd, size_t *len)
+{
+	struct stat st;
+	unsigned char *buf;
+
+	if(fstat(fd,&st) == -1)
+		err_exit("slurp() --> fstat()\n");
+	buf = (unsigned char *)malloc(st.st_size + 1);
+	if(buf == NULL)
+		err_exit("slurp() --> malloc()\n");
+	if(pread(fd,buf,st.st_size,0) != st.st_size)
+		err_exit("slurp() --> pread()\n");
+	*len = st.st_size;
+
+	return buf;
+}
+
+/* Plain raw inflate: zip_inflate() wants the ELF magic, a patch may clear it */
+static unsigned char *
+unpack(const unsigned char *src, size_t csize, size_t usize)
+{
+	z_stream zs;
+	unsigned char *buf;
+	int ret;
+
+	buf = (unsigned char *)malloc(usize + 1);
+	memset(&zs,0,sizeof(zs));
+	if(buf == NULL || inflateInit2(&zs,-MAX_WBITS) != Z_OK)
+		err_exit("unpack() --> inflateInit2()\n");
+
+	zs.next_in = (Bytef *)src;
+	zs.avail_in = csize;
+	zs.next_out = buf;
+	zs.avail_out = usize + 1;
+	ret = inflate(&zs,Z_FINISH);
+	inflateEnd(&zs);
+
+	if(ret != Z_STREAM_END || zs.total_out != usize){
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+static int
+memfd_with(const uint8_t *data, size_t size)
+{
+	int fd;
+
+	fd = memfd_create("engines",MFD_CLOEXEC);
+	if(fd == -1 || write_all(fd,(const char *)data,size) == -1)
+		err_exit("memfd_with() --> memfd_create()\n");
+
+	return fd;
+}
+
+/* The semantics every engine is held to */
+static void
+run_reference(Outcome *o, const uint8_t *data, size_t size)
+{
+	ElfView view;
+
+	o->engine = "reference";
+	if(elf_view(&view,data,size) != NULL)
+		return;
+
+	o->ok = 1;
+	o->len = view_cut(&view);
+	o->out = (unsigned char *)malloc(o->len);
+	memcpy(o->out,data,o->len);
+	o->zeroed = patch_image(o->out,o->len,&view);
+}
+
+/* err_exit() in the child: the input was rejected, leave at once */
+static void
+verdict_rejected(void)
+{
+	unsigned char verdict;
+
+	verdict = 0;
+	write(verdict_fd,&verdict,1);
+	_exit(EXIT_FAILURE);
+}
+
+/* process_file() on every input, as the command line runs it */
+static void
+run_file(Outcome *o, const uint8_t *data, size_t size)
+{
+	Worker w;
+	char in[PATH_MAX + 4];
+	unsigned char verdict;
+	size_t zeroed;
+	ssize_t got;
+	pid_t pid;
+	int fd, fds[2], status;
+
+	o->engine = "process_file";
+	o->zeroed = -1;
+
+	snprintf(in,sizeof(in),"%s.in",scratch);
+	fd = open(in,O_CREAT|O_WRONLY|O_TRUNC,S_IRWXU);
+	if(fd == -1 || write_all(fd,(const char *)data,size) == -1)
+		err_exit("run_file() --> open()\n");
+	close(fd);
+	unlink(scratch);
+
+	if(pipe(fds) == -1)
+		err_exit("run_file() --> pipe()\n");
+	pid = fork();
+	if(pid == -1)
+		err_exit("run_file() --> fork()\n");
+
+	if(pid == 0){
+		/* Rejections are expected; sanitizers still report on descriptor 2 */
+		close(fds[0]);
+		verdict_fd = fds[1];
+		atexit(verdict_rejected);
+		stderr = fopen("/dev/null","w");
+
+		memset(&w,0,sizeof(w));
+		process_file(&w,in,scratch);
+
+		verdict = 1;
+		write(verdict_fd,&verdict,1);
+		write(verdict_fd,&w.cur.strtblsize,sizeof(w.cur.strtblsize));
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(fds[1]);
+	got = read(fds[0],&verdict,1);
+	if(got == 1 && verdict == 1 && read(fds[0],&zeroed,sizeof(zeroed)) != sizeof(zeroed))
+		got = 0;
+	close(fds[0]);
+	if(waitpid(pid,&status,0) == -1)
+		err_exit("run_file() --> waitpid()\n");
+	unlink(in);
+
+	if(got != 1){
+		o->fault = WIFSIGNALED(status) ? strsignal(WTERMSIG(status)) : "died";
+		return;
+	}
+	if(verdict == 0)
+		return;
+
+	fd = open(scratch,O_RDONLY);
+	if(fd == -1)
+		err_exit("run_file() --> open()\n");
+	o->ok = 1;
+	o->out = slurp(fd,&o->len);
+	o->zeroed = zeroed;
+	close(fd);
+}
+
+/*
+  copy_parallel() only runs on inputs of COPY_PARALLEL_MIN bytes and
+  up, so it gets the cut of the reference directly; deciding is left
+  to the other engines.
+*/
+static void
+run_pwrite(Outcome *o, const Outcome *ref, const uint8_t *data, size_t size)
+{
+	ElfContainer *elfc;
+	ElfView view;
+	int fd;
+
+	o->engine = "pwrite";
+	o->zeroed = -1;
+	if(!ref->ok || elf_view(&view,data,size) != NULL)
+		return;
+
+	fd = open(scratch,O_CREAT|O_RDWR|O_TRUNC,S_IRWXU);
+	if(fd == -1)
+		err_exit("run_pwrite() --> open()\n");
+	opt_copy_threads = 4;
+	copy_parallel(fd,data,ref->len);
+	close(fd);
+
+	elfc = build_container(scratch,1);
+	adjust_header(elfc,&view);
+	destroy_container(elfc);
+
+	fd = open(scratch,O_RDONLY);
+	if(fd == -1)
+		err_exit("run_pwrite() --> open()\n");
+	o->ok = 1;
+	o->out = slurp(fd,&o->len);
+	close(fd);
+}
+
+/* The embedding API's engine, descriptor to descriptor */
+static void
+run_strip_fd(Outcome *o, const uint8_t *data, size_t size)
+{
+	ElfkillahResult res;
+	int in_fd, out_fd;
+
+	o->engine = "strip_fd";
+	in_fd = memfd_with(data,size);
+	out_fd = memfd_with((const uint8_t *)"stale",5);
+
+	memset(&res,0,sizeof(res));
+	if(strip_fd(in_fd,out_fd,&res) == NULL){
+		o->ok = 1;
+		o->out = slurp(out_fd,&o->len);
+		o->zeroed = res.strtblsize;
+	}
+
+	close(in_fd);
+	close(out_fd);
+}
+
+/* The --mount view: header-only probe, then reads of uneven sizes */
+static void
+run_lazy(Outcome *o, const uint8_t *data, size_t size)
+{
+	MountProbe p;
+	struct stat st;
+	size_t off, len;
+	uint64_t rng;
+	int fd;
+
+	o->engine = "lazy";
+	o->zeroed = -1;
+	fd = memfd_with(data,size);
+	if(fstat(fd,&st) == -1)
+		err_exit("run_lazy() --> fstat()\n");
+
+	mount_probe(fd,&st,&p);
+	if(p.state == MOUNT_ELF){
+		o->ok = 1;
+		o->len = view_cut(&p.view);
+		o->out = (unsigned char *)malloc(o->len + 1);
+		rng = size * 0x9e3779b97f4a7c15ULL + 1;
+		for(off=0; off < o->len; off += len){
+			rng ^= rng << 13;
+			rng ^= rng >> 7;
+			rng ^= rng << 17;
+			len = 1 + rng % 97;
+			if(len > o->len - off)
+				len = o->len - off;
+			if(pread(fd,o->out + off,len,off) != (ssize_t)len)
+				err_exit("run_lazy() --> pread()\n");
+			patch_range(o->out + off,off,len,&p.view,p.hdr);
+		}
+	}
+
+	close(fd);
+}
+
+/* The package engine: planning pass, then the emitting pass */
+static void
+run_stream(Outcome *o, const uint8_t *data, size_t size)
+{
+	Package pkg;
+	StripPlan *plan;
+	Inflow in;
+	Outflow out;
+	FILE *f;
+	char *buf;
+	size_t len;
+
+	o->engine = "stream";
+	package_init(&pkg,DIGEST_SHA256);
+
+	inflow_open(&in,CODEC_NONE,data,size);
+	strip_plan(&pkg,&in,size);
+	inflow_close(&in);
+
+	plan = strip_planned(&pkg);
+	if(plan != NULL){
+		f = open_memstream(&buf,&len);
+		if(f == NULL)
+			err_exit("run_stream() --> open_memstream()\n");
+		outflow_open(&out,CODEC_NONE,f);
+		inflow_open(&in,CODEC_NONE,data,size);
+		strip_emit(&pkg,&in,&out,size,plan,"member");
+		inflow_close(&in);
+		outflow_close(&out);
+		fclose(f);
+
+		o->ok = 1;
+		o->out = (unsigned char *)buf;
+		o->len = len;
+		o->zeroed = plan->zeroed;
+	}
+
+	package_free(&pkg);
+}
+
+/* A ZIP entry, stored or deflated; short entries are skipped as process_zip() does */
+static void
+run_zip(Outcome *o, const uint8_t *data, size_t size, int method)
+{
+	ZipEntry e;
+	unsigned char *packed;
+
+	o->engine = method == ZIP_STORED ? "zip-stored" : "zip-deflated";
+	if(size < EI_NIDENT)
+		return;
+
+	memset(&e,0,sizeof(e));
+	e.method = method;
+	e.usize = size;
+	if(method == ZIP_STORED){
+		packed = NULL;
+		e.csize = size;
+		zip_strip_entry(&e,data);
+	}else{
+		packed = zip_deflate(data,size,&e.csize);
+		zip_strip_entry(&e,packed);
+	}
+	free(packed);
+
+	if(e.out == NULL)
+		return;
+
+	o->ok = 1;
+	o->zeroed = e.zeroed;
+	if(method == ZIP_STORED){
+		o->out = e.out;
+		o->len = e.out_usize;
+	}else{
+		o->out = unpack(e.out,e.out_csize,e.out_usize);
+		o->len = e.out_usize;
+		free(e.out);
+		if(o->out == NULL){
+			o->ok = 0;
+			return;
+		}
+	}
+
+	/* Flagged by compare() whatever the reference did */
+	if(crc32_fast(0,o->out,o->len) != e.out_crc)
+		o->ok = -1;
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	Outcome ref, o;
+	int i;
+
+	if(scratch[0] == '\0'){
+		snprintf(scratch,sizeof(scratch),"%s/elfkillah-engines.%d",
+			getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp",(int)getpid());
+	}
+
+	/* The streaming engines read at most CAPTURE_MAX bytes of section headers */
+	if(size > CAPTURE_MAX)
+		return 0;
+
+	memset(&ref,0,sizeof(ref));
+	run_reference(&ref,data,size);
+
+	for(i=0; i<7; i++){
+		memset(&o,0,sizeof(o));
+		switch(i){
+		case 0: run_file(&o,data,size); break;
+		case 1: run_pwrite(&o,&ref,data,size); break;
+		case 2: run_strip_fd(&o,data,size); break;
+		case 3: run_lazy(&o,data,size); break;
+		case 4: run_stream(&o,data,size); break;
+		case 5: run_zip(&o,data,size,ZIP_STORED); break;
+		case 6: run_zip(&o,data,size,ZIP_DEFLATED); break;
+		}
+		compare(&ref,&o,data,size);
+		outcome_free(&o);
+	}
+
+	outcome_free(&ref);
+	unlink(scratch);
+
+	return 0;
+}
+
+#ifndef ELFKILLAH_FUZZER
+
+static uint64_t
+rnd(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+#define EH_SET(f,v) do{ if(is64) e64->f = (v); else e32->f = (v); }while(0)
+#define SH_SET(i,f,v) do{ \
+	unsigned char *sh_ = buf + shoff + (i) * shentsize; \
+	Elf32_Shdr s32_; \
+	Elf64_Shdr s64_; \
+	if(is64){ \
+		memcpy(&s64_,sh_,sizeof(s64_)); \
+		s64_.f = (v); \
+		memcpy(sh_,&s64_,sizeof(s64_)); \
+	}else{ \
+		memcpy(&s32_,sh_,sizeof(s32_)); \
+		s32_.f = (v); \
+		memcpy(sh_,&s32_,sizeof(s32_)); \
+	} \
+}while(0)
+
+/*
+  Build a random image: header, program headers, a body, then the
+  section header table, with the string table put anywhere, over the
+  header, across the cut or past it, then maybe damage it.
+*/
+static size_t
+gen_elf(unsigned char *buf, size_t cap, uint64_t *s)
+{
+	Elf32_Ehdr *e32;
+	Elf64_Ehdr *e64;
+	size_t ehsize, shentsize, phentsize, phnum, shnum, shstrndx, body;
+	size_t shoff, size, stroff, strsize, i;
+	int is64;
+
+	is64 = rnd(s) & 1;
+	ehsize = is64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr);
+	phentsize = is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr);
+	shentsize = is64 ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr);
+	if(rnd(s) % 8 == 0)
+		shentsize += rnd(s) % 16;
+
+	phnum = rnd(s) % 4;
+	shnum = 1 + rnd(s) % 12;
+	body = rnd(s) % 3000;
+	shoff = ehsize + phnum * phentsize + body;
+	if(rnd(s) % 2)
+		shoff = (shoff + 7) & ~(size_t)7;
+	size = shoff + shnum * shentsize + rnd(s) % 64;
+	if(size > cap)
+		return 0;
+
+	for(i=0; i<size; i++)
+		buf[i] = rnd(s);
+	memset(buf + shoff,0,shnum * shentsize);
+	memset(buf,0,ehsize);
+
+	e32 = (Elf32_Ehdr *)buf;
+	e64 = (Elf64_Ehdr *)buf;
+	memcpy(buf,ELFMAG,SELFMAG);
+	buf[EI_CLASS] = is64 ? ELFCLASS64 : ELFCLASS32;
+	buf[EI_DATA] = ELFDATA2LSB;
+	buf[EI_VERSION] = EV_CURRENT;
+	EH_SET(e_type,ET_EXEC);
+	EH_SET(e_ehsize,ehsize);
+	EH_SET(e_phoff,phnum ? ehsize : 0);
+	EH_SET(e_phentsize,phentsize);
+	EH_SET(e_phnum,phnum);
+	EH_SET(e_shoff,shoff);
+	EH_SET(e_shentsize,shentsize);
+	EH_SET(e_shnum,shnum);
+
+	shstrndx = rnd(s) % shnum;
+	strsize = rnd(s) % 300;
+	switch(rnd(s) % 5){
+	case 0:
+		stroff = rnd(s) % ehsize;
+		break;
+	case 1:
+		stroff = shoff - 1 - (strsize ? rnd(s) % strsize : 0);
+		break;
+	case 2:
+		stroff = shoff + rnd(s) % (size - shoff);
+		break;
+	default:
+		stroff = ehsize + (body ? rnd(s) % body : 0);
+	}
+	if(stroff + strsize > size)
+		strsize = size - stroff;
+
+	SH_SET(shstrndx,sh_type,rnd(s) % 6 == 0 ? SHT_NOBITS : SHT_STRTAB);
+	SH_SET(shstrndx,sh_offset,stroff);
+	SH_SET(shstrndx,sh_size,strsize);
+
+	/* Counts past the header fields live in section 0 */
+	if(rnd(s) % 6 == 0){
+		EH_SET(e_shnum,0);
+		SH_SET(0,sh_size,shnum);
+	}
+	if(rnd(s) % 6 == 0){
+		EH_SET(e_shstrndx,SHN_XINDEX);
+		SH_SET(0,sh_link,shstrndx);
+	}else
+		EH_SET(e_shstrndx,rnd(s) % 10 == 0 ? SHN_UNDEF : shstrndx);
+
+	/* Hostile: flipped header bytes, wild fields, truncation */
+	if(rnd(s) % 4 == 0)
+		for(i=rnd(s) % 4; i > 0; i--)
+			buf[rnd(s) % ehsize] ^= 1 << (rnd(s) % 8);
+	switch(rnd(s) % 16){
+	case 0:
+		EH_SET(e_shoff,is64 ? rnd(s) : (uint32_t)rnd(s));
+		break;
+	case 1:
+		EH_SET(e_shnum,rnd(s));
+		break;
+	case 2:
+		SH_SET(shstrndx,sh_offset,is64 ? rnd(s) : (uint32_t)rnd(s));
+		break;
+	case 3:
+		SH_SET(shstrndx,sh_size,is64 ? ~(uint64_t)0 : ~(uint32_t)0);
+		break;
+	case 4:
+		EH_SET(e_phoff,size - rnd(s) % 64);
+		break;
+	case 5:
+		EH_SET(e_shoff,ehsize - rnd(s) % 4);
+		break;
+	}
+	if(rnd(s) % 8 == 0)
+		size = rnd(s) % (size + 1);
+
+	return size;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static unsigned char buf[16384];
+	uint64_t seed, start, elapsed;
+	long i, iterations, accepted;
+	size_t size;
+	ElfView view;
+
+	iterations = argc > 1 ? atol(argv[1]) : 100000;
+	seed = argc > 2 ? strtoull(argv[2],NULL,0) : (uint64_t)time(NULL);
+	if(seed == 0)
+		seed = 1;
+	printf("seed %llu\n",(unsigned long long)seed);
+
+	accepted = 0;
+	start = now_ns();
+	for(i=0; i<iterations; i++){
+		size = gen_elf(buf,sizeof(buf),&seed);
+		if(elf_view(&view,buf,size) == NULL)
+			accepted++;
+		LLVMFuzzerTestOneInput(buf,size);
+	}
+	elapsed = now_ns() - start;
+
+	printf("%ld inputs, %ld stripped, %ld rejected by every engine, %.0f exec/s\n",
+		iterations,accepted,iterations - accepted,iterations / (elapsed / 1e9));
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# Run elfkillah, built with AddressSanitizer, over the crafted inputs
+# of tests/inputs. Each one has to be stripped or rejected as expected,
+# never read or written out of bounds.
+#
+# usage: tests/hostile.sh [workdir]
+#
+
+set -e
+
+WORK=${1:-$(mktemp -d /tmp/elfkillah-hostile.XXXXXX)}
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+IN="$SRC/tests/inputs"
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--g -fsanitize=address}
+
+ASAN_OPTIONS=exitcode=99:detect_leaks=0
+export ASAN_OPTIONS
+
+mkdir -p "$WORK"
+$CC $CFLAGS -pthread -o "$WORK/elfkillah" "$SRC/elfkillah.c" -lz -llzma
+
+# expect <status> <name> <elfkillah arguments>
+expect()
+{
+	want=$1
+	name=$2
+	shift 2
+	status=0
+	"$WORK/elfkillah" "$@" 2>"$WORK/$name.err" || status=$?
+	if [ $status -ne $want ]; then
+		cat "$WORK/$name.err" >&2
+		echo "hostile: $name exited $status, not $want" >&2
+		exit 1
+	fi
+}
+
+# A section far out of bounds must not size the debuginfo buffer
+expect 0 debug-oob-section --debug-store "$WORK/debug" \
+	"$IN/debug-oob-section.elf" "$WORK/debug-oob-section"
+test -s "$WORK/debug/pack"
+
+# A stored entry claiming more than it holds would be viewed past its end
+expect 1 zip-stored-usize --zip "$IN/zip-stored-usize.zip" "$WORK/zip-stored-usize.zip"
+grep -q "bad stored entry" "$WORK/zip-stored-usize.err"
+
+# A signature region whose trailer lies outside the data store
+expect 1 rpm-sig-region --package "$IN/rpm-sig-region.rpm" "$WORK/rpm-sig-region.rpm"
+grep -q "bad signature header" "$WORK/rpm-sig-region.err"
+
+echo "hostile: ok"
@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Publish a tree in place while one of its binaries runs, its files
+# read-only. Inputs are only ever read, so neither ETXTBSY nor the
+# permissions may stop the publish: the tree has to come out stripped,
+# every ELF file as a plain run would strip it, and the running
+# process has to live on from the tree it was started from.
+#
+# usage: tests/publish-busy.sh [workdir]
+#
+
+set -e
+
+WORK=${1:-$(mktemp -d /tmp/elfkillah-publish.XXXXXX)}
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+CC=${CC:-cc}
+
+mkdir -p "$WORK/t/bin" "$WORK/ref"
+$CC -O2 -pthread -o "$WORK/elfkillah" "$SRC/elfkillah.c" -lz -llzma
+
+cp "$(command -v sleep)" "$WORK/t/bin/sleep"
+cp "$WORK/elfkillah" "$WORK/t/bin/elfkillah"
+echo "not an ELF file" > "$WORK/t/README"
+chmod a-w "$WORK/t/bin/sleep" "$WORK/t/bin/elfkillah" "$WORK/t/README"
+for f in sleep elfkillah; do
+	"$WORK/elfkillah" "$WORK/t/bin/$f" "$WORK/ref/$f"
+done
+
+"$WORK/t/bin/sleep" 30 &
+BUSY=$!
+trap 'kill $BUSY 2>/dev/null || true' EXIT
+
+"$WORK/elfkillah" --publish "$WORK/t" "$WORK/t"
+
+for f in sleep elfkillah; do
+	cmp "$WORK/ref/$f" "$WORK/t/bin/$f"
+done
+grep -q "not an ELF file" "$WORK/t/README"
+kill -0 $BUSY
+
+echo "publish-busy: ok"